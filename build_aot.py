@@ -0,0 +1,79 @@
+import subprocess
+import os
+import sys
+import glob
+import argparse
+
+# Lox のスクリプトを AOT コンパイルして実行ファイルを作る
+# 1. cpplox --emit-cpp でスクリプトを C++ のソースに変換する
+# 2. 変換したソースとランタイム (cpplox/*.cpp から main.cpp を除いたもの) をホストの C++ コンパイラでリンクする
+
+SOURCE_DIRECTORY = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'cpplox')
+
+def is_msvc(cxx):
+    return os.path.basename(cxx).lower() in ("cl", "cl.exe")
+
+def compile_object(cxx, source, obj):
+    if is_msvc(cxx):
+        command = [cxx, "/nologo", "/std:c++20", "/O2", "/EHsc", "/utf-8", f"/I{SOURCE_DIRECTORY}", "/c", source, f"/Fo{obj}"]
+    else:
+        command = [cxx, "-std=c++20", "-O2", f"-I{SOURCE_DIRECTORY}", "-c", source, "-o", obj]
+    subprocess.run(command, check=True)
+
+def link(cxx, objs, output):
+    if is_msvc(cxx):
+        command = [cxx, "/nologo", *objs, f"/Fe{output}"]
+    else:
+        command = [cxx, *objs, "-o", output, "-lpthread"]
+    subprocess.run(command, check=True)
+
+def build_runtime(cxx, object_directory):
+    # ランタイムのオブジェクトファイルはスクリプトをまたいで使い回す
+    # ヘッダの変更は全てのオブジェクトファイルの作り直しで済ませる
+    os.makedirs(object_directory, exist_ok=True)
+    suffix = ".obj" if is_msvc(cxx) else ".o"
+    headers = glob.glob(os.path.join(SOURCE_DIRECTORY, "*.h"))
+    header_time = max(os.path.getmtime(h) for h in headers)
+
+    objs = []
+    for source in sorted(glob.glob(os.path.join(SOURCE_DIRECTORY, "*.cpp"))):
+        if os.path.basename(source) == "main.cpp":
+            continue
+        obj = os.path.join(object_directory, os.path.splitext(os.path.basename(source))[0] + suffix)
+        if not os.path.exists(obj) or os.path.getmtime(obj) < max(os.path.getmtime(source), header_time):
+            compile_object(cxx, source, obj)
+        objs.append(obj)
+    return objs
+
+def build(script, output, cpplox, cxx, object_directory):
+    # 変換に失敗した場合 (コンパイルエラー) は cpplox の終了コードを返す
+    generated = output + ".cpp"
+    os.makedirs(os.path.dirname(os.path.abspath(output)), exist_ok=True)
+    result = subprocess.run([cpplox, "--emit-cpp", generated, script])
+    if result.returncode != 0:
+        return result.returncode
+
+    objs = build_runtime(cxx, object_directory)
+    suffix = ".obj" if is_msvc(cxx) else ".o"
+    compile_object(cxx, generated, output + suffix)
+    link(cxx, [output + suffix, *objs], output)
+    return 0
+
+def main():
+    parser = argparse.ArgumentParser(description='Lox AOT compiler driver')
+    parser.add_argument('script', type=str, help='Lox script')
+    parser.add_argument('-o', '--output', type=str, help='Output executable', default=None)
+    parser.add_argument('--cpplox', type=str, help='cpplox binary', default="./x64/Release/cpplox.exe")
+    parser.add_argument('--cxx', type=str, help='C++ compiler', default=("cl" if os.name == "nt" else "c++"))
+    parser.add_argument('--objdir', type=str, help='Directory for runtime objects', default="./x64/aot")
+
+    args = parser.parse_args()
+
+    output = args.output
+    if output is None:
+        output = os.path.splitext(args.script)[0] + (".exe" if os.name == "nt" else "")
+
+    exit(build(args.script, output, args.cpplox, args.cxx, args.objdir))
+
+if __name__ == "__main__":
+    main()
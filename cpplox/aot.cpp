@@ -0,0 +1,669 @@
+﻿#include "aot.h"
+
+#include "compiler.h"
+#include "memory.h"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+
+// 出力する関数の一覧。入れ子の関数が外側の関数より前に来るように帰りがけ順に並べる
+struct FunctionList
+{
+	ObjFunction** functions = nullptr;
+	int count = 0;
+	int capacity = 0;
+};
+
+void addFunction(FunctionList* list, ObjFunction* function)
+{
+	if (list->capacity < list->count + 1)
+	{
+		auto oldCapacity = list->capacity;
+		list->capacity = grow_capacity(oldCapacity);
+		list->functions = grow_array(list->functions, oldCapacity, list->capacity);
+	}
+	list->functions[list->count++] = function;
+}
+
+void collectFunctions(FunctionList* list, ObjFunction* function)
+{
+	const ValueArray& constants = function->chunk.constants;
+	for (int i = 0; i < constants.count; i++)
+	{
+		if (IS_FUNCTION(constants.values[i])) collectFunctions(list, AS_FUNCTION(constants.values[i]));
+	}
+	addFunction(list, function);
+}
+
+int findFunction(const FunctionList* list, ObjFunction* function)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		if (list->functions[i] == function) return i;
+	}
+	return -1;
+}
+
+// C++ の文字列リテラルとして書き出す
+void writeString(FILE* out, const char* chars, int length)
+{
+	fputc('"', out);
+	for (int i = 0; i < length; i++)
+	{
+		unsigned char c = static_cast<unsigned char>(chars[i]);
+		if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\' && c != '?')
+		{
+			fputc(c, out);
+		}
+		else
+		{
+			fprintf(out, "\\%03o", c);
+		}
+	}
+	fputc('"', out);
+}
+
+int readShort(const uint8_t* operands)
+{
+	return (operands[0] << 8) | operands[1];
+}
+
+// ジャンプ命令の飛び先。ジャンプ命令でなければ -1
+int jumpTarget(const Chunk* chunk, int offset)
+{
+	const uint8_t* ip = chunk->code + offset;
+	int end = offset + getInstructionLength(chunk, offset);
+	switch (*ip)
+	{
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_NOT_EQUAL:
+	case OP_JUMP_IF_NOT_LESS_NUM:
+	case OP_JUMP_IF_NOT_GREATER_NUM:
+	case OP_JUMP_IF_NOT_EQUAL_NUM:
+		return end + readShort(ip + 1);
+	case OP_LOOP:
+		return end - readShort(ip + 1);
+	case OP_FOR_LOOP:
+	case OP_FOR_LOOP_CONSTANT:
+	case OP_FOR_LOOP_GLOBAL:
+		return end - readShort(chunk->code + end - 2);
+	default:
+		return -1;
+	}
+}
+
+bool isSwitch(uint8_t instruction)
+{
+	return instruction == OP_JUMP_TABLE || instruction == OP_JUMP_STRING;
+}
+
+// switch 文の表の i 番目 (0 番目は default) の飛び先。空きエントリなら -1
+int switchTarget(const Chunk* chunk, int offset, int i)
+{
+	const uint8_t* ip = chunk->code + offset;
+	int operand = getSwitchOperand(ip, i);
+	if (operand < 0) return -1;
+	return offset + getInstructionLength(chunk, offset) + readShort(ip + operand);
+}
+
+// インタプリタから AOT コードに入り直す位置かどうか
+// 関数の先頭と、呼び出し先がインタプリタで実行された呼び出し命令や yield の直後から再開する
+bool isResumePoint(uint8_t instruction)
+{
+	switch (instruction)
+	{
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+	case OP_SUPER_INVOKE:
+	case OP_YIELD:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// OP_WIDE や _LONG の命令を含む大きな関数かどうか
+// 大きな関数はホストの C++ コンパイラでの最適化に時間とメモリがかかりすぎるので、AOT コンパイルせずにインタプリタで実行する
+bool isLargeFunction(const Chunk* chunk)
+{
+	for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset))
+	{
+		switch (chunk->code[offset])
+		{
+		case OP_CONSTANT_LONG:
+		case OP_JUMP_LONG:
+		case OP_JUMP_IF_FALSE_LONG:
+		case OP_LOOP_LONG:
+		case OP_WIDE:
+			return true;
+		default:
+			break;
+		}
+	}
+	return false;
+}
+
+// 1 命令分の C++ を書き出す。対応していない命令の場合は false を返す
+bool writeInstruction(FILE* out, const Chunk* chunk, int offset)
+{
+	const uint8_t* ip = chunk->code + offset;
+	const uint8_t* operands = ip + 1;
+	int end = offset + getInstructionLength(chunk, offset);
+
+	switch (*ip)
+	{
+	case OP_CONSTANT:
+		fprintf(out, "\tAOT_PUSH(constants[%d]);\n", operands[0]);
+		return true;
+	case OP_NIL:
+		fprintf(out, "\tAOT_PUSH(TO_NIL());\n");
+		return true;
+	case OP_TRUE:
+		fprintf(out, "\tAOT_PUSH(TO_BOOL(true));\n");
+		return true;
+	case OP_FALSE:
+		fprintf(out, "\tAOT_PUSH(TO_BOOL(false));\n");
+		return true;
+	case OP_POP:
+		fprintf(out, "\tsp--;\n");
+		return true;
+
+	case OP_GET_LOCAL:
+		fprintf(out, "\tAOT_PUSH(slots[%d]);\n", operands[0]);
+		return true;
+	case OP_GET_LOCAL_0:
+	case OP_GET_LOCAL_1:
+	case OP_GET_LOCAL_2:
+	case OP_GET_LOCAL_3:
+		fprintf(out, "\tAOT_PUSH(slots[%d]);\n", *ip - OP_GET_LOCAL_0);
+		return true;
+	case OP_SET_LOCAL:
+		fprintf(out, "\tslots[%d] = sp[-1];\n", operands[0]);
+		return true;
+
+	case OP_GET_GLOBAL:
+		fprintf(out, "\tAOT_GET_GLOBAL(%d, %d);\n", readShort(operands), offset);
+		return true;
+	case OP_DEFINE_GLOBAL:
+		fprintf(out, "\tglobals[%d] = *--sp;\n", readShort(operands));
+		return true;
+	case OP_SET_GLOBAL:
+		fprintf(out, "\tAOT_SET_GLOBAL(%d, %d);\n", readShort(operands), offset);
+		return true;
+
+	case OP_GET_UPVALUE:
+		fprintf(out, "\tAOT_PUSH(*frame->closure->upvalues[%d]->location);\n", operands[0]);
+		return true;
+	case OP_SET_UPVALUE:
+		fprintf(out, "\tsetUpvalue(frame->closure->upvalues[%d], sp[-1]);\n", operands[0]);
+		return true;
+
+	case OP_GET_PROPERTY:
+		fprintf(out, "\tAOT_GET_FIELD(sp[-1], %d, %d);\n", readShort(operands + 1), offset);
+		return true;
+	case OP_GET_THIS_PROPERTY:
+		fprintf(out, "\tAOT_PUSH(slots[0]);\n");
+		fprintf(out, "\tAOT_GET_FIELD(sp[-1], %d, %d);\n", readShort(operands + 1), offset);
+		return true;
+	case OP_SET_PROPERTY:
+		fprintf(out, "\tAOT_RUNTIME(jitSetProperty, %d);\n", offset);
+		return true;
+	case OP_GET_SUPER:
+		fprintf(out, "\tAOT_RUNTIME(jitGetSuper, %d);\n", offset);
+		return true;
+
+	case OP_EQUAL:
+	case OP_EQUAL_NUM:
+		fprintf(out, "\tAOT_BINARY(BOOL, ==, %d);\n", offset);
+		return true;
+	case OP_GREATER:
+	case OP_GREATER_NUM:
+		fprintf(out, "\tAOT_BINARY(BOOL, >, %d);\n", offset);
+		return true;
+	case OP_LESS:
+	case OP_LESS_NUM:
+		fprintf(out, "\tAOT_BINARY(BOOL, <, %d);\n", offset);
+		return true;
+	case OP_ADD:
+	case OP_ADD_NUM:
+		fprintf(out, "\tAOT_BINARY(NUMBER, +, %d);\n", offset);
+		return true;
+	case OP_ADD_STR:
+		fprintf(out, "\tAOT_RUNTIME(jitBinaryOp, %d);\n", offset);
+		return true;
+	case OP_SUBTRACT:
+	case OP_SUBTRACT_NUM:
+		fprintf(out, "\tAOT_BINARY(NUMBER, -, %d);\n", offset);
+		return true;
+	case OP_MULTIPLY:
+	case OP_MULTIPLY_NUM:
+		fprintf(out, "\tAOT_BINARY(NUMBER, *, %d);\n", offset);
+		return true;
+	case OP_DIVIDE:
+	case OP_DIVIDE_NUM:
+		fprintf(out, "\tAOT_BINARY(NUMBER, /, %d);\n", offset);
+		return true;
+	case OP_GREATER_UNCHECKED:
+		fprintf(out, "\tAOT_BINARY_UNCHECKED(BOOL, >);\n");
+		return true;
+	case OP_LESS_UNCHECKED:
+		fprintf(out, "\tAOT_BINARY_UNCHECKED(BOOL, <);\n");
+		return true;
+	case OP_ADD_UNCHECKED:
+		fprintf(out, "\tAOT_BINARY_UNCHECKED(NUMBER, +);\n");
+		return true;
+	case OP_SUBTRACT_UNCHECKED:
+		fprintf(out, "\tAOT_BINARY_UNCHECKED(NUMBER, -);\n");
+		return true;
+	case OP_MULTIPLY_UNCHECKED:
+		fprintf(out, "\tAOT_BINARY_UNCHECKED(NUMBER, *);\n");
+		return true;
+	case OP_DIVIDE_UNCHECKED:
+		fprintf(out, "\tAOT_BINARY_UNCHECKED(NUMBER, /);\n");
+		return true;
+	case OP_ADD_LOCAL_CONST:
+	case OP_ADD_LOCAL_CONST_NUM:
+		fprintf(out, "\tAOT_ADD_LOCAL_CONST(%d, %d, %d);\n", operands[0], operands[1], offset);
+		return true;
+
+	case OP_NOT:
+		fprintf(out, "\tsp[-1] = TO_BOOL(aotIsFalsey(sp[-1]));\n");
+		return true;
+	case OP_NEGATE:
+		fprintf(out, "\tif (IS_NUMBER(sp[-1])) sp[-1] = TO_NUMBER(-AS_NUMBER(sp[-1]));\n");
+		fprintf(out, "\telse AOT_RUNTIME(jitNegate, %d);\n", offset);
+		return true;
+	case OP_NEGATE_UNCHECKED:
+		fprintf(out, "\tsp[-1] = TO_NUMBER(-AS_NUMBER(sp[-1]));\n");
+		return true;
+	case OP_PRINT:
+		fprintf(out, "\tAOT_RUNTIME(jitPrint, %d);\n", offset);
+		return true;
+
+	case OP_JUMP:
+	case OP_LOOP:
+		fprintf(out, "\tgoto L%d;\n", jumpTarget(chunk, offset));
+		return true;
+	case OP_JUMP_IF_FALSE:
+		fprintf(out, "\tif (aotIsFalsey(sp[-1])) goto L%d;\n", jumpTarget(chunk, offset));
+		return true;
+	case OP_FOR_LOOP:
+		fprintf(out, "\tAOT_FOR_LOOP(%d, %d, slots[%d], L%d);\n", operands[0], operands[1], operands[2], jumpTarget(chunk, offset));
+		return true;
+	case OP_FOR_LOOP_CONSTANT:
+		fprintf(out, "\tAOT_FOR_LOOP(%d, %d, constants[%d], L%d);\n", operands[0], operands[1], operands[2], jumpTarget(chunk, offset));
+		return true;
+	case OP_FOR_LOOP_GLOBAL:
+		fprintf(out, "\tAOT_FOR_LOOP(%d, %d, globals[%d], L%d);\n", operands[0], operands[1], readShort(operands + 2), jumpTarget(chunk, offset));
+		return true;
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_LESS_NUM:
+		fprintf(out, "\tAOT_JUMP_IF_NOT(<, %d, L%d);\n", offset, jumpTarget(chunk, offset));
+		return true;
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_NOT_GREATER_NUM:
+		fprintf(out, "\tAOT_JUMP_IF_NOT(>, %d, L%d);\n", offset, jumpTarget(chunk, offset));
+		return true;
+	case OP_JUMP_IF_NOT_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL_NUM:
+		fprintf(out, "\tAOT_JUMP_IF_NOT(==, %d, L%d);\n", offset, jumpTarget(chunk, offset));
+		return true;
+	case OP_JUMP_TABLE:
+	case OP_JUMP_STRING:
+	{
+		// 飛び先はインタプリタと同じ関数で引いて、命令の先頭からの距離で C++ の switch に分岐する
+		fprintf(out, "\tswitch (getSwitchJump(code + %d, constants, *--sp))\n\t{\n", offset);
+		int defaultTarget = switchTarget(chunk, offset, 0);
+		for (int i = 1; i < getSwitchOperandCount(ip); i++)
+		{
+			int target = switchTarget(chunk, offset, i);
+			bool isDuplicate = target < 0 || target == defaultTarget;
+			for (int j = 1; j < i && !isDuplicate; j++)
+			{
+				isDuplicate = switchTarget(chunk, offset, j) == target;
+			}
+			if (!isDuplicate) fprintf(out, "\tcase %d: goto L%d;\n", target - offset, target);
+		}
+		fprintf(out, "\tdefault: goto L%d;\n\t}\n", defaultTarget);
+		return true;
+	}
+
+	case OP_CLOSURE:
+		fprintf(out, "\tAOT_RUNTIME(jitClosure, %d);\n", offset);
+		return true;
+	case OP_CLOSE_UPVALUE:
+		fprintf(out, "\tAOT_RUNTIME(jitCloseUpvalue, %d);\n", offset);
+		return true;
+	case OP_CLASS:
+		fprintf(out, "\tAOT_RUNTIME(jitClass, %d);\n", offset);
+		return true;
+	case OP_INHERIT:
+		fprintf(out, "\tAOT_RUNTIME(jitInherit, %d);\n", offset);
+		return true;
+	case OP_METHOD:
+		fprintf(out, "\tAOT_RUNTIME(jitMethod, %d);\n", offset);
+		return true;
+
+	case OP_CALL:
+		fprintf(out, "\tAOT_CALL(jitCall, %d);\n", end);
+		return true;
+	case OP_TAIL_CALL:
+		fprintf(out, "\tAOT_CALL(jitTailCall, %d);\n", end);
+		return true;
+	case OP_INVOKE:
+		fprintf(out, "\tAOT_CALL(jitInvoke, %d);\n", end);
+		return true;
+	case OP_TAIL_INVOKE:
+		fprintf(out, "\tAOT_CALL(jitTailInvoke, %d);\n", end);
+		return true;
+	case OP_SUPER_INVOKE:
+		fprintf(out, "\tAOT_CALL(jitSuperInvoke, %d);\n", end);
+		return true;
+	case OP_RETURN:
+		fprintf(out, "\tAOT_RETURN(%d);\n", offset);
+		return true;
+
+	// スレッドの中断はインタプリタで行う。再開時は次の命令から AOT コードに入り直す
+	case OP_YIELD:
+		fprintf(out, "\tAOT_EXIT(%d);\n", offset);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+bool writeFunctionBody(FILE* out, ObjFunction* function, int index)
+{
+	const Chunk* chunk = &function->chunk;
+
+	// ラベルを置く位置と再開する位置を調べる。使わないラベルは警告になるので書かない
+	bool* isLabel = allocate<bool>(chunk->count + 1);
+	bool* isResume = allocate<bool>(chunk->count + 1);
+	for (int i = 0; i <= chunk->count; i++)
+	{
+		isLabel[i] = false;
+		isResume[i] = false;
+	}
+	isResume[0] = true;
+	for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset))
+	{
+		int target = jumpTarget(chunk, offset);
+		if (target >= 0) isLabel[target] = true;
+		for (int i = 0; isSwitch(chunk->code[offset]) && i < getSwitchOperandCount(chunk->code + offset); i++)
+		{
+			target = switchTarget(chunk, offset, i);
+			if (target >= 0) isLabel[target] = true;
+		}
+		if (isResumePoint(chunk->code[offset])) isResume[offset + getInstructionLength(chunk, offset)] = true;
+	}
+
+	fprintf(out, "// %s\n", function->name != nullptr ? function->name->chars : "<script>");
+	fprintf(out, "JitResult aotFunction%d(Thread* thread, bool nested)\n{\n", index);
+	fprintf(out, "\tAOT_PROLOGUE();\n");
+	fprintf(out, "\tswitch (AOT_RESUME_OFFSET())\n\t{\n");
+	for (int offset = 0; offset < chunk->count; offset++)
+	{
+		if (!isResume[offset]) continue;
+		isLabel[offset] = true;
+		fprintf(out, "\tcase %d: goto L%d;\n", offset, offset);
+	}
+	fprintf(out, "\tdefault: return JitResult::Exit;\n\t}\n");
+
+	bool succeeded = true;
+	for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset))
+	{
+		if (isLabel[offset]) fprintf(out, "L%d:\n", offset);
+		if (!writeInstruction(out, chunk, offset))
+		{
+			succeeded = false;
+			break;
+		}
+	}
+	fprintf(out, "}\n\n");
+
+	free_array(isResume, chunk->count + 1);
+	free_array(isLabel, chunk->count + 1);
+	return succeeded;
+}
+
+void writeFunctionData(FILE* out, const FunctionList* list, int index)
+{
+	ObjFunction* function = list->functions[index];
+	const Chunk* chunk = &function->chunk;
+
+	fprintf(out, "const uint8_t code%d[] = {", index);
+	for (int i = 0; i < chunk->count; i++)
+	{
+		fprintf(out, "%s%d,", i % 16 == 0 ? "\n\t" : " ", chunk->code[i]);
+	}
+	fprintf(out, "\n};\n");
+
+	fprintf(out, "const LineStart lines%d[] = {", index);
+	for (int i = 0; i < chunk->lineCount; i++)
+	{
+		fprintf(out, "%s{ %d, %d },", i % 8 == 0 ? "\n\t" : " ", chunk->lines[i].offset, chunk->lines[i].line);
+	}
+	fprintf(out, "\n};\n");
+
+	if (chunk->constants.count == 0) return;
+
+	fprintf(out, "const AotConstant constants%d[] = {\n", index);
+	for (int i = 0; i < chunk->constants.count; i++)
+	{
+		Value value = chunk->constants.values[i];
+		if (IS_NUMBER(value))
+		{
+			double number = AS_NUMBER(value);
+			if (std::isfinite(number))
+			{
+				// 16 進の浮動小数点リテラルなら値が丸められない
+				fprintf(out, "\t{ AotConstantType::Number, %a, nullptr, 0, 0 },\n", number);
+			}
+			else
+			{
+				// 定数畳み込みで生じる無限大や NaN はリテラルで書けないので、符号も含めてビット列で書く
+				uint64_t bits;
+				memcpy(&bits, &number, sizeof(bits));
+				fprintf(out, "\t{ AotConstantType::Number, std::bit_cast<double>(UINT64_C(0x%016" PRIx64 ")), nullptr, 0, 0 },\n", bits);
+			}
+		}
+		else if (IS_STRING(value))
+		{
+			ObjString* string = AS_STRING(value);
+			fprintf(out, "\t{ AotConstantType::String, 0, ");
+			writeString(out, string->chars, string->length);
+			fprintf(out, ", %d, 0 },\n", string->length);
+		}
+		else
+		{
+			fprintf(out, "\t{ AotConstantType::Function, 0, nullptr, 0, %d },\n", findFunction(list, AS_FUNCTION(value)));
+		}
+	}
+	fprintf(out, "};\n");
+}
+
+void writeFunctionInfo(FILE* out, ObjFunction* function, int index)
+{
+	const Chunk* chunk = &function->chunk;
+
+	fprintf(out, "\t{ ");
+	if (function->name != nullptr)
+	{
+		writeString(out, function->name->chars, function->name->length);
+	}
+	else
+	{
+		fprintf(out, "nullptr");
+	}
+	fprintf(out, ", %d, %d, %d, code%d, %d, lines%d, %d, ", function->arity, function->upvalueCount, function->slotCount, index, chunk->count, index, chunk->lineCount);
+	if (chunk->constants.count > 0)
+	{
+		fprintf(out, "constants%d, %d, ", index, chunk->constants.count);
+	}
+	else
+	{
+		fprintf(out, "nullptr, 0, ");
+	}
+	if (isLargeFunction(chunk))
+	{
+		fprintf(out, "%d, nullptr },\n", chunk->cacheCount);
+	}
+	else
+	{
+		fprintf(out, "%d, aotFunction%d },\n", chunk->cacheCount, index);
+	}
+}
+
+}
+
+bool writeAotSource(const char* source, FILE* out)
+{
+	ObjFunction* script = compileImpl(source);
+	if (script == nullptr) return false;
+
+	Thread* thread = &getVM()->mainThread;
+	push(thread, TO_OBJ(script)); // GC 回避
+
+	FunctionList list;
+	collectFunctions(&list, script);
+
+	fprintf(out, "// cpplox --emit-cpp が生成したソース\n\n");
+	fprintf(out, "#include \"aot.h\"\n\n");
+	fprintf(out, "#include <bit>\n\n");
+	fprintf(out, "namespace\n{\n\n");
+
+	bool succeeded = true;
+	for (int i = 0; succeeded && i < list.count; i++)
+	{
+		if (isLargeFunction(&list.functions[i]->chunk)) continue;
+		succeeded = writeFunctionBody(out, list.functions[i], i);
+	}
+
+	for (int i = 0; succeeded && i < list.count; i++)
+	{
+		writeFunctionData(out, &list, i);
+	}
+
+	if (succeeded)
+	{
+		fprintf(out, "\nconst AotFunctionInfo functions[] = {\n");
+		for (int i = 0; i < list.count; i++)
+		{
+			writeFunctionInfo(out, list.functions[i], i);
+		}
+		fprintf(out, "};\n\n");
+
+		const ValueArray& names = getVM()->globalNames;
+		fprintf(out, "const char* const globals[] = {\n");
+		for (int i = 0; i < names.count; i++)
+		{
+			fprintf(out, "\t");
+			writeString(out, AS_STRING(names.values[i])->chars, AS_STRING(names.values[i])->length);
+			fprintf(out, ",\n");
+		}
+		fprintf(out, "};\n\n");
+		fprintf(out, "}\n\n");
+
+		fprintf(out, "int main()\n{\n");
+		fprintf(out, "\tconst AotProgram program = { functions, %d, globals, %d };\n", list.count, names.count);
+		fprintf(out, "\treturn runAotProgram(&program);\n}\n");
+	}
+
+	free_array(list.functions, list.capacity);
+	pop(thread);
+	return succeeded;
+}
+
+int runAotProgram(const AotProgram* program)
+{
+	initVM();
+
+	// 機械語の末尾呼び出しは AOT コードに直接飛べないので、JIT とは併用しない
+	setJitEnabled(false);
+
+	// グローバル変数をコンパイル時と同じ番号に割り当てる
+	for (int i = 0; i < program->globalCount; i++)
+	{
+		const char* name = program->globals[i];
+		if (resolveGlobal(copyString(name, static_cast<int>(strlen(name)))) != i)
+		{
+			fprintf(stderr, "Global variable '%s' does not match the compiled index.\n", name);
+			freeVM();
+			return 70;
+		}
+	}
+
+	// 関数を組み立てる。組み立てた関数はスタックに積んで GC から守り、外側の関数の定数から参照する
+	Thread* thread = &getVM()->mainThread;
+	if (program->functionCount >= static_cast<int>(STACK_COUNT_MAX))
+	{
+		fprintf(stderr, "Too many functions.\n");
+		freeVM();
+		return 70;
+	}
+	Value* base = thread->stackTop;
+	for (int i = 0; i < program->functionCount; i++)
+	{
+		const AotFunctionInfo& info = program->functions[i];
+		ObjFunction* function = newFunction();
+		push(thread, TO_OBJ(function));
+
+		function->arity = info.arity;
+		function->upvalueCount = info.upvalueCount;
+		function->slotCount = info.slotCount;
+		if (info.name != nullptr)
+		{
+			function->name = copyString(info.name, static_cast<int>(strlen(info.name)));
+		}
+
+		for (int j = 0; j < info.count; j++)
+		{
+			writeToChunk(&function->chunk, info.code[j], 0);
+		}
+		for (int j = 0; j < info.lineCount; j++)
+		{
+			addLine(&function->chunk, info.lines[j].offset, info.lines[j].line);
+		}
+
+		for (int j = 0; j < info.constantCount; j++)
+		{
+			const AotConstant& constant = info.constants[j];
+			switch (constant.type)
+			{
+			case AotConstantType::Number:
+				appendConstant(&function->chunk, TO_NUMBER(constant.number));
+				break;
+			case AotConstantType::String:
+				appendConstant(&function->chunk, TO_OBJ(copyString(constant.chars, constant.length)));
+				break;
+			case AotConstantType::Function:
+				appendConstant(&function->chunk, base[constant.function]);
+				break;
+			}
+		}
+
+		for (int j = 0; j < info.cacheCount; j++)
+		{
+			addInlineCache(&function->chunk);
+		}
+
+		if (info.body != nullptr) jitAttachAot(function, info.body);
+	}
+
+	ObjClosure* closure = newClosure(AS_FUNCTION(thread->stackTop[-1]));
+	thread->stackTop = base;
+	InterpretResult result = interpret(thread, closure);
+
+	freeVM();
+	return result == InterpretResult::RuntimeError ? 70 : 0;
+}
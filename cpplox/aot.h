@@ -0,0 +1,232 @@
+﻿#pragma once
+
+#include <cstdio>
+
+#include "common.h"
+#include "chunk.h"
+#include "jit.h"
+#include "object.h"
+#include "thread.h"
+#include "vm.h"
+
+// Lox のスクリプトを C++ の翻訳単位に変換する AOT コンパイラ
+// 生成したソースはランタイム (main.cpp 以外) と一緒にホストの C++ コンパイラでビルドして実行ファイルにする (build_aot.py)
+//
+// 関数ごとにバイトコードの各命令を下のマクロに展開した C++ の関数を出力する
+// 数値演算や変数アクセスは直接書き、それ以外は JIT と同じランタイム関数 (jit.h) を呼ぶ
+// バイトコード自体も実行ファイルに埋め込んで、行番号やランタイム関数のオペランドの読み出しとインタプリタでの再開に使う
+
+// source をコンパイルして、AOT コンパイルした C++ のソースを out に書き出す
+// コンパイルエラーの場合は何も書かずに false を返す
+bool writeAotSource(const char* source, FILE* out);
+
+// 生成したソースに埋め込む定数
+enum class AotConstantType
+{
+	Number,
+	String,
+	Function,
+};
+
+struct AotConstant
+{
+	AotConstantType type;
+	double number;
+	const char* chars; // String の場合の文字列
+	int length;
+	int function; // Function の場合の AotProgram::functions の番号
+};
+
+// 生成したソースに埋め込む関数。入れ子の関数は外側の関数より前に並べる
+struct AotFunctionInfo
+{
+	const char* name; // スクリプトの場合は nullptr
+	int arity;
+	int upvalueCount;
+	int slotCount;
+	const uint8_t* code;
+	int count;
+	const LineStart* lines; // Chunk と同じ行番号の表
+	int lineCount;
+	const AotConstant* constants;
+	int constantCount;
+	int cacheCount;
+	// 大きな関数は AOT コンパイルしないので nullptr になる
+	AotFunction body;
+};
+
+struct AotProgram
+{
+	const AotFunctionInfo* functions; // 最後の要素がスクリプト
+	int functionCount;
+	const char* const* globals; // コンパイル時にグローバル変数に割り当てた番号順の名前
+	int globalCount;
+};
+
+// 生成したソースの main() から呼ぶ。VM を初期化してスクリプトを実行し、cpplox と同じ終了コードを返す
+int runAotProgram(const AotProgram* program);
+
+// 以下は生成したソースが使う命令の実装
+
+inline bool aotIsFalsey(Value value)
+{
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// インラインキャッシュの先頭のエントリがフィールドなら、形を比べて直接読む
+inline bool aotReadField(Value receiver, const InlineCache* cache, Value* value)
+{
+	if (!IS_INSTANCE(receiver) || cache->count == 0) return false;
+
+	ObjInstance* instance = AS_INSTANCE(receiver);
+	const InlineCacheEntry& entry = cache->entries[0];
+	if (entry.shape != instance->shape || entry.method != nullptr) return false;
+
+	*value = instance->fields[entry.fieldIndex];
+	return true;
+}
+
+// 関数の先頭で実行中のフレームの状態を読み込む
+#define AOT_PROLOGUE() \
+	CallFrame* frame = &thread->frames[thread->frameCount - 1]; \
+	uint8_t* code = frame->closure->function->chunk.code; \
+	[[maybe_unused]] Value* slots = frame->slots; \
+	[[maybe_unused]] Value* constants = frame->closure->function->chunk.constants.values; \
+	[[maybe_unused]] InlineCache* caches = frame->closure->function->chunk.caches; \
+	[[maybe_unused]] Value* globals = getVM()->globalValues.values; \
+	Value* sp = thread->stackTop
+
+// 再開する命令の位置。生成したソースはここから各命令のラベルに switch する
+#define AOT_RESUME_OFFSET() (frame->ip - code)
+
+// frame->ip とスタックトップを書き戻す
+#define AOT_STORE(offset) \
+	do { \
+		frame->ip = code + (offset); \
+		thread->stackTop = sp; \
+	} while (false)
+
+// offset の命令をランタイム関数 function で実行する
+// グローバル変数の配列は伸びていることがあるので読み直す
+#define AOT_RUNTIME(function, offset) \
+	do { \
+		AOT_STORE((offset) + 1); \
+		if (!function(thread)) return JitResult::Error; \
+		sp = thread->stackTop; \
+		globals = getVM()->globalValues.values; \
+	} while (false)
+
+// 呼び出し命令。end は命令の末尾で、呼び出し先がインタプリタで実行される場合はそこから再開する
+#define AOT_CALL(function, end) \
+	do { \
+		AOT_STORE(end); \
+		JitResult result = function(thread); \
+		if (result != JitResult::Continue) return result; \
+		sp = thread->stackTop; \
+		globals = getVM()->globalValues.values; \
+	} while (false)
+
+// インタプリタに戻って offset の命令から実行する
+#define AOT_EXIT(offset) \
+	do { \
+		AOT_STORE(offset); \
+		return JitResult::Exit; \
+	} while (false)
+
+#define AOT_PUSH(value) (*sp++ = (value))
+
+#define AOT_GET_GLOBAL(index, offset) \
+	do { \
+		if (IS_UNDEFINED(globals[index])) AOT_RUNTIME(jitGetGlobal, offset); \
+		else AOT_PUSH(globals[index]); \
+	} while (false)
+
+#define AOT_SET_GLOBAL(index, offset) \
+	do { \
+		if (IS_UNDEFINED(globals[index])) AOT_RUNTIME(jitSetGlobal, offset); \
+		else globals[index] = sp[-1]; \
+	} while (false)
+
+#define AOT_GET_FIELD(receiver, cache, offset) \
+	do { \
+		Value value; \
+		if (aotReadField(receiver, &caches[cache], &value)) sp[-1] = value; \
+		else AOT_RUNTIME(jitGetProperty, offset); \
+	} while (false)
+
+// 数値同士なら直接計算する。それ以外はランタイム関数で型を調べる
+#define AOT_BINARY(ValueType, op, offset) \
+	do { \
+		Value b = sp[-1]; \
+		Value a = sp[-2]; \
+		if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+			sp--; \
+			sp[-1] = TO_##ValueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+		} else { \
+			AOT_RUNTIME(jitBinaryOp, offset); \
+		} \
+	} while (false)
+
+// 型推論で数値だと分かっている二項演算
+#define AOT_BINARY_UNCHECKED(ValueType, op) \
+	do { \
+		sp--; \
+		sp[-1] = TO_##ValueType(AS_NUMBER(sp[-1]) op AS_NUMBER(sp[0])); \
+	} while (false)
+
+#define AOT_ADD_LOCAL_CONST(slot, constant, offset) \
+	do { \
+		Value a = slots[slot]; \
+		Value b = constants[constant]; \
+		if (IS_NUMBER(a) && IS_NUMBER(b)) AOT_PUSH(TO_NUMBER(AS_NUMBER(a) + AS_NUMBER(b))); \
+		else AOT_RUNTIME(jitBinaryOp, offset); \
+	} while (false)
+
+// 数値の for ループの更新と条件の判定。数値でないか条件が偽なら、次の命令から通常の更新節と条件節を実行する
+#define AOT_FOR_LOOP(slot, step, limit, label) \
+	do { \
+		Value counter = slots[slot]; \
+		Value bound = (limit); \
+		if (IS_NUMBER(counter) && IS_NUMBER(bound)) { \
+			double next = AS_NUMBER(counter) + AS_NUMBER(constants[step]); \
+			if (next < AS_NUMBER(bound)) { \
+				slots[slot] = TO_NUMBER(next); \
+				goto label; \
+			} \
+		} \
+	} while (false)
+
+// 比較と分岐の融合命令。条件が偽なら分岐先の POP のために false を積んでからジャンプする
+#define AOT_JUMP_IF_NOT(op, offset, target) \
+	do { \
+		Value b = sp[-1]; \
+		Value a = sp[-2]; \
+		bool condition; \
+		if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+			sp -= 2; \
+			condition = AS_NUMBER(a) op AS_NUMBER(b); \
+		} else { \
+			AOT_RUNTIME(jitBinaryOp, offset); \
+			condition = AS_BOOL(*--sp); \
+		} \
+		if (!condition) { \
+			AOT_PUSH(TO_BOOL(false)); \
+			goto target; \
+		} \
+	} while (false)
+
+// 呼び出し元が AOT コードならフレームを捨てて戻る。インタプリタから入った場合はインタプリタで return する
+// このフレームのローカル変数を指すオープン上位値がなければ、閉じる処理を省いてその場でフレームを捨てる
+#define AOT_RETURN(offset) \
+	do { \
+		if (!nested) AOT_EXIT(offset); \
+		if (thread->openUpvalues == nullptr || thread->openUpvalues->location < slots) { \
+			slots[0] = sp[-1]; \
+			thread->stackTop = slots + 1; \
+			thread->frameCount--; \
+			return JitResult::Continue; \
+		} \
+		AOT_STORE((offset) + 1); \
+		jitReturn(thread); \
+		return JitResult::Continue; \
+	} while (false)
@@ -1,21 +1,30 @@
 ﻿#include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
+#include <cstring>
+
 void initChunk(Chunk* chunk)
 {
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = nullptr;
-	chunk->lines = nullptr;
 	initValueArray(&chunk->constants);
+	chunk->lines = nullptr;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = nullptr;
 }
 
 void freeChunk(Chunk* chunk)
 {
 	free_array(chunk->code, chunk->capacity);
-	free_array(chunk->lines, chunk->capacity);
 	freeValueArray(&chunk->constants);
+	free_array(chunk->lines, chunk->lineCapacity);
+	free_array(chunk->caches, chunk->cacheCapacity);
 	initChunk(chunk);
 }
 
@@ -26,15 +35,91 @@ void writeToChunk(Chunk* chunk, uint8_t byte, int line)
 		auto oldCapacity = chunk->capacity;
 		chunk->capacity = grow_capacity(oldCapacity);
 		chunk->code = grow_array(chunk->code, oldCapacity, chunk->capacity);
-		chunk->lines = grow_array(chunk->lines, oldCapacity, chunk->capacity);
 	}
 
+	addLine(chunk, chunk->count, line);
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
 	chunk->count++;
 }
 
+void addLine(Chunk* chunk, int offset, int line)
+{
+	while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= offset)
+	{
+		chunk->lineCount--;
+	}
+
+	// 直前の命令と同じ行なら、その要素の範囲を伸ばすだけでよい
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+	if (chunk->lineCapacity < chunk->lineCount + 1)
+	{
+		auto oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = grow_capacity(oldCapacity);
+		chunk->lines = grow_array(chunk->lines, oldCapacity, chunk->lineCapacity);
+	}
+
+	chunk->lines[chunk->lineCount].offset = offset;
+	chunk->lines[chunk->lineCount].line = line;
+	chunk->lineCount++;
+}
+
+void setLines(Chunk* chunk, const int* lines, int count)
+{
+	chunk->lineCount = 0;
+	for (int i = 0; i < count; i++)
+	{
+		addLine(chunk, i, lines[i]);
+	}
+}
+
+int getLine(const Chunk* chunk, int offset)
+{
+	// offset 以前から始まる最後の要素を探す
+	int low = 0;
+	int high = chunk->lineCount;
+	while (high - low > 1)
+	{
+		int middle = (low + high) / 2;
+		if (chunk->lines[middle].offset <= offset) low = middle;
+		else high = middle;
+	}
+	return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
+
+namespace
+{
+
+// 定数として同じ値か。数値はビット列で比べる (0 と -0 は区別し、NaN は同じ定数にする)
+bool isSameConstant(Value a, Value b)
+{
+#if NAN_BOXING
+	return a == b;
+#else
+	if (a.type != b.type) return false;
+	if (IS_NUMBER(a))
+	{
+		double x = AS_NUMBER(a);
+		double y = AS_NUMBER(b);
+		return memcmp(&x, &y, sizeof(double)) == 0;
+	}
+	return valuesEqual(a, b);
+#endif
+}
+
+}
+
 int addConstant(Chunk* chunk, Value value)
+{
+	// 識別子の名前などは何度も使われるので、同じ定数は一つにまとめる
+	for (int i = 0; i < chunk->constants.count; i++)
+	{
+		if (isSameConstant(chunk->constants.values[i], value)) return i;
+	}
+	return appendConstant(chunk, value);
+}
+
+int appendConstant(Chunk* chunk, Value value)
 {
 	// reallocate 時に Value が GC 対象にならないように、スタックに積んでおく
 	push(&getVM()->mainThread, value);
@@ -47,3 +132,179 @@ int addConstant(Chunk* chunk, Value value)
 	// 定数を置いたインデックスを返す
 	return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk* chunk)
+{
+	HeapLock lock; // マークスレッドは cacheCount までのキャッシュを読む
+	if (chunk->cacheCapacity < chunk->cacheCount + 1)
+	{
+		auto oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = grow_capacity(oldCapacity);
+		chunk->caches = grow_array(chunk->caches, oldCapacity, chunk->cacheCapacity);
+	}
+
+	chunk->caches[chunk->cacheCount] = InlineCache();
+	return chunk->cacheCount++;
+}
+
+int getInstructionLength(const Chunk* chunk, int offset)
+{
+	// オペランドを含めた命令のバイト数を返す
+	switch (chunk->code[offset])
+	{
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_SUPER:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_CLASS:
+	case OP_METHOD:
+		return 2;
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_LOOP:
+	case OP_SUPER_INVOKE:
+	case OP_ADD_LOCAL_CONST:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_NOT_EQUAL:
+	case OP_ADD_LOCAL_CONST_NUM:
+	case OP_JUMP_IF_NOT_LESS_NUM:
+	case OP_JUMP_IF_NOT_GREATER_NUM:
+	case OP_JUMP_IF_NOT_EQUAL_NUM:
+	case OP_MOVE:
+	case OP_LOAD_CONSTANT:
+		return 3;
+	case OP_ADD_RR:
+	case OP_ADD_RK:
+	case OP_SUBTRACT_RR:
+	case OP_SUBTRACT_RK:
+	case OP_MULTIPLY_RR:
+	case OP_MULTIPLY_RK:
+	case OP_DIVIDE_RR:
+	case OP_DIVIDE_RK:
+		// 書き込み先 + 2 つの読み出し元
+		return 4;
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_THIS_PROPERTY:
+		// 名前の定数 + 16bit のキャッシュ番号
+		return 4;
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+		// 名前の定数 + 引数の数 + 16bit のキャッシュ番号
+		return 5;
+	case OP_JUMP_IF_NOT_LESS_RR:
+	case OP_JUMP_IF_NOT_LESS_RK:
+	case OP_JUMP_IF_NOT_GREATER_RR:
+	case OP_JUMP_IF_NOT_GREATER_RK:
+	case OP_JUMP_IF_NOT_EQUAL_RR:
+	case OP_JUMP_IF_NOT_EQUAL_RK:
+		// 2 つの読み出し元 + 16bit のジャンプオフセット
+		return 5;
+	case OP_FOR_LOOP:
+	case OP_FOR_LOOP_CONSTANT:
+		// ループ変数 + 増分 + 上限 + 16bit のジャンプオフセット
+		return 6;
+	case OP_FOR_LOOP_GLOBAL:
+		return 7;
+	case OP_JUMP_TABLE:
+		// 最小値の定数 + エントリ数 + 16bit の default + エントリごとの 16bit のオフセット
+		return 5 + chunk->code[offset + 2] * 2;
+	case OP_JUMP_STRING:
+		// 容量 + 16bit の default + エントリごとの (定数, 16bit のオフセット)
+		return 4 + chunk->code[offset + 1] * 3;
+	case OP_CONSTANT_LONG:
+	case OP_JUMP_LONG:
+	case OP_JUMP_IF_FALSE_LONG:
+	case OP_LOOP_LONG:
+		return 4;
+	case OP_WIDE:
+	{
+		// 前置した命令の最初のオペランドが 1 バイト増える。OP_CLOSURE は上位値のインデックスも 16bit になる
+		const uint8_t* code = chunk->code + offset;
+		if (code[1] == OP_CLOSURE)
+		{
+			ObjFunction* function = AS_FUNCTION(chunk->constants.values[(code[2] << 8) | code[3]]);
+			return 4 + function->upvalueCount * 3;
+		}
+		return 2 + getInstructionLength(chunk, offset + 1);
+	}
+	case OP_CLOSURE:
+	{
+		// 上位値の数だけ (isLocal, index) のペアが続く
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+		return 2 + function->upvalueCount * 2;
+	}
+	default:
+		return 1;
+	}
+}
+
+namespace
+{
+
+uint16_t readSwitchOffset(const uint8_t* operand)
+{
+	return static_cast<uint16_t>(operand[0] << 8 | operand[1]);
+}
+
+}
+
+int getSwitchJump(const uint8_t* instruction, const Value* constants, Value subject)
+{
+	if (instruction[0] == OP_JUMP_TABLE)
+	{
+		int count = instruction[2];
+		int end = 5 + count * 2;
+		if (IS_NUMBER(subject))
+		{
+			// 整数でない値や範囲外の値 (NaN を含む) は default に飛ぶ
+			double index = AS_NUMBER(subject) - AS_NUMBER(constants[instruction[1]]);
+			if (index >= 0 && index < count && index == static_cast<int>(index))
+			{
+				return end + readSwitchOffset(instruction + 5 + static_cast<int>(index) * 2);
+			}
+		}
+		return end + readSwitchOffset(instruction + 3);
+	}
+
+	int capacity = instruction[1];
+	int end = 4 + capacity * 3;
+	if (IS_STRING(subject))
+	{
+		// 文字列はインターン化されているので、ポインタで比較してよい
+		ObjString* string = AS_STRING(subject);
+		for (int index = string->hash & (capacity - 1);; index = (index + 1) & (capacity - 1))
+		{
+			const uint8_t* entry = instruction + 4 + index * 3;
+			uint16_t offset = readSwitchOffset(entry + 1);
+			if (offset == SWITCH_EMPTY_ENTRY) break;
+			if (AS_STRING(constants[entry[0]]) == string) return end + offset;
+		}
+	}
+	return end + readSwitchOffset(instruction + 2);
+}
+
+int getSwitchOperandCount(const uint8_t* instruction)
+{
+	return 1 + (instruction[0] == OP_JUMP_TABLE ? instruction[2] : instruction[1]);
+}
+
+int getSwitchOperand(const uint8_t* instruction, int i)
+{
+	if (instruction[0] == OP_JUMP_TABLE)
+	{
+		return i == 0 ? 3 : 5 + (i - 1) * 2;
+	}
+
+	if (i == 0) return 2;
+	int operand = 4 + (i - 1) * 3 + 1;
+	return readSwitchOffset(instruction + operand) == SWITCH_EMPTY_ENTRY ? -1 : operand;
+}
@@ -34,7 +34,9 @@ enum OpCode
 	OP_JUMP_IF_FALSE,
 	OP_LOOP,
 	OP_CALL,
+	OP_TAIL_CALL, // return f(...) の呼び出し。現在のフレームを再利用する
 	OP_INVOKE,
+	OP_TAIL_INVOKE, // return obj.method(...) の呼び出し。現在のフレームを再利用する
 	OP_SUPER_INVOKE,
 	OP_CLOSURE,
 	OP_CLOSE_UPVALUE,
@@ -43,6 +45,109 @@ enum OpCode
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
+
+	// 数値の for ループ (for (var i = ...; i < limit; i = i + step)) の本文の末尾に置く、更新と条件の判定をまとめた命令
+	// i と limit が数値で i + step < limit なら i を更新して本文の先頭に戻る。そうでなければ何もせずに次の命令 (通常の更新節への OP_LOOP) に進む
+	OP_FOR_LOOP, // i K(step) limit offset16 (limit はスロット)
+	OP_FOR_LOOP_CONSTANT, // i K(step) K(limit) offset16
+	OP_FOR_LOOP_GLOBAL, // i K(step) global16 offset16
+
+	// switch 文の分岐。値を POP して一致するラベルの本文に飛ぶ。一致しなければ default (無ければ switch 文の末尾) に飛ぶ
+	// オフセットはどれも命令の末尾からの前方ジャンプ
+	OP_JUMP_TABLE, // K(min) count default16 offset16 * count (ラベルが密な整数の場合。値 - min で引く)
+	OP_JUMP_STRING, // capacity default16 (K offset16) * capacity (ラベルが文字列の場合。ハッシュで引くオープンアドレス法の表)
+
+	// オペランドが 8bit / 16bit に収まらない場合の命令。小さな関数は従来の短い形のまま
+	OP_CONSTANT_LONG, // K24
+	OP_JUMP_LONG, // offset24
+	OP_JUMP_IF_FALSE_LONG, // offset24
+	OP_LOOP_LONG, // offset24
+	OP_WIDE, // 次の命令の最初のオペランド (定数、ローカル変数、上位値) を 16bit にする前置命令。OP_CLOSURE は上位値のインデックスも 16bit になる
+
+	// 以下はピープホール最適化 (peephole.cpp) が生成するスーパー命令
+	OP_GET_LOCAL_0, // OP_GET_LOCAL 0
+	OP_GET_LOCAL_1, // OP_GET_LOCAL 1
+	OP_GET_LOCAL_2, // OP_GET_LOCAL 2
+	OP_GET_LOCAL_3, // OP_GET_LOCAL 3
+	OP_ADD_LOCAL_CONST, // OP_GET_LOCAL + OP_CONSTANT + OP_ADD
+	OP_JUMP_IF_NOT_LESS, // OP_LESS + OP_JUMP_IF_FALSE + OP_POP
+	OP_JUMP_IF_NOT_GREATER, // OP_GREATER + OP_JUMP_IF_FALSE + OP_POP
+	OP_JUMP_IF_NOT_EQUAL, // OP_EQUAL + OP_JUMP_IF_FALSE + OP_POP
+	OP_GET_THIS_PROPERTY, // OP_GET_LOCAL 0 + OP_GET_PROPERTY
+
+	// 以下はレジスタ命令モード (setRegisterBytecodeEnabled) で中間表現 (ir.cpp) が生成する三番地命令
+	// レジスタはフレームのスロットで、ローカル変数と式の途中の値 (スタックに積まれた値) が入る
+	// 書き込むスロットがスタックトップなら、スタックに積んだことになる
+	// R はスロット、K は定数の番号のオペランド
+	OP_MOVE, // dst src
+	OP_LOAD_CONSTANT, // dst K
+	OP_ADD_RR, // dst a b
+	OP_ADD_RK,
+	OP_SUBTRACT_RR,
+	OP_SUBTRACT_RK,
+	OP_MULTIPLY_RR,
+	OP_MULTIPLY_RK,
+	OP_DIVIDE_RR,
+	OP_DIVIDE_RK,
+	OP_JUMP_IF_NOT_LESS_RR, // a b offset16 (条件が偽なら false を積んでジャンプする)
+	OP_JUMP_IF_NOT_LESS_RK,
+	OP_JUMP_IF_NOT_GREATER_RR,
+	OP_JUMP_IF_NOT_GREATER_RK,
+	OP_JUMP_IF_NOT_EQUAL_RR,
+	OP_JUMP_IF_NOT_EQUAL_RK,
+
+	// 以下は中間表現での型推論 (ir.cpp) でオペランドが数値だと分かった演算の、型を検査しない命令
+	OP_ADD_UNCHECKED,
+	OP_SUBTRACT_UNCHECKED,
+	OP_MULTIPLY_UNCHECKED,
+	OP_DIVIDE_UNCHECKED,
+	OP_NEGATE_UNCHECKED,
+	OP_GREATER_UNCHECKED,
+	OP_LESS_UNCHECKED,
+
+	// 以下は実行時に汎用命令が自分自身を書き換えてできる型特化命令 (quickening)
+	// ガードが外れた場合は汎用命令に戻る
+	OP_EQUAL_NUM,
+	OP_GREATER_NUM,
+	OP_LESS_NUM,
+	OP_ADD_NUM,
+	OP_ADD_STR,
+	OP_SUBTRACT_NUM,
+	OP_MULTIPLY_NUM,
+	OP_DIVIDE_NUM,
+	OP_ADD_LOCAL_CONST_NUM,
+	OP_JUMP_IF_NOT_LESS_NUM,
+	OP_JUMP_IF_NOT_GREATER_NUM,
+	OP_JUMP_IF_NOT_EQUAL_NUM,
+
+	OP_COUNT, // 命令の総数 (命令ではない)
+};
+
+// OP_GET_PROPERTY / OP_SET_PROPERTY / OP_INVOKE の呼び出し地点ごとのインラインキャッシュ
+// レシーバの形 (クラスとフィールドの並び) をキーにして、解決済みのメソッドかフィールドの位置を覚えておく
+// 単相 -> 多相 (INLINE_CACHE_ENTRIES 個まで) -> メガモーフィック (キャッシュしない) と遷移する
+#define INLINE_CACHE_ENTRIES 4
+
+struct InlineCacheEntry
+{
+	ObjShape* shape = nullptr;
+	ObjClosure* method = nullptr; // nullptr ならフィールド
+	ObjShape* transition = nullptr; // OP_SET_PROPERTY でフィールドを追加した場合の遷移先の形
+	int fieldIndex = 0;
+};
+
+struct InlineCache
+{
+	int count = 0;
+	bool isMegamorphic = false;
+	InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+};
+
+// 行番号の表の要素。offset の命令から次の要素の offset の手前までが line 行目にある
+struct LineStart
+{
+	int offset = 0;
+	int line = 0;
 };
 
 struct Chunk
@@ -50,11 +155,44 @@ struct Chunk
 	int count = 0;
 	int capacity = 0;
 	uint8_t* code = nullptr;
-	int* lines = nullptr;
 	ValueArray constants;
+
+	// 行番号はエラーの報告と逆アセンブルでしか引かないので、同じ行が続く範囲をまとめて持つ (ランレングス符号化)
+	LineStart* lines = nullptr;
+	int lineCount = 0;
+	int lineCapacity = 0;
+
+	// 命令のオペランドで指定されるインラインキャッシュ
+	int cacheCount = 0;
+	int cacheCapacity = 0;
+	InlineCache* caches = nullptr;
 };
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeToChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value);
+
+// offset 以降の命令の行番号を line にする。offset より後ろから始まる要素は捨てる (命令列を切り詰めた場合)
+void addLine(Chunk* chunk, int offset, int line);
+
+// 命令ごとの行番号の配列から、行番号の表を作り直す (最適化で命令列を書き換えた場合)
+void setLines(Chunk* chunk, const int* lines, int count);
+
+// offset の命令の行番号。表を二分探索するので、エラーの報告など遅くてよい所で使う
+int getLine(const Chunk* chunk, int offset);
+int addConstant(Chunk* chunk, Value value); // 同じ定数が既にあればその番号を返す
+int appendConstant(Chunk* chunk, Value value); // 常に末尾に追加する (保存した定数表を番号どおりに復元する場合)
+int addInlineCache(Chunk* chunk);
+int getInstructionLength(const Chunk* chunk, int offset);
+
+// OP_JUMP_STRING の空きエントリのオフセット
+constexpr uint16_t SWITCH_EMPTY_ENTRY = UINT16_MAX;
+
+// OP_JUMP_TABLE / OP_JUMP_STRING で subject に対応する飛び先を、命令の先頭からの距離で返す
+int getSwitchJump(const uint8_t* instruction, const Value* constants, Value subject);
+
+// OP_JUMP_TABLE / OP_JUMP_STRING の飛び先のオフセットの数 (default を含む)
+int getSwitchOperandCount(const uint8_t* instruction);
+
+// i 番目 (0 番目は default) の飛び先のオフセットの位置を、命令の先頭からの距離で返す。OP_JUMP_STRING の空きエントリは -1
+int getSwitchOperand(const uint8_t* instruction, int i);
@@ -12,9 +12,32 @@
 #define DEBUG_TRACE_EXECUTION 0
 #endif
 
+// GCC/Clang では computed goto (labels as values) による direct threading で命令をディスパッチする
+// 未対応のコンパイラ (MSVC) では switch 文によるディスパッチにフォールバックする
+#ifndef COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+#endif
+
+// ホットな関数を x86-64 の機械語に変換するベースライン JIT
+// 生成コードが System V の呼び出し規約と NaN boxing の値表現に依存するので、Linux x86-64 でのみ有効にする
+#ifndef JIT_SUPPORTED
+#if defined(__x86_64__) && defined(__linux__) && NAN_BOXING
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+#endif
+
 #define DEBUG_STRESS_GC 0
 #define DEBUG_LOG_GC 0
+#define DEBUG_PEEPHOLE_STATS 0
+#define DEBUG_LOG_JIT 0
 
-#define LOCAL_VARIABLE_COUNT (UINT8_MAX + 1)
-#define UPVALUE_COUNT (UINT8_MAX)
+// 8bit に収まらない番号は OP_WIDE を前置した 16bit のオペランドで表す
+#define LOCAL_VARIABLE_COUNT (UINT16_MAX + 1)
+#define UPVALUE_COUNT (UINT16_MAX)
 
@@ -4,7 +4,10 @@
 #include "chunk.h"
 #include "common.h"
 #include "object.h"
+#include "ir.h"
 #include "memory.h"
+#include "peephole.h"
+#include "vm.h"
 
 #if DEBUG_PRINT_CODE
 #include "debug.h"
@@ -63,7 +66,8 @@ struct Local
 
 struct Upvalue
 {
-	uint8_t index = 0;
+	Token name; // 遅延コンパイルする関数では、上位値を名前で解決する (resolveUpvalue)
+	uint16_t index = 0;
 	bool isLocal = false;
 };
 
@@ -75,22 +79,51 @@ enum class FunctionType
 	Script,
 };
 
+// 定数を積む命令 (OP_CONSTANT / OP_TRUE / OP_FALSE / OP_NIL) の記録。定数畳み込みで使う
+struct ConstantInstruction
+{
+	int offset = 0;
+	int length = 0;
+	Value value = TO_NIL();
+	bool isNewConstant = false; // 命令を発行した時に定数表の末尾に追加した定数を参照している
+};
+
+// 二項演算の畳み込みに必要なのは直前の 2 つだが、1 + 2 * 3 のように右辺を畳み込んだ後に左辺と畳み込むことがあるので少し多めに持つ
+constexpr int CONSTANT_HISTORY_COUNT = 8;
+
 struct Compiler
 {
 	Compiler* enclosing = nullptr;
 	ObjFunction* function = nullptr;
 	FunctionType type = FunctionType::Script;
 
-	Local locals[LOCAL_VARIABLE_COUNT];
+	// 上限 (LOCAL_VARIABLE_COUNT / UPVALUE_COUNT) まで必要に応じて伸ばす
+	Local* locals = nullptr;
 	int localCount = 0;
+	int localCapacity = 0;
 
-	Upvalue upvalues[UPVALUE_COUNT];
+	Upvalue* upvalues = nullptr;
+	int upvalueCapacity = 0;
 
 	int scopeDepth = 0;
+
+	// 前方ジャンプを 24bit のオフセットの命令で出力するかどうか
+	// 16bit のオフセットに収まらないジャンプがあったら (isJumpOverflowed)、関数全体をこの形でコンパイルし直す
+	bool useLongJumps = false;
+	bool isJumpOverflowed = false;
+
+	int lastCallOffset = -1; // 最後に発行した OP_CALL / OP_INVOKE の位置 (末尾呼び出しの検出用)
+
+	// 最近発行した定数を積む命令と、最後にジャンプ先になった位置 (定数畳み込み用)
+	ConstantInstruction constants[CONSTANT_HISTORY_COUNT];
+	int constantCount = 0;
+	int lastJumpTarget = 0;
 };
 
 Parser parser;
 Compiler* current = nullptr;
+bool isOptimizationEnabled = true;
+bool isRegisterBytecodeEnabled = false;
 
 struct ClassCompiler
 {
@@ -99,6 +132,34 @@ struct ClassCompiler
 };
 ClassCompiler* currentClass = nullptr;
 
+bool isLazyCompilationEnabled = false;
+
+// 遅延コンパイルでは関数の本文を後から読み直すので、ソース全体を文字列オブジェクトとして保持する
+// コンパイル中はトークンがこの文字列の中を指す
+ObjString* lazySource = nullptr;
+
+}
+
+// 事前解析で読み飛ばした関数の本文と、それをコンパイルするのに必要な外側の情報
+struct LazyFunction
+{
+	ObjString* source;
+	int offset; // 仮引数リストの ( の位置
+	int line;
+	FunctionType type;
+
+	// 本文で this や super を使えるかどうか
+	bool isInClass;
+	bool hasSuperclass;
+
+	// 上位値の名前。本文をコンパイルする時は外側の関数のコンパイラが無いので、名前だけで解決する
+	Token* upvalueNames;
+	int upvalueCount;
+};
+
+namespace
+{
+
 Chunk* currentChunk()
 {
 	return &current->function->chunk;
@@ -183,24 +244,63 @@ void emitBytes(uint8_t byte1, uint8_t byte2)
 	emitByte(byte2);
 }
 
-void emitLoop(int loopStart)
+// 24bit のオペランド (OP_CONSTANT_LONG の定数、_LONG のジャンプ命令のオフセット) の最大値
+constexpr int LONG_OPERAND_MAX = 0xFFFFFF;
+
+void emitLong(int value)
 {
-	emitByte(OP_LOOP);
+	emitByte(static_cast<uint8_t>((value >> 16) & 0xFF));
+	emitByte(static_cast<uint8_t>((value >> 8) & 0xFF));
+	emitByte(static_cast<uint8_t>(value & 0xFF));
+}
 
-	// OP_LOOP は 3 要素の命令なので currentChunk + 2 から、loopStart を引いただけをオフセットとして格納する
+// オペランドを 1 つ持つ命令を発行する。8bit に収まらなければ OP_WIDE を前置して 16bit のオペランドにする
+// OP_INVOKE などの残りのオペランドは、呼び出し元が続けて発行する
+void emitOperandInstruction(uint8_t op, int operand)
+{
+	if (operand > UINT8_MAX)
+	{
+		emitBytes(OP_WIDE, op);
+		emitBytes(static_cast<uint8_t>((operand >> 8) & 0xFF), static_cast<uint8_t>(operand & 0xFF));
+	}
+	else
+	{
+		emitBytes(op, static_cast<uint8_t>(operand));
+	}
+}
+
+void emitLoop(int loopStart)
+{
+	// OP_LOOP は 3 要素の命令なので、命令の末尾から loopStart を引いただけをオフセットとして格納する
 	// 実行時にこのオフセットの分だけ後ろに戻る
-	int offset = currentChunk()->count - loopStart + 2;
-	if (offset > UINT16_MAX)
+	int offset = currentChunk()->count - loopStart + 3;
+	if (offset <= UINT16_MAX)
 	{
-		error("Loop body too large.");
+		emitByte(OP_LOOP);
+		emitByte((offset >> 8) & 0xFF);
+		emitByte(offset & 0xFF);
+		return;
 	}
 
-	emitByte((offset >> 8) & 0xFF);
-	emitByte(offset & 0xFF);
+	// 16bit に収まらなければ 4 要素の OP_LOOP_LONG にする
+	offset++;
+	if (offset > LONG_OPERAND_MAX)
+	{
+		error("Loop body too large.");
+	}
+	emitByte(OP_LOOP_LONG);
+	emitLong(offset);
 }
 
 int emitJump(uint8_t instruction)
 {
+	if (current->useLongJumps)
+	{
+		emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+		emitLong(LONG_OPERAND_MAX);
+		return currentChunk()->count - 3;
+	}
+
 	emitByte(instruction);
 	// placeholder for back pacthing
 	emitByte(0xFF);
@@ -211,36 +311,211 @@ int emitJump(uint8_t instruction)
 
 void patchJump(int offset)
 {
+	Chunk* chunk = currentChunk();
+	bool isLong = chunk->code[offset - 1] == OP_JUMP_LONG || chunk->code[offset - 1] == OP_JUMP_IF_FALSE_LONG;
+
 	// jump すべき分を決定する
-	// currentChunk の数にはジャンプ命令のダミーオペランド分も含まれているので、
-	// -2 して差し引いておく
-	int jump = currentChunk()->count - offset - 2;
+	// currentChunk の数にはジャンプ命令のダミーオペランド分も含まれているので、差し引いておく
+	int jump = chunk->count - offset - (isLong ? 3 : 2);
 
-	if (jump > UINT16_MAX)
+	if (isLong)
 	{
-		// cannot jump larger than 65535 instruction
-		error("Too match code to jump over");
+		if (jump > LONG_OPERAND_MAX)
+		{
+			error("Too match code to jump over");
+		}
+		chunk->code[offset] = static_cast<uint8_t>((jump >> 16) & 0xFF);
+		chunk->code[offset + 1] = static_cast<uint8_t>((jump >> 8) & 0xFF);
+		chunk->code[offset + 2] = static_cast<uint8_t>(jump & 0xFF);
+	}
+	else
+	{
+		if (jump > UINT16_MAX)
+		{
+			// 関数全体を _LONG のジャンプ命令でコンパイルし直すので、ここではエラーにしない
+			current->isJumpOverflowed = true;
+		}
+		chunk->code[offset] = static_cast<uint8_t>((jump >> 8) & 0xFF);
+		chunk->code[offset + 1] = static_cast<uint8_t>(jump & 0xFF);
 	}
 
-	currentChunk()->code[offset] = static_cast<uint8_t>((jump >> 8) & 0xFF);
-	currentChunk()->code[offset + 1] = static_cast<uint8_t>(jump & 0xFF);
+	// ジャンプ先をまたいで定数を畳み込まないように記録しておく
+	current->lastJumpTarget = currentChunk()->count;
 }
 
-uint8_t makeConstant(Value value)
+int makeConstant(Value value)
 {
 	int constant = addConstant(currentChunk(), value);
-	if (constant > UINT8_MAX)
+	if (constant > LONG_OPERAND_MAX)
 	{
 		error("Too many constants in one chunk.");
 		return 0;
 	}
 
-	return static_cast<uint8_t>(constant);
+	return constant;
+}
+
+// 定数を積む命令を発行したことを記録する
+void recordConstant(int offset, Value value, bool isNewConstant)
+{
+	if (current->constantCount == CONSTANT_HISTORY_COUNT)
+	{
+		// 古いものから捨てる
+		memmove(current->constants, current->constants + 1, sizeof(ConstantInstruction) * (CONSTANT_HISTORY_COUNT - 1));
+		current->constantCount--;
+	}
+
+	current->constants[current->constantCount++] = { offset, currentChunk()->count - offset, value, isNewConstant };
 }
 
 void emitConstant(Value value)
 {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+	Chunk* chunk = currentChunk();
+	int offset = chunk->count;
+	int constantCount = chunk->constants.count;
+
+	// 256 個目以降の定数は 24bit のオペランドの命令で積む
+	int constant = makeConstant(value);
+	if (constant > UINT8_MAX)
+	{
+		emitByte(OP_CONSTANT_LONG);
+		emitLong(constant);
+	}
+	else
+	{
+		emitBytes(OP_CONSTANT, static_cast<uint8_t>(constant));
+	}
+	recordConstant(offset, value, chunk->constants.count > constantCount);
+}
+
+// 定数を積む命令を発行する。真偽値と nil は定数表を使わない命令にする
+void emitConstantValue(Value value)
+{
+	if (IS_BOOL(value) || IS_NIL(value))
+	{
+		int offset = currentChunk()->count;
+		emitByte(IS_NIL(value) ? OP_NIL : AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+		recordConstant(offset, value, false);
+	}
+	else
+	{
+		emitConstant(value);
+	}
+}
+
+// チャンクの末尾の count 個の命令がどれも定数を積む命令なら、その値を values に順に入れて true を返す
+// 途中の命令がジャンプ先になっている場合 ((a and 1) + 2 の 2 など) は、命令の並びが式の構造と一致しないので畳み込まない
+bool peekConstants(int count, Value* values)
+{
+	if (current->constantCount < count) return false;
+
+	int end = currentChunk()->count;
+	for (int i = 0; i < count; i++)
+	{
+		const ConstantInstruction& constant = current->constants[current->constantCount - 1 - i];
+		if (constant.offset + constant.length != end) return false;
+
+		values[count - 1 - i] = constant.value;
+		end = constant.offset;
+	}
+
+	return current->lastJumpTarget <= end;
+}
+
+// チャンクの末尾の count 個の定数を積む命令を取り除く
+// 命令が定数表の末尾に追加した定数も、他から参照されていないので取り除く
+// 既にあった定数を使い回している場合は、他の命令も参照しているかもしれないので残す
+void discardConstants(int count)
+{
+	Chunk* chunk = currentChunk();
+	for (int i = 0; i < count; i++)
+	{
+		const ConstantInstruction& constant = current->constants[--current->constantCount];
+		if (constant.isNewConstant)
+		{
+			chunk->constants.count--;
+		}
+		chunk->count = constant.offset;
+	}
+}
+
+bool isFalseyConstant(Value value)
+{
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// オペランドが全て定数なら、op をコンパイル時に計算して result に入れる
+// 実行時エラーになる組み合わせ (-"a" や 1 + nil など) は畳み込まずに、実行時にエラーを出させる
+bool evaluateConstant(uint8_t op, const Value* operands, Value* result)
+{
+	Value a = operands[0];
+	Value b = operands[1];
+
+	switch (op)
+	{
+	case OP_NOT:
+		*result = TO_BOOL(isFalseyConstant(a));
+		return true;
+	case OP_NEGATE:
+		if (!IS_NUMBER(a)) return false;
+		*result = TO_NUMBER(-AS_NUMBER(a));
+		return true;
+	case OP_EQUAL:
+		*result = TO_BOOL(valuesEqual(a, b));
+		return true;
+	case OP_ADD:
+		if (IS_STRING(a) && IS_STRING(b))
+		{
+			// 畳み込む前の文字列は定数表から参照されているので、ここで GC が走っても回収されない
+			ObjString* left = AS_STRING(a);
+			ObjString* right = AS_STRING(b);
+
+			int length = left->length + right->length;
+			char* chars = allocate<char>(length + 1);
+			memcpy(chars, left->chars, left->length);
+			memcpy(chars + left->length, right->chars, right->length);
+			chars[length] = '\0';
+
+			*result = toObjValue(takeString(chars, length));
+			return true;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (op)
+	{
+	case OP_GREATER: *result = TO_BOOL(x > y); return true;
+	case OP_LESS: *result = TO_BOOL(x < y); return true;
+	case OP_ADD: *result = TO_NUMBER(x + y); return true;
+	case OP_SUBTRACT: *result = TO_NUMBER(x - y); return true;
+	case OP_MULTIPLY: *result = TO_NUMBER(x * y); return true;
+	case OP_DIVIDE: *result = TO_NUMBER(x / y); return true;
+	default: return false;
+	}
+}
+
+// 演算子の命令を発行する。オペランドが定数なら、計算結果を積む命令に置き換える
+void emitOperator(uint8_t op)
+{
+	int operandCount = (op == OP_NOT || op == OP_NEGATE) ? 1 : 2;
+
+	Value operands[2] = { TO_NIL(), TO_NIL() };
+	Value result;
+	if (peekConstants(operandCount, operands) && evaluateConstant(op, operands, &result))
+	{
+		// 結果の文字列は定数表に入るまで GC から見えないが、取り除く処理と定数の追加の間に割り当てはない
+		discardConstants(operandCount);
+		emitConstantValue(result);
+		return;
+	}
+
+	emitByte(op);
 }
 
 void emitReturn()
@@ -258,26 +533,59 @@ void emitReturn()
 	emitByte(OP_RETURN);
 }
 
-void initCompiler(Compiler* compiler, FunctionType type)
+void addLocal(Token name);
+
+// function が nullptr なら、コンパイル対象となる関数オブジェクトを新しく生成する
+// 遅延コンパイルでは、事前解析で生成済みの関数オブジェクトにバイトコードを書き込む
+void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function)
 {
 	compiler->enclosing = current;
 	compiler->function = nullptr;
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
-
-	// コンパイル対象となる関数オブジェクトをコンパイル時に生成する
-	compiler->function = newFunction();
-	current = compiler;
-
-	if (type != FunctionType::Script)
+	compiler->lastCallOffset = -1;
+	compiler->constantCount = 0;
+	compiler->lastJumpTarget = 0;
+	compiler->useLongJumps = false;
+	compiler->isJumpOverflowed = false;
+
+	if (function != nullptr)
+	{
+		// コンパイルし直すこともあるので、本文から決まるものは初期化しておく
+		compiler->function = function;
+		current = compiler;
+		function->arity = 0;
+		function->slotCount = 0;
+		freeChunk(&function->chunk);
+		rememberObject(&function->obj); // 実行時に定数を書き込み直す
+
+		// 事前解析で集めた上位値を、同じ番号で使う
+		LazyFunction* lazy = function->lazy;
+		compiler->upvalues = allocate<Upvalue>(lazy->upvalueCount);
+		compiler->upvalueCapacity = lazy->upvalueCount;
+		for (int i = 0; i < lazy->upvalueCount; i++)
+		{
+			compiler->upvalues[i] = Upvalue();
+			compiler->upvalues[i].name = lazy->upvalueNames[i];
+		}
+	}
+	else
 	{
-		// 関数名解析直後なので、一つ前のトークンから関数名を取得できる
-		current->function->name = copyString(parser.previous.start, parser.previous.length);
+		// コンパイル対象となる関数オブジェクトをコンパイル時に生成する
+		compiler->function = newFunction();
+		current = compiler;
+
+		if (type != FunctionType::Script)
+		{
+			// 関数名解析直後なので、一つ前のトークンから関数名を取得できる
+			current->function->name = copyString(parser.previous.start, parser.previous.length);
+		}
 	}
 
 	// 0 番目のローカル変数を VM 用に予約
-	Local* local = &current->locals[current->localCount++];
+	addLocal(Token());
+	Local* local = &current->locals[0];
 	local->depth = 0;
 	local->isCaptured = false;
 
@@ -295,13 +603,32 @@ void initCompiler(Compiler* compiler, FunctionType type)
 	}
 }
 
+// 可変長の配列を解放する。関数オブジェクトは GC が管理する
+void freeCompiler(Compiler* compiler)
+{
+	free_array(compiler->locals, compiler->localCapacity);
+	free_array(compiler->upvalues, compiler->upvalueCapacity);
+	compiler->locals = nullptr;
+	compiler->upvalues = nullptr;
+	compiler->localCapacity = 0;
+	compiler->upvalueCapacity = 0;
+}
+
 ObjFunction* endCompiler()
 {
 	emitReturn();
 	ObjFunction* f = current->function;
 
+	// 16bit に収まらないジャンプがあった関数はコンパイルし直すので、最適化しない
+	if (!parser.hadError && !current->isJumpOverflowed)
+	{
+		// 制御フローの単純化などを中間表現で行ってから、頻出する命令列をスーパー命令に融合する
+		if (isOptimizationEnabled) optimizeIr(currentChunk(), f->arity, isRegisterBytecodeEnabled);
+		optimizeChunk(currentChunk());
+	}
+
 #if DEBUG_PRINT_CODE
-	if (!parser.hadError)
+	if (!parser.hadError && !current->isJumpOverflowed)
 	{
 		disassembleChunk(currentChunk(), f->name != nullptr ? f->name->chars : "<script>");
 	}
@@ -367,6 +694,7 @@ ParseRule rules[] = {
 	/* TOKEN_SEMICOLON     */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_SLASH         */ {nullptr, binary, PREC_FACTOR},
 	/* TOKEN_STAR          */ {nullptr, binary, PREC_FACTOR},
+	/* TOKEN_COLON         */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_BANG          */ {unary, nullptr, PREC_NONE},
 	/* TOKEN_BANG_EQUAL    */ {nullptr, binary, PREC_EQUALITY},
 	/* TOKEN_EQUAL         */ {nullptr, nullptr, PREC_NONE},
@@ -379,7 +707,9 @@ ParseRule rules[] = {
 	/* TOKEN_STRING        */ {str, nullptr, PREC_NONE},
 	/* TOKEN_NUMBER        */ {number, nullptr, PREC_NONE},
 	/* TOKEN_AND           */ {nullptr, and_, PREC_AND},
+	/* TOKEN_CASE          */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_CLASS         */ {nullptr, nullptr, PREC_NONE},
+	/* TOKEN_DEFAULT       */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_ELSE          */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_FALSE         */ {literal, nullptr, PREC_NONE},
 	/* TOKEN_FOR           */ {nullptr, nullptr, PREC_NONE},
@@ -390,6 +720,7 @@ ParseRule rules[] = {
 	/* TOKEN_PRINT         */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_RETURN        */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_SUPER         */ {super, nullptr, PREC_NONE},
+	/* TOKEN_SWITCH        */ {nullptr, nullptr, PREC_NONE},
 	/* TOKEN_THIS          */ {this_, nullptr, PREC_NONE},
 	/* TOKEN_TRUE          */ {literal, nullptr, PREC_NONE},
 	/* TOKEN_VAR           */ {nullptr, nullptr, PREC_NONE},
@@ -446,10 +777,35 @@ void parsePrecedence(Precedence precedence)
 	}
 }
 
-uint8_t identifierConstant(Token* name)
+int identifierConstant(Token* name)
 {
 	// 変数名を表す文字列を、オブジェクトとして定数表に格納する
-	return makeConstant(TO_OBJ(copyString(name->start, name->length)));
+	// 名前を使う命令のオペランドは OP_WIDE を前置しても 16bit まで
+	int constant = makeConstant(TO_OBJ(copyString(name->start, name->length)));
+	if (constant > UINT16_MAX)
+	{
+		error("Too many constants in one chunk.");
+		return 0;
+	}
+	return constant;
+}
+
+int globalIndex(Token* name)
+{
+	// グローバル変数は実行時に名前で引かずに済むよう、コンパイル時に番号へ解決する
+	int index = resolveGlobal(copyString(name->start, name->length));
+	if (index > UINT16_MAX)
+	{
+		error("Too many global variables.");
+		return 0;
+	}
+	return index;
+}
+
+void emitGlobal(OpCode op, int index)
+{
+	emitByte(op);
+	emitBytes(static_cast<uint8_t>((index >> 8) & 0xFF), static_cast<uint8_t>(index & 0xFF));
 }
 
 bool identifierEqual(Token* a, Token* b)
@@ -478,7 +834,7 @@ int resolveLocal(Compiler* compiler, Token* name)
 	return -1;
 }
 
-int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+int addUpvalue(Compiler* compiler, int index, bool isLocal, Token* name)
 {
 	int upvalueCount = compiler->function->upvalueCount;
 
@@ -498,14 +854,31 @@ int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 		return 0;
 	}
 
+	if (upvalueCount == compiler->upvalueCapacity)
+	{
+		int oldCapacity = compiler->upvalueCapacity;
+		compiler->upvalueCapacity = grow_capacity(oldCapacity);
+		compiler->upvalues = grow_array(compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+	}
+
+	compiler->upvalues[upvalueCount].name = *name;
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
-	compiler->upvalues[upvalueCount].index = index;
+	compiler->upvalues[upvalueCount].index = static_cast<uint16_t>(index);
 	return compiler->function->upvalueCount++;
 }
 
 int resolveUpvalue(Compiler* compiler, Token* name)
 {
-	if (compiler->enclosing == nullptr) return -1;
+	if (compiler->enclosing == nullptr)
+	{
+		// 遅延コンパイル中の関数は、事前解析で集めた上位値を名前で引く
+		// 事前解析では本文に現れる識別子を全て外側で解決してあるので、ここで見つからなければグローバル変数である
+		for (int i = 0; i < compiler->function->upvalueCount; i++)
+		{
+			if (identifierEqual(name, &compiler->upvalues[i].name)) return i;
+		}
+		return -1;
+	}
 
 	// すぐ外側のローカル変数として解決可能であれば上位値である
 	// そのスコープにおけるインデックスを保存する
@@ -514,7 +887,7 @@ int resolveUpvalue(Compiler* compiler, Token* name)
 	{
 		// キャプチャされたことをマークしておき、スタックから抜けるときに解放されないようにする
 		compiler->enclosing->locals[local].isCaptured = true;
-		return addUpvalue(compiler, static_cast<uint8_t>(local), true);
+		return addUpvalue(compiler, local, true, name);
 	}
 
 	// 外側の関数の上位値として解決できるかを再帰的に試みる
@@ -524,7 +897,7 @@ int resolveUpvalue(Compiler* compiler, Token* name)
 	{
 		// 見つけられた場合は自身の上位値として追加
 		// ただし、直上のローカル変数ではない
-		return addUpvalue(compiler, static_cast<uint8_t>(local), false);
+		return addUpvalue(compiler, upvalue, false, name);
 	}
 
 	return -1;
@@ -538,6 +911,19 @@ void addLocal(Token name)
 		return;
 	}
 
+	if (current->localCount == current->localCapacity)
+	{
+		int oldCapacity = current->localCapacity;
+		current->localCapacity = grow_capacity(oldCapacity);
+		current->locals = grow_array(current->locals, oldCapacity, current->localCapacity);
+	}
+
+	// 実行時に確保するスタックのスロット数 (呼び出し時の溢れの検査に使う)
+	if (current->localCount + 1 > current->function->slotCount)
+	{
+		current->function->slotCount = current->localCount + 1;
+	}
+
 	Local* local = &current->locals[current->localCount++];
 	local->name = name;
 	local->depth = -1;
@@ -568,14 +954,14 @@ void declareVariable()
 	addLocal(*name);
 }
 
-uint8_t parseVariable(const char* errorMessage)
+int parseVariable(const char* errorMessage)
 {
 	consume(TOKEN_IDENTIFIER, errorMessage);
 
 	declareVariable();
 	if (current->scopeDepth > 0) return 0;
 
-	return identifierConstant(&parser.previous);
+	return globalIndex(&parser.previous);
 }
 
 void markInitialized()
@@ -584,14 +970,14 @@ void markInitialized()
 	current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-void defineVariable(uint8_t global)
+void defineVariable(int global)
 {
 	if (current->scopeDepth > 0)
 	{
 		markInitialized();
 		return;
 	}
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 uint8_t argumentList()
@@ -667,20 +1053,23 @@ void namedVariable(Token name)
 	}
 	else
 	{
-		arg = identifierConstant(&name);
+		arg = globalIndex(&name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 
+	bool isGlobal = getOp == OP_GET_GLOBAL;
 	if (canAssign && match(TOKEN_EQUAL))
 	{
 		// identifier の後に = があったら、後段にあるものを右辺値としてセット命令で包む
 		expression();
-		emitBytes(setOp, static_cast<uint8_t>(arg));
+		if (isGlobal) emitGlobal(OP_SET_GLOBAL, arg);
+		else emitOperandInstruction(setOp, arg);
 	}
 	else
 	{
-		emitBytes(getOp, static_cast<uint8_t>(arg));
+		if (isGlobal) emitGlobal(OP_GET_GLOBAL, arg);
+		else emitOperandInstruction(getOp, arg);
 	}
 }
 
@@ -710,7 +1099,7 @@ void super()
 
 	consume(TOKEN_DOT, "Expect '.' after 'super'.");
 	consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 
 	bool canAssign = parser.canAssign;
 	parser.canAssign = false;
@@ -720,13 +1109,13 @@ void super()
 	{
 		uint8_t argCount = argumentList();
 		namedVariable(syntheticToken("super"));
-		emitBytes(OP_SUPER_INVOKE, name);
+		emitOperandInstruction(OP_SUPER_INVOKE, name);
 		emitByte(argCount);
 	}
 	else
 	{
 		namedVariable(syntheticToken("super"));
-		emitBytes(OP_GET_SUPER, name);
+		emitOperandInstruction(OP_GET_SUPER, name);
 	}
 	parser.canAssign = canAssign;
 }
@@ -756,10 +1145,10 @@ void unary()
 	switch (opType)
 	{
 	case TOKEN_BANG:
-		emitByte(OP_NOT);
+		emitOperator(OP_NOT);
 		break;
 	case TOKEN_MINUS:
-		emitByte(OP_NEGATE);
+		emitOperator(OP_NEGATE);
 		break;
 	default:
 		return; // Unreachable
@@ -778,34 +1167,37 @@ void binary()
 	switch (opType)
 	{
 	case TOKEN_BANG_EQUAL:
-		emitBytes(OP_EQUAL, OP_NOT);
+		emitOperator(OP_EQUAL);
+		emitOperator(OP_NOT);
 		break;
 	case TOKEN_EQUAL_EQUAL:
-		emitByte(OP_EQUAL);
+		emitOperator(OP_EQUAL);
 		break;
 	case TOKEN_GREATER:
-		emitByte(OP_GREATER);
+		emitOperator(OP_GREATER);
 		break;
 	case TOKEN_GREATER_EQUAL:
-		emitBytes(OP_LESS, OP_NOT);
+		emitOperator(OP_LESS);
+		emitOperator(OP_NOT);
 		break;
 	case TOKEN_LESS:
-		emitByte(OP_LESS);
+		emitOperator(OP_LESS);
 		break;
 	case TOKEN_LESS_EQUAL:
-		emitBytes(OP_GREATER, OP_NOT);
+		emitOperator(OP_GREATER);
+		emitOperator(OP_NOT);
 		break;
 	case TOKEN_PLUS:
-		emitByte(OP_ADD);
+		emitOperator(OP_ADD);
 		break;
 	case TOKEN_MINUS:
-		emitByte(OP_SUBTRACT);
+		emitOperator(OP_SUBTRACT);
 		break;
 	case TOKEN_STAR:
-		emitByte(OP_MULTIPLY);
+		emitOperator(OP_MULTIPLY);
 		break;
 	case TOKEN_SLASH:
-		emitByte(OP_DIVIDE);
+		emitOperator(OP_DIVIDE);
 		break;
 	default:
 		return; // Unreachable
@@ -815,19 +1207,33 @@ void binary()
 void call()
 {
 	uint8_t argCount = argumentList();
+	current->lastCallOffset = currentChunk()->count;
 	emitBytes(OP_CALL, argCount);
 }
 
+// プロパティアクセス命令のオペランドとして、インラインキャッシュの番号を書き出す
+void emitInlineCache()
+{
+	int cache = addInlineCache(currentChunk());
+	if (cache > UINT16_MAX)
+	{
+		error("Too many property accesses in one chunk.");
+		return;
+	}
+	emitBytes(static_cast<uint8_t>((cache >> 8) & 0xFF), static_cast<uint8_t>(cache & 0xFF));
+}
+
 void dot()
 {
 	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 
 	if (parser.canAssign && match(TOKEN_EQUAL))
 	{
 		// 左辺値なので、右辺の式を評価して SET
 		expression();
-		emitBytes(OP_SET_PROPERTY, name);
+		emitOperandInstruction(OP_SET_PROPERTY, name);
+		emitInlineCache();
 	}
 	else if (match(TOKEN_LEFT_PAREN))
 	{
@@ -835,13 +1241,16 @@ void dot()
 		uint8_t argCount = argumentList();
 
 		// OP_INVOKE = OP_GET_PROPERTY + OP_CALL
-		emitBytes(OP_INVOKE, name);
+		current->lastCallOffset = currentChunk()->count;
+		emitOperandInstruction(OP_INVOKE, name);
 		emitByte(argCount);
+		emitInlineCache();
 	}
 	else
 	{
 		// 右辺値なので、name を使って GET
-		emitBytes(OP_GET_PROPERTY, name);
+		emitOperandInstruction(OP_GET_PROPERTY, name);
+		emitInlineCache();
 	}
 }
 
@@ -850,13 +1259,13 @@ void literal()
 	switch (parser.previous.type)
 	{
 	case TOKEN_FALSE:
-		emitByte(OP_FALSE);
+		emitConstantValue(TO_BOOL(false));
 		break;
 	case TOKEN_NIL:
-		emitByte(OP_NIL);
+		emitConstantValue(TO_NIL());
 		break;
 	case TOKEN_TRUE:
-		emitByte(OP_TRUE);
+		emitConstantValue(TO_BOOL(true));
 		break;
 	default:
 		return; // Unreachable
@@ -896,10 +1305,9 @@ void block()
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-void function(FunctionType type)
+// 仮引数と本文をコンパイルして、関数オブジェクトを返す
+ObjFunction* functionBody()
 {
-	Compiler compiler;
-	initCompiler(&compiler, type);
 	beginScope();
 
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -913,7 +1321,7 @@ void function(FunctionType type)
 			{
 				errorAtCurrent("Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parseVariable("Expect parameter name.");
+			int constant = parseVariable("Expect parameter name.");
 			defineVariable(constant);
 		} while (match(TOKEN_COMMA));
 	}
@@ -924,22 +1332,158 @@ void function(FunctionType type)
 	block();
 
 	// NOTE: 関数が終わるとコンパイラが終了するので endScope() は不要
-	ObjFunction* f = endCompiler();
+	return endCompiler();
+}
+
+// 仮引数リストから関数をコンパイルする。function は initCompiler() と同じ
+ObjFunction* compileFunction(Compiler* compiler, FunctionType type, ObjFunction* function)
+{
+	// 16bit に収まらないジャンプがあったら、ここから読み直して _LONG のジャンプ命令でコンパイルし直す
+	// 外側の関数の上位値の追加やグローバル変数の番号の解決は、同じ名前に対して同じ結果になるので二度行ってもよい
+	ScannerState state = saveScanner();
+	Parser start = parser;
+
+	ObjFunction* f = nullptr;
+	for (bool useLongJumps = false;; useLongJumps = true)
+	{
+		initCompiler(compiler, type, function);
+		compiler->useLongJumps = useLongJumps;
+		f = functionBody();
+		if (!compiler->isJumpOverflowed || useLongJumps || parser.hadError) break;
+
+		freeCompiler(compiler);
+		restoreScanner(state);
+		parser = start;
+	}
+	return f;
+}
+
+// 本文の識別子が外側の関数の変数を指していれば、上位値としてキャプチャする
+void captureVariable(Token name)
+{
+	if (resolveLocal(current, &name) == -1)
+	{
+		resolveUpvalue(current, &name);
+	}
+}
+
+// 本文をコンパイルせずに対応する } まで読み飛ばして、最初の呼び出しでコンパイルする関数オブジェクトを返す
+// 本文に現れる識別子を全て外側の関数で解決して、上位値を集めておく
+// 本文の中で宣言したローカル変数を指す識別子も含むので上位値は多めになるが、使わない上位値をキャプチャしても動作は変わらない
+// 不正な文字と、括弧の対応の誤りはここで報告する。それ以外の構文エラーは最初の呼び出しでコンパイルする時に報告する
+ObjFunction* preparseFunction(Compiler* compiler, FunctionType type)
+{
+	initCompiler(compiler, type, nullptr);
+	ObjFunction* f = compiler->function;
+	Token start = parser.current;
+
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	if (!check(TOKEN_RIGHT_PAREN))
+	{
+		do {
+			f->arity++;
+			if (f->arity > 255)
+			{
+				errorAtCurrent("Can't have more than 255 parameters.");
+			}
+			consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+	// Lox の式は { } を含まないので、( ) は { } の間で閉じていなければならない
+	int depth = 1;
+	int parenDepth = 0;
+	while (!check(TOKEN_EOF))
+	{
+		if ((check(TOKEN_LEFT_BRACE) || check(TOKEN_RIGHT_BRACE)) && parenDepth > 0)
+		{
+			errorAtCurrent("Expect ')' to close '('.");
+			parenDepth = 0;
+		}
+		if (check(TOKEN_RIGHT_PAREN) && --parenDepth < 0)
+		{
+			errorAtCurrent("Unmatched ')'.");
+			parenDepth = 0;
+		}
+		if (check(TOKEN_LEFT_PAREN)) parenDepth++;
+		if (check(TOKEN_RIGHT_BRACE) && --depth == 0) break;
+		if (check(TOKEN_LEFT_BRACE)) depth++;
+
+		// . の後の識別子はプロパティ名なので変数ではない
+		if (check(TOKEN_IDENTIFIER) && parser.previous.type != TOKEN_DOT) captureVariable(parser.current);
+		if (check(TOKEN_THIS) || check(TOKEN_SUPER)) captureVariable(syntheticToken("this"));
+		if (check(TOKEN_SUPER)) captureVariable(syntheticToken("super"));
+		advance();
+	}
+	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+
+	Token* upvalueNames = allocate<Token>(f->upvalueCount);
+	for (int i = 0; i < f->upvalueCount; i++)
+	{
+		upvalueNames[i] = compiler->upvalues[i].name;
+	}
+
+	LazyFunction* lazy = allocate<LazyFunction>(1);
+	lazy->source = lazySource;
+	lazy->offset = static_cast<int>(start.start - lazySource->chars);
+	lazy->line = start.line;
+	lazy->type = type;
+	lazy->isInClass = currentClass != nullptr;
+	lazy->hasSuperclass = currentClass != nullptr && currentClass->hasSuperclass;
+	lazy->upvalueNames = upvalueNames;
+	lazy->upvalueCount = f->upvalueCount;
+	f->lazy = lazy;
+
+	current = current->enclosing;
+	return f;
+}
+
+void function(FunctionType type)
+{
+	Compiler compiler;
+	ObjFunction* f = isLazyCompilationEnabled ? preparseFunction(&compiler, type) : compileFunction(&compiler, type, nullptr);
 
 	// クロージャと上位値のリストを吐き出す
-	// OP_CLOSURE のサイズは可変になる
-	emitBytes(OP_CLOSURE, makeConstant(TO_OBJ(f)));
+	// OP_CLOSURE のサイズは可変になる。定数か上位値のインデックスが 8bit に収まらなければ、OP_WIDE を前置してどちらも 16bit にする
+	int constant = makeConstant(TO_OBJ(f));
+	bool isWide = constant > UINT8_MAX;
 	for (int i = 0; i < f->upvalueCount; i++)
 	{
-		emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-		emitByte(compiler.upvalues[i].index);
+		if (compiler.upvalues[i].index > UINT8_MAX) isWide = true;
+	}
+
+	if (isWide)
+	{
+		if (constant > UINT16_MAX)
+		{
+			error("Too many constants in one chunk.");
+		}
+		emitBytes(OP_WIDE, OP_CLOSURE);
+		emitBytes(static_cast<uint8_t>((constant >> 8) & 0xFF), static_cast<uint8_t>(constant & 0xFF));
+		for (int i = 0; i < f->upvalueCount; i++)
+		{
+			emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+			emitBytes(static_cast<uint8_t>((compiler.upvalues[i].index >> 8) & 0xFF), static_cast<uint8_t>(compiler.upvalues[i].index & 0xFF));
+		}
+	}
+	else
+	{
+		emitBytes(OP_CLOSURE, static_cast<uint8_t>(constant));
+		for (int i = 0; i < f->upvalueCount; i++)
+		{
+			emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+			emitByte(static_cast<uint8_t>(compiler.upvalues[i].index));
+		}
 	}
+	freeCompiler(&compiler);
 }
 
 void method()
 {
 	consume(TOKEN_IDENTIFIER, "Expect method name.");
-	uint8_t constant = identifierConstant(&parser.previous);
+	int constant = identifierConstant(&parser.previous);
 
 	auto type = FunctionType::Method;
 	// もし "init" を別の文字列にするなら、ここの長さも変えないといけない
@@ -949,7 +1493,7 @@ void method()
 	}
 	function(type);
 
-	emitBytes(OP_METHOD, constant);
+	emitOperandInstruction(OP_METHOD, constant);
 }
 
 void classDeclaration()
@@ -958,11 +1502,11 @@ void classDeclaration()
 	consume(TOKEN_IDENTIFIER, "Expect class name.");
 
 	Token className = parser.previous;
-	uint8_t nameConstant = identifierConstant(&parser.previous);
+	int nameConstant = identifierConstant(&parser.previous);
 	declareVariable();
 
-	emitBytes(OP_CLASS, nameConstant);
-	defineVariable(nameConstant);
+	emitOperandInstruction(OP_CLASS, nameConstant);
+	defineVariable(current->scopeDepth > 0 ? 0 : globalIndex(&className));
 
 	ClassCompiler classCompiler;
 	classCompiler.enclosing = currentClass;
@@ -1020,7 +1564,7 @@ void funDeclaration()
 
 	// 関数名も変数としてパースする
 	// 未初期化変数としてマークしておくことで、本文内で参照可能にする
-	uint8_t global = parseVariable("Expect function name.");
+	int global = parseVariable("Expect function name.");
 	markInitialized();
 	function(FunctionType::Function);
 	defineVariable(global);
@@ -1028,7 +1572,7 @@ void funDeclaration()
 
 void varDeclaration()
 {
-	uint8_t global = parseVariable("Expect variable name.");
+	int global = parseVariable("Expect variable name.");
 
 	if (match(TOKEN_EQUAL))
 	{
@@ -1052,6 +1596,71 @@ void expressionStatement()
 	emitByte(OP_POP);
 }
 
+// 条件節が i < limit (limit はローカル変数、定数、グローバル変数)、更新節が i = i + step (step は数値の定数) の for ループなら、
+// 本文の末尾に更新と条件の判定をまとめた OP_FOR_LOOP 系の命令を置いて bodyStart に戻る
+// 出力済みの条件節と更新節の命令列の形で判定する。当てはまらなければ何もしない
+void emitForLoop(int conditionStart, int conditionEnd, int incrementStart, int incrementEnd, int bodyStart)
+{
+	const Chunk* chunk = currentChunk();
+
+	// OP_GET_LOCAL i, OP_CONSTANT step, OP_ADD, OP_SET_LOCAL i, OP_POP
+	const uint8_t* increment = chunk->code + incrementStart;
+	if (incrementEnd - incrementStart != 8 ||
+		increment[0] != OP_GET_LOCAL || increment[2] != OP_CONSTANT || increment[4] != OP_ADD ||
+		increment[5] != OP_SET_LOCAL || increment[6] != increment[1] || increment[7] != OP_POP)
+	{
+		return;
+	}
+	const uint8_t counter = increment[1];
+	const uint8_t step = increment[3];
+	if (!IS_NUMBER(chunk->constants.values[step])) return;
+
+	// OP_GET_LOCAL i, (OP_GET_LOCAL | OP_CONSTANT | OP_GET_GLOBAL) limit, OP_LESS
+	const uint8_t* condition = chunk->code + conditionStart;
+	const int length = conditionEnd - conditionStart;
+	if (length < 5 || condition[0] != OP_GET_LOCAL || condition[1] != counter || condition[length - 1] != OP_LESS) return;
+
+	uint8_t limit[2];
+	int limitLength = 1;
+	OpCode op;
+	if (length == 5 && condition[2] == OP_GET_LOCAL)
+	{
+		op = OP_FOR_LOOP;
+		limit[0] = condition[3];
+	}
+	else if (length == 5 && condition[2] == OP_CONSTANT)
+	{
+		op = OP_FOR_LOOP_CONSTANT;
+		limit[0] = condition[3];
+	}
+	else if (length == 6 && condition[2] == OP_GET_GLOBAL)
+	{
+		op = OP_FOR_LOOP_GLOBAL;
+		limit[0] = condition[3];
+		limit[1] = condition[4];
+		limitLength = 2;
+	}
+	else
+	{
+		return;
+	}
+
+	// 本文の先頭に 16bit のオフセットで戻れない場合は、融合せずに OP_LOOP 系の命令で更新節に戻る
+	if (chunk->count + 3 + limitLength + 2 - bodyStart > UINT16_MAX) return;
+
+	// 命令を出力するとチャンクが再確保されるので、オペランドは読み終えておく
+	emitBytes(op, counter);
+	emitByte(step);
+	for (int i = 0; i < limitLength; i++)
+	{
+		emitByte(limit[i]);
+	}
+
+	int offset = currentChunk()->count - bodyStart + 2;
+	emitByte((offset >> 8) & 0xFF);
+	emitByte(offset & 0xFF);
+}
+
 void forStatement()
 {
 	beginScope();
@@ -1075,9 +1684,13 @@ void forStatement()
 
 	int loopStart = currentChunk()->count;
 	int exitJump = -1;
+	int conditionEnd = -1;
+	int incrementStart = -1;
+	int incrementEnd = -1;
 	if (!match(TOKEN_SEMICOLON))
 	{
 		expression();
+		conditionEnd = currentChunk()->count;
 		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
 		// 条件が偽のとき、評価値をスタックに残したままループを抜ける
@@ -1091,18 +1704,25 @@ void forStatement()
 		// そして、本文実行後のジャンプ先をインクリメント節の実行開始に置き換えておく
 		// 本文実行後にインクリメント節を実行し、その後条件節の実行前までジャンプする
 		int bodyJump = emitJump(OP_JUMP);
-		int incrementStart = currentChunk()->count;
+		incrementStart = currentChunk()->count;
 		expression();
 		emitByte(OP_POP);
+		incrementEnd = currentChunk()->count;
 		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
 		emitLoop(loopStart);
-		loopStart = incrementStart; // ジャンプ先差し替え
 		patchJump(bodyJump);
 	}
 
+	int bodyStart = currentChunk()->count;
 	statement();
-	emitLoop(loopStart);
+
+	if (exitJump != -1 && incrementStart != -1)
+	{
+		// 数値のループなら本文の末尾で更新と条件の判定をまとめて行い、そうでなければ次の OP_LOOP で更新節に進む
+		emitForLoop(loopStart, conditionEnd, incrementStart, incrementEnd, bodyStart);
+	}
+	emitLoop(incrementStart != -1 ? incrementStart : loopStart);
 
 	if (exitJump != -1)
 	{
@@ -1167,6 +1787,18 @@ void returnStatement()
 
 		expression();
 		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+		// return f(...) なら呼び出しを末尾呼び出しに置き換える
+		// OP_RETURN は残しておく。ネイティブ関数やクラスの呼び出しは通常の呼び出しになって戻ってくるし、
+		// and / or の短絡でジャンプしてきた場合もここに着地する
+		Chunk* chunk = currentChunk();
+		int call = current->lastCallOffset;
+		if (call >= 0 && call + getInstructionLength(chunk, call) == chunk->count)
+		{
+			// OP_WIDE の付いた OP_INVOKE は、前置された命令の方を置き換える
+			if (chunk->code[call] == OP_WIDE) call++;
+			chunk->code[call] = chunk->code[call] == OP_CALL ? OP_TAIL_CALL : OP_TAIL_INVOKE;
+		}
 		emitByte(OP_RETURN);
 	}
 }
@@ -1190,6 +1822,332 @@ void whileStatement()
 	emitByte(OP_POP);
 }
 
+// 後でまとめて書き換える前方ジャンプの一覧
+struct JumpList
+{
+	int* offsets = nullptr;
+	int count = 0;
+	int capacity = 0;
+};
+
+void addJump(JumpList* list, int offset)
+{
+	if (list->capacity < list->count + 1)
+	{
+		auto oldCapacity = list->capacity;
+		list->capacity = grow_capacity(oldCapacity);
+		list->offsets = grow_array(list->offsets, oldCapacity, list->capacity);
+	}
+	list->offsets[list->count++] = offset;
+}
+
+// 一覧のジャンプをすべて現在の位置に向けて、一覧を解放する
+void patchJumps(JumpList* list)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		patchJump(list->offsets[i]);
+	}
+	free_array(list->offsets, list->capacity);
+	*list = JumpList();
+}
+
+// switch 文の case のラベルを先読みで分類した結果
+struct SwitchLabels
+{
+	int count = 0;
+	bool isInteger = true; // すべて整数の定数
+	bool isString = true; // すべて文字列の定数
+	double min = 0;
+	double max = 0;
+};
+
+// 表を引く命令にする case の数の下限と、整数の表の空きの許容量 (エントリ数 / case の数)
+constexpr int SWITCH_TABLE_MIN_CASES = 2;
+constexpr int SWITCH_TABLE_MAX_SPARSENESS = 2;
+
+bool isSwitchInteger(double value)
+{
+	return value >= INT32_MIN && value <= INT32_MAX && value == static_cast<int32_t>(value);
+}
+
+// switch 文の本文を先読みして、ネストしていない case のラベルを分類する。走査位置は元に戻す
+// ラベルが "-"? 数値 ":" か 文字列 ":" だけのものを定数とみなす
+SwitchLabels scanSwitchLabels()
+{
+	SwitchLabels labels;
+	ScannerState state = saveScanner();
+
+	int depth = 0;
+	Token token = parser.current;
+	while (token.type != TOKEN_EOF)
+	{
+		if (token.type == TOKEN_LEFT_BRACE)
+		{
+			depth++;
+		}
+		else if (token.type == TOKEN_RIGHT_BRACE)
+		{
+			if (depth == 0) break;
+			depth--;
+		}
+		else if (token.type == TOKEN_CASE && depth == 0)
+		{
+			labels.count++;
+
+			token = scanToken();
+			bool isNegative = token.type == TOKEN_MINUS;
+			if (isNegative) token = scanToken();
+			Token label = token;
+			token = scanToken();
+
+			bool isConstant = token.type == TOKEN_COLON;
+			if (isConstant && !isNegative && label.type == TOKEN_STRING)
+			{
+				labels.isInteger = false;
+			}
+			else if (isConstant && label.type == TOKEN_NUMBER)
+			{
+				labels.isString = false;
+				double value = strtod(label.start, nullptr);
+				if (isNegative) value = -value;
+				if (!isSwitchInteger(value)) labels.isInteger = false;
+				if (labels.count == 1 || value < labels.min) labels.min = value;
+				if (labels.count == 1 || value > labels.max) labels.max = value;
+			}
+			else
+			{
+				labels.isInteger = false;
+				labels.isString = false;
+			}
+			continue; // ラベルの後のトークンは読み込み済み
+		}
+
+		token = scanToken();
+	}
+
+	restoreScanner(state);
+	return labels;
+}
+
+// 文字列の表の容量。空きのエントリで探索が止まるように、case の数の 2 倍以上の 2 のべき乗にする
+int switchStringCapacity(int count)
+{
+	int capacity = 1;
+	while (capacity < count * 2) capacity *= 2;
+	return capacity;
+}
+
+// case / default の本文。次の case / default か "}" までの文を、それぞれのスコープで実行する
+void switchCaseBody()
+{
+	beginScope();
+	while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+	{
+		declaration();
+	}
+	endScope();
+}
+
+// 表を引く命令 table のエントリ operand に、命令の末尾から現在の位置までのオフセットを書き込む
+void patchSwitchEntry(int table, int operand)
+{
+	Chunk* chunk = currentChunk();
+	int jump = chunk->count - (table + getInstructionLength(chunk, table));
+	if (jump >= SWITCH_EMPTY_ENTRY)
+	{
+		// ジャンプ命令と同じく、関数全体を比較を並べる形でコンパイルし直す
+		current->isJumpOverflowed = true;
+	}
+
+	chunk->code[operand] = static_cast<uint8_t>((jump >> 8) & 0xFF);
+	chunk->code[operand + 1] = static_cast<uint8_t>(jump & 0xFF);
+
+	// ジャンプ先をまたいで定数を畳み込まないように記録しておく
+	current->lastJumpTarget = chunk->count;
+}
+
+// case のラベルの定数を読む。先読みで "-"? 数値 か 文字列 であることは確かめてある
+Value switchLabel()
+{
+	bool isNegative = match(TOKEN_MINUS);
+	advance();
+	if (parser.previous.type == TOKEN_STRING)
+	{
+		return toObjValue(copyString(parser.previous.start + 1, parser.previous.length - 2));
+	}
+
+	double value = strtod(parser.previous.start, nullptr);
+	return TO_NUMBER(isNegative ? -value : value);
+}
+
+// ラベルが定数の switch 文。値を POP して表を一度引くだけで、一致した case の本文に飛ぶ
+void switchTable(const SwitchLabels& labels)
+{
+	Chunk* chunk = currentChunk();
+	int table = chunk->count;
+	int entryCount = 0;
+	if (labels.isInteger)
+	{
+		// OP_JUMP_TABLE K(min) count default16 offset16 * count
+		entryCount = static_cast<int>(labels.max - labels.min) + 1;
+		emitBytes(OP_JUMP_TABLE, static_cast<uint8_t>(makeConstant(TO_NUMBER(labels.min))));
+		emitByte(static_cast<uint8_t>(entryCount));
+		for (int i = 0; i < entryCount + 1; i++)
+		{
+			emitBytes(0xFF, 0xFF);
+		}
+	}
+	else
+	{
+		// OP_JUMP_STRING capacity default16 (K offset16) * capacity
+		entryCount = switchStringCapacity(labels.count);
+		emitBytes(OP_JUMP_STRING, static_cast<uint8_t>(entryCount));
+		emitBytes(0xFF, 0xFF);
+		for (int i = 0; i < entryCount; i++)
+		{
+			emitByte(0);
+			emitBytes(0xFF, 0xFF);
+		}
+	}
+	int defaultOperand = table + (labels.isInteger ? 3 : 2);
+
+	JumpList endJumps;
+	while (match(TOKEN_CASE))
+	{
+		Value label = switchLabel();
+		consume(TOKEN_COLON, "Expect ':' after case value.");
+
+		// 重複したラベルは最初の case を優先する
+		if (labels.isInteger)
+		{
+			int operand = table + 5 + static_cast<int>(AS_NUMBER(label) - labels.min) * 2;
+			if (chunk->code[operand] == 0xFF && chunk->code[operand + 1] == 0xFF)
+			{
+				patchSwitchEntry(table, operand);
+			}
+		}
+		else
+		{
+			ObjString* string = AS_STRING(label);
+			for (int index = string->hash & (entryCount - 1);; index = (index + 1) & (entryCount - 1))
+			{
+				int entry = table + 4 + index * 3;
+				if (chunk->code[entry + 1] == 0xFF && chunk->code[entry + 2] == 0xFF)
+				{
+					chunk->code[entry] = static_cast<uint8_t>(makeConstant(label));
+					patchSwitchEntry(table, entry + 1);
+					break;
+				}
+				if (AS_STRING(chunk->constants.values[chunk->code[entry]]) == string) break;
+			}
+		}
+
+		switchCaseBody();
+
+		// 最後の case は末尾まで飛ぶ必要がない
+		if (!check(TOKEN_RIGHT_BRACE)) addJump(&endJumps, emitJump(OP_JUMP));
+	}
+
+	if (match(TOKEN_DEFAULT))
+	{
+		consume(TOKEN_COLON, "Expect ':' after 'default'.");
+		patchSwitchEntry(table, defaultOperand);
+		switchCaseBody();
+	}
+
+	patchJumps(&endJumps);
+	if (chunk->code[defaultOperand] == 0xFF && chunk->code[defaultOperand + 1] == 0xFF)
+	{
+		patchSwitchEntry(table, defaultOperand);
+	}
+
+	// ラベルの無い整数の表のエントリは default に飛ばす
+	for (int i = 0; labels.isInteger && i < entryCount; i++)
+	{
+		int operand = table + 5 + i * 2;
+		if (chunk->code[operand] == 0xFF && chunk->code[operand + 1] == 0xFF)
+		{
+			chunk->code[operand] = chunk->code[defaultOperand];
+			chunk->code[operand + 1] = chunk->code[defaultOperand + 1];
+		}
+	}
+}
+
+// ラベルが定数でない switch 文。値を隠れたローカル変数に置いて、case ごとに == で比較する
+void switchChain()
+{
+	beginScope();
+	addLocal(syntheticToken("switch"));
+	markInitialized();
+	int slot = current->localCount - 1;
+
+	JumpList endJumps;
+	while (match(TOKEN_CASE))
+	{
+		emitOperandInstruction(OP_GET_LOCAL, slot);
+		expression();
+		consume(TOKEN_COLON, "Expect ':' after case value.");
+		emitByte(OP_EQUAL);
+
+		int nextJump = emitJump(OP_JUMP_IF_FALSE);
+		emitByte(OP_POP);
+		switchCaseBody();
+		addJump(&endJumps, emitJump(OP_JUMP));
+
+		patchJump(nextJump);
+		emitByte(OP_POP);
+	}
+
+	if (match(TOKEN_DEFAULT))
+	{
+		consume(TOKEN_COLON, "Expect ':' after 'default'.");
+		switchCaseBody();
+	}
+
+	patchJumps(&endJumps);
+	endScope();
+}
+
+void switchStatement()
+{
+	// switchStmt := "switch" "(" expression ")" "{" ("case" expression ":" declaration*)* ("default" ":" declaration*)? "}"
+	// フォールスルーは無く、最初に一致した case の本文だけを実行する
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+	expression();
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+
+	// ラベルがすべて密な整数か文字列の定数なら表を引く。そうでなければ比較を並べる
+	// 表のオペランドは 8bit の定数と 16bit のオフセットなので、どちらかが収まらない関数でも比較を並べる
+	SwitchLabels labels = scanSwitchLabels();
+	bool useTable = false;
+	if (current->useLongJumps || currentChunk()->constants.count + labels.count + 1 > UINT8_MAX + 1)
+	{
+		useTable = false;
+	}
+	else if (labels.count >= SWITCH_TABLE_MIN_CASES && labels.isInteger)
+	{
+		double entryCount = labels.max - labels.min + 1;
+		useTable = entryCount <= UINT8_MAX && entryCount <= labels.count * SWITCH_TABLE_MAX_SPARSENESS;
+	}
+	else if (labels.count >= SWITCH_TABLE_MIN_CASES && labels.isString)
+	{
+		useTable = switchStringCapacity(labels.count) <= UINT8_MAX;
+	}
+
+	if (useTable)
+	{
+		switchTable(labels);
+	}
+	else
+	{
+		switchChain();
+	}
+
+	consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+}
+
 void synchronize()
 {
 	parser.panicMode = false;
@@ -1205,6 +2163,7 @@ void synchronize()
 		case TOKEN_VAR:
 		case TOKEN_FOR:
 		case TOKEN_IF:
+		case TOKEN_SWITCH:
 		case TOKEN_WHILE:
 		case TOKEN_PRINT:
 		case TOKEN_RETURN:
@@ -1259,6 +2218,10 @@ void statement()
 	{
 		returnStatement();
 	}
+	else if (match(TOKEN_SWITCH))
+	{
+		switchStatement();
+	}
 	else if (match(TOKEN_WHILE))
 	{
 		whileStatement();
@@ -1285,20 +2248,115 @@ void grouping()
 
 ObjFunction* compileImpl(const char* source)
 {
+	if (isLazyCompilationEnabled)
+	{
+		lazySource = copyString(source, static_cast<int>(strlen(source)));
+		source = lazySource->chars;
+	}
+
 	initScanner(source);
+	ScannerState state = saveScanner();
+	Parser start = parser;
 
+	// 16bit に収まらないジャンプがあったら、関数と同じくスクリプト全体をコンパイルし直す
 	Compiler compiler;
-	initCompiler(&compiler, FunctionType::Script);
+	ObjFunction* f = nullptr;
+	for (bool useLongJumps = false;; useLongJumps = true)
+	{
+		initCompiler(&compiler, FunctionType::Script, nullptr);
+		compiler.useLongJumps = useLongJumps;
+
+		advance();
+
+		while (!match(TOKEN_EOF))
+		{
+			declaration();
+		}
+
+		f = endCompiler();
+		if (!compiler.isJumpOverflowed || useLongJumps || parser.hadError) break;
+
+		freeCompiler(&compiler);
+		restoreScanner(state);
+		parser = start;
+	}
+	freeCompiler(&compiler);
+	lazySource = nullptr;
+	return parser.hadError ? nullptr : f;
+}
+
+bool compileLazyFunction(ObjFunction* function)
+{
+	// 既にあった関数のチャンクを作り直すので、終わるまでマークスレッドに読ませない
+	HeapLock lock;
+	LazyFunction* lazy = function->lazy;
 
+	// 事前解析した時と同じく、仮引数リストの ( から読み直す
+	lazySource = lazy->source;
+	const char* start = lazy->source->chars + lazy->offset;
+	restoreScanner({ start, start, lazy->line });
+	parser = Parser();
 	advance();
 
-	while (!match(TOKEN_EOF))
+	ClassCompiler classCompiler;
+	classCompiler.hasSuperclass = lazy->hasSuperclass;
+	currentClass = lazy->isInClass ? &classCompiler : nullptr;
+
+	Compiler compiler;
+	current = nullptr;
+	compileFunction(&compiler, lazy->type, function);
+	freeCompiler(&compiler);
+	currentClass = nullptr;
+	lazySource = nullptr;
+
+	if (parser.hadError)
 	{
-		declaration();
+		// 書きかけのバイトコードは捨てる。呼び出すたびに同じエラーを報告する
+		freeChunk(&function->chunk);
+		return false;
 	}
 
-	auto f = endCompiler();
-	return parser.hadError ? nullptr : f;
+	overwriteBarrier(TO_OBJ(lazy->source));
+	function->lazy = nullptr;
+	freeLazyFunction(lazy);
+	return true;
+}
+
+void markLazyFunction(LazyFunction* lazy)
+{
+	if (lazy == nullptr) return;
+
+	// 上位値の名前はソースの中か、静的な文字列を指している
+	markObject(reinterpret_cast<Obj*>(lazy->source));
+}
+
+void forwardLazyFunction(LazyFunction* lazy)
+{
+	if (lazy == nullptr) return;
+	forwardObject(reinterpret_cast<Obj**>(&lazy->source));
+}
+
+void freeLazyFunction(LazyFunction* lazy)
+{
+	if (lazy == nullptr) return;
+
+	free_array(lazy->upvalueNames, lazy->upvalueCount);
+	free(lazy);
+}
+
+void setOptimizationEnabled(bool enabled)
+{
+	isOptimizationEnabled = enabled;
+}
+
+void setRegisterBytecodeEnabled(bool enabled)
+{
+	isRegisterBytecodeEnabled = enabled;
+}
+
+void setLazyCompilationEnabled(bool enabled)
+{
+	isLazyCompilationEnabled = enabled;
 }
 
 void markCompilerRoots()
@@ -1310,4 +2368,5 @@ void markCompilerRoots()
 		markObject(reinterpret_cast<Obj*>(compiler->function));
 		compiler = compiler->enclosing;
 	}
+	markObject(reinterpret_cast<Obj*>(lazySource));
 }
@@ -1,6 +1,28 @@
 ﻿#pragma once
 
 struct ObjFunction;
+struct LazyFunction;
 
 ObjFunction* compileImpl(const char* source);
+
+// 中間表現での最適化 (ir.h) を行うかどうか。REPL では一行ずつのコンパイルを速くするために切る
+void setOptimizationEnabled(bool enabled);
+
+// 演算と比較をフレームのスロットを直接読み書きするレジスタ命令 (chunk.h) で出力するかどうか
+// 中間表現での最適化の一部として行うので、最適化が無効なら出力しない
+// レジスタ命令を含む関数は JIT コンパイルせず、AOT コンパイルもできない
+void setRegisterBytecodeEnabled(bool enabled);
+
+// 関数の本文を事前解析で読み飛ばして、最初の呼び出しでコンパイルするかどうか (遅延コンパイル)
+// 呼ばれない関数のバイトコードを作らない代わりに、その本文の構文エラーの多くは呼び出すまで報告されない
+// 事前解析で見つけられるのは不正な文字と括弧の対応の誤りだけで、それ以外は最初の呼び出しで実行時エラーになる
+// (先にコンパイルする場合はスクリプトを実行する前に終了コード 65 で止まるが、遅延コンパイルではそこまでの副作用が起きる)
+void setLazyCompilationEnabled(bool enabled);
+
+// 遅延コンパイルする関数の本文をコンパイルする。コンパイルエラーなら false を返す
+bool compileLazyFunction(ObjFunction* function);
+void markLazyFunction(LazyFunction* lazy);
+void forwardLazyFunction(LazyFunction* lazy);
+void freeLazyFunction(LazyFunction* lazy);
+
 void markCompilerRoots();
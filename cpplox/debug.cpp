@@ -3,6 +3,7 @@
 #include <cstdio>
 #include "chunk.h"
 #include "object.h"
+#include "vm.h"
 
 namespace
 {
@@ -22,6 +23,15 @@ namespace
 		return offset + 2;
 	}
 
+	int constantLongInstruction(const char* name, const Chunk* chunk, int offset)
+	{
+		const int constantIndex = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+		printf("%-16s %4d '", name, constantIndex);
+		printValue(chunk->constants.values[constantIndex]);
+		printf("'\n");
+		return offset + 4;
+	}
+
 	int byteInstruction(const char* name, const Chunk* chunk, int offset)
 	{
 		uint8_t slot = chunk->code[offset + 1];
@@ -37,6 +47,177 @@ namespace
 		return offset + 3;
 	}
 
+	int longJumpInstruction(const char* name, int sign, const Chunk* chunk, int offset)
+	{
+		int jump = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+		printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+		return offset + 4;
+	}
+
+	// OP_WIDE を前置した命令。最初のオペランドを 16bit で表示し、残りのオペランドは読み飛ばす
+	int wideInstruction(const Chunk* chunk, int offset)
+	{
+		uint8_t op = chunk->code[offset + 1];
+		uint16_t operand = static_cast<uint16_t>((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+
+		const char* name = "OP_UNKNOWN";
+		bool isConstant = true;
+		switch (op)
+		{
+		case OP_GET_LOCAL: name = "OP_GET_LOCAL"; isConstant = false; break;
+		case OP_SET_LOCAL: name = "OP_SET_LOCAL"; isConstant = false; break;
+		case OP_GET_UPVALUE: name = "OP_GET_UPVALUE"; isConstant = false; break;
+		case OP_SET_UPVALUE: name = "OP_SET_UPVALUE"; isConstant = false; break;
+		case OP_GET_PROPERTY: name = "OP_GET_PROPERTY"; break;
+		case OP_SET_PROPERTY: name = "OP_SET_PROPERTY"; break;
+		case OP_GET_SUPER: name = "OP_GET_SUPER"; break;
+		case OP_INVOKE: name = "OP_INVOKE"; break;
+		case OP_TAIL_INVOKE: name = "OP_TAIL_INVOKE"; break;
+		case OP_SUPER_INVOKE: name = "OP_SUPER_INVOKE"; break;
+		case OP_CLOSURE: name = "OP_CLOSURE"; break;
+		case OP_CLASS: name = "OP_CLASS"; break;
+		case OP_METHOD: name = "OP_METHOD"; break;
+		default: isConstant = false; break;
+		}
+
+		printf("%-16s %-16s %4d", "OP_WIDE", name, operand);
+		if (isConstant)
+		{
+			printf(" '");
+			printValue(chunk->constants.values[operand]);
+			printf("'");
+		}
+		printf("\n");
+
+		if (op == OP_CLOSURE)
+		{
+			ObjFunction* function = AS_FUNCTION(chunk->constants.values[operand]);
+			for (int j = 0; j < function->upvalueCount; j++)
+			{
+				int pair = offset + 4 + j * 3;
+				int index = (chunk->code[pair + 1] << 8) | chunk->code[pair + 2];
+				printf("%04d      |                   %s %d\n",
+					pair, chunk->code[pair] ? "local" : "upvalue", index);
+			}
+		}
+
+		return offset + getInstructionLength(chunk, offset);
+	}
+
+	// レジスタ命令の 2 番目の読み出し元。K の場合は定数の値も表示する
+	void printRegisterOperand(const Chunk* chunk, uint8_t operand, bool isConstant)
+	{
+		printf(" %4d", operand);
+		if (isConstant)
+		{
+			printf(" '");
+			printValue(chunk->constants.values[operand]);
+			printf("'");
+		}
+	}
+
+	int moveInstruction(const char* name, bool isConstant, const Chunk* chunk, int offset)
+	{
+		printf("%-16s %4d", name, chunk->code[offset + 1]);
+		printRegisterOperand(chunk, chunk->code[offset + 2], isConstant);
+		printf("\n");
+		return offset + 3;
+	}
+
+	int registerInstruction(const char* name, bool isConstant, const Chunk* chunk, int offset)
+	{
+		printf("%-16s %4d %4d", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+		printRegisterOperand(chunk, chunk->code[offset + 3], isConstant);
+		printf("\n");
+		return offset + 4;
+	}
+
+	int registerJumpInstruction(const char* name, bool isConstant, const Chunk* chunk, int offset)
+	{
+		uint16_t jump = static_cast<uint16_t>((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+		printf("%-16s %4d", name, chunk->code[offset + 1]);
+		printRegisterOperand(chunk, chunk->code[offset + 2], isConstant);
+		printf(" -> %d\n", offset + 5 + jump);
+		return offset + 5;
+	}
+
+	int forLoopInstruction(const char* name, const Chunk* chunk, int offset)
+	{
+		const uint8_t* code = chunk->code + offset;
+		int length = getInstructionLength(chunk, offset);
+		uint16_t jump = static_cast<uint16_t>((code[length - 2] << 8) | code[length - 1]);
+		printf("%-16s %4d += '", name, code[1]);
+		printValue(chunk->constants.values[code[2]]);
+		printf("' < ");
+		switch (code[0])
+		{
+		case OP_FOR_LOOP:
+			printf("%d", code[3]);
+			break;
+		case OP_FOR_LOOP_CONSTANT:
+			printf("'");
+			printValue(chunk->constants.values[code[3]]);
+			printf("'");
+			break;
+		default:
+			printValue(getVM()->globalNames.values[(code[3] << 8) | code[4]]);
+			break;
+		}
+		printf(" -> %d\n", offset + length - jump);
+		return offset + length;
+	}
+
+	// switch 文の表。エントリごとにラベルと飛び先を 1 行ずつ表示する
+	int switchInstruction(const char* name, const Chunk* chunk, int offset)
+	{
+		const uint8_t* code = chunk->code + offset;
+		int length = getInstructionLength(chunk, offset);
+		int defaultOffset = code[0] == OP_JUMP_TABLE ? 3 : 2;
+		printf("%-16s default -> %d\n", name, offset + length + ((code[defaultOffset] << 8) | code[defaultOffset + 1]));
+
+		if (code[0] == OP_JUMP_TABLE)
+		{
+			double min = AS_NUMBER(chunk->constants.values[code[1]]);
+			for (int i = 0; i < code[2]; i++)
+			{
+				const uint8_t* entry = code + 5 + i * 2;
+				printf("%04d      |                   %g -> %d\n", offset, min + i, offset + length + ((entry[0] << 8) | entry[1]));
+			}
+		}
+		else
+		{
+			for (int i = 0; i < code[1]; i++)
+			{
+				const uint8_t* entry = code + 4 + i * 3;
+				uint16_t jump = static_cast<uint16_t>((entry[1] << 8) | entry[2]);
+				if (jump == SWITCH_EMPTY_ENTRY) continue;
+				printf("%04d      |                   ", offset);
+				printValue(chunk->constants.values[entry[0]]);
+				printf(" -> %d\n", offset + length + jump);
+			}
+		}
+		return offset + length;
+	}
+
+	int propertyInstruction(const char* name, const Chunk* chunk, int offset)
+	{
+		uint8_t constant = chunk->code[offset + 1];
+		uint16_t cache = static_cast<uint16_t>((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+		printf("%-16s %4d '", name, constant);
+		printValue(chunk->constants.values[constant]);
+		printf("' [cache %d]\n", cache);
+		return offset + 4;
+	}
+
+	int globalInstruction(const char* name, const Chunk* chunk, int offset)
+	{
+		uint16_t index = static_cast<uint16_t>((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+		printf("%-16s %4d '", name, index);
+		printValue(getVM()->globalNames.values[index]);
+		printf("'\n");
+		return offset + 3;
+	}
+
 	int invokeInstruction(const char* name, const Chunk* chunk, int offset)
 	{
 		uint8_t constant = chunk->code[offset + 1];
@@ -47,6 +228,17 @@ namespace
 		return offset + 3;
 	}
 
+	int cachedInvokeInstruction(const char* name, const Chunk* chunk, int offset)
+	{
+		uint8_t constant = chunk->code[offset + 1];
+		uint8_t argCount = chunk->code[offset + 2];
+		uint16_t cache = static_cast<uint16_t>((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+		printf("%-16s (%d args) %4d '", name, argCount, constant);
+		printValue(chunk->constants.values[constant]);
+		printf("' [cache %d]\n", cache);
+		return offset + 5;
+	}
+
 }
 
 void disassembleChunk(const Chunk* chunk, const char* name)
@@ -58,16 +250,30 @@ void disassembleChunk(const Chunk* chunk, const char* name)
 	}
 }
 
+void disassembleFunction(const ObjFunction* function)
+{
+	const ValueArray& constants = function->chunk.constants;
+	for (int i = 0; i < constants.count; i++)
+	{
+		if (IS_FUNCTION(constants.values[i]))
+		{
+			disassembleFunction(AS_FUNCTION(constants.values[i]));
+		}
+	}
+
+	disassembleChunk(&function->chunk, function->name != nullptr ? function->name->chars : "<script>");
+}
+
 int disassembleInstruction(const Chunk* chunk, int offset)
 {
 	printf("%04d ", offset);
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+	if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1))
 	{
 		printf("   | ");
 	}
 	else
 	{
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", getLine(chunk, offset));
 	}
 
 	auto instruction = chunk->code[offset];
@@ -89,19 +295,19 @@ int disassembleInstruction(const Chunk* chunk, int offset)
 	case OP_SET_LOCAL:
 		return byteInstruction("OP_SET_LOCAL", chunk, offset);
 	case OP_GET_GLOBAL:
-		return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_GET_GLOBAL", chunk, offset);
 	case OP_DEFINE_GLOBAL:
-		return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+		return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
 	case OP_SET_GLOBAL:
-		return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_SET_GLOBAL", chunk, offset);
 	case OP_GET_UPVALUE:
 		return byteInstruction("OP_GET_UPVALUE", chunk, offset);
 	case OP_SET_UPVALUE:
 		return byteInstruction("OP_SET_UPVALUE", chunk, offset);
 	case OP_GET_PROPERTY:
-		return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+		return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
 	case OP_SET_PROPERTY:
-		return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+		return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
 	case OP_GET_SUPER:
 		return constantInstruction("OP_GET_SUPER", chunk, offset);
 	case OP_EQUAL:
@@ -132,8 +338,12 @@ int disassembleInstruction(const Chunk* chunk, int offset)
 		return jumpInstruction("OP_LOOP", -1, chunk, offset);
 	case OP_CALL:
 		return byteInstruction("OP_CALL", chunk, offset);
+	case OP_TAIL_CALL:
+		return byteInstruction("OP_TAIL_CALL", chunk, offset);
 	case OP_INVOKE:
-		return invokeInstruction("OP_INVOKE", chunk, offset);
+		return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
+	case OP_TAIL_INVOKE:
+		return cachedInvokeInstruction("OP_TAIL_INVOKE", chunk, offset);
 	case OP_SUPER_INVOKE:
 		return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
 	case OP_CLOSURE:
@@ -167,6 +377,128 @@ int disassembleInstruction(const Chunk* chunk, int offset)
 		return simpleInstruction("OP_INHERIT", offset);
 	case OP_METHOD:
 		return constantInstruction("OP_METHOD", chunk, offset);
+	case OP_FOR_LOOP:
+		return forLoopInstruction("OP_FOR_LOOP", chunk, offset);
+	case OP_FOR_LOOP_CONSTANT:
+		return forLoopInstruction("OP_FOR_LOOP_CONSTANT", chunk, offset);
+	case OP_FOR_LOOP_GLOBAL:
+		return forLoopInstruction("OP_FOR_LOOP_GLOBAL", chunk, offset);
+	case OP_JUMP_TABLE:
+		return switchInstruction("OP_JUMP_TABLE", chunk, offset);
+	case OP_JUMP_STRING:
+		return switchInstruction("OP_JUMP_STRING", chunk, offset);
+	case OP_CONSTANT_LONG:
+		return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+	case OP_JUMP_LONG:
+		return longJumpInstruction("OP_JUMP_LONG", 1, chunk, offset);
+	case OP_JUMP_IF_FALSE_LONG:
+		return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+	case OP_LOOP_LONG:
+		return longJumpInstruction("OP_LOOP_LONG", -1, chunk, offset);
+	case OP_WIDE:
+		return wideInstruction(chunk, offset);
+	case OP_GET_LOCAL_0:
+		return simpleInstruction("OP_GET_LOCAL_0", offset);
+	case OP_GET_LOCAL_1:
+		return simpleInstruction("OP_GET_LOCAL_1", offset);
+	case OP_GET_LOCAL_2:
+		return simpleInstruction("OP_GET_LOCAL_2", offset);
+	case OP_GET_LOCAL_3:
+		return simpleInstruction("OP_GET_LOCAL_3", offset);
+	case OP_ADD_LOCAL_CONST:
+	{
+		uint8_t slot = chunk->code[offset + 1];
+		uint8_t constant = chunk->code[offset + 2];
+		printf("%-16s %4d %4d '", "OP_ADD_LOCAL_CONST", slot, constant);
+		printValue(chunk->constants.values[constant]);
+		printf("'\n");
+		return offset + 3;
+	}
+	case OP_JUMP_IF_NOT_LESS:
+		return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER:
+		return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+	case OP_JUMP_IF_NOT_EQUAL:
+		return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+	case OP_GET_THIS_PROPERTY:
+		return propertyInstruction("OP_GET_THIS_PROPERTY", chunk, offset);
+	case OP_MOVE:
+		return moveInstruction("OP_MOVE", false, chunk, offset);
+	case OP_LOAD_CONSTANT:
+		return moveInstruction("OP_LOAD_CONSTANT", true, chunk, offset);
+	case OP_ADD_RR:
+		return registerInstruction("OP_ADD_RR", false, chunk, offset);
+	case OP_ADD_RK:
+		return registerInstruction("OP_ADD_RK", true, chunk, offset);
+	case OP_SUBTRACT_RR:
+		return registerInstruction("OP_SUBTRACT_RR", false, chunk, offset);
+	case OP_SUBTRACT_RK:
+		return registerInstruction("OP_SUBTRACT_RK", true, chunk, offset);
+	case OP_MULTIPLY_RR:
+		return registerInstruction("OP_MULTIPLY_RR", false, chunk, offset);
+	case OP_MULTIPLY_RK:
+		return registerInstruction("OP_MULTIPLY_RK", true, chunk, offset);
+	case OP_DIVIDE_RR:
+		return registerInstruction("OP_DIVIDE_RR", false, chunk, offset);
+	case OP_DIVIDE_RK:
+		return registerInstruction("OP_DIVIDE_RK", true, chunk, offset);
+	case OP_JUMP_IF_NOT_LESS_RR:
+		return registerJumpInstruction("OP_JUMP_IF_NOT_LESS_RR", false, chunk, offset);
+	case OP_JUMP_IF_NOT_LESS_RK:
+		return registerJumpInstruction("OP_JUMP_IF_NOT_LESS_RK", true, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER_RR:
+		return registerJumpInstruction("OP_JUMP_IF_NOT_GREATER_RR", false, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER_RK:
+		return registerJumpInstruction("OP_JUMP_IF_NOT_GREATER_RK", true, chunk, offset);
+	case OP_JUMP_IF_NOT_EQUAL_RR:
+		return registerJumpInstruction("OP_JUMP_IF_NOT_EQUAL_RR", false, chunk, offset);
+	case OP_JUMP_IF_NOT_EQUAL_RK:
+		return registerJumpInstruction("OP_JUMP_IF_NOT_EQUAL_RK", true, chunk, offset);
+	case OP_ADD_UNCHECKED:
+		return simpleInstruction("OP_ADD_UNCHECKED", offset);
+	case OP_SUBTRACT_UNCHECKED:
+		return simpleInstruction("OP_SUBTRACT_UNCHECKED", offset);
+	case OP_MULTIPLY_UNCHECKED:
+		return simpleInstruction("OP_MULTIPLY_UNCHECKED", offset);
+	case OP_DIVIDE_UNCHECKED:
+		return simpleInstruction("OP_DIVIDE_UNCHECKED", offset);
+	case OP_NEGATE_UNCHECKED:
+		return simpleInstruction("OP_NEGATE_UNCHECKED", offset);
+	case OP_GREATER_UNCHECKED:
+		return simpleInstruction("OP_GREATER_UNCHECKED", offset);
+	case OP_LESS_UNCHECKED:
+		return simpleInstruction("OP_LESS_UNCHECKED", offset);
+	case OP_EQUAL_NUM:
+		return simpleInstruction("OP_EQUAL_NUM", offset);
+	case OP_GREATER_NUM:
+		return simpleInstruction("OP_GREATER_NUM", offset);
+	case OP_LESS_NUM:
+		return simpleInstruction("OP_LESS_NUM", offset);
+	case OP_ADD_NUM:
+		return simpleInstruction("OP_ADD_NUM", offset);
+	case OP_ADD_STR:
+		return simpleInstruction("OP_ADD_STR", offset);
+	case OP_SUBTRACT_NUM:
+		return simpleInstruction("OP_SUBTRACT_NUM", offset);
+	case OP_MULTIPLY_NUM:
+		return simpleInstruction("OP_MULTIPLY_NUM", offset);
+	case OP_DIVIDE_NUM:
+		return simpleInstruction("OP_DIVIDE_NUM", offset);
+	case OP_ADD_LOCAL_CONST_NUM:
+	{
+		uint8_t slot = chunk->code[offset + 1];
+		uint8_t constant = chunk->code[offset + 2];
+		printf("%-16s %4d %4d '", "OP_ADD_LOCAL_CONST_NUM", slot, constant);
+		printValue(chunk->constants.values[constant]);
+		printf("'\n");
+		return offset + 3;
+	}
+	case OP_JUMP_IF_NOT_LESS_NUM:
+		return jumpInstruction("OP_JUMP_IF_NOT_LESS_NUM", 1, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER_NUM:
+		return jumpInstruction("OP_JUMP_IF_NOT_GREATER_NUM", 1, chunk, offset);
+	case OP_JUMP_IF_NOT_EQUAL_NUM:
+		return jumpInstruction("OP_JUMP_IF_NOT_EQUAL_NUM", 1, chunk, offset);
 	default:
 		printf("Unknown opcode %d\n", instruction);
 		return offset + 1;
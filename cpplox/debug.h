@@ -1,6 +1,11 @@
 ﻿#pragma once
 
 struct Chunk;
+struct ObjFunction;
 
 void disassembleChunk(const Chunk* chunk, const char* name);
 int disassembleInstruction(const Chunk* chunk, int offset);
+
+// 関数と、定数表にある入れ子の関数をまとめて表示する
+// DEBUG_PRINT_CODE でコンパイル時に表示するのと同じく、入れ子の関数を先に表示する
+void disassembleFunction(const ObjFunction* function);
@@ -0,0 +1,1679 @@
+﻿#include "ir.h"
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+
+namespace
+{
+
+// 変換する関数のローカル変数のスロット数の上限。OP_WIDE を含む関数は変換しないので、スロットは 8bit で表せる
+constexpr int SLOT_COUNT_MAX = UINT8_MAX + 1;
+
+// 命令。バイト列は IrFunction::code に置き、オペランドの書き換えはそこで行う
+struct IrInstruction
+{
+	int offset = 0;
+	int length = 0;
+	int target = -1; // ジャンプ命令の飛び先のブロック
+};
+
+// 基本ブロック。ジャンプ命令と return 系の命令はブロックの末尾にしか置かない
+// 末尾が無条件ジャンプか return 系でなければ、並び順で次のブロックに落ちる
+struct IrBlock
+{
+	IrInstruction* instructions = nullptr;
+	int count = 0;
+	int capacity = 0;
+
+	bool isLive = true; // 到達不能なブロックと、前のブロックに併合したブロックは false (命令は空にする)
+	int height = -1; // 入口でのスタックの高さ (フレームの先頭からのスロット数)
+};
+
+struct IrFunction
+{
+	// 命令のバイト列と行番号。元のチャンクのコピーに、最適化で追加した命令を足していく
+	uint8_t* code = nullptr;
+	int* lines = nullptr;
+	int codeCount = 0;
+	int codeCapacity = 0;
+
+	IrBlock* blocks = nullptr;
+	int blockCount = 0;
+	int blockCapacity = 0;
+
+	int arity = 0;
+	int maxHeight = 0;
+};
+
+int addCode(IrFunction* ir, const uint8_t* bytes, int length, int line)
+{
+	while (ir->codeCapacity < ir->codeCount + length)
+	{
+		auto oldCapacity = ir->codeCapacity;
+		ir->codeCapacity = grow_capacity(oldCapacity);
+		ir->code = grow_array(ir->code, oldCapacity, ir->codeCapacity);
+		ir->lines = grow_array(ir->lines, oldCapacity, ir->codeCapacity);
+	}
+
+	int offset = ir->codeCount;
+	for (int i = 0; i < length; i++)
+	{
+		ir->code[offset + i] = bytes[i];
+		ir->lines[offset + i] = line;
+	}
+	ir->codeCount += length;
+	return offset;
+}
+
+// 命令を新しく作る。行番号は元の命令から引き継ぐ
+IrInstruction newInstruction(IrFunction* ir, const uint8_t* bytes, int length, int line)
+{
+	IrInstruction instruction;
+	instruction.offset = addCode(ir, bytes, length, line);
+	instruction.length = length;
+	return instruction;
+}
+
+int addBlock(IrFunction* ir)
+{
+	if (ir->blockCapacity < ir->blockCount + 1)
+	{
+		auto oldCapacity = ir->blockCapacity;
+		ir->blockCapacity = grow_capacity(oldCapacity);
+		ir->blocks = grow_array(ir->blocks, oldCapacity, ir->blockCapacity);
+	}
+
+	ir->blocks[ir->blockCount] = IrBlock();
+	return ir->blockCount++;
+}
+
+void insertInstruction(IrBlock* block, int index, const IrInstruction& instruction)
+{
+	if (block->capacity < block->count + 1)
+	{
+		auto oldCapacity = block->capacity;
+		block->capacity = grow_capacity(oldCapacity);
+		block->instructions = grow_array(block->instructions, oldCapacity, block->capacity);
+	}
+
+	memmove(block->instructions + index + 1, block->instructions + index, sizeof(IrInstruction) * (block->count - index));
+	block->instructions[index] = instruction;
+	block->count++;
+}
+
+void appendInstruction(IrBlock* block, const IrInstruction& instruction)
+{
+	insertInstruction(block, block->count, instruction);
+}
+
+void removeInstruction(IrBlock* block, int index)
+{
+	memmove(block->instructions + index, block->instructions + index + 1, sizeof(IrInstruction) * (block->count - index - 1));
+	block->count--;
+}
+
+void freeIr(IrFunction* ir)
+{
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		free_array(ir->blocks[i].instructions, ir->blocks[i].capacity);
+	}
+	free_array(ir->blocks, ir->blockCapacity);
+	free_array(ir->code, ir->codeCapacity);
+	free_array(ir->lines, ir->codeCapacity);
+}
+
+uint8_t opcodeOf(const IrFunction* ir, const IrInstruction& instruction)
+{
+	return ir->code[instruction.offset];
+}
+
+int readShort(const uint8_t* code)
+{
+	return (code[0] << 8) | code[1];
+}
+
+// 数値の for ループの命令。本文の先頭に戻る後ろ向きの条件分岐として扱う
+bool isForLoop(uint8_t op)
+{
+	return op == OP_FOR_LOOP || op == OP_FOR_LOOP_CONSTANT || op == OP_FOR_LOOP_GLOBAL;
+}
+
+bool isJump(uint8_t op)
+{
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP || isForLoop(op);
+}
+
+// レジスタ命令の比較と分岐。最後に作るので、ブロックの変形は isJump の命令だけを考えればよい
+bool isRegisterJump(uint8_t op)
+{
+	return op >= OP_JUMP_IF_NOT_LESS_RR && op <= OP_JUMP_IF_NOT_EQUAL_RK;
+}
+
+// 次の命令に落ちない命令
+// OP_TAIL_CALL / OP_TAIL_INVOKE は呼び出し先がネイティブ関数なら直後の OP_RETURN に進むので含めない
+bool isUnconditional(uint8_t op)
+{
+	return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+
+// 副作用がなく、スタックに値を一つ積むだけの命令
+bool isPurePush(uint8_t op)
+{
+	return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE || op == OP_GET_LOCAL || op == OP_GET_UPVALUE;
+}
+
+// ブロックが次のブロックに落ちるか
+bool fallsThrough(const IrFunction* ir, const IrBlock& block)
+{
+	return block.count == 0 || !isUnconditional(opcodeOf(ir, block.instructions[block.count - 1]));
+}
+
+// 命令を実行した時に、スタックから取り除く値の数と積む値の数
+// return 系の命令はフレームを捨てるので考えなくてよい
+void stackEffect(const uint8_t* code, int* pops, int* pushes)
+{
+	*pops = 0;
+	*pushes = 0;
+	switch (code[0])
+	{
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+		*pushes = 1;
+		break;
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_PRINT:
+	case OP_CLOSE_UPVALUE:
+	case OP_METHOD:
+		*pops = 1;
+		break;
+	case OP_GET_PROPERTY:
+	case OP_NOT:
+	case OP_NEGATE:
+	case OP_NEGATE_UNCHECKED:
+	case OP_YIELD:
+		*pops = 1;
+		*pushes = 1;
+		break;
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+	case OP_INHERIT:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_GREATER_UNCHECKED:
+	case OP_LESS_UNCHECKED:
+	case OP_ADD_UNCHECKED:
+	case OP_SUBTRACT_UNCHECKED:
+	case OP_MULTIPLY_UNCHECKED:
+	case OP_DIVIDE_UNCHECKED:
+		*pops = 2;
+		*pushes = 1;
+		break;
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		*pops = code[1] + 1;
+		*pushes = 1;
+		break;
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+		*pops = code[2] + 1;
+		*pushes = 1;
+		break;
+	case OP_SUPER_INVOKE:
+		*pops = code[2] + 2;
+		*pushes = 1;
+		break;
+	default:
+		// OP_SET_LOCAL などスタックの高さを変えない命令
+		break;
+	}
+}
+
+// チャンクの命令列を基本ブロックに分ける
+void buildIr(IrFunction* ir, const Chunk* chunk)
+{
+	const int count = chunk->count;
+	addCode(ir, chunk->code, count, 0);
+	for (int i = 0; i < count; i++)
+	{
+		ir->lines[i] = getLine(chunk, i);
+	}
+
+	// ブロックの先頭になる命令をマークしてから番号を振る
+	int* blockAt = allocate<int>(count + 1);
+	for (int i = 0; i <= count; i++)
+	{
+		blockAt[i] = -1;
+	}
+
+	blockAt[0] = 0;
+	for (int offset = 0; offset < count; offset += getInstructionLength(chunk, offset))
+	{
+		uint8_t op = chunk->code[offset];
+		int length = getInstructionLength(chunk, offset);
+		if (op == OP_JUMP || op == OP_JUMP_IF_FALSE)
+		{
+			blockAt[offset + length + readShort(chunk->code + offset + 1)] = 0;
+		}
+		else if (op == OP_LOOP || isForLoop(op))
+		{
+			blockAt[offset + length - readShort(chunk->code + offset + length - 2)] = 0;
+		}
+
+		if (isJump(op) || isUnconditional(op))
+		{
+			blockAt[offset + length] = 0;
+		}
+	}
+
+	for (int offset = 0; offset < count; offset++)
+	{
+		if (blockAt[offset] == 0) blockAt[offset] = addBlock(ir);
+	}
+
+	int current = 0;
+	for (int offset = 0; offset < count; offset += getInstructionLength(chunk, offset))
+	{
+		if (blockAt[offset] >= 0) current = blockAt[offset];
+
+		IrInstruction instruction;
+		instruction.offset = offset;
+		instruction.length = getInstructionLength(chunk, offset);
+
+		uint8_t op = chunk->code[offset];
+		if (op == OP_JUMP || op == OP_JUMP_IF_FALSE)
+		{
+			instruction.target = blockAt[offset + 3 + readShort(chunk->code + offset + 1)];
+		}
+		else if (op == OP_LOOP || isForLoop(op))
+		{
+			instruction.target = blockAt[offset + instruction.length - readShort(chunk->code + offset + instruction.length - 2)];
+		}
+
+		appendInstruction(&ir->blocks[current], instruction);
+	}
+
+	free_array(blockAt, count + 1);
+}
+
+// 中間表現を命令列に戻してチャンクを置き換える
+// ジャンプの向きは並び順で決まるので、OP_JUMP と OP_LOOP はここで選び直す
+// ジャンプの距離が 16bit に収まらなければ何もせずに false を返す
+bool lowerIr(const IrFunction* ir, Chunk* chunk)
+{
+	int* blockOffsets = allocate<int>(ir->blockCount);
+	int count = 0;
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		blockOffsets[i] = count;
+		const IrBlock& block = ir->blocks[i];
+		for (int j = 0; j < block.count; j++)
+		{
+			count += block.instructions[j].length;
+		}
+	}
+
+	uint8_t* code = allocate<uint8_t>(count);
+	int* lines = allocate<int>(count);
+	bool succeeded = true;
+
+	int offset = 0;
+	for (int i = 0; i < ir->blockCount && succeeded; i++)
+	{
+		const IrBlock& block = ir->blocks[i];
+		for (int j = 0; j < block.count; j++)
+		{
+			const IrInstruction& instruction = block.instructions[j];
+			memcpy(code + offset, ir->code + instruction.offset, instruction.length);
+			memcpy(lines + offset, ir->lines + instruction.offset, sizeof(int) * instruction.length);
+
+			if (isJump(code[offset]) || isRegisterJump(code[offset]))
+			{
+				// オフセットは命令の末尾の 16bit
+				int end = offset + instruction.length;
+				int target = blockOffsets[instruction.target];
+				int jump = target - end;
+				if (isForLoop(code[offset]))
+				{
+					// 数値の for ループの命令は後ろ向きにしか分岐できない
+					if (jump >= 0) succeeded = false;
+					jump = -jump;
+				}
+				else if (jump < 0)
+				{
+					// 後ろ向きに条件分岐する命令はない
+					if (code[offset] != OP_JUMP && code[offset] != OP_LOOP) succeeded = false;
+					code[offset] = OP_LOOP;
+					jump = -jump;
+				}
+				else if (code[offset] == OP_LOOP)
+				{
+					code[offset] = OP_JUMP;
+				}
+
+				if (jump > UINT16_MAX) succeeded = false;
+				code[end - 2] = static_cast<uint8_t>((jump >> 8) & 0xFF);
+				code[end - 1] = static_cast<uint8_t>(jump & 0xFF);
+			}
+			offset += instruction.length;
+		}
+	}
+
+	if (succeeded)
+	{
+		free_array(chunk->code, chunk->capacity);
+		chunk->code = code;
+		chunk->count = count;
+		chunk->capacity = count;
+		setLines(chunk, lines, count);
+	}
+	else
+	{
+		free_array(code, count);
+	}
+	free_array(lines, count);
+
+	free_array(blockOffsets, ir->blockCount);
+	return succeeded;
+}
+
+// 空のブロックは次のブロックに落ちるので、実際に命令を実行するブロックまで進める
+int skipEmpty(const IrFunction* ir, int block)
+{
+	while (block < ir->blockCount && ir->blocks[block].count == 0) block++;
+	return block;
+}
+
+// 定数で分岐する OP_JUMP_IF_FALSE を、無条件ジャンプか何もしない命令に置き換える
+// 条件の値は分岐先で POP するので、そのまま積んでおく
+bool foldConstantBranches(IrFunction* ir)
+{
+	bool changed = false;
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (block->count < 2) continue;
+
+		const IrInstruction& last = block->instructions[block->count - 1];
+		if (opcodeOf(ir, last) != OP_JUMP_IF_FALSE) continue;
+
+		// 定数表に入るのは数値、文字列、関数なので、OP_CONSTANT は常に真
+		uint8_t condition = opcodeOf(ir, block->instructions[block->count - 2]);
+		if (condition == OP_TRUE || condition == OP_CONSTANT)
+		{
+			removeInstruction(block, block->count - 1);
+			changed = true;
+		}
+		else if (condition == OP_FALSE || condition == OP_NIL)
+		{
+			ir->code[last.offset] = OP_JUMP;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// ジャンプ先が無条件ジャンプなら、その飛び先に直接ジャンプする
+// 条件分岐の飛び先が同じ値での条件分岐なら (a and b and c など)、それも必ず分岐するので飛び越える
+bool threadJumps(IrFunction* ir)
+{
+	bool changed = false;
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (block->count == 0) continue;
+
+		IrInstruction* last = &block->instructions[block->count - 1];
+		uint8_t op = opcodeOf(ir, *last);
+		if (!isJump(op) || isForLoop(op)) continue;
+
+		// 循環しているジャンプで止まらないように回数を制限する
+		for (int step = 0; step < 16; step++)
+		{
+			int target = skipEmpty(ir, last->target);
+			if (target >= ir->blockCount) break;
+			int next = target;
+
+			const IrInstruction& first = ir->blocks[target].instructions[0];
+			uint8_t firstOp = opcodeOf(ir, first);
+			if (firstOp == OP_JUMP || firstOp == OP_LOOP || (op == OP_JUMP_IF_FALSE && firstOp == OP_JUMP_IF_FALSE))
+			{
+				next = first.target;
+			}
+
+			if (next == last->target) break;
+			last->target = next;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// 先頭のブロックから辿れないブロックを取り除く
+bool removeUnreachable(IrFunction* ir)
+{
+	bool* isReachable = allocate<bool>(ir->blockCount);
+	int* worklist = allocate<int>(ir->blockCount * 2 + 1);
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		isReachable[i] = false;
+	}
+
+	int worklistCount = 0;
+	worklist[worklistCount++] = 0;
+	while (worklistCount > 0)
+	{
+		int index = worklist[--worklistCount];
+		if (index >= ir->blockCount || isReachable[index]) continue;
+		isReachable[index] = true;
+
+		const IrBlock& block = ir->blocks[index];
+		if (block.count > 0)
+		{
+			const IrInstruction& last = block.instructions[block.count - 1];
+			if (isJump(opcodeOf(ir, last))) worklist[worklistCount++] = last.target;
+		}
+		if (fallsThrough(ir, block)) worklist[worklistCount++] = index + 1;
+	}
+
+	bool changed = false;
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (!isReachable[i] && block->count > 0)
+		{
+			block->count = 0;
+			block->isLive = false;
+			changed = true;
+		}
+	}
+
+	free_array(worklist, ir->blockCount * 2 + 1);
+	free_array(isReachable, ir->blockCount);
+	return changed;
+}
+
+// 次に実行されるブロックへのジャンプを取り除く
+// OP_JUMP_IF_FALSE は値を取り除かないので、分岐先が次のブロックなら何もしない命令になる
+bool removeJumpsToNext(IrFunction* ir)
+{
+	bool changed = false;
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (block->count == 0) continue;
+
+		const IrInstruction& last = block->instructions[block->count - 1];
+		uint8_t op = opcodeOf(ir, last);
+		if ((op == OP_JUMP || op == OP_JUMP_IF_FALSE) && skipEmpty(ir, last.target) == skipEmpty(ir, i + 1))
+		{
+			removeInstruction(block, block->count - 1);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// 次のブロックに落ちるだけで他から飛び込まれないブロックを前のブロックに併合する
+// 併合した後で、値を積んですぐに捨てる命令の組 (while (true) の条件など) を取り除く
+bool simplifyBlocks(IrFunction* ir)
+{
+	int* jumpCount = allocate<int>(ir->blockCount);
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		jumpCount[i] = 0;
+	}
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		const IrBlock& block = ir->blocks[i];
+		if (block.count == 0) continue;
+
+		const IrInstruction& last = block.instructions[block.count - 1];
+		if (isJump(opcodeOf(ir, last))) jumpCount[last.target]++;
+	}
+
+	bool changed = false;
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (block->count == 0) continue;
+
+		// 条件分岐で終わるブロックは、併合すると分岐が途中に来てしまうので併合しない
+		for (int next = i + 1; next < ir->blockCount && !isJump(opcodeOf(ir, block->instructions[block->count - 1])) && fallsThrough(ir, *block); next++)
+		{
+			IrBlock* nextBlock = &ir->blocks[next];
+			if (jumpCount[next] > 0) break;
+
+			for (int j = 0; j < nextBlock->count; j++)
+			{
+				appendInstruction(block, nextBlock->instructions[j]);
+			}
+			if (nextBlock->count > 0) changed = true;
+			nextBlock->count = 0;
+			nextBlock->isLive = false;
+		}
+
+		for (int j = 0; j + 1 < block->count;)
+		{
+			if (isPurePush(opcodeOf(ir, block->instructions[j])) && opcodeOf(ir, block->instructions[j + 1]) == OP_POP)
+			{
+				removeInstruction(block, j + 1);
+				removeInstruction(block, j);
+				if (j > 0) j--;
+				changed = true;
+			}
+			else
+			{
+				j++;
+			}
+		}
+	}
+
+	free_array(jumpCount, ir->blockCount);
+	return changed;
+}
+
+// 各ブロックの入口でのスタックの高さを求める
+// 合流点で高さが一致しない場合 (コンパイラの想定外の命令列) は false を返す
+bool computeHeights(IrFunction* ir)
+{
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		ir->blocks[i].height = -1;
+	}
+
+	int* worklist = allocate<int>(ir->blockCount);
+	int worklistCount = 0;
+	bool isConsistent = true;
+	ir->maxHeight = ir->arity + 1;
+
+	auto propagate = [&](int index, int height) {
+		if (index >= ir->blockCount) return;
+		if (ir->blocks[index].height == -1)
+		{
+			ir->blocks[index].height = height;
+			worklist[worklistCount++] = index;
+		}
+		else if (ir->blocks[index].height != height)
+		{
+			isConsistent = false;
+		}
+	};
+
+	propagate(0, ir->arity + 1);
+	while (worklistCount > 0 && isConsistent)
+	{
+		int index = worklist[--worklistCount];
+		const IrBlock& block = ir->blocks[index];
+
+		int height = block.height;
+		for (int i = 0; i < block.count; i++)
+		{
+			const IrInstruction& instruction = block.instructions[i];
+			int pops, pushes;
+			stackEffect(ir->code + instruction.offset, &pops, &pushes);
+			height += pushes - pops;
+			if (height < 0) isConsistent = false;
+			if (height > ir->maxHeight) ir->maxHeight = height;
+
+			if (isJump(opcodeOf(ir, instruction))) propagate(instruction.target, height);
+		}
+		if (fallsThrough(ir, block)) propagate(index + 1, height);
+	}
+
+	free_array(worklist, ir->blockCount);
+	return isConsistent;
+}
+
+// クロージャに捕捉されるスロットをマークする
+// 捕捉されたローカル変数は呼び出し先から上位値経由で書き換えられるので、コピー伝播やスロットの付け替えの対象にしない
+void markCapturedSlots(const IrFunction* ir, bool* isCaptured)
+{
+	for (int i = 0; i < SLOT_COUNT_MAX; i++)
+	{
+		isCaptured[i] = false;
+	}
+
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		const IrBlock& block = ir->blocks[i];
+		for (int j = 0; j < block.count; j++)
+		{
+			const IrInstruction& instruction = block.instructions[j];
+			if (opcodeOf(ir, instruction) != OP_CLOSURE) continue;
+
+			const uint8_t* code = ir->code + instruction.offset;
+			for (int k = 2; k < instruction.length; k += 2)
+			{
+				if (code[k]) isCaptured[code[k + 1]] = true;
+			}
+		}
+	}
+}
+
+// ブロック内で、他のローカル変数のコピーになっているスロットの読み出しを、コピー元の読み出しに置き換える
+// var self = this; self.x を this.x にできれば OP_GET_THIS_PROPERTY に、
+// スロット 4 以降の変数のコピーの読み出しをスロット 0-3 の読み出しにできれば OP_GET_LOCAL_0..3 に融合できる
+bool propagateCopies(IrFunction* ir)
+{
+	bool isCaptured[SLOT_COUNT_MAX];
+	markCapturedSlots(ir, isCaptured);
+
+	// copyOf[slot] はスロットが同じ値を持つ別のスロット (なければ -1)
+	const int slotCount = ir->maxHeight + 1;
+	int* copyOf = allocate<int>(slotCount);
+
+	auto invalidate = [&](int slot) {
+		for (int i = 0; i < slotCount; i++)
+		{
+			if (i == slot || copyOf[i] == slot) copyOf[i] = -1;
+		}
+	};
+
+	bool changed = false;
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (block->height < 0) continue;
+
+		for (int j = 0; j < slotCount; j++)
+		{
+			copyOf[j] = -1;
+		}
+
+		int height = block->height;
+		for (int j = 0; j < block->count; j++)
+		{
+			const IrInstruction& instruction = block->instructions[j];
+			uint8_t* code = ir->code + instruction.offset;
+
+			int pops, pushes;
+			stackEffect(code, &pops, &pushes);
+
+			if (code[0] == OP_GET_LOCAL)
+			{
+				int slot = code[1];
+				if (copyOf[slot] >= 0)
+				{
+					slot = copyOf[slot];
+					code[1] = static_cast<uint8_t>(slot);
+					changed = true;
+				}
+
+				invalidate(height);
+				if (slot != height && !isCaptured[slot] && !isCaptured[height]) copyOf[height] = slot;
+			}
+			else if (code[0] == OP_SET_LOCAL)
+			{
+				// スタックトップの値がコピー元のスロットの値なら、代入先もそのコピーになる
+				int slot = code[1];
+				int source = height > 0 ? copyOf[height - 1] : -1;
+				invalidate(slot);
+				if (source >= 0 && source != slot && !isCaptured[slot]) copyOf[slot] = source;
+			}
+			else if (isForLoop(code[0]))
+			{
+				// ループ変数を書き換える
+				invalidate(code[1]);
+			}
+			else
+			{
+				// 取り除いた値と積んだ値のスロットは上書きされる
+				for (int slot = height - pops; slot < height; slot++)
+				{
+					invalidate(slot);
+				}
+				for (int slot = height - pops; slot < height - pops + pushes; slot++)
+				{
+					invalidate(slot);
+				}
+			}
+
+			height += pushes - pops;
+		}
+	}
+
+	free_array(copyOf, slotCount);
+	return changed;
+}
+
+// 型を検査しない版の命令
+uint8_t uncheckedOpcode(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_ADD: return OP_ADD_UNCHECKED;
+	case OP_SUBTRACT: return OP_SUBTRACT_UNCHECKED;
+	case OP_MULTIPLY: return OP_MULTIPLY_UNCHECKED;
+	case OP_DIVIDE: return OP_DIVIDE_UNCHECKED;
+	case OP_NEGATE: return OP_NEGATE_UNCHECKED;
+	case OP_GREATER: return OP_GREATER_UNCHECKED;
+	case OP_LESS: return OP_LESS_UNCHECKED;
+	default: return op;
+	}
+}
+
+// 型を検査しない命令を元の命令に戻す
+uint8_t checkedOpcode(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_ADD_UNCHECKED: return OP_ADD;
+	case OP_SUBTRACT_UNCHECKED: return OP_SUBTRACT;
+	case OP_MULTIPLY_UNCHECKED: return OP_MULTIPLY;
+	case OP_DIVIDE_UNCHECKED: return OP_DIVIDE;
+	case OP_NEGATE_UNCHECKED: return OP_NEGATE;
+	case OP_GREATER_UNCHECKED: return OP_GREATER;
+	case OP_LESS_UNCHECKED: return OP_LESS;
+	default: return op;
+	}
+}
+
+// スロットの値が数値だと分かっているかを前向きのデータフロー解析で求め、オペランドが数値の演算を型を検査しない命令にする
+// 引数や呼び出しの結果などは不明とし、合流点ではすべての入り口で数値の場合に限り数値とする
+// 捕捉されたスロットは呼び出し先から書き換えられうるので常に不明とする
+bool inferNumberTypes(IrFunction* ir, const ValueArray& constants)
+{
+	bool isCaptured[SLOT_COUNT_MAX];
+	markCapturedSlots(ir, isCaptured);
+
+	// entryTypes[block * slotCount + slot] はブロックの入口でスロットの値が数値か
+	const int slotCount = ir->maxHeight + 1;
+	const int blockCount = ir->blockCount;
+	bool* entryTypes = allocate<bool>(blockCount * slotCount);
+	bool* isReached = allocate<bool>(blockCount);
+	bool* isQueued = allocate<bool>(blockCount);
+	int* worklist = allocate<int>(blockCount);
+	bool* types = allocate<bool>(slotCount);
+	int worklistCount = 0;
+
+	for (int i = 0; i < blockCount; i++)
+	{
+		isReached[i] = false;
+		isQueued[i] = false;
+	}
+
+	auto propagate = [&](int index, int height) {
+		if (index >= blockCount) return;
+		bool* entry = entryTypes + index * slotCount;
+		bool changed = !isReached[index];
+		for (int slot = 0; slot < slotCount; slot++)
+		{
+			bool isNumber = slot < height && types[slot] && (!isReached[index] || entry[slot]);
+			if (isReached[index] && entry[slot] != isNumber) changed = true;
+			entry[slot] = isNumber;
+		}
+		isReached[index] = true;
+		if (changed && !isQueued[index])
+		{
+			isQueued[index] = true;
+			worklist[worklistCount++] = index;
+		}
+	};
+
+	// types をブロックの入口の状態にして命令を順に解釈する。rewrite なら演算の命令を書き換える
+	bool changed = false;
+	auto interpret = [&](int index, bool rewrite) {
+		const IrBlock& block = ir->blocks[index];
+		memcpy(types, entryTypes + index * slotCount, sizeof(bool) * slotCount);
+
+		int height = block.height;
+		for (int i = 0; i < block.count; i++)
+		{
+			const IrInstruction& instruction = block.instructions[i];
+			uint8_t* code = ir->code + instruction.offset;
+			int pops, pushes;
+			stackEffect(code, &pops, &pushes);
+
+			// 積む値が数値か
+			bool isNumber = false;
+			bool isProven = false;
+			switch (code[0])
+			{
+			case OP_CONSTANT:
+				isNumber = IS_NUMBER(constants.values[code[1]]);
+				break;
+			case OP_GET_LOCAL:
+				isNumber = !isCaptured[code[1]] && types[code[1]];
+				break;
+			case OP_SET_LOCAL:
+				types[code[1]] = !isCaptured[code[1]] && types[height - 1];
+				break;
+			case OP_NEGATE:
+				isProven = types[height - 1];
+				isNumber = true; // 数値でなければ実行時エラーで止まる
+				break;
+			case OP_ADD:
+				isProven = types[height - 2] && types[height - 1];
+				isNumber = isProven; // 文字列の連結かもしれない
+				break;
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+				isProven = types[height - 2] && types[height - 1];
+				isNumber = true;
+				break;
+			case OP_GREATER:
+			case OP_LESS:
+				isProven = types[height - 2] && types[height - 1];
+				break;
+			default:
+				break;
+			}
+
+			if (rewrite && isProven)
+			{
+				code[0] = uncheckedOpcode(code[0]);
+				changed = true;
+			}
+
+			height += pushes - pops;
+			for (int slot = height - pushes; slot < height; slot++)
+			{
+				types[slot] = isNumber;
+			}
+
+			if (isJump(opcodeOf(ir, instruction))) propagate(instruction.target, height);
+		}
+		if (fallsThrough(ir, block)) propagate(index + 1, height);
+	};
+
+	for (int slot = 0; slot < slotCount; slot++)
+	{
+		types[slot] = false;
+	}
+	propagate(0, ir->arity + 1);
+	while (worklistCount > 0)
+	{
+		int index = worklist[--worklistCount];
+		isQueued[index] = false;
+		interpret(index, false);
+	}
+
+	// 不動点に達してから書き換える
+	for (int i = 0; i < blockCount; i++)
+	{
+		if (isReached[i] && ir->blocks[i].height >= 0) interpret(i, true);
+	}
+
+	free_array(types, slotCount);
+	free_array(worklist, blockCount);
+	free_array(isQueued, blockCount);
+	free_array(isReached, blockCount);
+	free_array(entryTypes, blockCount * slotCount);
+	return changed;
+}
+
+// ブロックの先行ブロックの一覧 (ジャンプと次のブロックへの落ち込み)
+struct Predecessors
+{
+	int* starts = nullptr; // blocks[i] の先行ブロックは list[starts[i] .. starts[i + 1])
+	int* list = nullptr;
+	int count = 0;
+};
+
+void buildPredecessors(const IrFunction* ir, Predecessors* predecessors)
+{
+	const int blockCount = ir->blockCount;
+	predecessors->starts = allocate<int>(blockCount + 1);
+	for (int i = 0; i <= blockCount; i++)
+	{
+		predecessors->starts[i] = 0;
+	}
+
+	// 辺を数えてから詰める
+	auto forEachEdge = [&](auto&& visit) {
+		for (int i = 0; i < blockCount; i++)
+		{
+			const IrBlock& block = ir->blocks[i];
+			if (block.height < 0) continue;
+
+			if (block.count > 0)
+			{
+				const IrInstruction& last = block.instructions[block.count - 1];
+				if (isJump(opcodeOf(ir, last))) visit(i, last.target);
+			}
+			if (fallsThrough(ir, block) && i + 1 < blockCount) visit(i, i + 1);
+		}
+	};
+
+	forEachEdge([&](int, int to) { predecessors->starts[to + 1]++; });
+	for (int i = 0; i < blockCount; i++)
+	{
+		predecessors->starts[i + 1] += predecessors->starts[i];
+	}
+
+	predecessors->count = predecessors->starts[blockCount];
+	predecessors->list = allocate<int>(predecessors->count);
+	int* filled = allocate<int>(blockCount);
+	for (int i = 0; i < blockCount; i++)
+	{
+		filled[i] = predecessors->starts[i];
+	}
+	forEachEdge([&](int from, int to) { predecessors->list[filled[to]++] = from; });
+
+	free_array(filled, blockCount);
+}
+
+void freePredecessors(const IrFunction* ir, Predecessors* predecessors)
+{
+	free_array(predecessors->starts, ir->blockCount + 1);
+	free_array(predecessors->list, predecessors->count);
+}
+
+// OP_LOOP で header に戻るループについて、ループの条件の先頭で読むグローバル変数を、ループに入る前に一度だけ読む
+// 読んだ値はループの入口のスタックの高さのスロットに置き、ループ内の同じ変数の読み出しを OP_GET_LOCAL にする
+// ループ内のローカル変数のスロットは一つずつずれるので付け替え、ループの出口で置いた値を捨てる
+//
+// グローバル変数の値が変わりうる命令 (代入、呼び出し、yield) を含むループは対象にしない
+// また、未定義のグローバル変数のエラーが同じ時点で出るように、ループの入口から副作用なしに読まれるものに限る
+bool hoistGlobalLoad(IrFunction* ir, int latch, const Predecessors& predecessors, bool* inLoop, int* worklist)
+{
+	const IrBlock& latchBlock = ir->blocks[latch];
+	const int header = latchBlock.instructions[latchBlock.count - 1].target;
+	const int headerHeight = ir->blocks[header].height;
+	if (header > latch || headerHeight < 0 || headerHeight >= UINT8_MAX) return false;
+
+	// latch から header を通らずに遡れるブロックがループの本体
+	// 関数の先頭まで遡れてしまう場合は header が入口になっていないので対象外
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		inLoop[i] = false;
+	}
+	inLoop[header] = true;
+	int worklistCount = 0;
+	worklist[worklistCount++] = latch;
+	while (worklistCount > 0)
+	{
+		int index = worklist[--worklistCount];
+		if (inLoop[index]) continue;
+		if (index == 0) return false;
+		inLoop[index] = true;
+
+		for (int i = predecessors.starts[index]; i < predecessors.starts[index + 1]; i++)
+		{
+			worklist[worklistCount++] = predecessors.list[i];
+		}
+	}
+
+	// 並び順で header の直前にあるブロックがループの中から header に落ちてくる場合は、前に命令を置けない
+	for (int i = header - 1; i >= 0; i--)
+	{
+		if (ir->blocks[i].count == 0) continue;
+		if (inLoop[i] && fallsThrough(ir, ir->blocks[i])) return false;
+		break;
+	}
+
+	// header の先頭から副作用のない命令だけを辿って、最初に読むグローバル変数を探す
+	// それより前に別のグローバル変数を読む場合は、エラーの順番が変わるので対象外
+	IrBlock* headerBlock = &ir->blocks[header];
+	int loadIndex = -1;
+	for (int i = 0; i < headerBlock->count; i++)
+	{
+		uint8_t op = opcodeOf(ir, headerBlock->instructions[i]);
+		if (op == OP_GET_GLOBAL)
+		{
+			loadIndex = i;
+			break;
+		}
+		if (!isPurePush(op)) break;
+	}
+	if (loadIndex < 0) return false;
+
+	const IrInstruction load = headerBlock->instructions[loadIndex];
+	const int global = readShort(ir->code + load.offset + 1);
+
+	// ループ内の命令を調べる
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		if (!inLoop[i]) continue;
+
+		const IrBlock& block = ir->blocks[i];
+		for (int j = 0; j < block.count; j++)
+		{
+			const uint8_t* code = ir->code + block.instructions[j].offset;
+			switch (code[0])
+			{
+			case OP_CALL:
+			case OP_TAIL_CALL:
+			case OP_INVOKE:
+			case OP_TAIL_INVOKE:
+			case OP_SUPER_INVOKE:
+			case OP_YIELD:
+				return false;
+			case OP_SET_GLOBAL:
+			case OP_DEFINE_GLOBAL:
+				if (readShort(code + 1) == global) return false;
+				break;
+			case OP_GET_LOCAL:
+			case OP_SET_LOCAL:
+			case OP_FOR_LOOP_CONSTANT:
+			case OP_FOR_LOOP_GLOBAL:
+				// 付け替えたスロットが 8bit に収まらなくなる
+				if (code[1] == UINT8_MAX) return false;
+				break;
+			case OP_FOR_LOOP:
+				if (code[1] == UINT8_MAX || code[3] == UINT8_MAX) return false;
+				break;
+			case OP_CLOSURE:
+				for (int k = 2; k < block.instructions[j].length; k += 2)
+				{
+					if (code[k] && code[k + 1] == UINT8_MAX) return false;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	// ループの出口は、条件の値を POP するブロックで、ループの外から飛び込まれないものに限る
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		if (!inLoop[i] || ir->blocks[i].height < 0) continue;
+
+		const IrBlock& block = ir->blocks[i];
+		int successors[2];
+		int successorCount = 0;
+		if (block.count > 0 && isJump(opcodeOf(ir, block.instructions[block.count - 1])))
+		{
+			successors[successorCount++] = block.instructions[block.count - 1].target;
+		}
+		if (fallsThrough(ir, block)) successors[successorCount++] = i + 1;
+
+		for (int j = 0; j < successorCount; j++)
+		{
+			int exit = skipEmpty(ir, successors[j]);
+			if (exit >= ir->blockCount || inLoop[exit]) continue;
+
+			const IrBlock& exitBlock = ir->blocks[exit];
+			if (exitBlock.height != headerHeight + 1 || opcodeOf(ir, exitBlock.instructions[0]) != OP_POP) return false;
+			for (int k = predecessors.starts[exit]; k < predecessors.starts[exit + 1]; k++)
+			{
+				if (!inLoop[predecessors.list[k]]) return false;
+			}
+			// 空のブロックを挟んでいる場合は、空のブロックへの飛び込みも調べる
+			if (exit != successors[j]) return false;
+		}
+	}
+
+	// ここから書き換え
+	const int slot = headerHeight;
+	const int line = ir->lines[load.offset];
+	const uint8_t getLocal[] = { OP_GET_LOCAL, static_cast<uint8_t>(slot) };
+
+	// 先に出口に POP を置く (出口を複数の辺が共有していても一つだけ置く)
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		if (!inLoop[i] || ir->blocks[i].height < 0) continue;
+
+		const IrBlock& block = ir->blocks[i];
+		int successors[2];
+		int successorCount = 0;
+		if (block.count > 0 && isJump(opcodeOf(ir, block.instructions[block.count - 1])))
+		{
+			successors[successorCount++] = block.instructions[block.count - 1].target;
+		}
+		if (fallsThrough(ir, block)) successors[successorCount++] = i + 1;
+
+		for (int j = 0; j < successorCount; j++)
+		{
+			int exit = successors[j];
+			if (exit >= ir->blockCount || inLoop[exit]) continue;
+
+			IrBlock* exitBlock = &ir->blocks[exit];
+			if (exitBlock->height == headerHeight + 2) continue; // 処理済み
+
+			const uint8_t pop[] = { OP_POP };
+			insertInstruction(exitBlock, 0, newInstruction(ir, pop, 1, ir->lines[exitBlock->instructions[0].offset]));
+			exitBlock->height = headerHeight + 2;
+		}
+	}
+
+	// ループ内のスロットを付け替えて、グローバル変数の読み出しを置いたスロットの読み出しにする
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		if (!inLoop[i]) continue;
+
+		IrBlock* block = &ir->blocks[i];
+		for (int j = 0; j < block->count; j++)
+		{
+			IrInstruction* instruction = &block->instructions[j];
+			uint8_t* code = ir->code + instruction->offset;
+			switch (code[0])
+			{
+			case OP_GET_LOCAL:
+			case OP_SET_LOCAL:
+			case OP_FOR_LOOP_CONSTANT:
+				if (code[1] >= slot) code[1]++;
+				break;
+			case OP_FOR_LOOP:
+				if (code[1] >= slot) code[1]++;
+				if (code[3] >= slot) code[3]++;
+				break;
+			case OP_FOR_LOOP_GLOBAL:
+			{
+				if (code[1] >= slot) code[1]++;
+				if (readShort(code + 3) != global) break;
+
+				// 上限のグローバル変数も置いたスロットから読む
+				const uint8_t forLoop[] = { OP_FOR_LOOP, code[1], code[2], static_cast<uint8_t>(slot), 0xFF, 0xFF };
+				const int target = instruction->target;
+				*instruction = newInstruction(ir, forLoop, sizeof(forLoop), ir->lines[instruction->offset]);
+				instruction->target = target;
+				break;
+			}
+			case OP_CLOSURE:
+				for (int k = 2; k < instruction->length; k += 2)
+				{
+					if (code[k] && code[k + 1] >= slot) code[k + 1]++;
+				}
+				break;
+			case OP_GET_GLOBAL:
+				if (readShort(code + 1) == global && !(i == header && j == loadIndex))
+				{
+					*instruction = newInstruction(ir, getLocal, 2, ir->lines[instruction->offset]);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	headerBlock->instructions[loadIndex] = newInstruction(ir, getLocal, 2, line);
+
+	// header の前に読み出しを置くブロックを挟む
+	// ループの外から header へのジャンプはこのブロックへ、ループの中からのジャンプは header のままにする
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (block->count == 0) continue;
+
+		IrInstruction* last = &block->instructions[block->count - 1];
+		if (!isJump(opcodeOf(ir, *last))) continue;
+
+		if (last->target > header || (last->target == header && inLoop[i])) last->target++;
+	}
+
+	addBlock(ir);
+	memmove(ir->blocks + header + 1, ir->blocks + header, sizeof(IrBlock) * (ir->blockCount - 1 - header));
+	ir->blocks[header] = IrBlock();
+	appendInstruction(&ir->blocks[header], load);
+	return true;
+}
+
+// 呼び出しのないループのグローバル変数の読み出しを、ループの外に出す
+bool hoistGlobalLoads(IrFunction* ir)
+{
+	bool changed = false;
+
+	// 書き換えるとブロックの番号と高さが変わるので、一つ出すごとに調べ直す
+	for (bool hoisted = true; hoisted;)
+	{
+		hoisted = false;
+		if (!computeHeights(ir)) break;
+
+		Predecessors predecessors;
+		buildPredecessors(ir, &predecessors);
+		bool* inLoop = allocate<bool>(ir->blockCount);
+		int* worklist = allocate<int>(predecessors.count + 1);
+		const int blockCount = ir->blockCount;
+
+		for (int i = 0; i < blockCount && !hoisted; i++)
+		{
+			const IrBlock& block = ir->blocks[i];
+			if (block.count == 0 || block.height < 0) continue;
+			if (opcodeOf(ir, block.instructions[block.count - 1]) != OP_LOOP) continue;
+
+			hoisted = hoistGlobalLoad(ir, i, predecessors, inLoop, worklist);
+		}
+
+		free_array(worklist, predecessors.count + 1);
+		free_array(inLoop, blockCount);
+		freePredecessors(ir, &predecessors);
+		changed |= hoisted;
+	}
+	return changed;
+}
+
+// レジスタ命令の選択で、スタックに積まれるはずの値の置き場所
+enum class VirtualValueKind
+{
+	Local, // まだ読み出していないローカル変数のスロット
+	Constant, // まだ読み出していない定数
+	Temporary, // 一時値。命令を出力済みで、スタックに積まれている
+};
+
+struct VirtualValue
+{
+	VirtualValueKind kind = VirtualValueKind::Local;
+	int operand = 0; // Local ならスロット、Constant なら定数の番号
+	int line = 0;
+};
+
+// ブロックの命令列をスタックの先頭から見ていき、スタックに積む命令を遅らせながらレジスタ命令に置き換える
+//
+// 出力済みの命令が作ったスタックは、スロット real までが元の命令列と一致していて、その上に一時値が順に積まれている
+// values[0..count) は元の命令列でスロット real から積まれている値で、ローカル変数と定数の読み出しはまだ出力していない
+// 一時値は後に積んだものから先に消費されるので、常にスタックの上に連続して並ぶ
+struct RegisterSelector
+{
+	IrFunction* ir = nullptr;
+	IrBlock output; // 書き出し中の命令列
+
+	int real = 0;
+	VirtualValue* values = nullptr;
+	int count = 0;
+};
+
+void emit(RegisterSelector* selector, std::initializer_list<uint8_t> bytes, int line)
+{
+	appendInstruction(&selector->output, newInstruction(selector->ir, bytes.begin(), static_cast<int>(bytes.size()), line));
+}
+
+// values[index] が一時値の場合に、それが置かれているスロット
+int temporarySlot(const RegisterSelector* selector, int index)
+{
+	int slot = selector->real;
+	for (int i = 0; i < index; i++)
+	{
+		if (selector->values[i].kind == VirtualValueKind::Temporary) slot++;
+	}
+	return slot;
+}
+
+// values[from..to) にスロット slot の読み出しが残っているか
+bool readsSlot(const RegisterSelector* selector, int from, int to, int slot)
+{
+	for (int i = from; i < to; i++)
+	{
+		const VirtualValue& value = selector->values[i];
+		if (value.kind == VirtualValueKind::Local && value.operand == slot) return true;
+	}
+	return false;
+}
+
+// values[0..n) を元の命令列どおりのスロットに置いて、スタックを real + n まで確定させる
+// 上に残る一時値は、上のものから順に新しいスロットへ動かす (移動先は常に元のスロット以上なので上書きしない)
+void materialize(RegisterSelector* selector, int n)
+{
+	if (n == 0) return;
+
+	const int real = selector->real;
+	int top = temporarySlot(selector, selector->count);
+	for (int i = selector->count - 1; i >= 0; i--)
+	{
+		if (selector->values[i].kind != VirtualValueKind::Temporary) continue;
+
+		int from = temporarySlot(selector, i);
+		int to = i < n ? real + i : real + n + (from - temporarySlot(selector, n));
+		if (from != to)
+		{
+			emit(selector, { OP_MOVE, static_cast<uint8_t>(to), static_cast<uint8_t>(from) }, selector->values[i].line);
+			if (to >= top) top = to + 1;
+		}
+	}
+
+	// スタックトップに置く場合は積む命令、その下に置く場合は書き込むだけの命令を使う
+	for (int i = 0; i < n; i++)
+	{
+		const VirtualValue& value = selector->values[i];
+		const uint8_t slot = static_cast<uint8_t>(real + i);
+		const uint8_t operand = static_cast<uint8_t>(value.operand);
+		if (value.kind == VirtualValueKind::Temporary) continue;
+
+		if (real + i == top)
+		{
+			emit(selector, { static_cast<uint8_t>(value.kind == VirtualValueKind::Local ? OP_GET_LOCAL : OP_CONSTANT), operand }, value.line);
+			top++;
+		}
+		else
+		{
+			emit(selector, { static_cast<uint8_t>(value.kind == VirtualValueKind::Local ? OP_MOVE : OP_LOAD_CONSTANT), slot, operand }, value.line);
+		}
+	}
+
+	memmove(selector->values, selector->values + n, sizeof(VirtualValue) * (selector->count - n));
+	selector->count -= n;
+	selector->real += n;
+}
+
+void push(RegisterSelector* selector, VirtualValueKind kind, int operand, int line)
+{
+	VirtualValue value;
+	value.kind = kind;
+	value.operand = operand;
+	value.line = line;
+	selector->values[selector->count++] = value;
+}
+
+// 出力済みのスタックトップの値 (呼び出しの結果など) を一時値として扱う
+void demote(RegisterSelector* selector, int line)
+{
+	if (readsSlot(selector, 0, selector->count, selector->real - 1)) materialize(selector, selector->count);
+
+	memmove(selector->values + 1, selector->values, sizeof(VirtualValue) * selector->count);
+	selector->count++;
+	selector->real--;
+	selector->values[0].kind = VirtualValueKind::Temporary;
+	selector->values[0].operand = 0;
+	selector->values[0].line = line;
+}
+
+uint8_t registerBinaryOp(uint8_t op, bool isConstant)
+{
+	switch (op)
+	{
+	case OP_ADD: return isConstant ? OP_ADD_RK : OP_ADD_RR;
+	case OP_SUBTRACT: return isConstant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR;
+	case OP_MULTIPLY: return isConstant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR;
+	default: return isConstant ? OP_DIVIDE_RK : OP_DIVIDE_RR;
+	}
+}
+
+uint8_t registerJump(uint8_t op, bool isConstant)
+{
+	switch (op)
+	{
+	case OP_LESS: return isConstant ? OP_JUMP_IF_NOT_LESS_RK : OP_JUMP_IF_NOT_LESS_RR;
+	case OP_GREATER: return isConstant ? OP_JUMP_IF_NOT_GREATER_RK : OP_JUMP_IF_NOT_GREATER_RR;
+	default: return isConstant ? OP_JUMP_IF_NOT_EQUAL_RK : OP_JUMP_IF_NOT_EQUAL_RR;
+	}
+}
+
+// 数値演算を三番地命令にする
+// 直後が OP_SET_LOCAL + OP_POP なら結果をそのスロットに直接書き込み、そうでなければ一時値にする
+// 置き換えた後続の命令の数を返す
+int selectBinaryOp(RegisterSelector* selector, const IrBlock& block, int index)
+{
+	IrFunction* ir = selector->ir;
+	const IrInstruction& instruction = block.instructions[index];
+	const uint8_t op = checkedOpcode(opcodeOf(ir, instruction));
+	const int line = ir->lines[instruction.offset];
+
+	while (selector->count < 2) demote(selector, line);
+
+	// 定数を左辺に取る命令はないので、一時値にする
+	if (selector->values[selector->count - 2].kind == VirtualValueKind::Constant)
+	{
+		materialize(selector, selector->count - 1);
+		demote(selector, line);
+	}
+
+	int destination = -1;
+	if (index + 2 < block.count &&
+		opcodeOf(ir, block.instructions[index + 1]) == OP_SET_LOCAL &&
+		opcodeOf(ir, block.instructions[index + 2]) == OP_POP)
+	{
+		destination = ir->code[block.instructions[index + 1].offset + 1];
+	}
+	if (destination >= selector->real + selector->count - 2)
+	{
+		// 代入先がオペランドのスロット (コンパイラは出力しない)
+		destination = -1;
+	}
+	else if (destination >= 0)
+	{
+		if (destination >= selector->real) materialize(selector, destination - selector->real + 1);
+		// 代入より前に積んだ値がこのスロットを読むなら、先に読んでおく
+		if (readsSlot(selector, 0, selector->count - 2, destination)) materialize(selector, selector->count - 2);
+	}
+
+	const int leftIndex = selector->count - 2;
+	const int rightIndex = selector->count - 1;
+	const VirtualValue left = selector->values[leftIndex];
+	const VirtualValue right = selector->values[rightIndex];
+	const int a = left.kind == VirtualValueKind::Local ? left.operand : temporarySlot(selector, leftIndex);
+	const bool isConstant = right.kind == VirtualValueKind::Constant;
+	const int b = right.kind == VirtualValueKind::Temporary ? temporarySlot(selector, rightIndex) : right.operand;
+	const int temporaries = (left.kind == VirtualValueKind::Temporary ? 1 : 0) + (right.kind == VirtualValueKind::Temporary ? 1 : 0);
+
+	// 結果の一時値は、消費した一時値の一番下か、スタックトップに置く
+	const int resultSlot = temporarySlot(selector, leftIndex);
+	selector->count -= 2;
+
+	// どちらも一時値ならスタックトップの 2 つの値の演算なので、元の命令のままにする
+	if (temporaries == 2)
+	{
+		appendInstruction(&selector->output, instruction);
+		push(selector, VirtualValueKind::Temporary, 0, line);
+		return 0;
+	}
+
+	const uint8_t fused = registerBinaryOp(op, isConstant);
+	if (destination >= 0)
+	{
+		emit(selector, { fused, static_cast<uint8_t>(destination), static_cast<uint8_t>(a), static_cast<uint8_t>(b) }, line);
+		if (temporaries == 1) emit(selector, { OP_POP }, line);
+		return 2;
+	}
+
+	emit(selector, { fused, static_cast<uint8_t>(resultSlot), static_cast<uint8_t>(a), static_cast<uint8_t>(b) }, line);
+	push(selector, VirtualValueKind::Temporary, 0, line);
+	return 0;
+}
+
+// 比較 + OP_JUMP_IF_FALSE (+ 次のブロックの先頭の OP_POP) をレジスタ命令の比較と分岐にする
+// 一時値はスタックから取り除く必要があるので、ローカル変数と定数の比較に限る
+bool selectCompareAndJump(RegisterSelector* selector, IrBlock* block, int index, IrBlock* next)
+{
+	IrFunction* ir = selector->ir;
+	if (selector->count < 2) return false;
+
+	VirtualValue left = selector->values[selector->count - 2];
+	VirtualValue right = selector->values[selector->count - 1];
+	uint8_t op = checkedOpcode(opcodeOf(ir, block->instructions[index]));
+	if (left.kind == VirtualValueKind::Temporary || right.kind == VirtualValueKind::Temporary) return false;
+	if (left.kind == VirtualValueKind::Constant)
+	{
+		// k < x は x > k にする。比較が失敗した場合のエラーはどちらも同じ
+		if (right.kind == VirtualValueKind::Constant) return false;
+		std::swap(left, right);
+		if (op == OP_LESS) op = OP_GREATER;
+		else if (op == OP_GREATER) op = OP_LESS;
+	}
+
+	materialize(selector, selector->count - 2);
+	selector->count -= 2;
+
+	const IrInstruction& jump = block->instructions[index + 1];
+	const uint8_t fused = registerJump(op, right.kind == VirtualValueKind::Constant);
+	emit(selector, { fused, static_cast<uint8_t>(left.operand), static_cast<uint8_t>(right.operand), 0xFF, 0xFF }, ir->lines[block->instructions[index].offset]);
+	selector->output.instructions[selector->output.count - 1].target = jump.target;
+
+	// 次のブロックは条件の値を積まずに始まる
+	removeInstruction(next, 0);
+	next->height--;
+	return true;
+}
+
+// 各ブロックの命令列のうち、ローカル変数と定数を読んで計算する部分をレジスタ命令にする
+// 呼び出しなどの他の命令の前では、スタックを元の命令列どおりに戻してからその命令を置く
+void selectRegisterInstructions(IrFunction* ir)
+{
+	// スロットは 8bit のオペランドで指定する
+	if (ir->maxHeight > UINT8_MAX) return;
+
+	Predecessors predecessors;
+	buildPredecessors(ir, &predecessors);
+
+	RegisterSelector selector;
+	selector.ir = ir;
+	selector.values = allocate<VirtualValue>(ir->maxHeight + 2);
+
+	for (int i = 0; i < ir->blockCount; i++)
+	{
+		IrBlock* block = &ir->blocks[i];
+		if (block->height < 0 || block->count == 0) continue;
+
+		// 条件分岐の次のブロックが、この分岐からしか入らずに条件の値を POP するなら分岐と融合できる
+		// 間に空のブロックがあれば、それも他から入らないものに限る
+		IrBlock* next = nullptr;
+		for (int j = i + 1; j < ir->blockCount && predecessors.starts[j + 1] - predecessors.starts[j] == 1; j++)
+		{
+			if (ir->blocks[j].count == 0) continue;
+			if (opcodeOf(ir, ir->blocks[j].instructions[0]) == OP_POP) next = &ir->blocks[j];
+			break;
+		}
+
+		selector.output = IrBlock();
+		selector.real = block->height;
+		selector.count = 0;
+
+		for (int j = 0; j < block->count; j++)
+		{
+			// 命令を出力すると ir->code が伸びて移動するので、オペランドは先に読んでおく
+			const IrInstruction& instruction = block->instructions[j];
+			const uint8_t op = opcodeOf(ir, instruction);
+			const int operand = instruction.length > 1 ? ir->code[instruction.offset + 1] : 0;
+			const int line = ir->lines[instruction.offset];
+			int pops, pushes;
+			stackEffect(ir->code + instruction.offset, &pops, &pushes);
+
+			switch (op)
+			{
+			case OP_GET_LOCAL:
+				if (operand >= selector.real) materialize(&selector, operand - selector.real + 1);
+				push(&selector, VirtualValueKind::Local, operand, line);
+				continue;
+			case OP_CONSTANT:
+				push(&selector, VirtualValueKind::Constant, operand, line);
+				continue;
+			case OP_POP:
+				if (selector.count == 0) break;
+				// 読み出していない値は読まずに捨てる
+				if (selector.values[selector.count - 1].kind == VirtualValueKind::Temporary) appendInstruction(&selector.output, instruction);
+				selector.count--;
+				continue;
+			case OP_SET_LOCAL:
+			{
+				if (selector.count == 0 || j + 1 >= block->count || opcodeOf(ir, block->instructions[j + 1]) != OP_POP) break;
+				if (selector.values[selector.count - 1].kind == VirtualValueKind::Temporary) break;
+
+				const int destination = operand;
+				if (destination >= selector.real) materialize(&selector, destination - selector.real + 1);
+				if (readsSlot(&selector, 0, selector.count - 1, destination)) materialize(&selector, selector.count - 1);
+
+				const VirtualValue value = selector.values[--selector.count];
+				if (value.kind == VirtualValueKind::Constant)
+				{
+					emit(&selector, { OP_LOAD_CONSTANT, static_cast<uint8_t>(destination), static_cast<uint8_t>(value.operand) }, line);
+				}
+				else if (value.operand != destination)
+				{
+					emit(&selector, { OP_MOVE, static_cast<uint8_t>(destination), static_cast<uint8_t>(value.operand) }, line);
+				}
+				j++;
+				continue;
+			}
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_ADD_UNCHECKED:
+			case OP_SUBTRACT_UNCHECKED:
+			case OP_MULTIPLY_UNCHECKED:
+			case OP_DIVIDE_UNCHECKED:
+				j += selectBinaryOp(&selector, *block, j);
+				continue;
+			case OP_LESS:
+			case OP_GREATER:
+			case OP_EQUAL:
+			case OP_LESS_UNCHECKED:
+			case OP_GREATER_UNCHECKED:
+				if (next != nullptr && j + 2 == block->count &&
+					opcodeOf(ir, block->instructions[j + 1]) == OP_JUMP_IF_FALSE &&
+					selectCompareAndJump(&selector, block, j, next))
+				{
+					j++;
+					continue;
+				}
+				break;
+			default:
+				break;
+			}
+
+			// それ以外の命令はスタックを確定させてからそのまま置く
+			materialize(&selector, selector.count);
+			appendInstruction(&selector.output, instruction);
+			selector.real += pushes - pops;
+		}
+		materialize(&selector, selector.count);
+
+		free_array(block->instructions, block->capacity);
+		block->instructions = selector.output.instructions;
+		block->count = selector.output.count;
+		block->capacity = selector.output.capacity;
+	}
+
+	free_array(selector.values, ir->maxHeight + 2);
+	freePredecessors(ir, &predecessors);
+}
+
+}
+
+void optimizeIr(Chunk* chunk, int arity, bool useRegisters)
+{
+	// ブロックの飛び先は一つなので、飛び先を複数持つ switch 文の表を含む関数はそのままにする
+	// 8bit / 16bit に収まらないオペランドを持つ大きな関数も、命令の形が変わるのでそのままにする
+	for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset))
+	{
+		switch (chunk->code[offset])
+		{
+		case OP_JUMP_TABLE:
+		case OP_JUMP_STRING:
+		case OP_CONSTANT_LONG:
+		case OP_JUMP_LONG:
+		case OP_JUMP_IF_FALSE_LONG:
+		case OP_LOOP_LONG:
+		case OP_WIDE:
+			return;
+		default:
+			break;
+		}
+	}
+
+	IrFunction ir;
+	ir.arity = arity;
+	buildIr(&ir, chunk);
+
+	// 制御フローの単純化は、一つの変換が次の変換の機会を作るので変化がなくなるまで繰り返す
+	for (bool changed = true; changed;)
+	{
+		changed = foldConstantBranches(&ir);
+		changed |= threadJumps(&ir);
+		changed |= removeUnreachable(&ir);
+		changed |= removeJumpsToNext(&ir);
+		changed |= simplifyBlocks(&ir);
+	}
+
+	// ループの外に出したグローバル変数のコピーも伝播できるように、出してからコピー伝播する
+	hoistGlobalLoads(&ir);
+	if (computeHeights(&ir))
+	{
+		propagateCopies(&ir);
+		inferNumberTypes(&ir, chunk->constants);
+		if (useRegisters) selectRegisterInstructions(&ir);
+	}
+
+	lowerIr(&ir, chunk);
+	freeIr(&ir);
+}
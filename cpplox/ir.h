@@ -0,0 +1,18 @@
+﻿#pragma once
+
+struct Chunk;
+
+// コンパイラが出力した命令列を基本ブロックの中間表現に変換して最適化し、命令列に戻す
+// ピープホール最適化 (peephole.h) の前に関数ごとに行う
+//
+// - 定数で分岐する OP_JUMP_IF_FALSE の除去と、到達不能なブロックの削除
+// - ジャンプ先がジャンプ命令の場合の飛び先の付け替え (jump threading)
+// - ブロック内でのローカル変数のコピー伝播 (var b = a; の後の b の読み出しを a の読み出しにする)
+// - 呼び出しのないループの条件で読むグローバル変数を、ループの前で一度だけ読んでスロットに置く
+// - 型推論でオペランドが数値だと分かった算術演算と比較を、型を検査しない命令 (OP_ADD_UNCHECKED など) にする
+// - useRegisters なら、ローカル変数と定数の演算と比較をフレームのスロットを直接読み書きする三番地命令にする
+//
+// switch 文の表 (OP_JUMP_TABLE / OP_JUMP_STRING) や、OP_WIDE / _LONG の命令を含む関数は変換しない
+//
+// arity はフレームの先頭に積まれている引数の数 (スロット 0 の関数自身 / this は含まない)
+void optimizeIr(Chunk* chunk, int arity, bool useRegisters);
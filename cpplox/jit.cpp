@@ -0,0 +1,1351 @@
+﻿#include "jit.h"
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "thread.h"
+#include "vm.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#if JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+bool jitEnabled = JIT_SUPPORTED;
+
+}
+
+void setJitEnabled(bool enabled)
+{
+	jitEnabled = enabled && JIT_SUPPORTED;
+}
+
+bool isJitEnabled()
+{
+	return jitEnabled;
+}
+
+struct JitCode
+{
+	AotFunction aot = nullptr; // AOT コンパイルした関数の場合は、これ以外のメンバは使わない
+
+	uint8_t* code = nullptr; // mmap した実行可能領域。先頭に入口のプロローグがある
+	size_t size = 0;
+	uint8_t* start = nullptr; // 関数の先頭の命令に対応する位置
+
+	// バイトコードのオフセット -> 機械語のオフセット。命令の先頭以外は -1
+	// 関数の先頭だけでなく、呼び出しから戻った位置やループの途中からも機械語に入れる
+	int* entries = nullptr;
+	int entryCount = 0;
+};
+
+namespace
+{
+
+// AOT コンパイルした関数を実行する
+// 末尾呼び出しでフレームが置き換わったら、呼び出し先の関数を続けて実行する
+JitResult enterAot(Thread* thread, bool nested)
+{
+	for (;;)
+	{
+		CallFrame* frame = &thread->frames[thread->frameCount - 1];
+		JitCode* code = frame->closure->function->jitCode;
+		if (code == nullptr || code->aot == nullptr) return JitResult::Exit;
+
+		JitResult result = code->aot(thread, nested);
+		if (result != JitResult::TailCall) return result;
+	}
+}
+
+}
+
+#if JIT_SUPPORTED
+
+namespace
+{
+
+// 機械語の入口。System V の呼び出し規約で引数を受け取る
+// nested は機械語の呼び出し命令から入ったかどうか。その場合は return も機械語で行って Continue を返す
+using JitEntry = JitResult (*)(Thread* thread, CallFrame* frame, Value* constants, uint8_t* start, bool nested);
+
+// ランタイム関数の型
+using JitRuntimeFn = bool (*)(Thread* thread);
+using JitCallFn = JitResult (*)(Thread* thread);
+
+enum Reg
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// 生成コード内のレジスタの用途。いずれも callee-saved なのでランタイム関数を呼んでも壊れない
+constexpr Reg REG_THREAD = RBX;
+constexpr Reg REG_STACK_TOP = R12;
+constexpr Reg REG_SLOTS = R13;
+constexpr Reg REG_CONSTANTS = R14;
+constexpr Reg REG_FRAME = R15;
+
+enum Condition
+{
+	CC_B = 0x2,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_P = 0xA,
+	CC_NP = 0xB,
+};
+
+enum AluOp
+{
+	ALU_ADD = 0x01,
+	ALU_OR = 0x09,
+	ALU_AND = 0x21,
+	ALU_SUB = 0x29,
+	ALU_XOR = 0x31,
+	ALU_CMP = 0x39,
+};
+
+enum SseOp
+{
+	SSE_ADD = 0x58,
+	SSE_MUL = 0x59,
+	SSE_SUB = 0x5C,
+	SSE_DIV = 0x5E,
+};
+
+// バイトコードのジャンプ先を、全命令を書き出した後に埋めるための情報
+struct JumpPatch
+{
+	int position = 0; // rel32 の位置
+	int target = 0; // ジャンプ先のバイトコードのオフセット
+};
+
+struct Assembler
+{
+	uint8_t* code = nullptr;
+	int count = 0;
+	int capacity = 0;
+
+	JumpPatch* patches = nullptr;
+	int patchCount = 0;
+	int patchCapacity = 0;
+
+	// 共通の出口
+	int exitLabel = 0; // スタックトップを書き戻してインタプリタに戻る
+	int errorLabel = 0; // 実行時エラーで戻る
+	int returnLabel = 0; // return を終えて呼び出し元の機械語に戻る
+};
+
+void emit8(Assembler* as, uint8_t byte)
+{
+	if (as->capacity < as->count + 1)
+	{
+		auto oldCapacity = as->capacity;
+		as->capacity = grow_capacity(oldCapacity);
+		as->code = grow_array(as->code, oldCapacity, as->capacity);
+	}
+	as->code[as->count++] = byte;
+}
+
+void emit32(Assembler* as, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		emit8(as, static_cast<uint8_t>(value >> (i * 8)));
+	}
+}
+
+void emit64(Assembler* as, uint64_t value)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		emit8(as, static_cast<uint8_t>(value >> (i * 8)));
+	}
+}
+
+void patch32(Assembler* as, int position, int32_t value)
+{
+	memcpy(as->code + position, &value, sizeof(value));
+}
+
+void emitRex(Assembler* as, int reg, int base)
+{
+	emit8(as, static_cast<uint8_t>(0x48 | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0)));
+}
+
+// [base + disp32] のメモリオペランド
+void emitMemory(Assembler* as, int reg, int base, int32_t disp)
+{
+	emit8(as, static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+	if ((base & 7) == RSP)
+	{
+		emit8(as, 0x24); // rsp / r12 をベースにする場合は SIB が必要
+	}
+	emit32(as, static_cast<uint32_t>(disp));
+}
+
+void emitModRM(Assembler* as, int reg, int rm)
+{
+	emit8(as, static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// mov dst, [base + disp]
+void emitLoad(Assembler* as, Reg dst, Reg base, int32_t disp)
+{
+	emitRex(as, dst, base);
+	emit8(as, 0x8B);
+	emitMemory(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+void emitStore(Assembler* as, Reg base, int32_t disp, Reg src)
+{
+	emitRex(as, src, base);
+	emit8(as, 0x89);
+	emitMemory(as, src, base, disp);
+}
+
+// mov dst, imm64
+void emitMoveImm(Assembler* as, Reg dst, uint64_t imm)
+{
+	emitRex(as, 0, dst);
+	emit8(as, static_cast<uint8_t>(0xB8 | (dst & 7)));
+	emit64(as, imm);
+}
+
+// op dst, src (64bit)
+void emitAlu(Assembler* as, AluOp op, Reg dst, Reg src)
+{
+	emitRex(as, src, dst);
+	emit8(as, static_cast<uint8_t>(op));
+	emitModRM(as, src, dst);
+}
+
+void emitMove(Assembler* as, Reg dst, Reg src)
+{
+	emitRex(as, src, dst);
+	emit8(as, 0x89);
+	emitModRM(as, src, dst);
+}
+
+// mov dst32, [base + disp] (上位 32bit はゼロになる)
+void emitLoad32(Assembler* as, Reg dst, Reg base, int32_t disp)
+{
+	if ((dst | base) & 8)
+	{
+		emit8(as, static_cast<uint8_t>(0x40 | ((dst & 8) ? 4 : 0) | ((base & 8) ? 1 : 0)));
+	}
+	emit8(as, 0x8B);
+	emitMemory(as, dst, base, disp);
+}
+
+// mov dst, [base + index * 8] (base に rbp / r13 は使えない)
+void emitLoadIndexed(Assembler* as, Reg dst, Reg base, Reg index)
+{
+	emit8(as, static_cast<uint8_t>(0x48 | ((dst & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0)));
+	emit8(as, 0x8B);
+	emit8(as, static_cast<uint8_t>(0x04 | ((dst & 7) << 3)));
+	emit8(as, static_cast<uint8_t>(0xC0 | ((index & 7) << 3) | (base & 7)));
+}
+
+// cmp / sub [base + disp], imm8。wide なら 64bit、そうでなければ 32bit で演算する
+enum MemoryOp
+{
+	MEM_SUB = 5,
+	MEM_CMP = 7,
+};
+
+void emitMemoryImm8(Assembler* as, MemoryOp op, bool wide, Reg base, int32_t disp, int8_t imm)
+{
+	if (wide || (base & 8))
+	{
+		emit8(as, static_cast<uint8_t>(0x40 | (wide ? 8 : 0) | ((base & 8) ? 1 : 0)));
+	}
+	emit8(as, 0x83);
+	emitMemory(as, op, base, disp);
+	emit8(as, static_cast<uint8_t>(imm));
+}
+
+// add / sub dst, imm32
+void emitAddImm(Assembler* as, Reg dst, int32_t imm)
+{
+	emitRex(as, 0, dst);
+	emit8(as, 0x81);
+	emitModRM(as, imm >= 0 ? 0 : 5, dst);
+	emit32(as, static_cast<uint32_t>(imm >= 0 ? imm : -imm));
+}
+
+// movq xmm, src
+void emitMoveToXmm(Assembler* as, int xmm, Reg src)
+{
+	emit8(as, 0x66);
+	emitRex(as, xmm, src);
+	emit8(as, 0x0F);
+	emit8(as, 0x6E);
+	emitModRM(as, xmm, src);
+}
+
+// movq dst, xmm
+void emitMoveFromXmm(Assembler* as, Reg dst, int xmm)
+{
+	emit8(as, 0x66);
+	emitRex(as, xmm, dst);
+	emit8(as, 0x0F);
+	emit8(as, 0x7E);
+	emitModRM(as, xmm, dst);
+}
+
+// addsd / subsd / mulsd / divsd xmm0, xmm1
+void emitSse(Assembler* as, SseOp op)
+{
+	emit8(as, 0xF2);
+	emit8(as, 0x0F);
+	emit8(as, static_cast<uint8_t>(op));
+	emitModRM(as, 0, 1);
+}
+
+// ucomisd xmm(a), xmm(b)
+void emitUcomisd(Assembler* as, int a, int b)
+{
+	emit8(as, 0x66);
+	emit8(as, 0x0F);
+	emit8(as, 0x2E);
+	emitModRM(as, a, b);
+}
+
+// setcc r8 (al, cl, dl のみ)
+void emitSetcc(Assembler* as, Condition cc, Reg dst)
+{
+	emit8(as, 0x0F);
+	emit8(as, static_cast<uint8_t>(0x90 | cc));
+	emitModRM(as, 0, dst);
+}
+
+// 比較結果の al (0 / 1) を rax の bool 値にする
+void emitBoolFromAl(Assembler* as)
+{
+	emit8(as, 0x0F); // movzx eax, al
+	emit8(as, 0xB6);
+	emit8(as, 0xC0);
+	emitMoveImm(as, RCX, FALSE_VAL);
+	emitAlu(as, ALU_ADD, RAX, RCX); // FALSE_VAL + 1 == TRUE_VAL
+}
+
+void emitPush(Assembler* as, Reg src)
+{
+	emitStore(as, REG_STACK_TOP, 0, src);
+	emitAddImm(as, REG_STACK_TOP, sizeof(Value));
+}
+
+// 前方への jcc / jmp。飛び先は bindLabel() で埋める
+int emitJccForward(Assembler* as, Condition cc)
+{
+	emit8(as, 0x0F);
+	emit8(as, static_cast<uint8_t>(0x80 | cc));
+	emit32(as, 0);
+	return as->count - 4;
+}
+
+int emitJmpForward(Assembler* as)
+{
+	emit8(as, 0xE9);
+	emit32(as, 0);
+	return as->count - 4;
+}
+
+void bindLabel(Assembler* as, int position)
+{
+	patch32(as, position, as->count - (position + 4));
+}
+
+// 既に書き出した位置への jcc / jmp
+void emitJccTo(Assembler* as, Condition cc, int label)
+{
+	emit8(as, 0x0F);
+	emit8(as, static_cast<uint8_t>(0x80 | cc));
+	emit32(as, static_cast<uint32_t>(label - (as->count + 4)));
+}
+
+void emitJmpTo(Assembler* as, int label)
+{
+	emit8(as, 0xE9);
+	emit32(as, static_cast<uint32_t>(label - (as->count + 4)));
+}
+
+// バイトコードのオフセット target への jcc / jmp。cc が負なら無条件
+void emitJumpToBytecode(Assembler* as, int cc, int target)
+{
+	if (cc < 0)
+	{
+		emit8(as, 0xE9);
+	}
+	else
+	{
+		emit8(as, 0x0F);
+		emit8(as, static_cast<uint8_t>(0x80 | cc));
+	}
+	emit32(as, 0);
+
+	if (as->patchCapacity < as->patchCount + 1)
+	{
+		auto oldCapacity = as->patchCapacity;
+		as->patchCapacity = grow_capacity(oldCapacity);
+		as->patches = grow_array(as->patches, oldCapacity, as->patchCapacity);
+	}
+	as->patches[as->patchCount++] = JumpPatch{ as->count - 4, target };
+}
+
+// reg が数値でなければ label に飛ぶ。rdx に QNAN を入れておくこと
+int emitJumpIfNotNumber(Assembler* as, Reg reg)
+{
+	emitMove(as, RSI, reg);
+	emitAlu(as, ALU_AND, RSI, RDX);
+	emitAlu(as, ALU_CMP, RSI, RDX);
+	return emitJccForward(as, CC_E);
+}
+
+// スタックの上 2 つを rax (左辺), rcx (右辺) に読み、どちらかが数値でなければ slow に飛ぶ
+void emitLoadNumberOperands(Assembler* as, int* slow1, int* slow2)
+{
+	emitLoad(as, RAX, REG_STACK_TOP, -16);
+	emitLoad(as, RCX, REG_STACK_TOP, -8);
+	emitMoveImm(as, RDX, QNAN);
+	*slow1 = emitJumpIfNotNumber(as, RAX);
+	*slow2 = emitJumpIfNotNumber(as, RCX);
+	emitMoveToXmm(as, 0, RAX);
+	emitMoveToXmm(as, 1, RCX);
+}
+
+// frame->ip を ip に合わせる
+void emitSetIp(Assembler* as, const uint8_t* ip)
+{
+	emitMoveImm(as, RAX, reinterpret_cast<uint64_t>(ip));
+	emitStore(as, REG_FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+// frame->ip を ip に、thread->stackTop をスタックトップに合わせて function(thread) を呼び出す
+void emitCallWithState(Assembler* as, const void* function, const uint8_t* ip)
+{
+	emitSetIp(as, ip);
+	emitStore(as, REG_THREAD, offsetof(Thread, stackTop), REG_STACK_TOP);
+	emitMove(as, RDI, REG_THREAD);
+	emitMoveImm(as, RAX, reinterpret_cast<uint64_t>(function));
+	emit8(as, 0xFF); // call rax
+	emit8(as, 0xD0);
+	emitLoad(as, REG_STACK_TOP, REG_THREAD, offsetof(Thread, stackTop));
+}
+
+// 命令 instruction の手前でインタプリタに戻る
+void emitExit(Assembler* as, const uint8_t* instruction)
+{
+	emitSetIp(as, instruction);
+	emitJmpTo(as, as->exitLabel);
+}
+
+// ランタイム関数を呼び出す。operands は命令のオペランドの先頭
+void emitCallRuntime(Assembler* as, JitRuntimeFn function, const uint8_t* operands)
+{
+	emitCallWithState(as, reinterpret_cast<const void*>(function), operands);
+	emit8(as, 0x84); // test al, al
+	emit8(as, 0xC0);
+	emitJccTo(as, CC_E, as->errorLabel);
+}
+
+// 呼び出し命令。end は命令の末尾で、呼び出し先から戻った後はそこから続ける
+// 呼び出し先が機械語で return すれば次の命令に進み、インタプリタに戻る必要があればこのフレームも抜ける
+void emitCallInstruction(Assembler* as, JitCallFn function, const uint8_t* end)
+{
+	emitCallWithState(as, reinterpret_cast<const void*>(function), end);
+	emit8(as, 0x83); // cmp eax, Exit
+	emit8(as, 0xF8);
+	emit8(as, static_cast<uint8_t>(JitResult::Exit));
+	emitJccTo(as, CC_B, as->errorLabel);
+	emitJccTo(as, CC_E, as->exitLabel);
+}
+
+// 末尾呼び出し命令。フレームが JIT コンパイル済みの関数に置き換わったら、その先頭にジャンプする
+void emitTailCallInstruction(Assembler* as, JitCallFn function, const uint8_t* end)
+{
+	emitCallInstruction(as, function, end);
+	emit8(as, 0x83); // cmp eax, Continue
+	emit8(as, 0xF8);
+	emit8(as, static_cast<uint8_t>(JitResult::Continue));
+	int next = emitJccForward(as, CC_E);
+
+	emitLoad(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+	emitLoad(as, RAX, REG_FRAME, offsetof(CallFrame, closure));
+	emitLoad(as, RAX, RAX, offsetof(ObjClosure, function));
+	emitLoad(as, REG_CONSTANTS, RAX, offsetof(ObjFunction, chunk.constants.values));
+	emitLoad(as, RAX, RAX, offsetof(ObjFunction, jitCode));
+	emitLoad(as, RAX, RAX, offsetof(JitCode, start));
+	emit8(as, 0xFF); // jmp rax
+	emit8(as, 0xE0);
+
+	bindLabel(as, next);
+}
+
+// OP_RETURN: 機械語から呼び出されたフレームなら機械語で return する
+void emitReturn(Assembler* as, const uint8_t* ip)
+{
+	emitLoad(as, RAX, RSP, 0); // nested
+	emit8(as, 0x84); // test al, al
+	emit8(as, 0xC0);
+	int fromInterpreter = emitJccForward(as, CC_E);
+
+	// このフレームのローカル変数を指すオープン上位値があれば、閉じる処理はランタイム関数に任せる
+	emitLoad(as, RAX, REG_THREAD, offsetof(Thread, openUpvalues));
+	emit8(as, 0x48); // test rax, rax
+	emit8(as, 0x85);
+	emit8(as, 0xC0);
+	int noUpvalues = emitJccForward(as, CC_E);
+	emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+	emitAlu(as, ALU_CMP, RAX, REG_SLOTS);
+	int notCaptured = emitJccForward(as, CC_B);
+	emitCallRuntime(as, jitReturn, ip + 1);
+	emitJmpTo(as, as->returnLabel);
+
+	// 戻り値をスロット 0 に置いて、フレームを捨てる
+	bindLabel(as, noUpvalues);
+	bindLabel(as, notCaptured);
+	emitLoad(as, RAX, REG_STACK_TOP, -8);
+	emitStore(as, REG_SLOTS, 0, RAX);
+	emitMove(as, RAX, REG_SLOTS);
+	emitAddImm(as, RAX, sizeof(Value));
+	emitStore(as, REG_THREAD, offsetof(Thread, stackTop), RAX);
+	emitMemoryImm8(as, MEM_SUB, false, REG_THREAD, offsetof(Thread, frameCount), 1);
+	emitJmpTo(as, as->returnLabel);
+
+	bindLabel(as, fromInterpreter);
+	emitExit(as, ip);
+}
+
+// インラインキャッシュの先頭のエントリがフィールドなら、レシーバ rax の形を比べて直接読む
+// 外れたら slow に飛ぶ。当たればフィールドの値が rax に入る
+void emitGetFieldFast(Assembler* as, InlineCache* cache, int* slow)
+{
+	constexpr int entry = offsetof(InlineCache, entries);
+
+	emitMoveImm(as, RCX, QNAN | SIGN_BIT);
+	emitMove(as, RDX, RAX);
+	emitAlu(as, ALU_AND, RDX, RCX);
+	emitAlu(as, ALU_CMP, RDX, RCX);
+	slow[0] = emitJccForward(as, CC_NE);
+	emitMove(as, RDX, RAX);
+	emitAlu(as, ALU_XOR, RDX, RCX); // Obj*
+	emitMemoryImm8(as, MEM_CMP, false, RDX, offsetof(Obj, type), static_cast<int8_t>(ObjType::Instance));
+	slow[1] = emitJccForward(as, CC_NE);
+
+	// メガモーフィックになるとエントリは GC に辿られなくなるので、count も確認する
+	emitMoveImm(as, RSI, reinterpret_cast<uint64_t>(cache));
+	emitMemoryImm8(as, MEM_CMP, false, RSI, offsetof(InlineCache, count), 0);
+	slow[2] = emitJccForward(as, CC_E);
+	emitLoad(as, RAX, RDX, offsetof(ObjInstance, shape));
+	emitLoad(as, RDI, RSI, entry + offsetof(InlineCacheEntry, shape));
+	emitAlu(as, ALU_CMP, RAX, RDI);
+	slow[3] = emitJccForward(as, CC_NE);
+	emitMemoryImm8(as, MEM_CMP, true, RSI, entry + offsetof(InlineCacheEntry, method), 0);
+	slow[4] = emitJccForward(as, CC_NE);
+
+	emitLoad32(as, RCX, RSI, entry + offsetof(InlineCacheEntry, fieldIndex));
+	emitLoad(as, RDX, RDX, offsetof(ObjInstance, fields));
+	emitLoadIndexed(as, RAX, RDX, RCX);
+}
+
+constexpr int GET_FIELD_SLOW_PATHS = 5;
+
+void emitPrologue(Assembler* as)
+{
+	static const uint8_t pushes[] = {
+		0x53, // push rbx
+		0x55, // push rbp
+		0x41, 0x54, // push r12
+		0x41, 0x55, // push r13
+		0x41, 0x56, // push r14
+		0x41, 0x57, // push r15
+	};
+	for (uint8_t byte : pushes) emit8(as, byte);
+	emitAddImm(as, RSP, -8); // 呼び出し時に rsp を 16 バイト境界に揃える
+	emitStore(as, RSP, 0, R8); // 空いた場所に nested を置いておく
+
+	emitMove(as, REG_THREAD, RDI);
+	emitMove(as, REG_FRAME, RSI);
+	emitMove(as, REG_CONSTANTS, RDX);
+	emitLoad(as, REG_STACK_TOP, REG_THREAD, offsetof(Thread, stackTop));
+	emitLoad(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+	emit8(as, 0xFF); // jmp rcx
+	emit8(as, 0xE1);
+
+	as->exitLabel = as->count;
+	emitStore(as, REG_THREAD, offsetof(Thread, stackTop), REG_STACK_TOP);
+	emit8(as, 0xB8); // mov eax, Exit
+	emit32(as, static_cast<uint32_t>(JitResult::Exit));
+	int epilogue1 = emitJmpForward(as);
+
+	as->returnLabel = as->count;
+	emit8(as, 0xB8); // mov eax, Continue
+	emit32(as, static_cast<uint32_t>(JitResult::Continue));
+	int epilogue2 = emitJmpForward(as);
+
+	as->errorLabel = as->count;
+	emit8(as, 0x31); // xor eax, eax (Error)
+	emit8(as, 0xC0);
+
+	bindLabel(as, epilogue1);
+	bindLabel(as, epilogue2);
+	emitAddImm(as, RSP, 8);
+	static const uint8_t pops[] = {
+		0x41, 0x5F, // pop r15
+		0x41, 0x5E, // pop r14
+		0x41, 0x5D, // pop r13
+		0x41, 0x5C, // pop r12
+		0x5D, // pop rbp
+		0x5B, // pop rbx
+		0xC3, // ret
+	};
+	for (uint8_t byte : pops) emit8(as, byte);
+}
+
+// 数値の四則演算。数値でなければランタイム関数で汎用の演算をする
+void emitArithmetic(Assembler* as, SseOp op, const uint8_t* operands)
+{
+	int slow1, slow2;
+	emitLoadNumberOperands(as, &slow1, &slow2);
+	emitSse(as, op);
+	emitMoveFromXmm(as, RAX, 0);
+	emitStore(as, REG_STACK_TOP, -16, RAX);
+	emitAddImm(as, REG_STACK_TOP, -8);
+	int done = emitJmpForward(as);
+
+	bindLabel(as, slow1);
+	bindLabel(as, slow2);
+	emitCallRuntime(as, jitBinaryOp, operands);
+	bindLabel(as, done);
+}
+
+// 型推論で数値だと分かっている四則演算。型の検査もランタイム関数への退避もしない
+void emitUncheckedArithmetic(Assembler* as, SseOp op)
+{
+	emitLoad(as, RAX, REG_STACK_TOP, -16);
+	emitLoad(as, RCX, REG_STACK_TOP, -8);
+	emitMoveToXmm(as, 0, RAX);
+	emitMoveToXmm(as, 1, RCX);
+	emitSse(as, op);
+	emitMoveFromXmm(as, RAX, 0);
+	emitStore(as, REG_STACK_TOP, -16, RAX);
+	emitAddImm(as, REG_STACK_TOP, -8);
+}
+
+// 数値の比較の条件を設定する。成立すれば cc が真になる
+Condition emitCompare(Assembler* as, uint8_t instruction)
+{
+	switch (instruction)
+	{
+	case OP_GREATER:
+	case OP_GREATER_NUM:
+	case OP_GREATER_UNCHECKED:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_NOT_GREATER_NUM:
+		emitUcomisd(as, 0, 1); // a > b
+		return CC_A;
+	case OP_LESS:
+	case OP_LESS_NUM:
+	case OP_LESS_UNCHECKED:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_LESS_NUM:
+		emitUcomisd(as, 1, 0); // b > a。NaN との比較は CF が立つので偽になる
+		return CC_A;
+	default:
+		// 等値比較は ZF が立ちかつ PF が立っていない (NaN でない) 場合に成立する
+		emitUcomisd(as, 0, 1);
+		return CC_E;
+	}
+}
+
+// xmm0, xmm1 を比較した bool で左辺を置き換える
+void emitStoreComparison(Assembler* as, uint8_t instruction)
+{
+	Condition cc = emitCompare(as, instruction);
+	emitSetcc(as, cc, RAX);
+	if (cc == CC_E)
+	{
+		emitSetcc(as, CC_NP, RCX);
+		emit8(as, 0x20); // and al, cl
+		emit8(as, 0xC8);
+	}
+	emitBoolFromAl(as);
+	emitStore(as, REG_STACK_TOP, -16, RAX);
+	emitAddImm(as, REG_STACK_TOP, -8);
+}
+
+// 比較して bool をスタックに積む
+void emitComparison(Assembler* as, uint8_t instruction, const uint8_t* operands)
+{
+	int slow1, slow2;
+	emitLoadNumberOperands(as, &slow1, &slow2);
+	emitStoreComparison(as, instruction);
+	int done = emitJmpForward(as);
+
+	bindLabel(as, slow1);
+	bindLabel(as, slow2);
+	emitCallRuntime(as, jitBinaryOp, operands);
+	bindLabel(as, done);
+}
+
+// OP_JUMP_IF_NOT_XXX: 比較が成立しなければ false を積んで target に飛ぶ
+void emitCompareAndJump(Assembler* as, uint8_t instruction, const uint8_t* operands, int target)
+{
+	int slow1, slow2;
+	emitLoadNumberOperands(as, &slow1, &slow2);
+	emitAddImm(as, REG_STACK_TOP, -16);
+	Condition cc = emitCompare(as, instruction);
+
+	int notTaken1 = 0;
+	int notTaken2 = 0;
+	if (cc == CC_E)
+	{
+		notTaken1 = emitJccForward(as, CC_NE);
+		notTaken2 = emitJccForward(as, CC_P);
+	}
+	else
+	{
+		notTaken1 = emitJccForward(as, CC_BE);
+	}
+	int done = emitJmpForward(as);
+
+	// 数値以外はランタイム関数で比較して、結果の bool を見る
+	bindLabel(as, slow1);
+	bindLabel(as, slow2);
+	emitCallRuntime(as, jitBinaryOp, operands);
+	emitLoad(as, RAX, REG_STACK_TOP, -8);
+	emitAddImm(as, REG_STACK_TOP, -8);
+	emitMoveImm(as, RCX, TRUE_VAL);
+	emitAlu(as, ALU_CMP, RAX, RCX);
+	int taken = emitJccForward(as, CC_E);
+
+	// 分岐先には条件式の評価値を POP する命令があるので、false を積んでおく
+	bindLabel(as, notTaken1);
+	if (cc == CC_E) bindLabel(as, notTaken2);
+	emitMoveImm(as, RAX, FALSE_VAL);
+	emitPush(as, RAX);
+	emitJumpToBytecode(as, -1, target);
+
+	bindLabel(as, done);
+	bindLabel(as, taken);
+}
+
+// 数値の for ループ。rcx に上限を読んでおくこと
+// ループ変数と上限が数値で、更新した値が上限より小さければ、ループ変数を書き換えて target に飛ぶ
+void emitForLoop(Assembler* as, const uint8_t* operands, int target)
+{
+	emitLoad(as, RAX, REG_SLOTS, operands[0] * sizeof(Value));
+	emitMoveImm(as, RDX, QNAN);
+	int notNumber1 = emitJumpIfNotNumber(as, RAX);
+	int notNumber2 = emitJumpIfNotNumber(as, RCX);
+	emitMoveToXmm(as, 0, RAX);
+	emitMoveToXmm(as, 2, RCX);
+	emitLoad(as, RAX, REG_CONSTANTS, operands[1] * sizeof(Value));
+	emitMoveToXmm(as, 1, RAX);
+	emitSse(as, SSE_ADD);
+	emitUcomisd(as, 2, 0); // limit > next
+	int done = emitJccForward(as, CC_BE);
+	emitMoveFromXmm(as, RAX, 0);
+	emitStore(as, REG_SLOTS, operands[0] * sizeof(Value), RAX);
+	emitJumpToBytecode(as, -1, target);
+
+	bindLabel(as, notNumber1);
+	bindLabel(as, notNumber2);
+	bindLabel(as, done);
+}
+
+// 値が falsey (nil か false) なら target に飛ぶ
+void emitJumpIfFalsey(Assembler* as, Reg value, int target)
+{
+	emitMoveImm(as, RCX, NIL_VAL);
+	emitAlu(as, ALU_CMP, value, RCX);
+	emitJumpToBytecode(as, CC_E, target);
+	emitMoveImm(as, RCX, FALSE_VAL);
+	emitAlu(as, ALU_CMP, value, RCX);
+	emitJumpToBytecode(as, CC_E, target);
+}
+
+void emitLoadGlobals(Assembler* as, Reg dst)
+{
+	// 配列はグローバル変数の追加で再確保されるので、毎回読み直す
+	emitMoveImm(as, dst, reinterpret_cast<uint64_t>(&getVM()->globalValues.values));
+	emitLoad(as, dst, dst, 0);
+}
+
+void emitLoadUpvalueLocation(Assembler* as, int slot)
+{
+	emitLoad(as, RAX, REG_FRAME, offsetof(CallFrame, closure));
+	emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+	emitLoad(as, RAX, RAX, slot * sizeof(ObjUpvalue*));
+	emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+int readShort(const uint8_t* operands)
+{
+	return (operands[0] << 8) | operands[1];
+}
+
+int readLong(const uint8_t* operands)
+{
+	return (operands[0] << 16) | (operands[1] << 8) | operands[2];
+}
+
+// switch 文の表。飛び先はインタプリタと同じ関数で引いて、表にある飛び先と順に比べて分岐する
+void emitSwitch(Assembler* as, const Chunk* chunk, int offset)
+{
+	const uint8_t* ip = chunk->code + offset;
+	emitMoveImm(as, RDI, reinterpret_cast<uint64_t>(ip));
+	emitMove(as, RSI, REG_CONSTANTS);
+	emitLoad(as, RDX, REG_STACK_TOP, -8);
+	emitAddImm(as, REG_STACK_TOP, -8);
+	emitMoveImm(as, RAX, reinterpret_cast<uint64_t>(getSwitchJump));
+	emit8(as, 0xFF); // call rax
+	emit8(as, 0xD0);
+
+	// 飛び先は命令の先頭からの距離で返ってくる。default (0 番目) には最後に無条件で飛ぶ
+	int length = getInstructionLength(chunk, offset);
+	auto distance = [&](int i) { return length + readShort(ip + getSwitchOperand(ip, i)); };
+	for (int i = 1; i < getSwitchOperandCount(ip); i++)
+	{
+		if (getSwitchOperand(ip, i) < 0) continue;
+
+		// 同じ飛び先は一度だけ比べる
+		bool isDuplicate = distance(i) == distance(0);
+		for (int j = 1; j < i && !isDuplicate; j++)
+		{
+			isDuplicate = getSwitchOperand(ip, j) >= 0 && distance(j) == distance(i);
+		}
+		if (isDuplicate) continue;
+
+		emit8(as, 0x3D); // cmp eax, imm32
+		emit32(as, static_cast<uint32_t>(distance(i)));
+		emitJumpToBytecode(as, CC_E, offset + distance(i));
+	}
+	emitJumpToBytecode(as, -1, offset + distance(0));
+}
+
+// 1 命令分の機械語を書き出す。対応していない命令なら false を返す
+bool emitInstruction(Assembler* as, Chunk* chunk, int offset)
+{
+	uint8_t* ip = chunk->code + offset;
+	uint8_t* operands = ip + 1;
+	int end = offset + getInstructionLength(chunk, offset);
+
+	switch (*ip)
+	{
+	case OP_CONSTANT:
+		emitLoad(as, RAX, REG_CONSTANTS, operands[0] * sizeof(Value));
+		emitPush(as, RAX);
+		return true;
+	case OP_CONSTANT_LONG:
+		emitLoad(as, RAX, REG_CONSTANTS, readLong(operands) * sizeof(Value));
+		emitPush(as, RAX);
+		return true;
+	case OP_NIL:
+		emitMoveImm(as, RAX, NIL_VAL);
+		emitPush(as, RAX);
+		return true;
+	case OP_TRUE:
+		emitMoveImm(as, RAX, TRUE_VAL);
+		emitPush(as, RAX);
+		return true;
+	case OP_FALSE:
+		emitMoveImm(as, RAX, FALSE_VAL);
+		emitPush(as, RAX);
+		return true;
+	case OP_POP:
+		emitAddImm(as, REG_STACK_TOP, -8);
+		return true;
+
+	case OP_GET_LOCAL:
+	case OP_GET_LOCAL_0:
+	case OP_GET_LOCAL_1:
+	case OP_GET_LOCAL_2:
+	case OP_GET_LOCAL_3:
+	{
+		int slot = *ip == OP_GET_LOCAL ? operands[0] : *ip - OP_GET_LOCAL_0;
+		emitLoad(as, RAX, REG_SLOTS, slot * sizeof(Value));
+		emitPush(as, RAX);
+		return true;
+	}
+	case OP_SET_LOCAL:
+		emitLoad(as, RAX, REG_STACK_TOP, -8);
+		emitStore(as, REG_SLOTS, operands[0] * sizeof(Value), RAX);
+		return true;
+
+	case OP_GET_GLOBAL:
+	{
+		emitLoadGlobals(as, RAX);
+		emitLoad(as, RAX, RAX, readShort(operands) * sizeof(Value));
+		emitMoveImm(as, RCX, UNDEFINED_VAL);
+		emitAlu(as, ALU_CMP, RAX, RCX);
+		int slow = emitJccForward(as, CC_E);
+		emitPush(as, RAX);
+		int done = emitJmpForward(as);
+		bindLabel(as, slow);
+		emitCallRuntime(as, jitGetGlobal, operands);
+		bindLabel(as, done);
+		return true;
+	}
+	case OP_DEFINE_GLOBAL:
+		emitLoadGlobals(as, RAX);
+		emitLoad(as, RCX, REG_STACK_TOP, -8);
+		emitStore(as, RAX, readShort(operands) * sizeof(Value), RCX);
+		emitAddImm(as, REG_STACK_TOP, -8);
+		return true;
+	case OP_SET_GLOBAL:
+	{
+		int disp = readShort(operands) * sizeof(Value);
+		emitLoadGlobals(as, RAX);
+		emitLoad(as, RCX, RAX, disp);
+		emitMoveImm(as, RDX, UNDEFINED_VAL);
+		emitAlu(as, ALU_CMP, RCX, RDX);
+		int slow = emitJccForward(as, CC_E);
+		emitLoad(as, RCX, REG_STACK_TOP, -8);
+		emitStore(as, RAX, disp, RCX);
+		int done = emitJmpForward(as);
+		bindLabel(as, slow);
+		emitCallRuntime(as, jitSetGlobal, operands);
+		bindLabel(as, done);
+		return true;
+	}
+
+	case OP_GET_UPVALUE:
+		emitLoadUpvalueLocation(as, operands[0]);
+		emitLoad(as, RAX, RAX, 0);
+		emitPush(as, RAX);
+		return true;
+	case OP_SET_UPVALUE:
+	{
+		// 書き込む値か書き換える前の値がオブジェクトなら、書き込みバリアを通すのでランタイム関数で行う
+		emitLoad(as, RCX, REG_STACK_TOP, -8);
+		emitMoveImm(as, RDX, QNAN | SIGN_BIT);
+		emitMove(as, RSI, RCX);
+		emitAlu(as, ALU_AND, RSI, RDX);
+		emitAlu(as, ALU_CMP, RSI, RDX);
+		int object = emitJccForward(as, CC_E);
+		emitLoadUpvalueLocation(as, operands[0]);
+		emitLoad(as, RSI, RAX, 0);
+		emitAlu(as, ALU_AND, RSI, RDX);
+		emitAlu(as, ALU_CMP, RSI, RDX);
+		int oldObject = emitJccForward(as, CC_E);
+		emitStore(as, RAX, 0, RCX);
+		int done = emitJmpForward(as);
+
+		bindLabel(as, object);
+		bindLabel(as, oldObject);
+		emitCallRuntime(as, jitSetUpvalue, operands);
+		bindLabel(as, done);
+		return true;
+	}
+
+	case OP_GET_PROPERTY:
+	case OP_GET_THIS_PROPERTY:
+	{
+		// フィールドの読み出しはインラインキャッシュが当たれば機械語で済ませる
+		// メソッドの場合はバインドメソッドを割り当てるのでランタイム関数で行う
+		InlineCache* cache = &chunk->caches[readShort(operands + 1)];
+		int slow[GET_FIELD_SLOW_PATHS];
+		if (*ip == OP_GET_PROPERTY)
+		{
+			emitLoad(as, RAX, REG_STACK_TOP, -8);
+			emitGetFieldFast(as, cache, slow);
+			emitStore(as, REG_STACK_TOP, -8, RAX);
+		}
+		else
+		{
+			emitLoad(as, RAX, REG_SLOTS, 0);
+			emitGetFieldFast(as, cache, slow);
+			emitPush(as, RAX);
+		}
+		int done = emitJmpForward(as);
+
+		for (int label : slow) bindLabel(as, label);
+		if (*ip == OP_GET_THIS_PROPERTY)
+		{
+			emitLoad(as, RAX, REG_SLOTS, 0);
+			emitPush(as, RAX);
+		}
+		emitCallRuntime(as, jitGetProperty, operands);
+		bindLabel(as, done);
+		return true;
+	}
+	case OP_SET_PROPERTY:
+		emitCallRuntime(as, jitSetProperty, operands);
+		return true;
+	case OP_GET_SUPER:
+		emitCallRuntime(as, jitGetSuper, operands);
+		return true;
+
+	case OP_EQUAL:
+	case OP_EQUAL_NUM:
+	case OP_GREATER:
+	case OP_GREATER_NUM:
+	case OP_LESS:
+	case OP_LESS_NUM:
+		emitComparison(as, *ip, operands);
+		return true;
+
+	case OP_ADD:
+	case OP_ADD_NUM:
+		emitArithmetic(as, SSE_ADD, operands);
+		return true;
+	case OP_ADD_STR:
+		emitCallRuntime(as, jitBinaryOp, operands);
+		return true;
+	case OP_SUBTRACT:
+	case OP_SUBTRACT_NUM:
+		emitArithmetic(as, SSE_SUB, operands);
+		return true;
+	case OP_MULTIPLY:
+	case OP_MULTIPLY_NUM:
+		emitArithmetic(as, SSE_MUL, operands);
+		return true;
+	case OP_DIVIDE:
+	case OP_DIVIDE_NUM:
+		emitArithmetic(as, SSE_DIV, operands);
+		return true;
+
+	case OP_ADD_UNCHECKED:
+		emitUncheckedArithmetic(as, SSE_ADD);
+		return true;
+	case OP_SUBTRACT_UNCHECKED:
+		emitUncheckedArithmetic(as, SSE_SUB);
+		return true;
+	case OP_MULTIPLY_UNCHECKED:
+		emitUncheckedArithmetic(as, SSE_MUL);
+		return true;
+	case OP_DIVIDE_UNCHECKED:
+		emitUncheckedArithmetic(as, SSE_DIV);
+		return true;
+	case OP_GREATER_UNCHECKED:
+	case OP_LESS_UNCHECKED:
+		emitLoad(as, RAX, REG_STACK_TOP, -16);
+		emitLoad(as, RCX, REG_STACK_TOP, -8);
+		emitMoveToXmm(as, 0, RAX);
+		emitMoveToXmm(as, 1, RCX);
+		emitStoreComparison(as, *ip);
+		return true;
+
+	case OP_ADD_LOCAL_CONST:
+	case OP_ADD_LOCAL_CONST_NUM:
+	{
+		emitLoad(as, RAX, REG_SLOTS, operands[0] * sizeof(Value));
+		emitLoad(as, RCX, REG_CONSTANTS, operands[1] * sizeof(Value));
+		emitMoveImm(as, RDX, QNAN);
+		int slow1 = emitJumpIfNotNumber(as, RAX);
+		int slow2 = emitJumpIfNotNumber(as, RCX);
+		emitMoveToXmm(as, 0, RAX);
+		emitMoveToXmm(as, 1, RCX);
+		emitSse(as, SSE_ADD);
+		emitMoveFromXmm(as, RAX, 0);
+		emitPush(as, RAX);
+		int done = emitJmpForward(as);
+		bindLabel(as, slow1);
+		bindLabel(as, slow2);
+		emitCallRuntime(as, jitBinaryOp, operands);
+		bindLabel(as, done);
+		return true;
+	}
+
+	case OP_NOT:
+		emitLoad(as, RDX, REG_STACK_TOP, -8);
+		emitMoveImm(as, RCX, NIL_VAL);
+		emitAlu(as, ALU_CMP, RDX, RCX);
+		emitSetcc(as, CC_E, RAX);
+		emitMoveImm(as, RCX, FALSE_VAL);
+		emitAlu(as, ALU_CMP, RDX, RCX);
+		emitSetcc(as, CC_E, RCX);
+		emit8(as, 0x08); // or al, cl
+		emit8(as, 0xC8);
+		emitBoolFromAl(as);
+		emitStore(as, REG_STACK_TOP, -8, RAX);
+		return true;
+
+	case OP_NEGATE:
+	{
+		emitLoad(as, RAX, REG_STACK_TOP, -8);
+		emitMoveImm(as, RDX, QNAN);
+		int slow = emitJumpIfNotNumber(as, RAX);
+		emitMoveImm(as, RCX, SIGN_BIT);
+		emitAlu(as, ALU_XOR, RAX, RCX);
+		emitStore(as, REG_STACK_TOP, -8, RAX);
+		int done = emitJmpForward(as);
+		bindLabel(as, slow);
+		emitCallRuntime(as, jitNegate, operands);
+		bindLabel(as, done);
+		return true;
+	}
+	case OP_NEGATE_UNCHECKED:
+		emitLoad(as, RAX, REG_STACK_TOP, -8);
+		emitMoveImm(as, RCX, SIGN_BIT);
+		emitAlu(as, ALU_XOR, RAX, RCX);
+		emitStore(as, REG_STACK_TOP, -8, RAX);
+		return true;
+
+	case OP_PRINT:
+		emitCallRuntime(as, jitPrint, operands);
+		return true;
+
+	case OP_JUMP:
+		emitJumpToBytecode(as, -1, end + readShort(operands));
+		return true;
+	case OP_JUMP_IF_FALSE:
+		emitLoad(as, RAX, REG_STACK_TOP, -8);
+		emitJumpIfFalsey(as, RAX, end + readShort(operands));
+		return true;
+	case OP_LOOP:
+		emitJumpToBytecode(as, -1, end - readShort(operands));
+		return true;
+	case OP_JUMP_LONG:
+		emitJumpToBytecode(as, -1, end + readLong(operands));
+		return true;
+	case OP_JUMP_IF_FALSE_LONG:
+		emitLoad(as, RAX, REG_STACK_TOP, -8);
+		emitJumpIfFalsey(as, RAX, end + readLong(operands));
+		return true;
+	case OP_LOOP_LONG:
+		emitJumpToBytecode(as, -1, end - readLong(operands));
+		return true;
+	case OP_FOR_LOOP:
+		emitLoad(as, RCX, REG_SLOTS, operands[2] * sizeof(Value));
+		emitForLoop(as, operands, end - readShort(operands + 3));
+		return true;
+	case OP_FOR_LOOP_CONSTANT:
+		emitLoad(as, RCX, REG_CONSTANTS, operands[2] * sizeof(Value));
+		emitForLoop(as, operands, end - readShort(operands + 3));
+		return true;
+	case OP_FOR_LOOP_GLOBAL:
+		emitLoadGlobals(as, RCX);
+		emitLoad(as, RCX, RCX, readShort(operands + 2) * sizeof(Value));
+		emitForLoop(as, operands, end - readShort(operands + 4));
+		return true;
+	case OP_JUMP_TABLE:
+	case OP_JUMP_STRING:
+		emitSwitch(as, chunk, offset);
+		return true;
+
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_NOT_EQUAL:
+	case OP_JUMP_IF_NOT_LESS_NUM:
+	case OP_JUMP_IF_NOT_GREATER_NUM:
+	case OP_JUMP_IF_NOT_EQUAL_NUM:
+		emitCompareAndJump(as, *ip, operands, end + readShort(operands));
+		return true;
+
+	case OP_CLOSURE:
+		emitCallRuntime(as, jitClosure, operands);
+		return true;
+	case OP_CLOSE_UPVALUE:
+		emitCallRuntime(as, jitCloseUpvalue, operands);
+		return true;
+	case OP_CLASS:
+		emitCallRuntime(as, jitClass, operands);
+		return true;
+	case OP_INHERIT:
+		emitCallRuntime(as, jitInherit, operands);
+		return true;
+	case OP_METHOD:
+		emitCallRuntime(as, jitMethod, operands);
+		return true;
+
+	case OP_CALL:
+		emitCallInstruction(as, jitCall, chunk->code + end);
+		return true;
+	case OP_INVOKE:
+		emitCallInstruction(as, jitInvoke, chunk->code + end);
+		return true;
+	case OP_SUPER_INVOKE:
+		emitCallInstruction(as, jitSuperInvoke, chunk->code + end);
+		return true;
+	case OP_TAIL_CALL:
+		emitTailCallInstruction(as, jitTailCall, chunk->code + end);
+		return true;
+	case OP_TAIL_INVOKE:
+		emitTailCallInstruction(as, jitTailInvoke, chunk->code + end);
+		return true;
+	case OP_RETURN:
+		emitReturn(as, ip);
+		return true;
+
+	// スレッドの中断はインタプリタで行う。再開時はインタプリタからまた機械語に入る
+	case OP_YIELD:
+		emitExit(as, ip);
+		return true;
+
+	// OP_WIDE を前置した命令は大きな関数にしか現れないので、インタプリタで実行する
+	case OP_WIDE:
+		emitExit(as, ip);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+void freeAssembler(Assembler* as)
+{
+	free_array(as->code, as->capacity);
+	free_array(as->patches, as->patchCapacity);
+}
+
+}
+
+bool jitCompile(ObjFunction* function)
+{
+	if (!jitEnabled || function->jitCode != nullptr) return false;
+
+	Chunk* chunk = &function->chunk;
+	int* entries = allocate<int>(chunk->count + 1);
+	for (int i = 0; i <= chunk->count; i++)
+	{
+		entries[i] = -1;
+	}
+
+	Assembler as;
+	emitPrologue(&as);
+
+	bool succeeded = true;
+	for (int offset = 0; offset < chunk->count; offset += getInstructionLength(chunk, offset))
+	{
+		entries[offset] = as.count;
+		if (!emitInstruction(&as, chunk, offset))
+		{
+			succeeded = false;
+			break;
+		}
+	}
+
+	for (int i = 0; succeeded && i < as.patchCount; i++)
+	{
+		const JumpPatch& patch = as.patches[i];
+		int target = entries[patch.target];
+		if (target < 0)
+		{
+			succeeded = false;
+			break;
+		}
+		patch32(&as, patch.position, target - (patch.position + 4));
+	}
+
+	// 書き込み可能な領域に書いてから実行可能に切り替える
+	size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t size = (static_cast<size_t>(as.count) + pageSize - 1) / pageSize * pageSize;
+	void* memory = MAP_FAILED;
+	if (succeeded)
+	{
+		memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (memory != MAP_FAILED)
+	{
+		memcpy(memory, as.code, as.count);
+		if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+		{
+			munmap(memory, size);
+			memory = MAP_FAILED;
+		}
+	}
+
+#if DEBUG_LOG_JIT
+	printf("-- jit %s: %s (%d bytes -> %d bytes)\n",
+		memory != MAP_FAILED ? "compiled" : "failed",
+		function->name != nullptr ? function->name->chars : "<script>",
+		chunk->count, as.count);
+#endif
+
+	freeAssembler(&as);
+	if (memory == MAP_FAILED)
+	{
+		free_array(entries, chunk->count + 1);
+		return false;
+	}
+
+	JitCode* code = allocate<JitCode>(1);
+	*code = JitCode();
+	code->code = static_cast<uint8_t*>(memory);
+	code->size = size;
+	code->start = code->code + entries[0];
+	code->entries = entries;
+	code->entryCount = chunk->count + 1;
+	function->jitCode = code;
+	return true;
+}
+
+#else
+
+bool jitCompile(ObjFunction* function)
+{
+	return false;
+}
+
+#endif
+
+void freeJitCode(JitCode* code)
+{
+	if (code == nullptr) return;
+
+#if JIT_SUPPORTED
+	if (code->code != nullptr)
+	{
+		munmap(code->code, code->size);
+		free_array(code->entries, code->entryCount);
+	}
+#endif
+	free(code);
+}
+
+void jitAttachAot(ObjFunction* function, AotFunction body)
+{
+	freeJitCode(function->jitCode);
+
+	JitCode* code = allocate<JitCode>(1);
+	*code = JitCode();
+	code->aot = body;
+	function->jitCode = code;
+}
+
+bool runJit(Thread* thread)
+{
+	CallFrame* frame = &thread->frames[thread->frameCount - 1];
+	ObjFunction* function = frame->closure->function;
+	JitCode* code = function->jitCode;
+	if (code->aot != nullptr) return enterAot(thread, false) != JitResult::Error;
+
+#if JIT_SUPPORTED
+	int entry = code->entries[frame->ip - function->chunk.code];
+	if (entry < 0) return true;
+
+	auto enter = reinterpret_cast<JitEntry>(code->code);
+	return enter(thread, frame, function->chunk.constants.values, code->code + entry, false) != JitResult::Error;
+#else
+	return true;
+#endif
+}
+
+JitResult jitEnterCallee(Thread* thread)
+{
+	CallFrame* frame = &thread->frames[thread->frameCount - 1];
+	ObjFunction* function = frame->closure->function;
+	JitCode* code = function->jitCode;
+	if (code == nullptr) return JitResult::Exit;
+	if (code->aot != nullptr) return enterAot(thread, true);
+
+#if JIT_SUPPORTED
+	auto enter = reinterpret_cast<JitEntry>(code->code);
+	return enter(thread, frame, function->chunk.constants.values, code->start, true);
+#else
+	return JitResult::Exit;
+#endif
+}
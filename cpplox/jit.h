@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#include "common.h"
+
+struct ObjFunction;
+struct Thread;
+struct JitCode;
+
+// 呼び出し回数とループの後方ジャンプ回数の合計がこの値に達した関数を JIT コンパイルする
+constexpr int JIT_HOT_THRESHOLD = 1000;
+
+void setJitEnabled(bool enabled);
+bool isJitEnabled();
+
+// function を機械語に変換して function->jitCode に設定する
+// 変換できない命令を含む場合や実行可能メモリを確保できない場合は false を返し、インタプリタで実行を続ける
+bool jitCompile(ObjFunction* function);
+void freeJitCode(JitCode* code);
+
+// 機械語の実行結果
+enum class JitResult
+{
+	Error, // 実行時エラーを報告した
+	Exit, // frame->ip の位置からインタプリタで続きを実行する
+	Continue, // 呼び出し先が return したので、呼び出し元の機械語を続ける
+	TailCall, // 末尾呼び出しでフレームが JIT コンパイル済みの関数に置き換わった
+};
+
+// スレッドの実行中のフレームを、frame->ip の位置から機械語で実行する
+// yield や JIT コンパイルされていない関数の呼び出しに着いたら、frame->ip をその位置に合わせて戻るので、
+// インタプリタで続きを実行する。実行時エラーが起きた場合は false を返す
+bool runJit(Thread* thread);
+
+// 機械語から呼び出した関数のフレームを機械語で実行する
+// 呼び出し先が JIT コンパイルされていなければ Exit を返す
+JitResult jitEnterCallee(Thread* thread);
+
+// AOT コンパイルした関数 (aot.h)。実行中のフレームを frame->ip の位置から実行する
+// 戻り値と nested の意味は機械語の入口と同じ
+using AotFunction = JitResult (*)(Thread* thread, bool nested);
+
+// AOT コンパイルした関数を function->jitCode に設定する
+// 以降は JIT コンパイル済みの関数と同じ入口から実行される
+void jitAttachAot(ObjFunction* function, AotFunction body);
+
+// JIT コードと AOT コンパイルしたコードから呼び出すランタイム関数 (vm.cpp で定義する)
+// 呼び出し前に frame->ip がオペランドの先頭を、thread->stackTop が現在のスタックトップを指すように書き戻してある
+// 呼び出し命令の場合のみ、frame->ip は戻り先になる命令の末尾を指す
+// 実行時エラーを報告した場合は false (JitResult::Error) を返す
+JitResult jitCall(Thread* thread);
+JitResult jitTailCall(Thread* thread);
+JitResult jitInvoke(Thread* thread);
+JitResult jitTailInvoke(Thread* thread);
+JitResult jitSuperInvoke(Thread* thread);
+bool jitReturn(Thread* thread);
+bool jitGetGlobal(Thread* thread);
+bool jitSetGlobal(Thread* thread);
+bool jitSetUpvalue(Thread* thread);
+bool jitGetProperty(Thread* thread);
+bool jitSetProperty(Thread* thread);
+bool jitGetSuper(Thread* thread);
+bool jitBinaryOp(Thread* thread);
+bool jitNegate(Thread* thread);
+bool jitPrint(Thread* thread);
+bool jitClosure(Thread* thread);
+bool jitCloseUpvalue(Thread* thread);
+bool jitClass(Thread* thread);
+bool jitInherit(Thread* thread);
+bool jitMethod(Thread* thread);
@@ -0,0 +1,692 @@
+﻿#include "loxc.h"
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// ファイルの形式を変えたら上げる
+constexpr uint32_t LOXC_VERSION = 3;
+constexpr char LOXC_MAGIC[4] = { 'L', 'O', 'X', 'C' };
+
+enum class ConstantTag : uint8_t
+{
+	Number,
+	String,
+	Function,
+};
+
+uint64_t hashBytes(const uint8_t* bytes, size_t size)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t hashSource(const char* source)
+{
+	return hashBytes(reinterpret_cast<const uint8_t*>(source), strlen(source));
+}
+
+// 書き出すバイト列。最後にまとめてファイルに書く
+struct Writer
+{
+	uint8_t* bytes = nullptr;
+	int count = 0;
+	int capacity = 0;
+};
+
+void writeBytes(Writer* writer, const void* data, int size)
+{
+	if (writer->capacity < writer->count + size)
+	{
+		auto oldCapacity = writer->capacity;
+		auto newCapacity = grow_capacity(oldCapacity);
+		while (newCapacity < writer->count + size) newCapacity = grow_capacity(newCapacity);
+		writer->bytes = grow_array(writer->bytes, oldCapacity, newCapacity);
+		writer->capacity = newCapacity;
+	}
+	memcpy(writer->bytes + writer->count, data, size);
+	writer->count += size;
+}
+
+template<typename T>
+void write(Writer* writer, T value)
+{
+	writeBytes(writer, &value, sizeof(T));
+}
+
+void writeString(Writer* writer, const ObjString* string)
+{
+	write<uint32_t>(writer, string->length);
+	writeBytes(writer, string->chars, string->length);
+}
+
+// 入れ子の関数を先に書き出して、定数からは何番目に書いた関数かで参照する
+// 書き出した関数の番号を返す
+uint32_t writeFunction(Writer* writer, ObjFunction* function, uint32_t* functionCount)
+{
+	const Chunk* chunk = &function->chunk;
+	const ValueArray& constants = chunk->constants;
+
+	uint32_t* children = allocate<uint32_t>(constants.count);
+	for (int i = 0; i < constants.count; i++)
+	{
+		if (IS_FUNCTION(constants.values[i]))
+		{
+			children[i] = writeFunction(writer, AS_FUNCTION(constants.values[i]), functionCount);
+		}
+	}
+
+	write<int32_t>(writer, function->arity);
+	write<int32_t>(writer, function->upvalueCount);
+	write<int32_t>(writer, function->slotCount);
+	write<uint8_t>(writer, function->name != nullptr);
+	if (function->name != nullptr) writeString(writer, function->name);
+
+	write<uint32_t>(writer, chunk->count);
+	writeBytes(writer, chunk->code, chunk->count);
+	write<uint32_t>(writer, chunk->lineCount);
+	writeBytes(writer, chunk->lines, chunk->lineCount * static_cast<int>(sizeof(LineStart)));
+
+	write<uint32_t>(writer, constants.count);
+	for (int i = 0; i < constants.count; i++)
+	{
+		Value value = constants.values[i];
+		if (IS_NUMBER(value))
+		{
+			write(writer, ConstantTag::Number);
+			write<double>(writer, AS_NUMBER(value));
+		}
+		else if (IS_STRING(value))
+		{
+			write(writer, ConstantTag::String);
+			writeString(writer, AS_STRING(value));
+		}
+		else
+		{
+			write(writer, ConstantTag::Function);
+			write<uint32_t>(writer, children[i]);
+		}
+	}
+
+	write<uint32_t>(writer, chunk->cacheCount);
+
+	free_array(children, constants.count);
+	return (*functionCount)++;
+}
+
+// mmap したファイルを先頭から読む。範囲外を読もうとしたら failed を立てて 0 を返す
+struct Reader
+{
+	const uint8_t* current = nullptr;
+	const uint8_t* end = nullptr;
+	bool failed = false;
+};
+
+const uint8_t* readBytes(Reader* reader, size_t size)
+{
+	if (reader->failed || static_cast<size_t>(reader->end - reader->current) < size)
+	{
+		reader->failed = true;
+		return nullptr;
+	}
+	const uint8_t* bytes = reader->current;
+	reader->current += size;
+	return bytes;
+}
+
+template<typename T>
+T read(Reader* reader)
+{
+	T value{};
+	const uint8_t* bytes = readBytes(reader, sizeof(T));
+	if (bytes != nullptr) memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+ObjString* readString(Reader* reader)
+{
+	uint32_t length = read<uint32_t>(reader);
+	const uint8_t* chars = readBytes(reader, length);
+	if (chars == nullptr) return nullptr;
+	return copyString(reinterpret_cast<const char*>(chars), static_cast<int>(length));
+}
+
+uint16_t readShort(const uint8_t* operand)
+{
+	return static_cast<uint16_t>((operand[0] << 8) | operand[1]);
+}
+
+int readLong(const uint8_t* operand)
+{
+	return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+// 読み込んだ関数の命令列を検査する
+// VM は命令のオペランドを信用して配列を引くので、範囲外の番号を含むキャッシュは実行せずにソースからコンパイルし直す
+// 命令の長さ、定数 (と必要ならその型)、グローバル変数、上位値、インラインキャッシュの番号と、
+// ジャンプ先が命令の先頭かどうかを調べる
+// ローカル変数の番号は、中間表現での最適化が式の途中の値のスロットも指すので slotCount では抑えられない
+// 代わりに slotCount を命令が使うスロットまで広げて、呼び出し時のスタックの溢れの検査で範囲内に収める
+bool verifyFunction(ObjFunction* function)
+{
+	if (function->arity < 0 || function->arity > UINT8_MAX) return false;
+	if (function->upvalueCount < 0 || function->upvalueCount > UPVALUE_COUNT) return false;
+	if (function->slotCount < 0 || function->slotCount > LOCAL_VARIABLE_COUNT) return false;
+	if (function->arity > 0 && function->slotCount <= function->arity) return false;
+
+	const Chunk* chunk = &function->chunk;
+	const uint8_t* code = chunk->code;
+	const int count = chunk->count;
+	const ValueArray& constants = chunk->constants;
+	const int globalCount = getVM()->globalNames.count;
+
+	auto isConstant = [&](int index) { return index < constants.count; };
+	auto isNumber = [&](int index) { return index < constants.count && IS_NUMBER(constants.values[index]); };
+	auto isString = [&](int index) { return index < constants.count && IS_STRING(constants.values[index]); };
+	auto isFunction = [&](int index) { return index < constants.count && IS_FUNCTION(constants.values[index]); };
+	auto isUpvalue = [&](int index) { return index < function->upvalueCount; };
+	auto isGlobal = [&](int index) { return index < globalCount; };
+	auto isCache = [&](int index) { return index < chunk->cacheCount; };
+	int slotCount = function->slotCount;
+	auto useSlot = [&](int slot) {
+		if (slotCount < slot + 1) slotCount = slot + 1;
+		return true;
+	};
+
+	// ジャンプ先が命令の先頭かどうかは、すべての命令の先頭が分かってから調べる
+	bool* isStart = allocate<bool>(count);
+	bool* isTarget = allocate<bool>(count);
+	memset(isStart, 0, count);
+	memset(isTarget, 0, count);
+	auto jumpTo = [&](int target) {
+		if (target < 0 || target >= count) return false;
+		isTarget[target] = true;
+		return true;
+	};
+
+	// OP_CLOSURE の上位値のペア。ローカル変数でなければ index はこの関数の上位値
+	auto isCapture = [&](const uint8_t* pairs, int upvalueCount, bool isWide) {
+		int pairSize = isWide ? 3 : 2;
+		for (int i = 0; i < upvalueCount; i++)
+		{
+			const uint8_t* pair = pairs + i * pairSize;
+			int index = isWide ? readShort(pair + 1) : pair[1];
+			if (pair[0] ? !useSlot(index) : !isUpvalue(index)) return false;
+		}
+		return true;
+	};
+
+	bool isValid = true;
+	int offset = 0;
+	uint8_t lastOp = OP_RETURN;
+	while (isValid && offset < count)
+	{
+		const uint8_t* ip = code + offset;
+		const int remaining = count - offset;
+		const uint8_t op = ip[0];
+		isStart[offset] = true;
+		lastOp = op;
+		if (op >= OP_COUNT)
+		{
+			isValid = false;
+			break;
+		}
+
+		// 長さがオペランドで決まる命令は、長さを求める前にそのオペランドまで読めるか調べる
+		switch (op)
+		{
+		case OP_JUMP_TABLE: isValid = remaining >= 5; break;
+		case OP_JUMP_STRING: isValid = remaining >= 4; break;
+		case OP_CLOSURE: isValid = remaining >= 2 && isFunction(ip[1]); break;
+		case OP_WIDE: isValid = remaining >= 4 && (ip[1] != OP_CLOSURE || isFunction(readShort(ip + 2))); break;
+		default: break;
+		}
+		if (!isValid) break;
+
+		const int length = getInstructionLength(chunk, offset);
+		if (length > remaining)
+		{
+			isValid = false;
+			break;
+		}
+
+		switch (op)
+		{
+		case OP_CONSTANT: isValid = isConstant(ip[1]); break;
+		case OP_CONSTANT_LONG: isValid = isConstant(readLong(ip + 1)); break;
+		case OP_LOAD_CONSTANT: isValid = useSlot(ip[1]) && isConstant(ip[2]); break;
+		case OP_MOVE: isValid = useSlot(ip[1]) && useSlot(ip[2]); break;
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+			isValid = useSlot(ip[1]);
+			break;
+		case OP_GET_LOCAL_0:
+		case OP_GET_LOCAL_1:
+		case OP_GET_LOCAL_2:
+		case OP_GET_LOCAL_3:
+			isValid = useSlot(op - OP_GET_LOCAL_0);
+			break;
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+			isValid = isUpvalue(ip[1]);
+			break;
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+			isValid = isGlobal(readShort(ip + 1));
+			break;
+		case OP_GET_SUPER:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_SUPER_INVOKE:
+			isValid = isString(ip[1]);
+			break;
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_THIS_PROPERTY:
+			isValid = isString(ip[1]) && isCache(readShort(ip + 2));
+			break;
+		case OP_INVOKE:
+		case OP_TAIL_INVOKE:
+			isValid = isString(ip[1]) && isCache(readShort(ip + 3));
+			break;
+		case OP_ADD_LOCAL_CONST: isValid = useSlot(ip[1]) && isConstant(ip[2]); break;
+		case OP_ADD_LOCAL_CONST_NUM: isValid = useSlot(ip[1]) && isNumber(ip[2]); break;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_LESS_NUM:
+		case OP_JUMP_IF_NOT_GREATER_NUM:
+		case OP_JUMP_IF_NOT_EQUAL_NUM:
+			isValid = jumpTo(offset + length + readShort(ip + 1));
+			break;
+		case OP_LOOP: isValid = jumpTo(offset + length - readShort(ip + 1)); break;
+		case OP_JUMP_LONG:
+		case OP_JUMP_IF_FALSE_LONG:
+			isValid = jumpTo(offset + length + readLong(ip + 1));
+			break;
+		case OP_LOOP_LONG: isValid = jumpTo(offset + length - readLong(ip + 1)); break;
+		case OP_ADD_RR:
+		case OP_SUBTRACT_RR:
+		case OP_MULTIPLY_RR:
+		case OP_DIVIDE_RR:
+			isValid = useSlot(ip[1]) && useSlot(ip[2]) && useSlot(ip[3]);
+			break;
+		case OP_ADD_RK:
+		case OP_SUBTRACT_RK:
+		case OP_MULTIPLY_RK:
+		case OP_DIVIDE_RK:
+			isValid = useSlot(ip[1]) && useSlot(ip[2]) && isConstant(ip[3]);
+			break;
+		case OP_JUMP_IF_NOT_LESS_RK:
+		case OP_JUMP_IF_NOT_GREATER_RK:
+		case OP_JUMP_IF_NOT_EQUAL_RK:
+			isValid = useSlot(ip[1]) && isConstant(ip[2]) && jumpTo(offset + length + readShort(ip + 3));
+			break;
+		case OP_JUMP_IF_NOT_LESS_RR:
+		case OP_JUMP_IF_NOT_GREATER_RR:
+		case OP_JUMP_IF_NOT_EQUAL_RR:
+			isValid = useSlot(ip[1]) && useSlot(ip[2]) && jumpTo(offset + length + readShort(ip + 3));
+			break;
+		case OP_FOR_LOOP:
+			isValid = useSlot(ip[1]) && isNumber(ip[2]) && useSlot(ip[3]) && jumpTo(offset + length - readShort(ip + 4));
+			break;
+		case OP_FOR_LOOP_CONSTANT:
+			isValid = useSlot(ip[1]) && isNumber(ip[2]) && isConstant(ip[3]) && jumpTo(offset + length - readShort(ip + 4));
+			break;
+		case OP_FOR_LOOP_GLOBAL:
+			isValid = useSlot(ip[1]) && isNumber(ip[2]) && isGlobal(readShort(ip + 3)) && jumpTo(offset + length - readShort(ip + 5));
+			break;
+		case OP_JUMP_TABLE:
+			isValid = isNumber(ip[1]);
+			for (int i = 0; isValid && i < getSwitchOperandCount(ip); i++)
+			{
+				isValid = jumpTo(offset + length + readShort(ip + getSwitchOperand(ip, i)));
+			}
+			break;
+		case OP_JUMP_STRING:
+		{
+			// 文字列の表はハッシュで引くので、容量が 2 の冪で空きエントリがないと探索が終わらない
+			const int capacity = ip[1];
+			bool hasEmpty = false;
+			isValid = capacity > 0 && (capacity & (capacity - 1)) == 0 && jumpTo(offset + length + readShort(ip + 2));
+			for (int i = 0; isValid && i < capacity; i++)
+			{
+				const uint8_t* entry = ip + 4 + i * 3;
+				if (readShort(entry + 1) == SWITCH_EMPTY_ENTRY)
+				{
+					hasEmpty = true;
+					continue;
+				}
+				isValid = isString(entry[0]) && jumpTo(offset + length + readShort(entry + 1));
+			}
+			isValid = isValid && hasEmpty;
+			break;
+		}
+		case OP_CLOSURE:
+			isValid = isCapture(ip + 2, AS_FUNCTION(constants.values[ip[1]])->upvalueCount, false);
+			break;
+		case OP_WIDE:
+		{
+			// 前置した命令の最初のオペランドが 16bit になり、残りのオペランドは 1 バイト後ろにずれる
+			const int operand = readShort(ip + 2);
+			switch (ip[1])
+			{
+			case OP_GET_LOCAL:
+			case OP_SET_LOCAL:
+				isValid = useSlot(operand);
+				break;
+			case OP_GET_UPVALUE:
+			case OP_SET_UPVALUE:
+				isValid = isUpvalue(operand);
+				break;
+			case OP_GET_SUPER:
+			case OP_CLASS:
+			case OP_METHOD:
+			case OP_SUPER_INVOKE:
+				isValid = isString(operand);
+				break;
+			case OP_GET_PROPERTY:
+			case OP_SET_PROPERTY:
+				isValid = isString(operand) && isCache(readShort(ip + 4));
+				break;
+			case OP_INVOKE:
+			case OP_TAIL_INVOKE:
+				isValid = isString(operand) && isCache(readShort(ip + 5));
+				break;
+			case OP_CLOSURE:
+				isValid = isCapture(ip + 4, AS_FUNCTION(constants.values[operand])->upvalueCount, true);
+				break;
+			default:
+				isValid = false;
+				break;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+		offset += length;
+	}
+
+	// 最後の命令から命令列の外に実行が進まないこと (到達しない命令を消した関数は無条件のジャンプで終わることもある)
+	isValid = isValid && (lastOp == OP_RETURN || lastOp == OP_LOOP || lastOp == OP_LOOP_LONG ||
+		lastOp == OP_JUMP || lastOp == OP_JUMP_LONG || lastOp == OP_JUMP_TABLE || lastOp == OP_JUMP_STRING);
+	for (int i = 0; isValid && i < count; i++)
+	{
+		isValid = !isTarget[i] || isStart[i];
+	}
+
+	free_array(isTarget, count);
+	free_array(isStart, count);
+	function->slotCount = slotCount;
+	return isValid;
+}
+
+// 関数を 1 つ読み込んで loaded の定数の末尾に追加する
+// 読み込み済みの関数は loaded から GC に辿られるので、入れ子の関数も loaded の中の番号で参照する
+bool readFunction(Reader* reader, ObjFunction* loaded)
+{
+	uint32_t index = loaded->chunk.constants.count;
+	ObjFunction* function = newFunction();
+	appendConstant(&loaded->chunk, TO_OBJ(function));
+
+	function->arity = read<int32_t>(reader);
+	function->upvalueCount = read<int32_t>(reader);
+	function->slotCount = read<int32_t>(reader);
+	if (read<uint8_t>(reader) != 0)
+	{
+		function->name = readString(reader);
+	}
+
+	uint32_t count = read<uint32_t>(reader);
+	const uint8_t* code = readBytes(reader, count);
+	uint32_t lineCount = read<uint32_t>(reader);
+	const uint8_t* lines = readBytes(reader, static_cast<size_t>(lineCount) * sizeof(LineStart));
+	if (reader->failed || count == 0 || lineCount == 0) return false;
+
+	// 命令列と行番号の表はマップした領域からまとめてコピーする
+	Chunk* chunk = &function->chunk;
+	chunk->code = allocate<uint8_t>(count);
+	chunk->lines = allocate<LineStart>(lineCount);
+	chunk->count = count;
+	chunk->capacity = count;
+	chunk->lineCount = lineCount;
+	chunk->lineCapacity = lineCount;
+	memcpy(chunk->code, code, count);
+	memcpy(chunk->lines, lines, lineCount * sizeof(LineStart));
+
+	uint32_t constantCount = read<uint32_t>(reader);
+	for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+	{
+		switch (read<ConstantTag>(reader))
+		{
+		case ConstantTag::Number:
+			appendConstant(chunk, TO_NUMBER(read<double>(reader)));
+			break;
+		case ConstantTag::String:
+		{
+			ObjString* string = readString(reader);
+			if (string == nullptr) return false;
+			appendConstant(chunk, TO_OBJ(string));
+			break;
+		}
+		case ConstantTag::Function:
+		{
+			uint32_t child = read<uint32_t>(reader);
+			if (child >= index) return false;
+			appendConstant(chunk, loaded->chunk.constants.values[child]);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+
+	uint32_t cacheCount = read<uint32_t>(reader);
+	if (reader->failed || cacheCount > count) return false;
+	for (uint32_t i = 0; i < cacheCount; i++)
+	{
+		addInlineCache(chunk);
+	}
+	return verifyFunction(function);
+}
+
+ObjClosure* readCache(Reader* reader, uint64_t sourceHash)
+{
+	const uint8_t* magic = readBytes(reader, sizeof(LOXC_MAGIC));
+	if (magic == nullptr || memcmp(magic, LOXC_MAGIC, sizeof(LOXC_MAGIC)) != 0) return nullptr;
+	if (read<uint32_t>(reader) != LOXC_VERSION) return nullptr;
+	if (read<uint32_t>(reader) != OP_COUNT) return nullptr;
+	if (read<uint64_t>(reader) != sourceHash) return nullptr;
+
+	// ヘッダより後ろが書き出した時と同じか、チェックサムで確かめる
+	uint64_t checksum = read<uint64_t>(reader);
+	if (reader->failed || hashBytes(reader->current, static_cast<size_t>(reader->end - reader->current)) != checksum) return nullptr;
+
+	// 命令のオペランドに入っているグローバル変数の番号を、コンパイル時と同じ名前に割り当てる
+	uint32_t globalCount = read<uint32_t>(reader);
+	for (uint32_t i = 0; i < globalCount; i++)
+	{
+		ObjString* name = readString(reader);
+		if (name == nullptr || resolveGlobal(name) != static_cast<int>(i)) return nullptr;
+	}
+
+	uint32_t functionCount = read<uint32_t>(reader);
+	if (functionCount == 0) return nullptr;
+
+	Thread* thread = &getVM()->mainThread;
+	ObjFunction* loaded = newFunction();
+	push(thread, TO_OBJ(loaded)); // GC 回避
+
+	bool succeeded = true;
+	for (uint32_t i = 0; succeeded && i < functionCount; i++)
+	{
+		succeeded = readFunction(reader, loaded) && !reader->failed;
+	}
+
+	// 最後に書いた関数がスクリプト
+	ObjClosure* closure = nullptr;
+	if (succeeded && reader->current == reader->end)
+	{
+		closure = newClosure(AS_FUNCTION(loaded->chunk.constants.values[functionCount - 1]));
+	}
+	pop(thread);
+	return closure;
+}
+
+struct MappedFile
+{
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+
+bool mapFile(const char* path, MappedFile* mapped)
+{
+	mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mapped->file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(mapped->file, &size) && size.QuadPart > 0)
+	{
+		mapped->mapping = CreateFileMappingA(mapped->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	}
+	if (mapped->mapping != nullptr)
+	{
+		mapped->data = static_cast<const uint8_t*>(MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0));
+		mapped->size = static_cast<size_t>(size.QuadPart);
+	}
+	if (mapped->data == nullptr)
+	{
+		if (mapped->mapping != nullptr) CloseHandle(mapped->mapping);
+		CloseHandle(mapped->file);
+		return false;
+	}
+	return true;
+}
+
+void unmapFile(MappedFile* mapped)
+{
+	UnmapViewOfFile(mapped->data);
+	CloseHandle(mapped->mapping);
+	CloseHandle(mapped->file);
+}
+
+#else
+
+bool mapFile(const char* path, MappedFile* mapped)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat status;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &status) == 0 && status.st_size > 0)
+	{
+		data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) return false;
+
+	mapped->data = static_cast<const uint8_t*>(data);
+	mapped->size = static_cast<size_t>(status.st_size);
+	return true;
+}
+
+void unmapFile(MappedFile* mapped)
+{
+	munmap(const_cast<uint8_t*>(mapped->data), mapped->size);
+}
+
+#endif
+
+}
+
+bool writeBytecodeCache(const char* source, FILE* out)
+{
+	ObjFunction* script = compileImpl(source);
+	if (script == nullptr) return false;
+
+	Thread* thread = &getVM()->mainThread;
+	push(thread, TO_OBJ(script)); // GC 回避
+
+	Writer writer;
+	writeBytes(&writer, LOXC_MAGIC, sizeof(LOXC_MAGIC));
+	write<uint32_t>(&writer, LOXC_VERSION);
+	write<uint32_t>(&writer, OP_COUNT);
+	write<uint64_t>(&writer, hashSource(source));
+
+	// チェックサムはヘッダより後ろを書き終わってから埋める
+	int checksumOffset = writer.count;
+	write<uint64_t>(&writer, 0);
+	int payloadOffset = writer.count;
+
+	const ValueArray& globals = getVM()->globalNames;
+	write<uint32_t>(&writer, globals.count);
+	for (int i = 0; i < globals.count; i++)
+	{
+		writeString(&writer, AS_STRING(globals.values[i]));
+	}
+
+	// 関数の数は書き終わってから埋める
+	int functionCountOffset = writer.count;
+	uint32_t functionCount = 0;
+	write<uint32_t>(&writer, 0);
+	writeFunction(&writer, script, &functionCount);
+	memcpy(writer.bytes + functionCountOffset, &functionCount, sizeof(uint32_t));
+
+	uint64_t checksum = hashBytes(writer.bytes + payloadOffset, writer.count - payloadOffset);
+	memcpy(writer.bytes + checksumOffset, &checksum, sizeof(uint64_t));
+
+	fwrite(writer.bytes, 1, writer.count, out);
+
+	free_array(writer.bytes, writer.capacity);
+	pop(thread);
+	return true;
+}
+
+ObjClosure* loadBytecodeCache(const char* path, const char* source)
+{
+	MappedFile file;
+	if (!mapFile(path, &file)) return nullptr;
+
+	Reader reader;
+	reader.current = file.data;
+	reader.end = file.data + file.size;
+	ObjClosure* closure = readCache(&reader, hashSource(source));
+
+	unmapFile(&file);
+	return closure;
+}
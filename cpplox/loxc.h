@@ -0,0 +1,21 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+struct ObjClosure;
+
+// コンパイル済みのバイトコードを .loxc ファイルに保存して、次回以降の起動でコンパイルを省くためのキャッシュ
+// ファイルには関数の木 (命令列、行番号、定数、入れ子の関数) と、命令が参照するグローバル変数の番号の割り当てを書き出す
+// 上位値の情報は OP_CLOSURE のオペランドと各関数の上位値の数に含まれる
+//
+// ヘッダにソースのハッシュと命令の総数を持たせておき、ソースや命令セットが変わったキャッシュは使わない
+// ヘッダより後ろのチェックサムが合わないキャッシュや、命令のオペランドが定数やグローバル変数などの範囲外を指すキャッシュも使わない
+
+// source をコンパイルしてキャッシュを out に書き出す
+// コンパイルエラーの場合は何も書かずに false を返す
+bool writeBytecodeCache(const char* source, FILE* out);
+
+// path のキャッシュを mmap で読み込んで、スクリプトのクロージャを返す
+// ファイルがない、source と一致しない、壊れているといった場合は nullptr を返すので、ソースからコンパイルする
+ObjClosure* loadBytecodeCache(const char* path, const char* source);
@@ -1,14 +1,25 @@
 ﻿#include "common.h"
 
+#include "aot.h"
+#include "compiler.h"
+#include "debug.h"
+#include "jit.h"
+#include "loxc.h"
+#include "memory.h"
+#include "object.h"
 #include "vm.h"
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 namespace
 {
 
 void repl()
 {
+	// 一行ずつのコンパイルは速さを優先して、中間表現での最適化を省く
+	setOptimizationEnabled(false);
+
 	char line[1024];
 	for (;;)
 	{
@@ -57,36 +68,222 @@ char* readFile(const char* path)
 	return buffer;
 }
 
+// スクリプトのバイトコードキャッシュのパス。foo.lox なら foo.loxc
+char* cachePathOf(const char* path)
+{
+	size_t length = strlen(path);
+	const char* suffix = length >= 4 && strcmp(path + length - 4, ".lox") == 0 ? "c" : ".loxc";
+	char* cachePath = static_cast<char*>(malloc(length + strlen(suffix) + 1));
+	if (cachePath == nullptr)
+	{
+		fprintf(stderr, "Not enough memory.\n");
+		exit(74);
+	}
+	memcpy(cachePath, path, length);
+	memcpy(cachePath + length, suffix, strlen(suffix) + 1);
+	return cachePath;
+}
+
 void runFile(const char* path)
 {
 	char* source = readFile(path);
-	const auto result = interpret(source);
+
+	// ソースと一致するバイトコードキャッシュがあれば、コンパイルせずにそれを実行する
+	char* cachePath = cachePathOf(path);
+	ObjClosure* cached = loadBytecodeCache(cachePath, source);
+	free(cachePath);
+
+	const auto result = cached != nullptr ? interpret(&getVM()->mainThread, cached) : interpret(source);
 	free(source);
 
 	if (result == InterpretResult::CompileError) exit(65);
 	if (result == InterpretResult::RuntimeError) exit(70);
 }
 
+// スクリプトをコンパイルして、バイトコードキャッシュを書き出す
+void compileFile(const char* path)
+{
+	char* source = readFile(path);
+	char* cachePath = cachePathOf(path);
+
+	FILE* out;
+	fopen_s(&out, cachePath, "wb");
+	if (out == NULL)
+	{
+		fprintf(stderr, "Could not open file \"%s\".\n", cachePath);
+		exit(74);
+	}
+
+	const bool succeeded = writeBytecodeCache(source, out);
+	fclose(out);
+	free(source);
+
+	if (!succeeded)
+	{
+		remove(cachePath);
+		exit(65);
+	}
+	free(cachePath);
+}
+
+// スクリプトを AOT コンパイルした C++ のソースを outputPath に書き出す
+void emitCpp(const char* path, const char* outputPath)
+{
+	char* source = readFile(path);
+
+	FILE* out;
+	fopen_s(&out, outputPath, "wb");
+	if (out == NULL)
+	{
+		fprintf(stderr, "Could not open file \"%s\".\n", outputPath);
+		exit(74);
+	}
+
+	const bool succeeded = writeAotSource(source, out);
+	fclose(out);
+	free(source);
+
+	if (!succeeded)
+	{
+		remove(outputPath);
+		exit(65);
+	}
+}
+
+// スクリプトをコンパイルして、実行せずにバイトコードを表示する (定数畳み込みなどのテスト用)
+void disassembleFile(const char* path)
+{
+	char* source = readFile(path);
+	ObjFunction* function = compileImpl(source);
+	free(source);
+
+	if (function == nullptr) exit(65);
+
+#if !DEBUG_PRINT_CODE
+	// DEBUG_PRINT_CODE が有効ならコンパイル時に表示済み
+	disassembleFunction(function);
+#endif
+}
+
 }
 
 int main(int argc, const char* argv[])
 {
 	initVM();
 
-	if (argc == 1)
+	// オプションを読み飛ばす。残りはスクリプトのパスのみ
+	const char* path = nullptr;
+	const char* emitPath = nullptr;
+	int pathCount = 0;
+	bool isValid = true;
+	bool isCompileOnly = false;
+	bool isDisassembleOnly = false;
+	bool isRegisterBytecode = false;
+	bool isLazy = false;
+	bool isGcStatsEnabled = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--compile") == 0)
+		{
+			isCompileOnly = true;
+		}
+		else if (strcmp(argv[i], "--disassemble") == 0)
+		{
+			isDisassembleOnly = true;
+		}
+		else if (strcmp(argv[i], "--emit-cpp") == 0)
+		{
+			if (i + 1 < argc) emitPath = argv[++i];
+			else isValid = false;
+		}
+		else if (strcmp(argv[i], "--jit") == 0)
+		{
+			setJitEnabled(true);
+		}
+		else if (strcmp(argv[i], "--no-jit") == 0)
+		{
+			setJitEnabled(false);
+		}
+		else if (strcmp(argv[i], "--register") == 0)
+		{
+			setRegisterBytecodeEnabled(true);
+			isRegisterBytecode = true;
+		}
+		else if (strcmp(argv[i], "--lazy") == 0)
+		{
+			setLazyCompilationEnabled(true);
+			isLazy = true;
+		}
+		else if (strcmp(argv[i], "--incremental-gc") == 0)
+		{
+			setIncrementalGcEnabled(true);
+		}
+		else if (strcmp(argv[i], "--concurrent-gc") == 0)
+		{
+			setConcurrentGcEnabled(true);
+		}
+		else if (strcmp(argv[i], "--background-sweep") == 0)
+		{
+			setBackgroundSweepEnabled(true);
+		}
+		else if (strcmp(argv[i], "--gc-pause") == 0)
+		{
+			// 増分 GC の 1 スライスの停止時間の目安 (マイクロ秒)
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) setGcPauseTarget(atoi(argv[++i]));
+			else isValid = false;
+		}
+		else if (strcmp(argv[i], "--gc-threads") == 0)
+		{
+			// マークを分けて行う GC スレッドの数 (プログラムのスレッドを含む)
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) setGcThreadCount(atoi(argv[++i]));
+			else isValid = false;
+		}
+		else if (strcmp(argv[i], "--gc-stats") == 0)
+		{
+			isGcStatsEnabled = true;
+		}
+		else
+		{
+			path = argv[i];
+			pathCount++;
+		}
+	}
+
+	// --compile, --emit-cpp, --disassemble は同時に指定できない
+	// AOT コンパイラはレジスタ命令を扱えないので --emit-cpp と --register も同時に指定できない
+	// --lazy は実行する時だけ指定できる。キャッシュや C++ のソースの書き出しには全ての関数のバイトコードが要る
+	const int modeCount = (isCompileOnly ? 1 : 0) + (emitPath != nullptr ? 1 : 0) + (isDisassembleOnly ? 1 : 0);
+	if (emitPath != nullptr && isRegisterBytecode) isValid = false;
+	if (modeCount != 0 && isLazy) isValid = false;
+
+	if (isValid && pathCount == 1 && modeCount == 1 && isCompileOnly)
+	{
+		compileFile(path);
+	}
+	else if (isValid && pathCount == 1 && modeCount == 1 && emitPath != nullptr)
+	{
+		emitCpp(path, emitPath);
+	}
+	else if (isValid && pathCount == 1 && modeCount == 1 && isDisassembleOnly)
+	{
+		disassembleFile(path);
+	}
+	else if (isValid && pathCount == 0 && modeCount == 0)
 	{
 		repl();
 	}
-	else if (argc == 2)
+	else if (isValid && pathCount == 1 && modeCount == 0)
 	{
-		runFile(argv[1]);
+		runFile(path);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: cpplox [path]\n");
+		fprintf(stderr, "Usage: cpplox [--jit | --no-jit] [--register] [--lazy] [--incremental-gc | --concurrent-gc] [--gc-pause us] [--gc-threads n] [--background-sweep] [--gc-stats] [--compile | --emit-cpp output | --disassemble] [path]\n");
 		exit(64);
 	}
 
+	if (isGcStatsEnabled) printGcStats();
+
 	freeVM();
 	return 0;
 }
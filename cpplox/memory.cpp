@@ -5,6 +5,13 @@
 #include "vm.h"
 
 #include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
 
 #if DEBUG_LOG_GC
 #include <cstdio>
@@ -14,6 +21,93 @@
 namespace
 {
 
+using Clock = std::chrono::steady_clock;
+
+bool isIncrementalGcEnabled = false;
+bool isConcurrentGcEnabled = false;
+int gcPauseTarget = GC_PAUSE_TARGET;
+bool isBackgroundSweepEnabled = false;
+
+// 並行マーク中のマークスレッド。マーク中でなければ nullptr
+std::thread* marker = nullptr;
+std::atomic<bool> isMarkerDone = false;
+std::atomic<bool> isMarkerStopping = false;
+thread_local bool isMarkerThread = false;
+
+// HeapLock のスコープの深さ (プログラムのスレッドだけが触る)
+int heapLockDepth = 0;
+
+// スイープ中のスイープスレッド。スイープ中でなければ nullptr
+// スイープスレッドは生き残ったオブジェクトを sweptObjects に繋ぎ、解放したバイト数を sweptBytes に数える
+std::thread* sweeper = nullptr;
+std::atomic<bool> isSweeperDone = false;
+thread_local bool isSweeperThread = false;
+Obj* sweptObjects = nullptr;
+Obj* sweptTail = nullptr;
+std::atomic<size_t> sweptBytes = 0;
+
+// 並列マークの GC スレッド 1 つ分の灰色のオブジェクト
+struct MarkWorker
+{
+	// 持ち主だけが触るスタック
+	int count = 0;
+	int capacity = 0;
+	Obj** stack = nullptr;
+
+	// 他のスレッドに分けた分。持ち主は top の側から取り戻し、盗むスレッドは bottom の側から取る
+	std::mutex mutex;
+	int bottom = 0;
+	int top = 0;
+	int dequeCapacity = 0;
+	Obj** deque = nullptr;
+};
+
+int gcThreadCount = 1;
+// gcThreadCount 個。0 番はプログラムのスレッドが使う。並列マークしないなら nullptr
+MarkWorker* workers = nullptr;
+thread_local MarkWorker* currentWorker = nullptr;
+
+// 1 番以降の GC スレッド。マークの合間は poolWake で待つ
+std::thread* helpers = nullptr;
+std::mutex poolMutex;
+std::condition_variable poolWake;
+std::condition_variable poolDone;
+uint64_t markEpoch = 0;
+int finishedHelpers = 0;
+bool isPoolStopping = false;
+bool areHelpersAwake = false; // プログラムのスレッドだけが触る
+
+// 灰色のオブジェクトを持っているかもしれない GC スレッドの数と、分けたオブジェクトの総数
+std::atomic<int> activeWorkers = 0;
+std::atomic<int> sharedCount = 0;
+
+// GC が使うオブジェクトの配列に追加する
+// NOTE: reallocate を使わないのは、再帰的な GC のトリガーを防ぐため
+void pushObject(Obj*** array, int* count, int* capacity, Obj* object)
+{
+	if (*capacity < *count + 1)
+	{
+		*capacity = grow_capacity(*capacity);
+		void* res = realloc(*array, sizeof(Obj*) * *capacity);
+		if (res == nullptr) exit(1);
+		*array = static_cast<Obj**>(res);
+	}
+
+	(*array)[(*count)++] = object;
+}
+
+void pushGray(Obj* object)
+{
+	if (MarkWorker* worker = currentWorker)
+	{
+		pushObject(&worker->stack, &worker->count, &worker->capacity, object);
+		return;
+	}
+
+	auto vm = getVM();
+	pushObject(&vm->grayStack, &vm->grayCount, &vm->grayCapacity, object);
+}
+
 void markThread(Thread* thread)
 {
 	// スタック上の変数をマーク
@@ -35,26 +129,28 @@ void markThread(Thread* thread)
 	}
 }
 
+void markArray(ValueArray* array)
+{
+	for (int i = 0; i < array->count; i++)
+	{
+		markValue(array->values[i]);
+	}
+}
+
 void markRoots()
 {
 	auto vm = getVM();
 	markThread(&vm->mainThread);
 
-	// グローバル変数テーブルをマーク
-	markTable(&vm->globals);
+	// グローバル変数をマーク
+	markTable(&vm->globalIndices);
+	markArray(&vm->globalValues);
+	markArray(&vm->globalNames);
 	markCompilerRoots();
 
 	markObject(reinterpret_cast<Obj*>(vm->initString));
 }
 
-void markArray(ValueArray* array)
-{
-	for (int i = 0; i < array->count; i++)
-	{
-		markValue(array->values[i]);
-	}
-}
-
 void blackenObject(Obj* obj)
 {
 #if DEBUG_LOG_GC
@@ -70,13 +166,28 @@ void blackenObject(Obj* obj)
 		ObjClass* klass = reinterpret_cast<ObjClass*>(obj);
 		markObject(reinterpret_cast<Obj*>(klass->name));
 		markTable(&klass->methods);
+		markObject(reinterpret_cast<Obj*>(klass->rootShape));
 		break;
 	}
 	case ObjType::Instance:
 	{
 		ObjInstance* instance = reinterpret_cast<ObjInstance*>(obj);
-		markObject(reinterpret_cast<Obj*>(instance->klass));
-		markTable(&instance->fields);
+		markObject(reinterpret_cast<Obj*>(instance->shape));
+		for (int i = 0; i < instance->shape->fieldCount; i++)
+		{
+			markValue(instance->fields[i]);
+		}
+		break;
+	}
+	case ObjType::Shape:
+	{
+		// 遷移先の形は遷移元が生きている限り生かしておく
+		ObjShape* shape = reinterpret_cast<ObjShape*>(obj);
+		markObject(reinterpret_cast<Obj*>(shape->klass));
+		markObject(reinterpret_cast<Obj*>(shape->parent));
+		markObject(reinterpret_cast<Obj*>(shape->name));
+		markTable(&shape->fieldIndices);
+		markTable(&shape->transitions);
 		break;
 	}
 	case ObjType::BoundMethod:
@@ -101,6 +212,19 @@ void blackenObject(Obj* obj)
 		ObjFunction* f = reinterpret_cast<ObjFunction*>(obj);
 		markObject(reinterpret_cast<Obj*>(f->name));
 		markArray(&f->chunk.constants);
+		markLazyFunction(f->lazy);
+
+		// キャッシュした形のアドレスが別のオブジェクトに再利用されないように、キャッシュの中身も生かしておく
+		for (int i = 0; i < f->chunk.cacheCount; i++)
+		{
+			const InlineCache& cache = f->chunk.caches[i];
+			for (int j = 0; j < cache.count; j++)
+			{
+				markObject(reinterpret_cast<Obj*>(cache.entries[j].shape));
+				markObject(reinterpret_cast<Obj*>(cache.entries[j].method));
+				markObject(reinterpret_cast<Obj*>(cache.entries[j].transition));
+			}
+		}
 		break;
 	}
 	case ObjType::Upvalue:
@@ -110,6 +234,13 @@ void blackenObject(Obj* obj)
 	case ObjType::Thread:
 	{
 		ObjThread* t = reinterpret_cast<ObjThread*>(obj);
+		if (isMarkerThread)
+		{
+			// スタックはプログラムが書き換えている最中かもしれないので、再マークで辿る
+			auto vm = getVM();
+			pushObject(&vm->deferredThreads, &vm->deferredThreadCount, &vm->deferredThreadCapacity, obj);
+			break;
+		}
 		markThread(&t->thread);
 		break;
 	}
@@ -119,142 +250,1108 @@ void blackenObject(Obj* obj)
 	}
 }
 
-void traceReferences()
+// スタックの古い方の半分を分けて、他の GC スレッドが盗めるようにする
+void shareGray(MarkWorker* worker)
 {
-	auto vm = getVM();
-	while (vm->grayCount > 0)
+	int half = worker->count / 2;
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	if (worker->bottom > 0)
 	{
-		Obj* obj = vm->grayStack[--vm->grayCount];
-		blackenObject(obj);
+		memmove(worker->deque, worker->deque + worker->bottom, sizeof(Obj*) * (worker->top - worker->bottom));
+		worker->top -= worker->bottom;
+		worker->bottom = 0;
+	}
+	if (worker->dequeCapacity < worker->top + half)
+	{
+		worker->dequeCapacity = grow_capacity(worker->top + half);
+		void* res = realloc(worker->deque, sizeof(Obj*) * worker->dequeCapacity);
+		if (res == nullptr) exit(1);
+		worker->deque = static_cast<Obj**>(res);
 	}
+
+	memcpy(worker->deque + worker->top, worker->stack, sizeof(Obj*) * half);
+	worker->top += half;
+	memmove(worker->stack, worker->stack + half, sizeof(Obj*) * (worker->count - half));
+	worker->count -= half;
+	sharedCount += half;
 }
 
-void sweep()
+// from が分けたオブジェクトを worker のスタックに移す
+// 自分の分は全て取り戻し、他のスレッドからは半分を盗む
+bool takeGray(MarkWorker* worker, MarkWorker* from)
 {
-	auto vm = getVM();
-	Obj* prev = nullptr;
-	Obj* obj = vm->objects;
+	std::lock_guard<std::mutex> lock(from->mutex);
+	int available = from->top - from->bottom;
+	if (available == 0) return false;
 
-	// 全てのオブジェクトを辿り、マークされていない白色オブジェクトを解放する
-	while (obj != nullptr)
+	int count = (from == worker) ? available : (available + 1) / 2;
+	Obj** taken = from->deque + from->bottom;
+	if (from == worker)
 	{
-		if (obj->isMarked)
-		{
-			obj->isMarked = false;
-			prev = obj;
-			obj = obj->next;
-		}
-		else
-		{
-			Obj* unreached = obj;
+		from->top = from->bottom;
+	}
+	else
+	{
+		from->bottom += count;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		pushObject(&worker->stack, &worker->count, &worker->capacity, taken[i]);
+	}
+	sharedCount -= count;
+	return true;
+}
 
-#if DEBUG_LOG_GC
-	printf("%p sweep ", obj);
-	printValue(Value::toObj(obj));
-	printf("\n");
-#endif
+bool stealGray(MarkWorker* worker)
+{
+	int index = static_cast<int>(worker - workers);
+	for (int i = 1; i < gcThreadCount; i++)
+	{
+		if (takeGray(worker, &workers[(index + i) % gcThreadCount])) return true;
+	}
+	return false;
+}
+
+void wakeHelpers()
+{
+	areHelpersAwake = true;
+	activeWorkers += gcThreadCount - 1;
+	{
+		std::lock_guard<std::mutex> lock(poolMutex);
+		finishedHelpers = 0;
+		markEpoch++;
+	}
+	poolWake.notify_all();
+}
 
-			obj = obj->next;
+// GC スレッド 1 つ分のマーク。全ての GC スレッドから灰色のオブジェクトが無くなるまで、黒くしては盗む
+// 灰色のオブジェクトは仕事中のスレッドしか持たないので、仕事中のスレッドが無くなればマークは終わる
+void drainWorker(MarkWorker* worker)
+{
+	currentWorker = worker;
+	for (;;)
+	{
+		while (worker->count > 0 || takeGray(worker, worker))
+		{
+			blackenObject(worker->stack[--worker->count]);
+			if (worker->count < GC_MARK_SHARE_SIZE) continue;
 
-			// LinkedList の繋ぎ直し
-			if (prev != nullptr)
+			// 他の GC スレッドは、分けるほどの仕事が見つかってから起こす
+			if (worker == workers && !areHelpersAwake)
 			{
-				prev->next = obj;
+				wakeHelpers();
 			}
-			else
+			else if (sharedCount == 0 && activeWorkers < gcThreadCount)
+			{
+				shareGray(worker);
+			}
+		}
+
+		activeWorkers--;
+		bool isStolen = false;
+		while (!isStolen && activeWorkers > 0)
+		{
+			if (sharedCount == 0)
 			{
-				// prev == nullptr なら、解放対象は先頭のオブジェクト
-				// -> 先頭を更新する
-				vm->objects = obj;
+				std::this_thread::yield();
+				continue;
 			}
+			activeWorkers++;
+			isStolen = stealGray(worker);
+			if (!isStolen) activeWorkers--;
+		}
+		if (!isStolen) break;
+	}
+	currentWorker = nullptr;
+}
 
-			freeObject(unreached);
+void runHelper(MarkWorker* worker)
+{
+	uint64_t epoch = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(poolMutex);
+			poolWake.wait(lock, [&epoch] { return isPoolStopping || markEpoch != epoch; });
+			if (isPoolStopping) return;
+			epoch = markEpoch;
 		}
+		drainWorker(worker);
+		{
+			std::lock_guard<std::mutex> lock(poolMutex);
+			finishedHelpers++;
+		}
+		poolDone.notify_one();
 	}
 }
 
+void stopHelpers()
+{
+	if (helpers == nullptr) return;
+	{
+		std::lock_guard<std::mutex> lock(poolMutex);
+		isPoolStopping = true;
+	}
+	poolWake.notify_all();
+	for (int i = 0; i < gcThreadCount - 1; i++)
+	{
+		helpers[i].join();
+	}
+	delete[] helpers;
+	helpers = nullptr;
+
+	for (int i = 0; i < gcThreadCount; i++)
+	{
+		free(workers[i].stack);
+		free(workers[i].deque);
+	}
+	delete[] workers;
+	workers = nullptr;
 }
 
-void* reallocate(void* ptr, int oldSize, int newSize)
+// 灰色のオブジェクトを GC スレッドで分けて黒くする
+void traceInParallel()
 {
 	auto vm = getVM();
-	vm->bytesAllocated += newSize - oldSize;
+	MarkWorker* worker = &workers[0];
+	for (int i = 0; i < vm->grayCount; i++)
+	{
+		pushObject(&worker->stack, &worker->count, &worker->capacity, vm->grayStack[i]);
+	}
+	vm->grayCount = 0;
 
-	if (newSize > oldSize)
+	activeWorkers = 1;
+	areHelpersAwake = false;
+	drainWorker(worker);
+
+	if (areHelpersAwake)
 	{
-#if DEBUG_STRESS_GC
-		collectGarbage();
-#endif
+		std::unique_lock<std::mutex> lock(poolMutex);
+		poolDone.wait(lock, [] { return finishedHelpers == gcThreadCount - 1; });
+	}
+}
 
-		if (vm->bytesAllocated > vm->nextGC)
+void traceReferences()
+{
+	if (workers != nullptr && marker == nullptr)
+	{
+		traceInParallel();
+		return;
+	}
+
+	auto vm = getVM();
+	while (vm->grayCount > 0)
+	{
+		Obj* obj = vm->grayStack[--vm->grayCount];
+		blackenObject(obj);
+	}
+}
+
+// スライスの中で、work 個の仕事をするごとに時間を確かめる
+bool isPastDeadline(size_t work, Clock::time_point deadline)
+{
+	return work % 64 == 0 && deadline != Clock::time_point::max() && Clock::now() >= deadline;
+}
+
+// 灰色のオブジェクトを budget 個まで黒くする。灰色が無くなれば true を返す
+bool markSlice(size_t budget, Clock::time_point deadline)
+{
+	auto vm = getVM();
+	for (size_t work = 0; vm->grayCount > 0; work++)
+	{
+		if (work >= budget || isPastDeadline(work, deadline)) return false;
+		blackenObject(vm->grayStack[--vm->grayCount]);
+	}
+	return true;
+}
+
+// マークスレッドの本体。heapMutex を取って、灰色のオブジェクトを GC_MARKER_BATCH 個ずつ黒くする
+void runMarker()
+{
+	isMarkerThread = true;
+	auto vm = getVM();
+	while (!isMarkerStopping)
+	{
+		// プログラムがロックを持ったまま止めに来ることがあるので、ロックを待つ間も止める要求を確かめる
+		if (!vm->heapMutex.try_lock())
 		{
-			collectGarbage();
+			std::this_thread::yield();
+			continue;
 		}
+		bool isDone = markSlice(GC_MARKER_BATCH, Clock::time_point::max());
+		vm->heapMutex.unlock();
+		if (isDone) break;
 	}
+	isMarkerDone = true;
+}
 
-	if (newSize == 0)
+void stopMarker()
+{
+	if (marker == nullptr) return;
+	isMarkerStopping = true;
+	marker->join();
+	delete marker;
+	marker = nullptr;
+}
+
+// SATB 書き込みバリアで記録したオブジェクトを灰色にする
+void flushSatbBuffer()
+{
+	auto vm = getVM();
+	if (vm->satbCount == 0) return;
+
+	std::lock_guard<std::recursive_mutex> lock(vm->heapMutex);
+	for (int i = 0; i < vm->satbCount; i++)
 	{
-		free(ptr);
-		return nullptr;
+		markObject(vm->satbBuffer[i]);
 	}
+	vm->satbCount = 0;
+}
 
-	void* res = realloc(ptr, newSize);
-	return res;
+// 初期マーク。ルートと、実行中かもしれないコルーチンのスタックを灰色にしてから、マークスレッドを始める
+void startConcurrentMarking()
+{
+	auto vm = getVM();
+	markRoots();
+	for (int i = 0; i < vm->rememberedCount; i++)
+	{
+		Obj* obj = vm->remembered[i];
+		if (obj->type == ObjType::Thread && reinterpret_cast<ObjThread*>(obj)->state != ThreadState::End)
+		{
+			markThread(&reinterpret_cast<ObjThread*>(obj)->thread);
+		}
+	}
+
+	isSatbBarrierActive = true;
+	isMarkerDone = false;
+	isMarkerStopping = false;
+	marker = new std::thread(runMarker);
 }
 
-void markObject(Obj* object)
+// スイープ待ちのオブジェクトを budget 個まで処理する。全て処理すれば true を返す
+// マークされていない白色オブジェクトは解放し、生き残ったものは白に戻して objects に繋ぎ直す
+// スイープ中に割り当てたオブジェクトは objects に繋がるので、このサイクルでは解放されない
+bool sweepSlice(size_t budget, Clock::time_point deadline)
 {
-	if (object == nullptr) return;
-	if (object->isMarked) return;
+	auto vm = getVM();
+	for (size_t work = 0; vm->sweepList != nullptr; work++)
+	{
+		if (work >= budget || isPastDeadline(work, deadline)) return false;
 
+		Obj* obj = vm->sweepList;
+		vm->sweepList = obj->next;
+		if (obj->isMarked)
+		{
+			obj->isMarked = false;
+			obj->next = vm->objects;
+			vm->objects = obj;
+		}
+		else
+		{
 #if DEBUG_LOG_GC
-	printf("%p mark ", object);
-	printValue(Value::toObj(object));
-	printf("\n");
+			printf("%p sweep ", obj);
+			printValue(TO_OBJ(obj));
+			printf("\n");
 #endif
+			freeObject(obj);
+		}
+	}
+	return true;
+}
+
+// スイープスレッドの本体。list の白いオブジェクトを解放し、生き残ったものを白に戻して sweptObjects に繋ぐ
+// 生き残ったオブジェクトの next はプログラムのスレッドが読まない (若いオブジェクトの next だけがコピー先を指す)
+void runSweeper(Obj* list)
+{
+	isSweeperThread = true;
+	while (list != nullptr)
+	{
+		Obj* obj = list;
+		list = obj->next;
+		if (obj->isMarked)
+		{
+			std::atomic_ref<bool>(obj->isMarked).store(false, std::memory_order_relaxed);
+			obj->next = sweptObjects;
+			sweptObjects = obj;
+			if (sweptTail == nullptr) sweptTail = obj;
+		}
+		else
+		{
+			freeObject(obj);
+		}
+	}
+	isSweeperDone = true;
+}
+
+void startSweeper()
+{
+	auto vm = getVM();
+	sweptObjects = nullptr;
+	sweptTail = nullptr;
+	isSweeperDone = false;
+	sweeper = new std::thread(runSweeper, vm->sweepList);
+	vm->sweepList = nullptr;
+}
 
-	object->isMarked = true;
+// スイープスレッドを待って、生き残ったオブジェクトを objects に戻す
+void joinSweeper()
+{
+	if (sweeper == nullptr) return;
+	sweeper->join();
+	delete sweeper;
+	sweeper = nullptr;
 
 	auto vm = getVM();
-	if (vm->grayCapacity < vm->grayCount + 1)
+	if (sweptObjects != nullptr)
 	{
-		vm->grayCapacity = grow_capacity(vm->grayCapacity);
+		sweptTail->next = vm->objects;
+		vm->objects = sweptObjects;
+	}
+	vm->bytesAllocated -= sweptBytes.exchange(0);
+}
 
-		// NOTE: グレイスタックの割当てに reallocate を使わないのは、再帰的な GC のトリガーを防ぐため
-		void* res = realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
-		if (res == nullptr) exit(1);
-		vm->grayStack = static_cast<Obj**>(res);
+// 記憶集合から、これから解放する古いオブジェクトを取り除く
+void pruneRemembered()
+{
+	auto vm = getVM();
+	int count = 0;
+	for (int i = 0; i < vm->rememberedCount; i++)
+	{
+		Obj* obj = vm->remembered[i];
+		if (obj->isMarked)
+		{
+			vm->remembered[count++] = obj;
+		}
 	}
+	vm->rememberedCount = count;
+}
 
-	vm->grayStack[vm->grayCount++] = object;
+// ナーサリのオブジェクトの大きさ。割り当ても、先頭から順にたどるのもこの大きさで行う
+size_t nurserySize(size_t size)
+{
+	return (size + alignof(Obj*) - 1) & ~(alignof(Obj*) - 1);
 }
 
-void markValue(Value value)
+size_t youngObjectSize(ObjType type)
 {
-	if (IS_OBJ(value)) markObject(AS_OBJ(value));
+	switch (type)
+	{
+	case ObjType::String: return nurserySize(sizeof(ObjString));
+	case ObjType::Instance: return nurserySize(sizeof(ObjInstance));
+	case ObjType::BoundMethod: return nurserySize(sizeof(ObjBoundMethod));
+	default:
+		// 他の型は古い世代にしか割り当てない
+		fprintf(stderr, "Unexpected object type %d in the nursery.\n", static_cast<int>(type));
+		abort();
+	}
 }
 
-void collectGarbage()
+// ナーサリのオブジェクトを先頭から順にたどる
+template<typename F>
+void forEachYoungObject(F f)
 {
 	auto vm = getVM();
+	uint8_t* p = vm->nurseryStart;
+	while (p < vm->nurseryTop)
+	{
+		Obj* obj = reinterpret_cast<Obj*>(p);
+		p += youngObjectSize(obj->type);
+		f(obj);
+	}
+}
 
-#if DEBUG_LOG_GC
-	printf("--- gc begin\n");
-	size_t before = vm->bytesAllocated;
-#endif
+// 若いオブジェクトを古い世代にコピーする。コピー済みならコピー先を返す
+// コピーしたオブジェクトは vm->objects の先頭に繋がるので、後からそこをたどって中身の参照を書き換える
+Obj* promote(Obj* obj)
+{
+	if (obj->next != nullptr) return obj->next;
 
-	markRoots();
-	traceReferences();
-	tableRemoveWhite(&getVM()->strings);
-	sweep();
+	auto vm = getVM();
+	size_t size = youngObjectSize(obj->type);
 
-	// 一度 GC したら、次は使用メモリ量の FACTOR 倍になるまで GC しない
-	// デフォルトは 2 倍
-	vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+	// NOTE: reallocate を使わないのは、マイナー GC の途中でメジャー GC が走るのを防ぐため
+	Obj* copy = static_cast<Obj*>(malloc(size));
+	if (copy == nullptr) exit(1);
+	memcpy(copy, obj, size);
+	copy->isYoung = false;
+	copy->next = vm->objects;
+	vm->objects = copy;
+	vm->bytesAllocated += size;
+	vm->gcDebt += size; // 昇格も古い世代への割り当てなので、増分 GC の仕事を進める
 
-#if DEBUG_LOG_GC
-	printf("--- gc end\n");
-	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-		   before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
-#endif
+	obj->next = copy;
+	return copy;
+}
+
+void forwardValue(Value* slot)
+{
+	if (IS_OBJ(*slot) && AS_OBJ(*slot)->isYoung)
+	{
+		*slot = TO_OBJ(promote(AS_OBJ(*slot)));
+	}
+}
+
+void forwardArray(ValueArray* array)
+{
+	for (int i = 0; i < array->count; i++)
+	{
+		forwardValue(&array->values[i]);
+	}
+}
+
+void forwardTable(Table* table)
+{
+	// 移動した文字列もハッシュ値は同じなので、キーはその場で書き換えてよい
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry* entry = &table->entries[i];
+		forwardObject(reinterpret_cast<Obj**>(&entry->key));
+		forwardValue(&entry->value);
+	}
+}
+
+// 古いオブジェクト obj が指す若いオブジェクトをコピーして、参照を書き換える
+// 関数、クロージャ、上位値、形が指すオブジェクトは、文字列以外は古い世代にしかいない
+void forwardReferences(Obj* obj)
+{
+	switch (obj->type)
+	{
+	case ObjType::Class:
+	{
+		ObjClass* klass = reinterpret_cast<ObjClass*>(obj);
+		forwardObject(reinterpret_cast<Obj**>(&klass->name));
+		forwardTable(&klass->methods);
+		break;
+	}
+	case ObjType::Instance:
+	{
+		ObjInstance* instance = reinterpret_cast<ObjInstance*>(obj);
+		for (int i = 0; i < instance->shape->fieldCount; i++)
+		{
+			forwardValue(&instance->fields[i]);
+		}
+		break;
+	}
+	case ObjType::Shape:
+	{
+		ObjShape* shape = reinterpret_cast<ObjShape*>(obj);
+		forwardObject(reinterpret_cast<Obj**>(&shape->name));
+		forwardTable(&shape->fieldIndices);
+		forwardTable(&shape->transitions);
+		break;
+	}
+	case ObjType::BoundMethod:
+		forwardValue(&reinterpret_cast<ObjBoundMethod*>(obj)->receiver);
+		break;
+	case ObjType::Function:
+	{
+		ObjFunction* f = reinterpret_cast<ObjFunction*>(obj);
+		forwardObject(reinterpret_cast<Obj**>(&f->name));
+		forwardArray(&f->chunk.constants);
+		forwardLazyFunction(f->lazy);
+		break;
+	}
+	case ObjType::Upvalue:
+		forwardValue(&reinterpret_cast<ObjUpvalue*>(obj)->closed);
+		break;
+	case ObjType::Thread:
+	{
+		Thread* thread = &reinterpret_cast<ObjThread*>(obj)->thread;
+		for (Value* slot = thread->stack; slot < thread->stackTop; slot++)
+		{
+			forwardValue(slot);
+		}
+		break;
+	}
+	case ObjType::Closure:
+	case ObjType::Native:
+	case ObjType::String:
+		break;
+	}
+}
+
+void forwardRoots()
+{
+	auto vm = getVM();
+	for (Value* slot = vm->mainThread.stack; slot < vm->mainThread.stackTop; slot++)
+	{
+		forwardValue(slot);
+	}
+
+	forwardTable(&vm->globalIndices);
+	forwardArray(&vm->globalValues);
+	forwardArray(&vm->globalNames);
+	forwardObject(reinterpret_cast<Obj**>(&vm->initString));
+
+	for (int i = 0; i < vm->rememberedCount; i++)
+	{
+		forwardReferences(vm->remembered[i]);
+	}
+
+	// 増分マーク中なら、灰色の若いオブジェクトと、SATB 書き込みバリアで記録した若いオブジェクトも生かしておく
+	for (int i = 0; i < vm->grayCount; i++)
+	{
+		forwardObject(&vm->grayStack[i]);
+	}
+	for (int i = 0; i < vm->satbCount; i++)
+	{
+		forwardObject(&vm->satbBuffer[i]);
+	}
+}
+
+// コピーしなかった若いオブジェクトが持つメモリを解放し、インターン化の表を移動先に合わせる
+// ナーサリの外にメモリを持つオブジェクトだけをたどるので、それ以外の死んだオブジェクトの数にはよらない
+void sweepNursery()
+{
+	auto vm = getVM();
+	for (int i = 0; i < vm->youngOwnerCount; i++)
+	{
+		Obj* obj = vm->youngOwners[i];
+		bool isAlive = obj->next != nullptr;
+		switch (obj->type)
+		{
+		case ObjType::String:
+		{
+			ObjString* s = reinterpret_cast<ObjString*>(obj);
+			if (isAlive)
+			{
+				Entry* entry = tableGetEntry(&vm->strings, s);
+				entry->key = reinterpret_cast<ObjString*>(obj->next);
+			}
+			else
+			{
+				// メジャー GC で表から取り除かれていることもある
+				tableDelete(&vm->strings, s);
+				free_array(s->chars, s->length + 1);
+			}
+			break;
+		}
+		case ObjType::Instance:
+			if (!isAlive)
+			{
+				ObjInstance* instance = reinterpret_cast<ObjInstance*>(obj);
+				free_array(instance->fields, instance->fieldCapacity);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	vm->youngOwnerCount = 0;
+}
+
+void recordPause(Clock::time_point start)
+{
+	auto vm = getVM();
+	uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	vm->totalGcPause += pause;
+	if (vm->maxGcPause < pause) vm->maxGcPause = pause;
+}
+
+// マークを終えてスイープに移る
+// スタックとグローバル変数は書き込みバリアを通さずに書き換わるので、ここでルートを辿り直す
+// 並行マークでは、初期マークの後に変わった所は SATB 書き込みバリアで記録してあるので、ルートは辿り直さない
+void finishMarking()
+{
+	auto vm = getVM();
+	if (marker != nullptr)
+	{
+		stopMarker();
+		isSatbBarrierActive = false;
+		flushSatbBuffer();
+		for (int i = 0; i < vm->deferredThreadCount; i++)
+		{
+			markThread(&reinterpret_cast<ObjThread*>(vm->deferredThreads[i])->thread);
+		}
+		vm->deferredThreadCount = 0;
+	}
+	else
+	{
+		markRoots();
+
+		// 終わっていないコルーチンのスタックも辿り直す (記憶集合に入っている)
+		for (int i = 0; isIncrementalGcEnabled && i < vm->rememberedCount; i++)
+		{
+			Obj* obj = vm->remembered[i];
+			if (obj->type == ObjType::Thread && obj->isMarked)
+			{
+				markThread(&reinterpret_cast<ObjThread*>(obj)->thread);
+			}
+		}
+	}
+	traceReferences();
+	tableRemoveWhite(&vm->strings);
+	pruneRemembered();
+
+	// 若いオブジェクトはマイナー GC で回収するので、マークだけ戻しておく
+	forEachYoungObject([](Obj* obj) { obj->isMarked = false; });
+
+	vm->sweepList = vm->objects;
+	vm->objects = nullptr;
+	vm->gcPhase = GcPhase::Sweep;
+	if (isBackgroundSweepEnabled) startSweeper();
+}
+
+void finishSweep()
+{
+	auto vm = getVM();
+	vm->gcPhase = GcPhase::Idle;
+	vm->gcCount++;
+
+	// 一度 GC したら、次は使用メモリ量の FACTOR 倍になるまで GC しない
+	// デフォルトは 2 倍
+	vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+}
+
+// スイープを budget 個まで進める。スイープスレッドがいれば、終わっているか確かめるだけ
+void sweepStep(size_t budget, Clock::time_point deadline)
+{
+	if (sweeper != nullptr)
+	{
+		if (!isSweeperDone) return;
+		joinSweeper();
+	}
+	else if (!sweepSlice(budget, deadline))
+	{
+		return;
+	}
+	finishSweep();
+}
+
+// 増分 GC を 1 スライス進める。仕事の量は前のスライスからの割り当て量に比例させ、時間は gcPauseTarget までに抑える
+void gcStep()
+{
+	auto vm = getVM();
+
+	// HeapLock のスコープの中では、マークスレッドが読む配列を付け替えている途中かもしれない
+	if (vm->gcPhase == GcPhase::Idle && isConcurrentGcEnabled && heapLockDepth > 0) return;
+
+	auto start = Clock::now();
+	auto deadline = start + std::chrono::microseconds(gcPauseTarget);
+	size_t budget = vm->gcDebt / GC_STEP_DIVISOR + 1;
+	vm->gcDebt = 0;
+
+	switch (vm->gcPhase)
+	{
+	case GcPhase::Idle:
+		vm->gcPhase = GcPhase::Mark;
+		if (isConcurrentGcEnabled) startConcurrentMarking();
+		else markRoots();
+		break;
+	case GcPhase::Mark:
+		if (isConcurrentGcEnabled)
+		{
+			// マークはマークスレッドが進める。記録した値を渡して、マークスレッドが終わっていれば再マークする
+			flushSatbBuffer();
+			if (isMarkerDone) finishMarking();
+		}
+		else if (markSlice(budget, deadline))
+		{
+			finishMarking();
+		}
+		break;
+	case GcPhase::Sweep:
+		sweepStep(budget, deadline);
+		break;
+	}
+
+	recordPause(start);
+}
+
+}
+
+void* reallocate(void* ptr, int oldSize, int newSize)
+{
+	if (isSweeperThread)
+	{
+		// スイープスレッドは解放しかしない。使用量はプログラムのスレッドが受け取る時に減らす
+		sweptBytes += oldSize;
+		free(ptr);
+		return nullptr;
+	}
+
+	auto vm = getVM();
+	vm->bytesAllocated += newSize - oldSize;
+
+	if (newSize > oldSize && !isIncrementalGcEnabled)
+	{
+#if DEBUG_STRESS_GC
+		collectGarbage();
+#endif
+
+		if (vm->bytesAllocated > vm->nextGC)
+		{
+			collectGarbage();
+		}
+		else if (vm->gcPhase == GcPhase::Sweep)
+		{
+			// 遅延スイープ。割り当てた量に比例する個数だけ解放する
+			sweepStep((newSize - oldSize) / GC_STEP_DIVISOR + 1, Clock::time_point::max());
+		}
+	}
+	else if (newSize > oldSize)
+	{
+		vm->gcDebt += newSize - oldSize;
+		if (vm->gcPhase != GcPhase::Idle && vm->bytesAllocated > vm->nextGC * GC_HEAP_GROW_FACTOR)
+		{
+			// マークが割り当てに追いつかずにヒープが伸び続けるなら、サイクルを一度に終わらせる
+			collectGarbage();
+		}
+		else if (DEBUG_STRESS_GC || (vm->gcPhase == GcPhase::Idle ? vm->bytesAllocated > vm->nextGC : vm->gcDebt >= GC_STEP_SIZE))
+		{
+			gcStep();
+		}
+	}
+
+	if (newSize == 0)
+	{
+		free(ptr);
+		return nullptr;
+	}
+
+	void* res = realloc(ptr, newSize);
+	return res;
+}
+
+void markObject(Obj* object)
+{
+	if (object == nullptr) return;
+
+	// 並列マークでは複数の GC スレッドが同じオブジェクトを同時にマークしうるので、ビットを立てたスレッドだけが灰色にする
+	std::atomic_ref<bool> mark(object->isMarked);
+	if (mark.load(std::memory_order_relaxed) || mark.exchange(true, std::memory_order_relaxed)) return;
+
+#if DEBUG_LOG_GC
+	printf("%p mark ", object);
+	printValue(Value::toObj(object));
+	printf("\n");
+#endif
+
+	pushGray(object);
+}
+
+void markValue(Value value)
+{
+	if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+void collectGarbage()
+{
+	auto vm = getVM();
+
+#if DEBUG_LOG_GC
+	printf("--- gc begin\n");
+	size_t before = vm->bytesAllocated;
+#endif
+
+	auto start = Clock::now();
+
+	// 前のサイクルのスイープが残っていれば終わらせる。増分 GC ではそれでサイクルが終わる
+	bool isSweepPending = vm->gcPhase == GcPhase::Sweep;
+	if (isSweepPending)
+	{
+		joinSweeper();
+		sweepSlice(SIZE_MAX, Clock::time_point::max());
+		finishSweep();
+	}
+
+	// マークの途中ならその続きから最後まで進める。スイープは後の割り当てか、スイープスレッドが行う
+	if (!isSweepPending || !isIncrementalGcEnabled)
+	{
+		if (vm->gcPhase == GcPhase::Idle) vm->gcPhase = GcPhase::Mark;
+		finishMarking();
+
+		// 解放前のゴミを含んだ量から決めるので、スイープが終わる前に次の GC が始まることはまず無い
+		if (!isIncrementalGcEnabled) vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+	}
+
+	recordPause(start);
+
+#if DEBUG_LOG_GC
+	printf("--- gc end\n");
+	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+		   before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+void initNursery()
+{
+	auto vm = getVM();
+	vm->nurseryStart = static_cast<uint8_t*>(malloc(GC_NURSERY_SIZE));
+	if (vm->nurseryStart == nullptr) exit(1);
+	vm->nurseryTop = vm->nurseryStart;
+	vm->nurseryEnd = vm->nurseryStart + GC_NURSERY_SIZE;
+
+	vm->rememberedCount = 0;
+	vm->rememberedCapacity = 0;
+	vm->remembered = nullptr;
+
+	vm->youngOwnerCount = 0;
+	vm->youngOwnerCapacity = 0;
+	vm->youngOwners = nullptr;
+}
+
+void freeNursery()
+{
+	auto vm = getVM();
+	for (int i = 0; i < vm->youngOwnerCount; i++)
+	{
+		Obj* obj = vm->youngOwners[i];
+		if (obj->type == ObjType::String)
+		{
+			ObjString* s = reinterpret_cast<ObjString*>(obj);
+			free_array(s->chars, s->length + 1);
+		}
+		else if (obj->type == ObjType::Instance)
+		{
+			ObjInstance* instance = reinterpret_cast<ObjInstance*>(obj);
+			free_array(instance->fields, instance->fieldCapacity);
+		}
+	}
+
+	free(vm->nurseryStart);
+	vm->nurseryStart = vm->nurseryTop = vm->nurseryEnd = nullptr;
+
+	free(vm->remembered);
+	vm->remembered = nullptr;
+	vm->rememberedCount = vm->rememberedCapacity = 0;
+
+	free(vm->youngOwners);
+	vm->youngOwners = nullptr;
+	vm->youngOwnerCount = vm->youngOwnerCapacity = 0;
+}
+
+void* allocateYoung(int size)
+{
+	auto vm = getVM();
+	size_t aligned = nurserySize(size);
+	if (static_cast<size_t>(vm->nurseryEnd - vm->nurseryTop) < aligned)
+	{
+		return nullptr;
+	}
+
+	void* result = vm->nurseryTop;
+	vm->nurseryTop += aligned;
+	return result;
+}
+
+void youngGcSafepoint()
+{
+#if DEBUG_STRESS_GC
+	collectYoungGarbage();
+#else
+	auto vm = getVM();
+	if (vm->nurseryEnd - vm->nurseryTop < GC_NURSERY_RESERVE)
+	{
+		collectYoungGarbage();
+	}
+#endif
+}
+
+void collectYoungGarbage()
+{
+	auto vm = getVM();
+	auto start = Clock::now();
+	HeapLock lock; // マークスレッドが若いオブジェクトを読んでいる間は移動しない
+
+#if DEBUG_LOG_GC
+	printf("--- minor gc begin\n");
+	size_t before = vm->bytesAllocated;
+#endif
+
+	// ルートと記憶集合から直接指されている若いオブジェクトをコピーする
+	Obj* scanned = vm->objects;
+	forwardRoots();
+
+	// コピーしたオブジェクトが指す若いオブジェクトを、コピーが無くなるまで順にコピーする
+	while (vm->objects != scanned)
+	{
+		Obj* head = vm->objects;
+		for (Obj* obj = head; obj != scanned; obj = obj->next)
+		{
+			forwardReferences(obj);
+		}
+		scanned = head;
+	}
+
+	sweepNursery();
+	vm->nurseryTop = vm->nurseryStart;
+
+	// もう古いオブジェクトから若いオブジェクトへの参照は無いので記憶集合を空にする
+	// 実行中のコルーチンはスタックに若いオブジェクトを積みうるので、終わるまで入れておく
+	int count = 0;
+	for (int i = 0; i < vm->rememberedCount; i++)
+	{
+		Obj* obj = vm->remembered[i];
+		if (obj->type == ObjType::Thread && reinterpret_cast<ObjThread*>(obj)->state != ThreadState::End)
+		{
+			vm->remembered[count++] = obj;
+		}
+		else
+		{
+			obj->isRemembered = false;
+		}
+	}
+	vm->rememberedCount = count;
+
+	vm->minorGcCount++;
+	recordPause(start);
+
+#if DEBUG_LOG_GC
+	printf("--- minor gc end\n");
+	printf("   old generation %zu bytes (from %zu)\n", vm->bytesAllocated, before);
+#endif
+}
+
+void rememberObject(Obj* object)
+{
+	if (object->isYoung || object->isRemembered) return;
+	object->isRemembered = true;
+
+	auto vm = getVM();
+	if (vm->rememberedCapacity < vm->rememberedCount + 1)
+	{
+		vm->rememberedCapacity = grow_capacity(vm->rememberedCapacity);
+
+		// NOTE: グレイスタックと同じく、GC のトリガーを防ぐため reallocate を使わない
+		void* res = realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+		if (res == nullptr) exit(1);
+		vm->remembered = static_cast<Obj**>(res);
+	}
+
+	vm->remembered[vm->rememberedCount++] = object;
+}
+
+void recordYoungOwner(Obj* object)
+{
+	if (!object->isYoung) return;
+
+	auto vm = getVM();
+	if (vm->youngOwnerCapacity < vm->youngOwnerCount + 1)
+	{
+		vm->youngOwnerCapacity = grow_capacity(vm->youngOwnerCapacity);
+
+		// NOTE: 記憶集合と同じく、GC のトリガーを防ぐため reallocate を使わない
+		void* res = realloc(vm->youngOwners, sizeof(Obj*) * vm->youngOwnerCapacity);
+		if (res == nullptr) exit(1);
+		vm->youngOwners = static_cast<Obj**>(res);
+	}
+
+	vm->youngOwners[vm->youngOwnerCount++] = object;
+}
+
+void forwardObject(Obj** object)
+{
+	if (*object != nullptr && (*object)->isYoung)
+	{
+		*object = promote(*object);
+	}
+}
+
+void setIncrementalGcEnabled(bool enabled)
+{
+	isIncrementalGcEnabled = enabled;
+}
+
+void setGcPauseTarget(int microseconds)
+{
+	gcPauseTarget = microseconds;
+}
+
+void printGcStats()
+{
+	auto vm = getVM();
+	fprintf(stderr, "gc: %d major, %d minor, max pause %.3f ms, total pause %.3f ms\n",
+			vm->gcCount, vm->minorGcCount, vm->maxGcPause / 1e6, vm->totalGcPause / 1e6);
+}
+
+void shadeObject(Obj* object)
+{
+	auto vm = getVM();
+	if (vm->gcPhase != GcPhase::Mark) return;
+
+	if (marker == nullptr)
+	{
+		markObject(object);
+	}
+	else if (!isObjMarked(object))
+	{
+		// 灰色のオブジェクトはマークスレッドと共有しているので、次のスライスか再マークでまとめて灰色にする
+		pushObject(&vm->satbBuffer, &vm->satbCount, &vm->satbCapacity, object);
+	}
+}
+
+void colorNewObject(Obj* object)
+{
+	if (getVM()->gcPhase == GcPhase::Mark)
+	{
+		// 並行マークでは黒にする。初期マークの後に作ったオブジェクトが指すものは、SATB 書き込みバリアが生かす
+		object->isMarked = true;
+		if (marker == nullptr) pushGray(object);
+	}
+}
+
+void setConcurrentGcEnabled(bool enabled)
+{
+	isConcurrentGcEnabled = enabled;
+	isIncrementalGcEnabled = enabled;
+	if (enabled) atexit(joinGcThreads);
+}
+
+void setGcThreadCount(int count)
+{
+	if (workers != nullptr || count <= 1) return;
+
+	gcThreadCount = count;
+	workers = new MarkWorker[count];
+	helpers = new std::thread[count - 1];
+	for (int i = 1; i < count; i++)
+	{
+		helpers[i - 1] = std::thread(runHelper, &workers[i]);
+	}
+	atexit(joinGcThreads);
+}
+
+void setBackgroundSweepEnabled(bool enabled)
+{
+	isBackgroundSweepEnabled = enabled;
+	if (enabled) atexit(joinGcThreads);
+}
+
+void joinGcThreads()
+{
+	stopMarker();
+	stopHelpers();
+	joinSweeper();
+}
+
+void shadeThread(Thread* thread)
+{
+	if (!isSatbBarrierActive) return;
+
+	for (Value* slot = thread->stack; slot < thread->stackTop; slot++)
+	{
+		if (IS_OBJ(*slot)) shadeObject(AS_OBJ(*slot));
+	}
+	for (int i = 0; i < thread->frameCount; i++)
+	{
+		shadeObject(reinterpret_cast<Obj*>(thread->frames[i].closure));
+	}
+	for (ObjUpvalue* upvalue = thread->openUpvalues; upvalue != nullptr; upvalue = upvalue->next)
+	{
+		shadeObject(reinterpret_cast<Obj*>(upvalue));
+	}
+}
+
+HeapLock::HeapLock()
+{
+	heapLockDepth++;
+	isLocked = marker != nullptr;
+	if (isLocked) getVM()->heapMutex.lock();
+}
+
+HeapLock::~HeapLock()
+{
+	if (isLocked) getVM()->heapMutex.unlock();
+	heapLockDepth--;
 }
@@ -4,7 +4,31 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// 若い世代のオブジェクトを割り当てるナーサリの大きさ
+#define GC_NURSERY_SIZE (256 * 1024)
+// セーフポイントでナーサリの残りがこれより少なければマイナー GC する
+#define GC_NURSERY_RESERVE 256
+
+// 増分 GC は GC_STEP_SIZE バイト割り当てるごとに 1 スライス進める
+// 1 スライスでは、割り当てたバイト数の 1/GC_STEP_DIVISOR 個のオブジェクトをマークまたはスイープする
+#define GC_STEP_SIZE (64 * 1024)
+#define GC_STEP_DIVISOR 16
+// 1 スライスにかける時間の目安 (マイクロ秒) の既定値
+#define GC_PAUSE_TARGET 1000
+// 並行マークのマークスレッドは、この個数のオブジェクトを黒くするごとにロックを手放す
+#define GC_MARKER_BATCH 256
+// 並列マークの GC スレッドは、灰色のオブジェクトをこの個数以上持っていたら、暇なスレッドに半分を分ける
+#define GC_MARK_SHARE_SIZE 64
+
+enum class GcPhase
+{
+	Idle,
+	Mark, // 灰色のオブジェクトが残っている
+	Sweep, // VM::sweepList の解放待ち (スイープスレッドに渡していることもある)
+};
+
 struct Obj;
+struct Thread;
 
 inline int grow_capacity(int capacity)
 {
@@ -41,3 +65,79 @@ void free_array(T* ptr, int oldCount)
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
+
+// 増分 GC
+// 有効にすると、マークとスイープを割り当て量に応じたスライスに分けて、プログラムの実行と交互に進める
+// マーク中に黒いオブジェクトが白いオブジェクトを指さないように、書き込みバリアで書き込んだ値を灰色にする
+// スタックとグローバル変数にはバリアを置かず、マークの最後にまとめて辿り直す
+void setIncrementalGcEnabled(bool enabled);
+void setGcPauseTarget(int microseconds);
+void printGcStats(); // GC の回数と停止時間の最大値を stderr に表示する
+
+// 増分マーク中なら object を灰色にする
+void shadeObject(Obj* object);
+// 割り当てたオブジェクトの色を決める。増分マーク中なら、このサイクルでは回収しないように灰色にする
+void colorNewObject(Obj* object);
+
+// 並行マーク
+// 増分 GC のマークを別の OS スレッド (マークスレッド) で、プログラムの実行と並行して行う
+// 短い停止 (初期マーク) でルートを灰色にした後、プログラムは参照を書き換える前の値を記録する (SATB 書き込みバリア)
+// マークスレッドが終わったら、短い停止 (再マーク) で記録した値を辿ってマークを終える
+// スタックは書き込みバリアを通さずに書き換わるので、マークスレッドは辿らない
+// 初期マークと、スレッドを再開する時 (shadeThread) と、再マークで辿る
+void setConcurrentGcEnabled(bool enabled);
+void joinGcThreads(); // GC のスレッドを止める。VM を解放する前と、プロセスの終了時に呼ぶ
+
+// 並行マーク中だけ true。object.h の overwriteBarrier が見る
+inline bool isSatbBarrierActive = false;
+
+// 並行マーク中に実行を再開するスレッドの、スタックの値を記録する
+void shadeThread(Thread* thread);
+
+// マークスレッドが読む配列を付け替える間、マークスレッドを止めておく
+// 並行マーク中でなければロックしないが、このスコープの中では並行マークを始めない
+struct HeapLock
+{
+	HeapLock();
+	~HeapLock();
+	HeapLock(const HeapLock&) = delete;
+	HeapLock& operator=(const HeapLock&) = delete;
+
+	bool isLocked = false;
+};
+
+// 並列マーク
+// マークの残り (一度に回収する GC と、増分・並行マークの最後) を count 個の GC スレッドで分けて行う
+// GC スレッドはそれぞれ灰色のオブジェクトのスタックを持ち、仕事が無くなったら他のスレッドから盗む
+// 1 ならプログラムのスレッドだけでマークする
+void setGcThreadCount(int count);
+
+// 遅延スイープ
+// 一度に回収する GC も、停止中にはマークだけ行い、スイープはその後の割り当てのたびに割り当てた量に比例する分ずつ進める
+// スイープスレッドを有効にすると、スイープは別の OS スレッドで行う
+// プログラムのスレッドは、スイープスレッドが終わったら生き残ったオブジェクトを受け取るだけ
+void setBackgroundSweepEnabled(bool enabled);
+
+// 世代別 GC
+// 実行時に作る文字列、インスタンス、バインドメソッドはナーサリにポインタを進めるだけで割り当てる (若い世代)
+// マイナー GC はルートと記憶集合からたどれる若いオブジェクトだけを古い世代にコピーして、ナーサリを空にする
+// 若いオブジェクトは移動するので、マイナー GC はセーフポイント (youngGcSafepoint) でしか行わない
+void initNursery();
+void freeNursery();
+
+// ナーサリから size バイト割り当てる。空きが無ければ nullptr を返す (GC はしない)
+void* allocateYoung(int size);
+
+// ナーサリの残りが少なければマイナー GC する
+// 若いオブジェクトを指すポインタを、スタックなどのルート以外 (C++ のローカル変数など) に持っていない所で呼ぶこと
+void youngGcSafepoint();
+void collectYoungGarbage();
+
+// 古いオブジェクトを記憶集合に入れる。書き込みバリア (object.h の writeBarrier) から呼ばれる
+void rememberObject(Obj* object);
+
+// ナーサリの外にメモリを確保した若いオブジェクトを記録する。古いオブジェクトなら何もしない
+void recordYoungOwner(Obj* object);
+
+// マイナー GC 中に、若いオブジェクトを指す参照をコピー先に書き換える
+void forwardObject(Obj** object);
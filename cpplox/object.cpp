@@ -1,5 +1,7 @@
 ﻿#include "object.h"
 
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 #include "common.h"
@@ -17,11 +19,14 @@ T* allocateObject(ObjType type)
 	Obj* o = static_cast<Obj*>(reallocate(nullptr, 0, sizeof(T)));
 	o->type = type;
 	o->isMarked = false;
+	o->isYoung = false;
+	o->isRemembered = false;
 
 	// linked list として vm に登録
 	auto vm = getVM();
 	o->next = vm->objects;
 	vm->objects = o;
+	colorNewObject(o);
 
 #if DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", o, sizeof(T), type);
@@ -30,12 +35,38 @@ T* allocateObject(ObjType type)
 	return reinterpret_cast<T*>(o);
 }
 
+// ナーサリに割り当てる。空きが無ければ古い世代に割り当てる
+// ナーサリを空けるのはセーフポイントだけなので、ここでオブジェクトが移動することはない
+template<typename T>
+T* allocateYoungObject(ObjType type)
+{
+	Obj* o = static_cast<Obj*>(allocateYoung(sizeof(T)));
+	if (o == nullptr)
+	{
+		return allocateObject<T>(type);
+	}
+
+	o->type = type;
+	o->isMarked = false;
+	o->isYoung = true;
+	o->isRemembered = false;
+	o->next = nullptr;
+	colorNewObject(o);
+
+#if DEBUG_LOG_GC
+	printf("%p allocate young %zu for %d\n", o, sizeof(T), type);
+#endif
+
+	return reinterpret_cast<T*>(o);
+}
+
 ObjString* allocateString(char* chars, int length, uint32_t hash)
 {
-	ObjString* s = allocateObject<ObjString>(ObjType::String);
+	ObjString* s = allocateYoungObject<ObjString>(ObjType::String);
 	s->length = length;
 	s->chars = chars;
 	s->hash = hash;
+	recordYoungOwner(&s->obj);
 
 	// 文字列の intern 化
 	// Value はなんでもいいので nil を入れる
@@ -67,6 +98,41 @@ void printFunction(ObjFunction* function)
 	printf("<fn %s>", function->name->chars);
 }
 
+// 遷移で作った形の、名前から位置を引く表を遷移元を辿って作る
+// 遷移の長さは SHAPE_MAX_FIELDS 以下なので、形ごとに一度だけ作れば済む
+void buildFieldIndices(ObjShape* shape)
+{
+	if (shape->isDictionary || shape->fieldIndices.count == shape->fieldCount) return;
+
+	// マークスレッドが表を読んでいる間は付け替えない
+	HeapLock lock;
+	for (ObjShape* s = shape; s->parent != nullptr; s = s->parent)
+	{
+		tableSet(&shape->fieldIndices, s->name, TO_NUMBER(s->fieldCount - 1));
+	}
+}
+
+// フィールド配列を count 個まで入るように広げる
+void reserveFields(ObjInstance* instance, ObjClass* klass, int count)
+{
+	if (klass->fieldCountHint < count)
+	{
+		klass->fieldCountHint = count;
+	}
+
+	if (instance->fieldCapacity < count)
+	{
+		// 同じクラスのインスタンスが過去に持ったフィールド数を目安に確保して、再確保の回数を減らす
+		int capacity = instance->fieldCapacity * 2;
+		if (capacity < klass->fieldCountHint) capacity = klass->fieldCountHint;
+
+		// 値は呼び出し元でスタックに積まれているので、ここで GC が走っても問題ない
+		if (instance->fields == nullptr) recordYoungOwner(&instance->obj);
+		instance->fields = grow_array(instance->fields, instance->fieldCapacity, capacity);
+		instance->fieldCapacity = capacity;
+	}
+}
+
 }
 
 ObjClass* newClass(ObjString* name)
@@ -74,22 +140,151 @@ ObjClass* newClass(ObjString* name)
 	ObjClass* klass = allocateObject<ObjClass>(ObjType::Class);
 	klass->name = name;
 	initTable(&klass->methods);
+	klass->methods.owner = &klass->obj;
+	writeBarrier(&klass->obj, TO_OBJ(name));
+	klass->rootShape = nullptr;
+	klass->fieldCountHint = 0;
 	return klass;
 }
 
+ObjShape* newShape(ObjClass* klass)
+{
+	ObjShape* shape = allocateObject<ObjShape>(ObjType::Shape);
+	shape->klass = klass;
+	shape->parent = nullptr;
+	shape->name = nullptr;
+	shape->fieldCount = 0;
+	shape->isDictionary = false;
+	initTable(&shape->fieldIndices);
+	initTable(&shape->transitions);
+	shape->fieldIndices.owner = &shape->obj;
+	shape->transitions.owner = &shape->obj;
+	return shape;
+}
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name)
+{
+	Value next;
+	if (tableGet(&shape->transitions, name, &next))
+	{
+		return AS_SHAPE(next);
+	}
+
+	ObjShape* child = newShape(shape->klass);
+	push(&getVM()->mainThread, TO_OBJ(child)); // GC 回避
+
+	if (shape->fieldCount >= SHAPE_MAX_FIELDS)
+	{
+		// 遷移を作り続けると形の数と表の大きさがフィールド数の 2 乗で増えるので、インスタンス専用の形に切り替える
+		buildFieldIndices(shape);
+		tableAddAll(&shape->fieldIndices, &child->fieldIndices);
+		tableSet(&child->fieldIndices, name, TO_NUMBER(shape->fieldCount));
+		child->fieldCount = shape->fieldCount + 1;
+		child->isDictionary = true;
+		pop(&getVM()->mainThread);
+		return child;
+	}
+
+	child->parent = shape;
+	child->name = name;
+	child->fieldCount = shape->fieldCount + 1;
+	writeBarrier(&child->obj, TO_OBJ(name));
+
+	// 遷移元から辿れるようにしておけば、以降は遷移元と一緒に生存する
+	tableSet(&shape->transitions, name, TO_OBJ(child));
+	pop(&getVM()->mainThread);
+	return child;
+}
+
+int shapeFieldIndex(ObjShape* shape, ObjString* name)
+{
+	buildFieldIndices(shape);
+	Value index;
+	if (!tableGet(&shape->fieldIndices, name, &index))
+	{
+		return -1;
+	}
+	return static_cast<int>(AS_NUMBER(index));
+}
+
 ObjInstance* newInstance(ObjClass* klass)
 {
-	ObjInstance* instance = allocateObject<ObjInstance>(ObjType::Instance);
-	instance->klass = klass;
-	initTable(&instance->fields);
+	if (klass->rootShape == nullptr)
+	{
+		// klass は呼び出し元でスタックに積まれているので GC されない
+		klass->rootShape = newShape(klass);
+	}
+
+	ObjInstance* instance = allocateYoungObject<ObjInstance>(ObjType::Instance);
+	instance->shape = klass->rootShape;
+	instance->fields = nullptr;
+	instance->fieldCapacity = 0;
 	return instance;
 }
 
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value)
+{
+	int index = shapeFieldIndex(instance->shape, name);
+	if (index < 0)
+	{
+		return false;
+	}
+	*value = instance->fields[index];
+	return true;
+}
+
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value)
+{
+	// shape は instance->shape からフィールドを 1 つ追加した遷移先の形
+	// マークスレッドはフィールドの配列を形のフィールド数まで読むので、付け替え終わるまでロックする
+	// 辞書モードに切り替えた形は、まだどこからも辿れないのでスタックに積んでおく
+	HeapLock lock;
+	push(&getVM()->mainThread, TO_OBJ(shape)); // GC 回避
+	reserveFields(instance, shape->klass, shape->fieldCount);
+	pop(&getVM()->mainThread);
+
+	instance->fields[shape->fieldCount - 1] = value;
+	overwriteBarrier(TO_OBJ(instance->shape));
+	instance->shape = shape;
+	writeBarrier(&instance->obj, value);
+}
+
+void instanceAddDictionaryField(ObjInstance* instance, ObjString* name, Value value)
+{
+	// 形のフィールド数は、値を書き込んでから増やす (マークスレッドはその数まで読む)
+	HeapLock lock;
+	ObjShape* shape = instance->shape;
+	reserveFields(instance, shape->klass, shape->fieldCount + 1);
+
+	instance->fields[shape->fieldCount] = value;
+	tableSet(&shape->fieldIndices, name, TO_NUMBER(shape->fieldCount));
+	shape->fieldCount++;
+	writeBarrier(&instance->obj, value);
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value)
+{
+	int index = shapeFieldIndex(instance->shape, name);
+	if (index >= 0)
+	{
+		storeValue(&instance->obj, &instance->fields[index], value);
+		return;
+	}
+
+	if (instance->shape->isDictionary)
+	{
+		instanceAddDictionaryField(instance, name, value);
+		return;
+	}
+	instanceAddField(instance, shapeTransition(instance->shape, name), value);
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
 {
-	ObjBoundMethod* bound = allocateObject<ObjBoundMethod>(ObjType::BoundMethod);
+	ObjBoundMethod* bound = allocateYoungObject<ObjBoundMethod>(ObjType::BoundMethod);
 	bound->receiver = receiver;
 	bound->method = method;
+	writeBarrier(&bound->obj, receiver); // ナーサリが一杯で古い世代に割り当てた場合
 	return bound;
 }
 
@@ -112,8 +307,15 @@ ObjFunction* newFunction()
 	ObjFunction* f = allocateObject<ObjFunction>(ObjType::Function);
 	f->arity = 0;
 	f->upvalueCount = 0;
+	f->slotCount = 0;
 	f->name = nullptr;
+	f->hotness = 0;
+	f->jitCode = nullptr;
+	f->lazy = nullptr;
 	initChunk(&f->chunk);
+
+	// 定数と名前はコンパイラが後から書き込むので、最初から記憶集合に入れておく
+	rememberObject(&f->obj);
 	return f;
 }
 
@@ -159,6 +361,7 @@ ObjString* takeString(char* chars, int length)
 		// すでに vm がインターン化済みだったのでそれを返す
 		// -> 所有権を譲渡された文字列が必要なくなったので、解放する
 		free_array(chars, length + 1);
+		shadeObject(&interned->obj);
 		return interned;
 	}
 
@@ -170,7 +373,13 @@ ObjString* copyString(const char* chars, int length)
 {
 	auto hash = hashString(chars, length);
 	ObjString* interned = tableFindString(&getVM()->strings, chars, length, hash);
-	if (interned != nullptr) return interned; // 生成済みのエントリがあったのでそれを返す
+	if (interned != nullptr)
+	{
+		// 生成済みのエントリがあったのでそれを返す
+		// 増分マーク中は、まだマークされていない文字列が表から取り除かれないように灰色にする
+		shadeObject(&interned->obj);
+		return interned;
+	}
 
 	// 指定した文字列を所有しないのでヒープ上に新しく割り当てる
 	char* heapChars = allocate<char>(length + 1);
@@ -206,7 +415,7 @@ void freeObject(Obj* obj)
 	case Instance:
 	{
 		ObjInstance* i = reinterpret_cast<ObjInstance*>(obj);
-		freeTable(&i->fields);
+		free_array(i->fields, i->fieldCapacity);
 		free(i);
 		break;
 	}
@@ -221,6 +430,8 @@ void freeObject(Obj* obj)
 	case Function:
 	{
 		ObjFunction* f = reinterpret_cast<ObjFunction*>(obj);
+		freeJitCode(f->jitCode);
+		freeLazyFunction(f->lazy);
 		freeChunk(&f->chunk);
 		free(f);
 		break;
@@ -261,6 +472,15 @@ void freeObject(Obj* obj)
 
 	}
 
+	case Shape:
+	{
+		ObjShape* s = reinterpret_cast<ObjShape*>(obj);
+		freeTable(&s->fieldIndices);
+		freeTable(&s->transitions);
+		free(s);
+		break;
+	}
+
 	}
 }
 
@@ -273,7 +493,7 @@ void printObject(Value value)
 		printf("%s", AS_CLASS(value)->name->chars);
 		break;
 	case Instance:
-		printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+		printf("%s instance", AS_INSTANCE(value)->shape->klass->name->chars);
 		break;
 	case BoundMethod:
 		printFunction(AS_BOUND_METHOD(value)->method->function);
@@ -296,6 +516,9 @@ void printObject(Value value)
 	case Thread:
 		printf("<thread>");
 		break;
+	case Shape:
+		printf("<shape>");
+		break;
 	}
 }
 
@@ -311,7 +534,7 @@ void writeObjString(Value value, char* buffer, size_t bufferSize)
 	}
 	case Instance:
 	{
-		snprintf(buffer, bufferSize, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+		snprintf(buffer, bufferSize, "%s instance", AS_INSTANCE(value)->shape->klass->name->chars);
 		break;
 	}
 	case BoundMethod:
@@ -373,5 +596,10 @@ void writeObjString(Value value, char* buffer, size_t bufferSize)
 		snprintf(buffer, bufferSize, "<thread>");
 		break;
 	}
+	case Shape:
+	{
+		snprintf(buffer, bufferSize, "<shape>");
+		break;
+	}
 	}
 }
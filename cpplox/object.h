@@ -1,8 +1,10 @@
 ﻿#pragma once
 
+#include <atomic>
 #include <cstdint>
 
 #include "chunk.h"
+#include "memory.h"
 #include "value.h"
 #include "table.h"
 #include "thread.h"
@@ -37,6 +39,9 @@
 #define IS_THREAD(value) isObjType(value, ObjType::Thread)
 #define AS_THREAD(value) (reinterpret_cast<ObjThread*>(AS_OBJ(value)))
 
+#define IS_SHAPE(value) isObjType(value, ObjType::Shape)
+#define AS_SHAPE(value) (reinterpret_cast<ObjShape*>(AS_OBJ(value)))
+
 enum class ObjType
 {
 	Class,
@@ -48,22 +53,80 @@ enum class ObjType
 	Upvalue,
 	String,
 	Thread,
+	Shape,
 };
 
 struct Obj
 {
 	ObjType type;
 	bool isMarked = false;
-	Obj* next = nullptr;
+	bool isYoung = false; // ナーサリに割り当てた若いオブジェクト
+	bool isRemembered = false; // 記憶集合に入っている古いオブジェクト
+	Obj* next = nullptr; // 若いオブジェクトでは、マイナー GC でコピーした先 (コピー前は nullptr)
 };
 
+// マーク中は GC のスレッドがマークビットを立てるので、プログラムのスレッドからはアトミックに読む
+inline bool isObjMarked(Obj* object)
+{
+	return std::atomic_ref<bool>(object->isMarked).load(std::memory_order_relaxed);
+}
+
+// オブジェクト owner に value を書き込んだら呼ぶ (書き込みバリア)
+// 若いオブジェクトを指すようになった古い owner を記憶集合に入れて、マイナー GC でたどれるようにする
+// 増分マーク中に黒い owner が白いオブジェクトを指すようになったら、書き込んだ値を灰色にする
+inline void writeBarrier(Obj* owner, Value value)
+{
+	if (!IS_OBJ(value)) return;
+
+	Obj* object = AS_OBJ(value);
+	if (object->isYoung && !owner->isYoung && !owner->isRemembered)
+	{
+		rememberObject(owner);
+	}
+	if (isObjMarked(owner) && !isObjMarked(object))
+	{
+		shadeObject(object);
+	}
+}
+
+// オブジェクトの中の値 oldValue を書き換える前に呼ぶ (SATB 書き込みバリア)
+// 並行マーク中は、初期マークの時に辿れたオブジェクトが、参照が消えたせいでマークされずに残らないように記録する
+inline void overwriteBarrier(Value oldValue)
+{
+	if (isSatbBarrierActive && IS_OBJ(oldValue) && !isObjMarked(AS_OBJ(oldValue)))
+	{
+		shadeObject(AS_OBJ(oldValue));
+	}
+}
+
+// オブジェクト owner の中の値 *slot を value に書き換える
+// 並行マーク中はマークスレッドがヒープのロックの中でフィールドや閉じた上位値を読むので、ロックしてから書き換える
+inline void storeValue(Obj* owner, Value* slot, Value value)
+{
+	HeapLock lock;
+	overwriteBarrier(*slot);
+	*slot = value;
+	writeBarrier(owner, value);
+}
+
+struct JitCode;
+struct LazyFunction;
+
 struct ObjFunction
 {
 	Obj obj;
 	int arity = 0;
 	int upvalueCount = 0;
+	int slotCount = 0; // ローカル変数が使うスタックのスロット数の最大値 (予約の 0 番を含む)
 	Chunk chunk;
 	ObjString* name = nullptr;
+
+	// 呼び出しとループの回数。JIT_HOT_THRESHOLD に達したら機械語に変換する
+	int hotness = 0;
+	JitCode* jitCode = nullptr;
+
+	// 遅延コンパイル (compiler.h) を待っている本文。コンパイル済みなら nullptr
+	LazyFunction* lazy = nullptr;
 };
 
 ObjFunction* newFunction();
@@ -97,6 +160,11 @@ struct ObjUpvalue
 
 ObjUpvalue* newUpvalue(Value* slot);
 
+inline void setUpvalue(ObjUpvalue* upvalue, Value value)
+{
+	storeValue(&upvalue->obj, upvalue->location, value); // 閉じた上位値は古いオブジェクトなので記憶集合に入れる
+}
+
 struct ObjString
 {
 	Obj obj;
@@ -114,18 +182,51 @@ struct ObjClass
 	Obj obj;
 	ObjString* name = nullptr;
 	Table methods;
+	ObjShape* rootShape = nullptr; // フィールドを持たないインスタンスの形 (最初のインスタンス生成時に作る)
+	int fieldCountHint = 0; // インスタンスが持ったフィールド数の最大値。フィールド配列の確保量の目安にする
 };
 
 ObjClass* newClass(ObjString* name);
 
-struct ObjInstance
+// 遷移で表すフィールド数の上限。これより多くのフィールドを追加したインスタンスは辞書モードに切り替える
+#define SHAPE_MAX_FIELDS 64
+
+// インスタンスのフィールドの並び (隠しクラス)
+// 同じクラスで同じ順番にフィールドを追加したインスタンスは同じ形を共有する
+// 形は不変で、フィールドを追加するときは遷移先の形に切り替える
+// 遷移先の形は追加したフィールドだけを持ち、名前から位置を引く表は最初に引く時に遷移元を辿って作る
+// 辞書モードの形はインスタンス専用で、フィールドを追加するときは遷移せずに形を書き換える
+struct ObjShape
 {
 	Obj obj;
 	ObjClass* klass = nullptr;
-	Table fields;
+	ObjShape* parent = nullptr; // 遷移元の形
+	ObjString* name = nullptr; // 遷移元から追加したフィールドの名前 (位置は fieldCount - 1)
+	int fieldCount = 0;
+	bool isDictionary = false;
+	Table fieldIndices; // フィールド名 -> フィールド配列の位置。遷移で作った形では引くまで空
+	Table transitions; // 追加するフィールド名 -> 遷移先の形
+};
+
+// shape に name を追加した形を返す。shape は辞書モードではないこと
+// フィールド数が SHAPE_MAX_FIELDS を超える場合は、遷移を作らずに辞書モードの新しい形を返す
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+int shapeFieldIndex(ObjShape* shape, ObjString* name);
+
+struct ObjInstance
+{
+	Obj obj;
+	ObjShape* shape = nullptr;
+	Value* fields = nullptr; // shape->fieldCount 個の値
+	int fieldCapacity = 0;
 };
 
 ObjInstance* newInstance(ObjClass* klass);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value);
+// 辞書モードのインスタンスにフィールドを追加する
+void instanceAddDictionaryField(ObjInstance* instance, ObjString* name, Value value);
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
 
 struct ObjBoundMethod
 {
@@ -0,0 +1,381 @@
+﻿#include "peephole.h"
+
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+
+#include <cstdio>
+
+namespace
+{
+
+// 融合した回数 (DEBUG_PEEPHOLE_STATS 用)
+int fusedCount[OP_COUNT] = { };
+
+// 書き換え後のジャンプ命令のオペランドを後から埋めるための情報
+struct JumpFixup
+{
+	int newOffset = 0; // 書き換え後の命令の開始位置
+	int operandOffset = 0; // 書き換え後の 16bit オペランドの位置
+	int instructionLength = 0;
+	int oldTarget = 0; // 書き換え前のジャンプ先
+	bool isBackward = false;
+	bool isLong = false; // オペランドが 24bit (_LONG のジャンプ命令)
+};
+
+struct Rewriter
+{
+	uint8_t* code = nullptr;
+	int* lines = nullptr;
+	int count = 0;
+	int capacity = 0;
+
+	JumpFixup* fixups = nullptr;
+	int fixupCount = 0;
+	int fixupCapacity = 0;
+};
+
+void writeByte(Rewriter* rewriter, uint8_t byte, int line)
+{
+	if (rewriter->capacity < rewriter->count + 1)
+	{
+		auto oldCapacity = rewriter->capacity;
+		rewriter->capacity = grow_capacity(oldCapacity);
+		rewriter->code = grow_array(rewriter->code, oldCapacity, rewriter->capacity);
+		rewriter->lines = grow_array(rewriter->lines, oldCapacity, rewriter->capacity);
+	}
+
+	rewriter->code[rewriter->count] = byte;
+	rewriter->lines[rewriter->count] = line;
+	rewriter->count++;
+}
+
+void addFixup(Rewriter* rewriter, const JumpFixup& fixup)
+{
+	if (rewriter->fixupCapacity < rewriter->fixupCount + 1)
+	{
+		auto oldCapacity = rewriter->fixupCapacity;
+		rewriter->fixupCapacity = grow_capacity(oldCapacity);
+		rewriter->fixups = grow_array(rewriter->fixups, oldCapacity, rewriter->fixupCapacity);
+	}
+	rewriter->fixups[rewriter->fixupCount++] = fixup;
+}
+
+bool isLongJump(uint8_t instruction)
+{
+	return instruction == OP_JUMP_LONG || instruction == OP_JUMP_IF_FALSE_LONG || instruction == OP_LOOP_LONG;
+}
+
+// ジャンプ命令を書き出す。オフセットは全ての命令を書き出した後に埋める
+void writeJump(Rewriter* rewriter, uint8_t instruction, int oldTarget, bool isBackward, int line)
+{
+	JumpFixup fixup;
+	fixup.newOffset = rewriter->count;
+	fixup.operandOffset = rewriter->count + 1;
+	fixup.isLong = isLongJump(instruction);
+	fixup.instructionLength = fixup.isLong ? 4 : 3;
+	fixup.oldTarget = oldTarget;
+	fixup.isBackward = isBackward;
+	addFixup(rewriter, fixup);
+
+	writeByte(rewriter, instruction, line);
+	for (int i = 1; i < fixup.instructionLength; i++)
+	{
+		writeByte(rewriter, 0xFF, line);
+	}
+}
+
+// レジスタ命令の比較と分岐と数値の for ループの命令は、オペランドの後ろに 16bit のオフセットを持つ
+void writeOperandJump(Rewriter* rewriter, const uint8_t* instruction, int length, int oldTarget, bool isBackward, int line)
+{
+	JumpFixup fixup;
+	fixup.newOffset = rewriter->count;
+	fixup.operandOffset = rewriter->count + length - 2;
+	fixup.instructionLength = length;
+	fixup.oldTarget = oldTarget;
+	fixup.isBackward = isBackward;
+	addFixup(rewriter, fixup);
+
+	for (int i = 0; i < length - 2; i++)
+	{
+		writeByte(rewriter, instruction[i], line);
+	}
+	writeByte(rewriter, 0xFF, line);
+	writeByte(rewriter, 0xFF, line);
+}
+
+int readShort(const Chunk* chunk, int offset)
+{
+	return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+int readLong(const Chunk* chunk, int offset)
+{
+	return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+int jumpTarget(const Chunk* chunk, int offset)
+{
+	switch (chunk->code[offset])
+	{
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+		return offset + 3 + readShort(chunk, offset + 1);
+	case OP_LOOP:
+		return offset + 3 - readShort(chunk, offset + 1);
+	case OP_JUMP_LONG:
+	case OP_JUMP_IF_FALSE_LONG:
+		return offset + 4 + readLong(chunk, offset + 1);
+	case OP_LOOP_LONG:
+		return offset + 4 - readLong(chunk, offset + 1);
+	case OP_JUMP_IF_NOT_LESS_RR:
+	case OP_JUMP_IF_NOT_LESS_RK:
+	case OP_JUMP_IF_NOT_GREATER_RR:
+	case OP_JUMP_IF_NOT_GREATER_RK:
+	case OP_JUMP_IF_NOT_EQUAL_RR:
+	case OP_JUMP_IF_NOT_EQUAL_RK:
+		return offset + 5 + readShort(chunk, offset + 3);
+	case OP_FOR_LOOP:
+	case OP_FOR_LOOP_CONSTANT:
+	case OP_FOR_LOOP_GLOBAL:
+	{
+		int end = offset + getInstructionLength(chunk, offset);
+		return end - readShort(chunk, end - 2);
+	}
+	default:
+		return -1;
+	}
+}
+
+bool isJump(uint8_t instruction)
+{
+	return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP || isLongJump(instruction);
+}
+
+bool isRegisterJump(uint8_t instruction)
+{
+	return instruction >= OP_JUMP_IF_NOT_LESS_RR && instruction <= OP_JUMP_IF_NOT_EQUAL_RK;
+}
+
+bool isForLoop(uint8_t instruction)
+{
+	return instruction == OP_FOR_LOOP || instruction == OP_FOR_LOOP_CONSTANT || instruction == OP_FOR_LOOP_GLOBAL;
+}
+
+bool isSwitch(uint8_t instruction)
+{
+	return instruction == OP_JUMP_TABLE || instruction == OP_JUMP_STRING;
+}
+
+// switch 文の表の命令は飛び先ごとにオフセットを持つので、それぞれを後から埋める
+void writeSwitch(Rewriter* rewriter, const Chunk* chunk, int offset)
+{
+	const uint8_t* instruction = chunk->code + offset;
+	int length = getInstructionLength(chunk, offset);
+	for (int i = 0; i < getSwitchOperandCount(instruction); i++)
+	{
+		int operand = getSwitchOperand(instruction, i);
+		if (operand < 0) continue;
+
+		JumpFixup fixup;
+		fixup.newOffset = rewriter->count;
+		fixup.operandOffset = rewriter->count + operand;
+		fixup.instructionLength = length;
+		fixup.oldTarget = offset + length + readShort(chunk, offset + operand);
+		addFixup(rewriter, fixup);
+	}
+
+	for (int i = 0; i < length; i++)
+	{
+		writeByte(rewriter, instruction[i], getLine(chunk, offset + i));
+	}
+}
+
+}
+
+void optimizeChunk(Chunk* chunk)
+{
+	const int count = chunk->count;
+
+	// ジャンプ先をマークする
+	// ジャンプ先になっている命令を途中に含む命令列は融合できない
+	bool* isTarget = allocate<bool>(count + 1);
+	int* newOffsets = allocate<int>(count + 1);
+	for (int i = 0; i <= count; i++)
+	{
+		isTarget[i] = false;
+		newOffsets[i] = -1;
+	}
+
+	for (int offset = 0; offset < count; offset += getInstructionLength(chunk, offset))
+	{
+		int target = jumpTarget(chunk, offset);
+		if (target >= 0) isTarget[target] = true;
+
+		const uint8_t* instruction = chunk->code + offset;
+		for (int i = 0; isSwitch(instruction[0]) && i < getSwitchOperandCount(instruction); i++)
+		{
+			int operand = getSwitchOperand(instruction, i);
+			if (operand >= 0) isTarget[offset + getInstructionLength(chunk, offset) + readShort(chunk, offset + operand)] = true;
+		}
+	}
+
+	// offset から始まる n 個の命令の opcode を取り出す
+	// 2 番目以降の命令がジャンプ先になっている場合は失敗する
+	auto fetch = [&](int offset, uint8_t* ops, int* offsets, int n) {
+		for (int i = 0; i < n; i++)
+		{
+			if (offset >= count) return false;
+			if (i > 0 && isTarget[offset]) return false;
+			ops[i] = chunk->code[offset];
+			offsets[i] = offset;
+			offset += getInstructionLength(chunk, offset);
+		}
+		return true;
+	};
+
+	Rewriter rewriter;
+	int offset = 0;
+	while (offset < count)
+	{
+		newOffsets[offset] = rewriter.count;
+
+		uint8_t ops[3];
+		int offsets[3];
+		const uint8_t* code = chunk->code;
+
+		// OP_GET_LOCAL + OP_CONSTANT + OP_ADD => OP_ADD_LOCAL_CONST
+		if (fetch(offset, ops, offsets, 3) &&
+			ops[0] == OP_GET_LOCAL && ops[1] == OP_CONSTANT && (ops[2] == OP_ADD || ops[2] == OP_ADD_UNCHECKED))
+		{
+			// 型推論で数値と分かっていれば、最初から quickening した命令にする
+			int line = getLine(chunk, offsets[2]);
+			uint8_t fused = ops[2] == OP_ADD ? OP_ADD_LOCAL_CONST : OP_ADD_LOCAL_CONST_NUM;
+			writeByte(&rewriter, fused, line);
+			writeByte(&rewriter, code[offsets[0] + 1], line);
+			writeByte(&rewriter, code[offsets[1] + 1], line);
+			fusedCount[OP_ADD_LOCAL_CONST]++;
+			offset = offsets[2] + 1;
+			continue;
+		}
+
+		// 比較 + OP_JUMP_IF_FALSE + OP_POP => OP_JUMP_IF_NOT_XXX
+		// 条件が偽で分岐した場合は、分岐先の OP_POP のために false を積んでからジャンプする
+		if (fetch(offset, ops, offsets, 3) &&
+			(ops[0] == OP_LESS || ops[0] == OP_GREATER || ops[0] == OP_EQUAL ||
+				ops[0] == OP_LESS_UNCHECKED || ops[0] == OP_GREATER_UNCHECKED) &&
+			ops[1] == OP_JUMP_IF_FALSE && ops[2] == OP_POP)
+		{
+			uint8_t fused = ops[0] == OP_LESS ? OP_JUMP_IF_NOT_LESS
+				: ops[0] == OP_GREATER ? OP_JUMP_IF_NOT_GREATER
+				: ops[0] == OP_LESS_UNCHECKED ? OP_JUMP_IF_NOT_LESS_NUM
+				: ops[0] == OP_GREATER_UNCHECKED ? OP_JUMP_IF_NOT_GREATER_NUM
+				: OP_JUMP_IF_NOT_EQUAL;
+			writeJump(&rewriter, fused, jumpTarget(chunk, offsets[1]), false, getLine(chunk, offsets[0]));
+			// 型を確定した比較は、統計上は元の融合命令として数える
+			uint8_t counted = fused;
+			if (fused == OP_JUMP_IF_NOT_LESS_NUM) counted = OP_JUMP_IF_NOT_LESS;
+			if (fused == OP_JUMP_IF_NOT_GREATER_NUM) counted = OP_JUMP_IF_NOT_GREATER;
+			fusedCount[counted]++;
+			offset = offsets[2] + 1;
+			continue;
+		}
+
+		// OP_GET_LOCAL 0 + OP_GET_PROPERTY => OP_GET_THIS_PROPERTY
+		if (fetch(offset, ops, offsets, 2) &&
+			ops[0] == OP_GET_LOCAL && code[offsets[0] + 1] == 0 && ops[1] == OP_GET_PROPERTY)
+		{
+			int line = getLine(chunk, offsets[1]);
+			writeByte(&rewriter, OP_GET_THIS_PROPERTY, line);
+			// 名前の定数とインラインキャッシュの番号はそのまま引き継ぐ
+			for (int i = 1; i < 4; i++)
+			{
+				writeByte(&rewriter, code[offsets[1] + i], line);
+			}
+			fusedCount[OP_GET_THIS_PROPERTY]++;
+			offset = offsets[1] + 4;
+			continue;
+		}
+
+		// OP_GET_LOCAL 0..3 => OP_GET_LOCAL_0..3
+		if (code[offset] == OP_GET_LOCAL && code[offset + 1] <= 3)
+		{
+			uint8_t fused = static_cast<uint8_t>(OP_GET_LOCAL_0 + code[offset + 1]);
+			writeByte(&rewriter, fused, getLine(chunk, offset));
+			fusedCount[fused]++;
+			offset += 2;
+			continue;
+		}
+
+		// 融合できない命令はそのままコピーする
+		int length = getInstructionLength(chunk, offset);
+		if (isJump(code[offset]))
+		{
+			bool isBackward = code[offset] == OP_LOOP || code[offset] == OP_LOOP_LONG;
+			writeJump(&rewriter, code[offset], jumpTarget(chunk, offset), isBackward, getLine(chunk, offset));
+		}
+		else if (isRegisterJump(code[offset]) || isForLoop(code[offset]))
+		{
+			writeOperandJump(&rewriter, code + offset, length, jumpTarget(chunk, offset), isForLoop(code[offset]), getLine(chunk, offset));
+		}
+		else if (isSwitch(code[offset]))
+		{
+			writeSwitch(&rewriter, chunk, offset);
+		}
+		else
+		{
+			for (int i = 0; i < length; i++)
+			{
+				writeByte(&rewriter, code[offset + i], getLine(chunk, offset + i));
+			}
+		}
+		offset += length;
+	}
+	newOffsets[count] = rewriter.count;
+
+	// 命令位置が変わったのでジャンプオフセットを計算し直す
+	// 融合によって命令列は縮む一方なので、16bit に収まらなくなることはない
+	for (int i = 0; i < rewriter.fixupCount; i++)
+	{
+		const JumpFixup& fixup = rewriter.fixups[i];
+		int newTarget = newOffsets[fixup.oldTarget];
+		int end = fixup.newOffset + fixup.instructionLength;
+		int jump = fixup.isBackward ? end - newTarget : newTarget - end;
+		uint8_t* operand = rewriter.code + fixup.operandOffset;
+		if (fixup.isLong) *operand++ = static_cast<uint8_t>((jump >> 16) & 0xFF);
+		operand[0] = static_cast<uint8_t>((jump >> 8) & 0xFF);
+		operand[1] = static_cast<uint8_t>(jump & 0xFF);
+	}
+
+	free_array(chunk->code, chunk->capacity);
+	chunk->code = rewriter.code;
+	chunk->count = rewriter.count;
+	chunk->capacity = rewriter.capacity;
+	setLines(chunk, rewriter.lines, rewriter.count);
+
+	free_array(rewriter.lines, rewriter.capacity);
+	free_array(rewriter.fixups, rewriter.fixupCapacity);
+	free_array(newOffsets, count + 1);
+	free_array(isTarget, count + 1);
+}
+
+void printPeepholeStats()
+{
+	static const char* names[] = {
+		"OP_GET_LOCAL_0",
+		"OP_GET_LOCAL_1",
+		"OP_GET_LOCAL_2",
+		"OP_GET_LOCAL_3",
+		"OP_ADD_LOCAL_CONST",
+		"OP_JUMP_IF_NOT_LESS",
+		"OP_JUMP_IF_NOT_GREATER",
+		"OP_JUMP_IF_NOT_EQUAL",
+		"OP_GET_THIS_PROPERTY",
+	};
+
+	printf("== peephole ==\n");
+	for (int i = OP_GET_LOCAL_0; i <= OP_GET_THIS_PROPERTY; i++)
+	{
+		printf("%-24s %d\n", names[i - OP_GET_LOCAL_0], fusedCount[i]);
+	}
+}
@@ -0,0 +1,7 @@
+﻿#pragma once
+
+struct Chunk;
+
+// コンパイル済みの chunk を走査し、頻出する命令列をスーパー命令に置き換える
+void optimizeChunk(Chunk* chunk);
+void printPeepholeStats();
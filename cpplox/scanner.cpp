@@ -124,7 +124,16 @@ TokenType identifierType()
 	switch (scanner.start[0])
 	{
 		case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-		case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+		case 'c':
+			if (scanner.current - scanner.start > 1) {
+				switch (scanner.start[1])
+				{
+					case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
+					case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+				}
+			}
+			break;
+		case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
 		case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
 		case 'f':
 			if (scanner.current - scanner.start > 1) {
@@ -141,7 +150,15 @@ TokenType identifierType()
 		case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
 		case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
 		case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-		case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+		case 's':
+			if (scanner.current - scanner.start > 1) {
+				switch (scanner.start[1])
+				{
+					case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
+					case 'w': return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
+				}
+			}
+			break;
 		case 't':
 			if (scanner.current - scanner.start > 1) {
 				switch (scanner.start[1])
@@ -232,6 +249,7 @@ Token scanToken()
 		case '+': return makeToken(TOKEN_PLUS);
 		case '/': return makeToken(TOKEN_SLASH);
 		case '*': return makeToken(TOKEN_STAR);
+		case ':': return makeToken(TOKEN_COLON);
 		case '!':
 			return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 		case '=':
@@ -246,3 +264,15 @@ Token scanToken()
 
 	return errorToken("Unexpected character");
 }
+
+ScannerState saveScanner()
+{
+	return { scanner.start, scanner.current, scanner.line };
+}
+
+void restoreScanner(const ScannerState& state)
+{
+	scanner.start = state.start;
+	scanner.current = state.current;
+	scanner.line = state.line;
+}
@@ -14,6 +14,7 @@ enum TokenType
 	TOKEN_SEMICOLON,
 	TOKEN_SLASH,
 	TOKEN_STAR,
+	TOKEN_COLON,
 
 	// 1 文字か 2 文字
 	TOKEN_BANG,
@@ -32,7 +33,9 @@ enum TokenType
 
 	// キーワード
 	TOKEN_AND,
+	TOKEN_CASE,
 	TOKEN_CLASS,
+	TOKEN_DEFAULT,
 	TOKEN_ELSE,
 	TOKEN_FALSE,
 	TOKEN_FOR,
@@ -43,6 +46,7 @@ enum TokenType
 	TOKEN_PRINT,
 	TOKEN_RETURN,
 	TOKEN_SUPER,
+	TOKEN_SWITCH,
 	TOKEN_THIS,
 	TOKEN_TRUE,
 	TOKEN_VAR,
@@ -60,5 +64,15 @@ struct Token
 	int line = 0;
 };
 
+// 先読みした後に戻るための走査位置
+struct ScannerState
+{
+	const char* start = nullptr;
+	const char* current = nullptr;
+	int line = 0;
+};
+
 void initScanner(const char* source);
 Token scanToken();
+ScannerState saveScanner();
+void restoreScanner(const ScannerState& state);
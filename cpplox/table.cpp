@@ -46,6 +46,7 @@ Entry* findEntry(Entry* entries, int capacity, ObjString* key)
 
 void adjustCapacity(Table* table, int capacity)
 {
+	HeapLock lock; // マークスレッドが古いエントリを読んでいる間は解放しない
 	Entry* entries = allocate<Entry>(capacity);
 
 	for (int i = 0; i < capacity; i++)
@@ -103,6 +104,17 @@ bool tableGet(Table* table, ObjString* key, Value* value)
 	return true;
 }
 
+Entry* tableGetEntry(Table* table, ObjString* key)
+{
+	// エントリの位置をインラインキャッシュに覚えておくために、値ではなくエントリを返す
+	if (table->count == 0) return nullptr;
+
+	Entry* entry = findEntry(table->entries, table->capacity, key);
+	if (entry->key == nullptr) return nullptr;
+
+	return entry;
+}
+
 bool tableSet(Table* table, ObjString* key, Value value)
 {
 	// allocate table entries
@@ -121,8 +133,16 @@ bool tableSet(Table* table, ObjString* key, Value value)
 		table->count++;
 	}
 
+	HeapLock lock; // マークスレッドはクラスや形のテーブルのエントリをロックの中で読む
+	if (!isNewKey) overwriteBarrier(entry->value);
 	entry->key = key;
 	entry->value = value;
+
+	if (table->owner != nullptr)
+	{
+		writeBarrier(table->owner, TO_OBJ(key));
+		writeBarrier(table->owner, value);
+	}
 	return isNewKey;
 }
 
@@ -134,6 +154,7 @@ bool tableDelete(Table* table, ObjString* key)
 	if (entry->key == nullptr) return false;
 
 	// エントリに墓標を立てる
+	HeapLock lock;
 	entry->key = nullptr;
 	entry->value = TO_BOOL(true);
 	return true;
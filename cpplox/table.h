@@ -3,6 +3,7 @@
 #include <cstdint>
 #include "value.h"
 
+struct Obj;
 struct ObjString;
 
 struct Entry {
@@ -14,11 +15,13 @@ struct Table {
 	int count = 0;
 	int capacity = 0;
 	Entry* entries = nullptr;
+	Obj* owner = nullptr; // テーブルを持つオブジェクト。tableSet で書き込みバリアを通す (VM のテーブルは nullptr)
 };
 
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+Entry* tableGetEntry(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
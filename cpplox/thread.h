@@ -1,5 +1,7 @@
 ﻿#pragma once
 
+#include <cstddef>
+
 #include "value.h"
 
 constexpr size_t FRAMES_MAX = 64;
@@ -40,6 +40,9 @@ void printValue(Value val)
 	case Obj:
 		printObject(val);
 		break;
+	case Undefined:
+		printf("undefined");
+		break;
 	}
 #endif
 }
@@ -132,6 +135,8 @@ void freeValueArray(ValueArray* arr)
 
 void writeToValueArray(ValueArray* arr, Value val)
 {
+	// マークスレッドは count までの値を読むので、値を書いてから count を増やすまでロックする
+	HeapLock lock;
 	if (arr->capacity < arr->count + 1)
 	{
 		auto oldCapacity = arr->capacity;
@@ -11,6 +11,7 @@ struct ObjNative;
 struct ObjClosure;
 struct ObjUpvalue;
 struct ObjString;
+struct ObjShape;
 
 #if NAN_BOXING
 
@@ -22,6 +23,7 @@ struct ObjString;
 #define TAG_NIL 1
 #define TAG_FALSE 2
 #define TAG_TRUE 3
+#define TAG_UNDEFINED 4
 
 using Value = uint64_t;
 
@@ -36,6 +38,11 @@ using Value = uint64_t;
 #define TO_NIL() NIL_VAL
 #define IS_NIL(value) ((value) == NIL_VAL)
 
+// 宣言だけされて、まだ定義されていないグローバル変数のスロットの値
+// スクリプトからは見えない
+#define UNDEFINED_VAL (static_cast<Value>(QNAN | TAG_UNDEFINED))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define AS_BOOL(value) ((value) == TRUE_VAL)
 #define TO_BOOL(value) ((value) ? TRUE_VAL : FALSE_VAL)
@@ -71,6 +78,7 @@ enum class ValueType
 	Nil,
 	Number,
 	Obj,
+	Undefined, // 未定義のグローバル変数のスロット専用
 };
 
 struct Value
@@ -87,6 +95,7 @@ struct Value
 #define IS_NIL(value) ((value).type == ValueType::Nil)
 #define IS_NUMBER(value) ((value).type == ValueType::Number)
 #define IS_OBJ(value) ((value).type == ValueType::Obj)
+#define IS_UNDEFINED(value) ((value).type == ValueType::Undefined)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -96,6 +105,7 @@ struct Value
 #define TO_NIL() Value{ValueType::Nil, {.number = 0} }
 #define TO_NUMBER(value) Value{ValueType::Number, {.number = value} }
 #define TO_OBJ(value) Value{ValueType::Obj, {.obj = reinterpret_cast<Obj*>(value)} }
+#define UNDEFINED_VAL Value{ValueType::Undefined, {.number = 0} }
 
 #endif
 
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
 
@@ -9,6 +10,10 @@
 #include "debug.h"
 #endif
 
+#if DEBUG_PEEPHOLE_STATS
+#include "peephole.h"
+#endif
+
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
@@ -24,6 +29,7 @@ InterpretResult run(Thread* thread);
 Value peek(Thread* thread, int distance);
 bool call(Thread* thread, ObjClosure* closure, int argCount);
 void runtimeError(Thread* thread, const char* format, ...);
+void closeUpvalues(Thread* thread, Value* last);
 
 Value clockNative(int argCount, Value* args)
 {
@@ -32,6 +38,7 @@ Value clockNative(int argCount, Value* args)
 
 Value toStringNative(int argCount, Value* args)
 {
+	youngGcSafepoint();
 	return TO_OBJ(toString(args[0]));
 }
 
@@ -53,6 +60,10 @@ Value runThread(int argCount, Value* args)
 		return TO_NIL();
 	}
 
+	// 実行中はスタックに若いオブジェクトを積むので、スレッドが終わるまで記憶集合に入れておく
+	rememberObject(&obj->obj);
+	shadeThread(&obj->thread);
+
 	// arity に足りない分は nil で埋める
 	if (obj->state == ThreadState::NotStarted)
 	{
@@ -113,6 +124,24 @@ Value peek(Thread* thread, int distance)
 	return thread->stackTop[-1 - distance];
 }
 
+// 呼び出しとループの回数を数えて、ホットになった関数を JIT コンパイルする
+void countHotness(ObjFunction* function)
+{
+	if (function->hotness < JIT_HOT_THRESHOLD && ++function->hotness == JIT_HOT_THRESHOLD)
+	{
+		jitCompile(function);
+	}
+}
+
+// 遅延コンパイル (compiler.h) を待っている関数は、最初の呼び出しでコンパイルする
+bool compileOnFirstCall(Thread* thread, ObjFunction* function)
+{
+	if (function->lazy == nullptr || compileLazyFunction(function)) return true;
+
+	runtimeError(thread, "Could not compile function '%s'.", function->name->chars);
+	return false;
+}
+
 bool call(Thread* thread, ObjClosure* closure, int argCount)
 {
 	if (argCount != closure->function->arity)
@@ -121,19 +150,25 @@ bool call(Thread* thread, ObjClosure* closure, int argCount)
 		return false;
 	}
 
-	if (thread->frameCount == FRAMES_MAX)
+	if (!compileOnFirstCall(thread, closure->function)) return false;
+
+	// ローカル変数のスロットが値のスタックに収まらない呼び出しも、スタックの溢れとして扱う
+	Value* slots = thread->stackTop - (argCount + 1);
+	if (thread->frameCount == FRAMES_MAX || slots + closure->function->slotCount > thread->stack + STACK_COUNT_MAX)
 	{
 		runtimeError(thread, "Stack overflow.");
 		return false;
 	}
 
+	countHotness(closure->function);
+
 	CallFrame* frame = &thread->frames[thread->frameCount++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
 
 	// stack 中に乗っている引数の数を引いた位置が、frame が参照するスタックの開始位置になる
 	// argCount + 1 なのは、予約分の 0 番の分
-	frame->slots = thread->stackTop - (argCount + 1);
+	frame->slots = slots;
 
 	return true;
 }
@@ -153,6 +188,7 @@ bool callValue(Thread* thread, Value callee, int argCount)
 		}
 		case ObjType::Class:
 		{
+			youngGcSafepoint();
 			ObjClass* klass = AS_CLASS(callee);
 			thread->stackTop[-argCount - 1] = TO_OBJ(newInstance(klass));
 
@@ -191,37 +227,65 @@ bool callValue(Thread* thread, Value callee, int argCount)
 	return false;
 }
 
-bool invokeFromClass(Thread* thread, ObjClass* klass, ObjString* name, int argCount)
+// 現在のフレームを再利用して closure を呼び出す
+bool tailCall(Thread* thread, ObjClosure* closure, int argCount)
 {
-	Value method;
-	if (!tableGet(&klass->methods, name, &method))
+	if (argCount != closure->function->arity)
 	{
-		runtimeError(thread, "Undefine property '%s'.", name->chars);
+		runtimeError(thread, "Expected %d arguments but got %d.", closure->function->arity, argCount);
 		return false;
 	}
-	return call(thread, AS_CLOSURE(method), argCount);
-}
 
-bool invoke(Thread* thread, ObjString* name, int argCount)
-{
-	Value receiver = peek(thread, argCount); // インスタンスが入っている位置を狙う
-	if (!IS_INSTANCE(receiver))
+	if (!compileOnFirstCall(thread, closure->function)) return false;
+
+	CallFrame* frame = &thread->frames[thread->frameCount - 1];
+	if (frame->slots + closure->function->slotCount > thread->stack + STACK_COUNT_MAX)
 	{
-		runtimeError(thread, "Only instances have methods.");
+		runtimeError(thread, "Stack overflow.");
 		return false;
 	}
 
-	ObjInstance* instance = AS_INSTANCE(receiver);
+	// 現在のフレームのローカル変数は不要になるので、キャプチャされていれば閉じておく
+	closeUpvalues(thread, frame->slots);
 
-	Value value;
-	if (tableGet(&instance->fields, name, &value))
+	// 呼び出し先と引数をフレームの先頭に詰め直す
+	Value* args = thread->stackTop - (argCount + 1);
+	memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+	thread->stackTop = frame->slots + (argCount + 1);
+
+	frame->closure = closure;
+	frame->ip = closure->function->chunk.code;
+	countHotness(closure->function);
+	return true;
+}
+
+bool tailCallValue(Thread* thread, Value callee, int argCount)
+{
+	if (IS_CLOSURE(callee))
 	{
-		// プロパティがフィールドだった場合はそれを普通の関数として呼び出す
-		thread->stackTop[-argCount - 1] = value;
-		return callValue(thread, value, argCount);
+		return tailCall(thread, AS_CLOSURE(callee), argCount);
+	}
+
+	if (IS_BOUND_METHOD(callee))
+	{
+		ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+		thread->stackTop[-argCount - 1] = bound->receiver;
+		return tailCall(thread, bound->method, argCount);
 	}
 
-	return invokeFromClass(thread, instance->klass, name, argCount);
+	// ネイティブ関数とクラスは通常の呼び出しにする。直後の OP_RETURN で戻る
+	return callValue(thread, callee, argCount);
+}
+
+bool invokeFromClass(Thread* thread, ObjClass* klass, ObjString* name, int argCount)
+{
+	Value method;
+	if (!tableGet(&klass->methods, name, &method))
+	{
+		runtimeError(thread, "Undefine property '%s'.", name->chars);
+		return false;
+	}
+	return call(thread, AS_CLOSURE(method), argCount);
 }
 
 bool bindMethod(Thread* thread, ObjClass* klass, ObjString* name)
@@ -233,12 +297,199 @@ bool bindMethod(Thread* thread, ObjClass* klass, ObjString* name)
 	}
 
 	// スタックトップにバインド対象のインスタンスがいるはず
+	youngGcSafepoint();
 	ObjBoundMethod* bound = newBoundMethod(peek(thread, 0), AS_CLOSURE(method));
 	pop(thread); // instance
 	push(thread, TO_OBJ(bound));
 	return true;
 }
 
+enum class PropertyKind
+{
+	None,
+	Field,
+	Method,
+};
+
+// キャッシュ中のレシーバの形に対応するエントリを探す
+InlineCacheEntry* findCacheEntry(InlineCache* cache, ObjShape* shape)
+{
+	for (int i = 0; i < cache->count; i++)
+	{
+		if (cache->entries[i].shape == shape)
+		{
+			return &cache->entries[i];
+		}
+	}
+	return nullptr;
+}
+
+// 新しいエントリを追加する
+// エントリが埋まっていたらメガモーフィックとして以降はキャッシュしない
+void addCacheEntry(InlineCache* cache, ObjShape* shape, int fieldIndex, ObjClosure* method, ObjShape* transition)
+{
+	// 並行マーク中のマーカーが、数だけ増えて中身を書く前のエントリを読まないようにする
+	// マーカーはエントリの中身もロックの中で読むので、中身を全て書き終えるまでロックしておく
+	HeapLock lock;
+	if (cache->isMegamorphic)
+	{
+		return;
+	}
+
+	// 辞書モードの形は書き換わるので、フィールドの有無を形で判断できない
+	if (shape->isDictionary)
+	{
+		return;
+	}
+
+	if (cache->count == INLINE_CACHE_ENTRIES)
+	{
+		for (int i = 0; i < cache->count; i++)
+		{
+			overwriteBarrier(TO_OBJ(cache->entries[i].shape));
+			if (cache->entries[i].method != nullptr) overwriteBarrier(TO_OBJ(cache->entries[i].method));
+			if (cache->entries[i].transition != nullptr) overwriteBarrier(TO_OBJ(cache->entries[i].transition));
+		}
+		cache->isMegamorphic = true;
+		cache->count = 0;
+		return;
+	}
+
+	// キャッシュに入れたオブジェクトは関数から辿られるので、増分マーク中なら灰色にする
+	InlineCacheEntry* entry = &cache->entries[cache->count++];
+	entry->shape = shape;
+	entry->method = method;
+	entry->transition = transition;
+	entry->fieldIndex = fieldIndex;
+	shadeObject(&shape->obj);
+	if (method != nullptr) shadeObject(&method->obj);
+	if (transition != nullptr) shadeObject(&transition->obj);
+}
+
+// インスタンスのプロパティを探す。フィールドならその値を、メソッドならクロージャを value に入れる
+// 形が同じならフィールドの有無と位置も同じなので、キャッシュに当たればハッシュ表を引かずに済む
+PropertyKind lookupProperty(ObjInstance* instance, ObjString* name, InlineCache* cache, Value* value)
+{
+	ObjShape* shape = instance->shape;
+	if (InlineCacheEntry* entry = findCacheEntry(cache, shape))
+	{
+		if (entry->method != nullptr)
+		{
+			*value = TO_OBJ(entry->method);
+			return PropertyKind::Method;
+		}
+		*value = instance->fields[entry->fieldIndex];
+		return PropertyKind::Field;
+	}
+
+	int index = shapeFieldIndex(shape, name);
+	if (index >= 0)
+	{
+		addCacheEntry(cache, shape, index, nullptr, nullptr);
+		*value = instance->fields[index];
+		return PropertyKind::Field;
+	}
+
+	// クラスのメソッドはクラス宣言の後に変わらないので、キャッシュの無効化は不要
+	if (tableGet(&shape->klass->methods, name, value))
+	{
+		addCacheEntry(cache, shape, 0, AS_CLOSURE(*value), nullptr);
+		return PropertyKind::Method;
+	}
+
+	return PropertyKind::None;
+}
+
+// スタックトップのインスタンスのプロパティを読んで置き換える
+bool getProperty(Thread* thread, ObjString* name, InlineCache* cache)
+{
+	ObjInstance* instance = AS_INSTANCE(peek(thread, 0));
+
+	Value value;
+	switch (lookupProperty(instance, name, cache, &value))
+	{
+	case PropertyKind::Field:
+		thread->stackTop[-1] = value; // instance を値で置き換える
+		return true;
+	case PropertyKind::Method:
+	{
+		// instance はマイナー GC で移動しうるので、スタックから読み直す
+		youngGcSafepoint();
+		ObjBoundMethod* bound = newBoundMethod(peek(thread, 0), AS_CLOSURE(value));
+		thread->stackTop[-1] = TO_OBJ(bound);
+		return true;
+	}
+	default:
+		runtimeError(thread, "Undefine property '%s'.", name->chars);
+		return false;
+	}
+}
+
+// スタックの 2 番目のインスタンスのフィールドにスタックトップの値を書き込む
+void setProperty(Thread* thread, ObjString* name, InlineCache* cache)
+{
+	ObjInstance* instance = AS_INSTANCE(peek(thread, 1));
+	ObjShape* shape = instance->shape;
+
+	if (InlineCacheEntry* entry = findCacheEntry(cache, shape))
+	{
+		if (entry->transition == nullptr)
+		{
+			storeValue(&instance->obj, &instance->fields[entry->fieldIndex], peek(thread, 0));
+		}
+		else
+		{
+			instanceAddField(instance, entry->transition, peek(thread, 0));
+		}
+		return;
+	}
+
+	int index = shapeFieldIndex(shape, name);
+	if (index >= 0)
+	{
+		storeValue(&instance->obj, &instance->fields[index], peek(thread, 0));
+		addCacheEntry(cache, shape, index, nullptr, nullptr);
+		return;
+	}
+
+	if (shape->isDictionary)
+	{
+		instanceAddDictionaryField(instance, name, peek(thread, 0));
+		return;
+	}
+
+	// フィールドの追加は遷移先の形ごとキャッシュする
+	// 辞書モードに切り替えた形はインスタンス専用なので、キャッシュしない
+	ObjShape* transition = shapeTransition(shape, name);
+	instanceAddField(instance, transition, peek(thread, 0));
+	if (transition->isDictionary) return;
+	addCacheEntry(cache, shape, shape->fieldCount, nullptr, transition);
+}
+
+bool invoke(Thread* thread, ObjString* name, int argCount, InlineCache* cache, bool isTailCall)
+{
+	Value receiver = peek(thread, argCount);
+	if (!IS_INSTANCE(receiver))
+	{
+		runtimeError(thread, "Only instances have methods.");
+		return false;
+	}
+
+	Value value;
+	switch (lookupProperty(AS_INSTANCE(receiver), name, cache, &value))
+	{
+	case PropertyKind::Field:
+		// プロパティがフィールドだった場合はそれを普通の関数として呼び出す
+		thread->stackTop[-argCount - 1] = value;
+		return isTailCall ? tailCallValue(thread, value, argCount) : callValue(thread, value, argCount);
+	case PropertyKind::Method:
+		return isTailCall ? tailCall(thread, AS_CLOSURE(value), argCount) : call(thread, AS_CLOSURE(value), argCount);
+	default:
+		runtimeError(thread, "Undefine property '%s'.", name->chars);
+		return false;
+	}
+}
+
 ObjUpvalue* captureUpvalue(Thread* thread, Value* local)
 {
 	ObjUpvalue* prevUpvalue = nullptr;
@@ -282,8 +533,10 @@ void closeUpvalues(Thread* thread, Value* last)
 	while (thread->openUpvalues != nullptr && thread->openUpvalues->location >= last)
 	{
 		ObjUpvalue* upvalue = thread->openUpvalues;
+		HeapLock lock; // マークスレッドは閉じた上位値をロックの中で読む
 		upvalue->closed = *upvalue->location; // Value をコピー
 		upvalue->location = &upvalue->closed; // location がコピーした値を指すように変更
+		writeBarrier(&upvalue->obj, upvalue->closed);
 		thread->openUpvalues = upvalue->next;
 	}
 }
@@ -320,7 +573,7 @@ void runtimeError(Thread* thread, const char* format, ...)
 		ObjFunction* function = frame->closure->function;
 
 		size_t instruction = frame->ip - function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+		fprintf(stderr, "[line %d] in ", getLine(&function->chunk, static_cast<int>(instruction)));
 
 		if (function->name == nullptr)
 		{
@@ -332,13 +585,17 @@ void runtimeError(Thread* thread, const char* format, ...)
 		}
 	}
 
-	CallFrame* frame = &thread->frames[thread->frameCount - 1];
+	// スクリプト自体の呼び出しに失敗した場合 (ローカル変数がスタックに収まらないなど) は、まだフレームが無い
+	if (thread->frameCount > 0)
+	{
+		CallFrame* frame = &thread->frames[thread->frameCount - 1];
 
-	// コードを読んだあとに ip++ されているので、エラーを起こしたのは現在実行しているコードの一つ前になる
-	ObjFunction* function = frame->closure->function;
-	size_t instruction = frame->ip - function->chunk.code - 1;
-	int line = function->chunk.lines[instruction];
-	fprintf(stderr, "[line %d] in script\n", line);
+		// コードを読んだあとに ip++ されているので、エラーを起こしたのは現在実行しているコードの一つ前になる
+		ObjFunction* function = frame->closure->function;
+		size_t instruction = frame->ip - function->chunk.code - 1;
+		int line = getLine(&function->chunk, static_cast<int>(instruction));
+		fprintf(stderr, "[line %d] in script\n", line);
+	}
 
 	resetStack(thread);
 }
@@ -352,23 +609,13 @@ void defineNative(const char* name, NativeFn function)
 
 	// ネイティブ関数は global に入れる
 	// TODO: ここでスタックは空になっている前提で合っている？
-	tableSet(&vm.globals, AS_STRING(vm.mainThread.stack[0]), vm.mainThread.stack[1]);
+	int index = resolveGlobal(AS_STRING(vm.mainThread.stack[0]));
+	vm.globalValues.values[index] = vm.mainThread.stack[1];
 
 	pop(&vm.mainThread);
 	pop(&vm.mainThread);
 }
 
-#define BINARY_OP(ValueType, op) \
-	do { \
-        if (!IS_NUMBER(peek(thread, 0)) || !IS_NUMBER(peek(thread, 1))) { \
-            runtimeError(thread, "Operand must be numbers."); \
-            return InterpretResult::RuntimeError; \
-        } \
-		double b = AS_NUMBER(pop(thread)); \
-		double a = AS_NUMBER(pop(thread)); \
-		push(thread, TO_##ValueType(a op b)); \
-	} while (false)
-
 bool isFalsey(Value value)
 {
 	// nil: falsey
@@ -380,6 +627,9 @@ bool isFalsey(Value value)
 
 void concatenate(Thread* thread)
 {
+	// 結果の文字列は若い世代に割り当てるので、オペランドを読む前にセーフポイントを置く
+	youngGcSafepoint();
+
 	// ここでスタックから文字列オブジェクトを取り出してしまうと、次の allocate 時に回収される可能性がある
 	// 処理が完了するまでは peek() で参照する
 	ObjString* b = AS_STRING(peek(thread, 0));
@@ -397,22 +647,128 @@ void concatenate(Thread* thread)
 	push(thread, toObjValue(result)); // result
 }
 
-#define READ_BYTE() (*frame->ip++)
+// run() の中では ip, スタックトップ, フレームのスロット, 定数表の先頭をローカル変数にキャッシュする
+// Thread / CallFrame に書き戻すのは、関数呼び出し、GC を起こしうる割り当て、yield、エラーの直前のみ
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
 
 // 2 instruction 消費して 16bit 整数として読み取る
 #define READ_SHORT() \
-	(frame->ip += 2, \
-	static_cast<uint16_t>(frame->ip[-2] << 8 | frame->ip[-1]))
+	(ip += 2, \
+	static_cast<uint16_t>(ip[-2] << 8 | ip[-1]))
+
+// 3 instruction 消費して 24bit 整数として読み取る
+#define READ_LONG() \
+	(ip += 3, \
+	static_cast<uint32_t>(ip[-3] << 16 | ip[-2] << 8 | ip[-1]))
 
 #define READ_CONSTANT() \
-	(frame->closure->function->chunk.constants.values[READ_BYTE()])
+	(constants[READ_BYTE()])
 
 #define READ_STRING() \
 	AS_STRING(READ_CONSTANT())
 
-InterpretResult run(Thread* thread)
+#define READ_GLOBAL_INDEX() READ_SHORT()
+
+#define READ_INLINE_CACHE() \
+	(&frame->closure->function->chunk.caches[READ_SHORT()])
+
+// キャッシュしている ip とスタックトップを Thread / CallFrame に書き戻す
+#define STORE_STATE() \
+	do { \
+		frame->ip = ip; \
+		thread->stackTop = stackTop; \
+	} while (false)
+
+// 関数呼び出しなどでスタックトップが書き換わった後に読み直す
+#define LOAD_STACK() \
+	(stackTop = thread->stackTop)
+
+// 実行中のフレームが切り替わった後に読み直す
+#define LOAD_FRAME() \
+	do { \
+		frame = &thread->frames[thread->frameCount - 1]; \
+		ip = frame->ip; \
+		slots = frame->slots; \
+		constants = frame->closure->function->chunk.constants.values; \
+	} while (false)
+
+// 実行中の関数が JIT コンパイル済みなら、ip の位置から機械語で実行する
+// 機械語はフレームを切り替える命令の手前で戻ってくるので、その命令からインタプリタで続ける
+#define JIT_ENTER() \
+	do { \
+		if (frame->closure->function->jitCode != nullptr) { \
+			STORE_STATE(); \
+			if (!runJit(thread)) return InterpretResult::RuntimeError; \
+			LOAD_FRAME(); \
+			LOAD_STACK(); \
+		} \
+	} while (false)
+
+#define RUNTIME_ERROR(...) \
+	do { \
+		STORE_STATE(); \
+		runtimeError(thread, __VA_ARGS__); \
+		return InterpretResult::RuntimeError; \
+	} while (false)
+
+// 数値演算の汎用命令。成功したら自分自身を数値特化命令 quickened に書き換える
+#define BINARY_OP(ValueType, op, quickened) \
+	do { \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			RUNTIME_ERROR("Operand must be numbers."); \
+		} \
+		ip[-1] = (quickened); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(PEEK(0)); \
+		PEEK(0) = TO_##ValueType(a op b); \
+	} while (false)
+
+// 型特化命令のガードが外れた場合に、汎用命令 generic に書き戻して ip を命令の先頭に戻す
+// 呼び出し側はこの後 VM_DISPATCH() で同じ命令を汎用命令として実行し直す
+#define DEOPTIMIZE(generic) \
+	do { \
+		ip[-1] = (generic); \
+		ip--; \
+	} while (false)
+
+// BINARY_OP の数値特化版
+// 中で VM_DISPATCH() するので do-while では囲まない
+#define BINARY_OP_NUM(ValueType, op, generic) \
+	{ \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			DEOPTIMIZE(generic); \
+			VM_DISPATCH(); \
+		} \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(PEEK(0)); \
+		PEEK(0) = TO_##ValueType(a op b); \
+	}
+
+// GCC はディスパッチ部分の間接ジャンプを 1 箇所に併合してしまうことがあるので、
+// run() に限って併合系の最適化を抑制して各命令の末尾に間接ジャンプを残す
+#if COMPUTED_GOTO && defined(__GNUC__) && !defined(__clang__)
+#define RUN_ATTRIBUTES __attribute__((optimize("no-gcse", "no-crossjumping")))
+#else
+#define RUN_ATTRIBUTES
+#endif
+
+RUN_ATTRIBUTES InterpretResult run(Thread* thread)
 {
-	CallFrame* frame = &thread->frames[thread->frameCount - 1];
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* slots;
+	Value* constants;
+	Value* stackTop;
+
+	LOAD_FRAME();
+	LOAD_STACK();
+
+	// yield から再開したスレッドは JIT コンパイル済みの関数の途中にいることがある
+	JIT_ENTER();
 
 #if DEBUG_TRACE_EXECUTION
 	if (frame->ip == frame->closure->function->chunk.code)
@@ -425,390 +781,943 @@ InterpretResult run(Thread* thread)
 	}
 #endif
 
-	for (;;)
-	{
 #if DEBUG_TRACE_EXECUTION
-		printf("          ");
-		for (Value* slot = thread->stack; slot < thread->stackTop; slot++)
-		{
-			printf("[ ");
-			printValue(*slot);
-			printf(" ]");
-		}
-		printf("\n");
-		disassembleInstruction(&frame->closure->function->chunk, static_cast<int>(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() \
+	do { \
+		STORE_STATE(); \
+		printf("          "); \
+		for (Value* slot = thread->stack; slot < stackTop; slot++) \
+		{ \
+			printf("[ "); \
+			printValue(*slot); \
+			printf(" ]"); \
+		} \
+		printf("\n"); \
+		disassembleInstruction(&frame->closure->function->chunk, static_cast<int>(ip - frame->closure->function->chunk.code)); \
+	} while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#if COMPUTED_GOTO
+	// OpCode の並び順と一致させること
+	// 各命令の末尾で次の命令のラベルへ直接ジャンプする (direct threading)
+	static void* dispatchTable[] = {
+		&&label_OP_CONSTANT,
+		&&label_OP_NIL,
+		&&label_OP_TRUE,
+		&&label_OP_FALSE,
+		&&label_OP_POP,
+		&&label_OP_GET_LOCAL,
+		&&label_OP_SET_LOCAL,
+		&&label_OP_GET_GLOBAL,
+		&&label_OP_DEFINE_GLOBAL,
+		&&label_OP_SET_GLOBAL,
+		&&label_OP_GET_UPVALUE,
+		&&label_OP_SET_UPVALUE,
+		&&label_OP_GET_PROPERTY,
+		&&label_OP_SET_PROPERTY,
+		&&label_OP_GET_SUPER,
+		&&label_OP_EQUAL,
+		&&label_OP_GREATER,
+		&&label_OP_LESS,
+		&&label_OP_ADD,
+		&&label_OP_SUBTRACT,
+		&&label_OP_MULTIPLY,
+		&&label_OP_DIVIDE,
+		&&label_OP_NOT,
+		&&label_OP_NEGATE,
+		&&label_OP_PRINT,
+		&&label_OP_JUMP,
+		&&label_OP_JUMP_IF_FALSE,
+		&&label_OP_LOOP,
+		&&label_OP_CALL,
+		&&label_OP_TAIL_CALL,
+		&&label_OP_INVOKE,
+		&&label_OP_TAIL_INVOKE,
+		&&label_OP_SUPER_INVOKE,
+		&&label_OP_CLOSURE,
+		&&label_OP_CLOSE_UPVALUE,
+		&&label_OP_RETURN,
+		&&label_OP_YIELD,
+		&&label_OP_CLASS,
+		&&label_OP_INHERIT,
+		&&label_OP_METHOD,
+		&&label_OP_FOR_LOOP,
+		&&label_OP_FOR_LOOP_CONSTANT,
+		&&label_OP_FOR_LOOP_GLOBAL,
+		&&label_OP_JUMP_TABLE,
+		&&label_OP_JUMP_STRING,
+		&&label_OP_CONSTANT_LONG,
+		&&label_OP_JUMP_LONG,
+		&&label_OP_JUMP_IF_FALSE_LONG,
+		&&label_OP_LOOP_LONG,
+		&&label_OP_WIDE,
+		&&label_OP_GET_LOCAL_0,
+		&&label_OP_GET_LOCAL_1,
+		&&label_OP_GET_LOCAL_2,
+		&&label_OP_GET_LOCAL_3,
+		&&label_OP_ADD_LOCAL_CONST,
+		&&label_OP_JUMP_IF_NOT_LESS,
+		&&label_OP_JUMP_IF_NOT_GREATER,
+		&&label_OP_JUMP_IF_NOT_EQUAL,
+		&&label_OP_GET_THIS_PROPERTY,
+		&&label_OP_MOVE,
+		&&label_OP_LOAD_CONSTANT,
+		&&label_OP_ADD_RR,
+		&&label_OP_ADD_RK,
+		&&label_OP_SUBTRACT_RR,
+		&&label_OP_SUBTRACT_RK,
+		&&label_OP_MULTIPLY_RR,
+		&&label_OP_MULTIPLY_RK,
+		&&label_OP_DIVIDE_RR,
+		&&label_OP_DIVIDE_RK,
+		&&label_OP_JUMP_IF_NOT_LESS_RR,
+		&&label_OP_JUMP_IF_NOT_LESS_RK,
+		&&label_OP_JUMP_IF_NOT_GREATER_RR,
+		&&label_OP_JUMP_IF_NOT_GREATER_RK,
+		&&label_OP_JUMP_IF_NOT_EQUAL_RR,
+		&&label_OP_JUMP_IF_NOT_EQUAL_RK,
+		&&label_OP_ADD_UNCHECKED,
+		&&label_OP_SUBTRACT_UNCHECKED,
+		&&label_OP_MULTIPLY_UNCHECKED,
+		&&label_OP_DIVIDE_UNCHECKED,
+		&&label_OP_NEGATE_UNCHECKED,
+		&&label_OP_GREATER_UNCHECKED,
+		&&label_OP_LESS_UNCHECKED,
+		&&label_OP_EQUAL_NUM,
+		&&label_OP_GREATER_NUM,
+		&&label_OP_LESS_NUM,
+		&&label_OP_ADD_NUM,
+		&&label_OP_ADD_STR,
+		&&label_OP_SUBTRACT_NUM,
+		&&label_OP_MULTIPLY_NUM,
+		&&label_OP_DIVIDE_NUM,
+		&&label_OP_ADD_LOCAL_CONST_NUM,
+		&&label_OP_JUMP_IF_NOT_LESS_NUM,
+		&&label_OP_JUMP_IF_NOT_GREATER_NUM,
+		&&label_OP_JUMP_IF_NOT_EQUAL_NUM,
+	};
+	static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT, "dispatchTable must cover all opcodes.");
+
+#define VM_CASE(op) case op: label_##op
+#define VM_DISPATCH() \
+	do { \
+		TRACE_EXECUTION(); \
+		goto *dispatchTable[READ_BYTE()]; \
+	} while (false)
+#else
+#define VM_CASE(op) case op
+#define VM_DISPATCH() continue
 #endif
 
+	for (;;)
+	{
+		// COMPUTED_GOTO が有効な場合、ここを通るのは最初の 1 命令のみ
+		TRACE_EXECUTION();
+
 		using enum InterpretResult;
 		uint8_t instruction = READ_BYTE();
 		switch (instruction)
 		{
 
-		case OP_CONSTANT: {
+		VM_CASE(OP_CONSTANT): {
 			Value constant = READ_CONSTANT();
-			push(thread, constant);
-			break;
+			PUSH(constant);
+			VM_DISPATCH();
 		}
 
-		case OP_NIL:
-			push(thread, TO_NIL());
-			break;
+		VM_CASE(OP_NIL):
+			PUSH(TO_NIL());
+			VM_DISPATCH();
 
-		case OP_TRUE:
-			push(thread, TO_BOOL(true));
-			break;
+		VM_CASE(OP_TRUE):
+			PUSH(TO_BOOL(true));
+			VM_DISPATCH();
 
-		case OP_FALSE:
-			push(thread, TO_BOOL(false));
-			break;
+		VM_CASE(OP_FALSE):
+			PUSH(TO_BOOL(false));
+			VM_DISPATCH();
 
-		case OP_POP:
-			pop(thread);
-			break;
+		VM_CASE(OP_POP):
+			stackTop--;
+			VM_DISPATCH();
 
-		case OP_GET_LOCAL:
+		VM_CASE(OP_GET_LOCAL):
 		{
 			// ローカル変数のインデックスはスタックのインデックスと一致している
 			uint8_t slot = READ_BYTE();
-			push(thread, frame->slots[slot]);
-			break;
+			PUSH(slots[slot]);
+			VM_DISPATCH();
 		}
 
-		case OP_SET_LOCAL:
+		VM_CASE(OP_SET_LOCAL):
 		{
 			// ローカル変数のインデックスはスタックのインデックスと一致している
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(thread, 0); // 値がそのまま代入文の評価値になるので、pop() しない
-			break;
+			slots[slot] = PEEK(0); // 値がそのまま代入文の評価値になるので、pop() しない
+			VM_DISPATCH();
 		}
 
-		case OP_GET_GLOBAL:
+		VM_CASE(OP_GET_GLOBAL):
 		{
-			ObjString* name = READ_STRING();
-			Value value;
-			if (!tableGet(&vm.globals, name, &value)) {
-				runtimeError(thread, "Undefined variable '%s'.", name->chars);
-				return RuntimeError;
+			int index = READ_GLOBAL_INDEX();
+			Value value = vm.globalValues.values[index];
+			if (IS_UNDEFINED(value))
+			{
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[index]));
 			}
-			push(thread, value);
-			break;
+			PUSH(value);
+			VM_DISPATCH();
 		}
 
-		case OP_DEFINE_GLOBAL:
+		VM_CASE(OP_DEFINE_GLOBAL):
 		{
-			ObjString* name = READ_STRING();
-			tableSet(&vm.globals, name, peek(thread, 0));
-			pop(thread);
-			break;
+			vm.globalValues.values[READ_GLOBAL_INDEX()] = POP();
+			VM_DISPATCH();
 		}
 
-		case OP_SET_GLOBAL:
+		VM_CASE(OP_SET_GLOBAL):
 		{
-			ObjString* name = READ_STRING();
-			if (tableSet(&vm.globals, name, peek(thread, 0)))
+			int index = READ_GLOBAL_INDEX();
+			if (IS_UNDEFINED(vm.globalValues.values[index]))
 			{
-				// "新しいキーだったら" ランタイムエラーにする
-				tableDelete(&vm.globals, name);
-				runtimeError(thread, "Undefined variable '%s'.", name->chars);
-				return RuntimeError;
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[index]));
 			}
-			break;
+			vm.globalValues.values[index] = PEEK(0);
+			VM_DISPATCH();
 		}
 
-		case OP_GET_UPVALUE:
+		VM_CASE(OP_GET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			push(thread, *frame->closure->upvalues[slot]->location);
-			break;
+			PUSH(*frame->closure->upvalues[slot]->location);
+			VM_DISPATCH();
 		}
 
-		case OP_SET_UPVALUE:
+		VM_CASE(OP_SET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(thread, 0);
-			break;
+			setUpvalue(frame->closure->upvalues[slot], PEEK(0));
+			VM_DISPATCH();
 		}
 
-		case OP_GET_PROPERTY:
-		{
-			// アクセス対象の instance がスタックに積まれているはず
-			if (!IS_INSTANCE(peek(thread, 0)))
-			{
-				runtimeError(thread, "Only instances have properties.");
-				return RuntimeError;
-			}
-
-			ObjInstance* instance = AS_INSTANCE(peek(thread, 0));
-			ObjString* name = READ_STRING();
-
-			Value value;
-			if (tableGet(&instance->fields, name, &value))
-			{
-				pop(thread); // instance
-				push(thread, value);
-				break;
-			}
-
-			if (!bindMethod(thread, instance->klass, name))
-			{
-				runtimeError(thread, "Undefine property '%s'.", name->chars);
-				return RuntimeError;
-			}
-
-			break;
-		}
+// 名前をオペランドに持つ命令は、OP_WIDE からも 16bit の番号で読んだ名前で実行するのでマクロにしておく
+#define GET_PROPERTY(readName) \
+	do { \
+		/* アクセス対象の instance がスタックに積まれているはず */ \
+		if (!IS_INSTANCE(PEEK(0))) { \
+			RUNTIME_ERROR("Only instances have properties."); \
+		} \
+		ObjString* name = (readName); \
+		InlineCache* cache = READ_INLINE_CACHE(); \
+		/* バインドメソッドの割り当てで GC が走りうるので書き戻しておく */ \
+		STORE_STATE(); \
+		if (!getProperty(thread, name, cache)) return RuntimeError; \
+		LOAD_STACK(); \
+	} while (false)
 
-		case OP_SET_PROPERTY:
-		{
-			// スタックトップには代入する Value
-			// スタックの 2 番目に代入先の Instance
-			if (!IS_INSTANCE(peek(thread, 1)))
-			{
-				runtimeError(thread, "Only instances have fields.");
-				return RuntimeError;
-			}
+#define SET_PROPERTY(readName) \
+	do { \
+		/* スタックトップには代入する Value、スタックの 2 番目に代入先の Instance */ \
+		if (!IS_INSTANCE(PEEK(1))) { \
+			RUNTIME_ERROR("Only instances have fields."); \
+		} \
+		ObjString* name = (readName); \
+		InlineCache* cache = READ_INLINE_CACHE(); \
+		STORE_STATE(); \
+		setProperty(thread, name, cache); \
+		Value value = POP(); \
+		PEEK(0) = value; /* instance を評価値で置き換える */ \
+	} while (false)
 
-			ObjInstance* instance = AS_INSTANCE(peek(thread, 1));
-			tableSet(&instance->fields, READ_STRING(), peek(thread, 0));
+#define GET_SUPER(readName) \
+	do { \
+		ObjString* name = (readName); \
+		ObjClass* superclass = AS_CLASS(POP()); \
+		STORE_STATE(); \
+		if (!bindMethod(thread, superclass, name)) { \
+			RUNTIME_ERROR("Undefine property '%s'.", name->chars); \
+		} \
+		LOAD_STACK(); \
+	} while (false)
 
-			Value value = pop(thread);
-			pop(thread); // instance
-			push(thread, value); // 評価値
-			break;
-		}
+		VM_CASE(OP_GET_PROPERTY): GET_PROPERTY(READ_STRING()); VM_DISPATCH();
+		VM_CASE(OP_SET_PROPERTY): SET_PROPERTY(READ_STRING()); VM_DISPATCH();
+		VM_CASE(OP_GET_SUPER): GET_SUPER(READ_STRING()); VM_DISPATCH();
 
-		case OP_GET_SUPER:
+		VM_CASE(OP_EQUAL):
 		{
-			ObjString* name = READ_STRING();
-			ObjClass* superclass = AS_CLASS(pop(thread));
-			if (!bindMethod(thread, superclass, name))
+			Value b = POP();
+			Value a = PEEK(0);
+			if (IS_NUMBER(a) && IS_NUMBER(b))
 			{
-				runtimeError(thread, "Undefine property '%s'.", name->chars);
-				return RuntimeError;
+				ip[-1] = OP_EQUAL_NUM;
 			}
-			break;
-		}
-
-		case OP_EQUAL:
-		{
-			Value b = pop(thread);
-			Value a = pop(thread);
-			push(thread, TO_BOOL(valuesEqual(a, b)));
-			break;
+			PEEK(0) = TO_BOOL(valuesEqual(a, b));
+			VM_DISPATCH();
 		}
 
-		case OP_GREATER: BINARY_OP(BOOL, >); break;
-		case OP_LESS: BINARY_OP(BOOL, <); break;
-		case OP_ADD:
+		VM_CASE(OP_GREATER): BINARY_OP(BOOL, >, OP_GREATER_NUM); VM_DISPATCH();
+		VM_CASE(OP_LESS): BINARY_OP(BOOL, <, OP_LESS_NUM); VM_DISPATCH();
+		VM_CASE(OP_ADD):
 		{
-			if (IS_STRING(peek(thread, 0)) && IS_STRING(peek(thread, 1)))
+			if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
 			{
+				ip[-1] = OP_ADD_STR;
+				STORE_STATE();
 				concatenate(thread);
+				LOAD_STACK();
 			}
-			else if (IS_NUMBER(peek(thread, 0)) && IS_NUMBER(peek(thread, 1)))
+			else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
 			{
-				double b = AS_NUMBER(pop(thread));
-				double a = AS_NUMBER(pop(thread));
-				push(thread, TO_NUMBER(a + b));
+				ip[-1] = OP_ADD_NUM;
+				double b = AS_NUMBER(POP());
+				double a = AS_NUMBER(PEEK(0));
+				PEEK(0) = TO_NUMBER(a + b);
 			}
 			else
 			{
-				runtimeError(thread, "Operand must be two numbers or two strings.");
-				return InterpretResult::RuntimeError;
+				RUNTIME_ERROR("Operand must be two numbers or two strings.");
 			}
-			break;
+			VM_DISPATCH();
 		}
-		case OP_SUBTRACT: BINARY_OP(NUMBER, -); break;
-		case OP_MULTIPLY: BINARY_OP(NUMBER, *); break;
-		case OP_DIVIDE: BINARY_OP(NUMBER, /); break;
+		VM_CASE(OP_SUBTRACT): BINARY_OP(NUMBER, -, OP_SUBTRACT_NUM); VM_DISPATCH();
+		VM_CASE(OP_MULTIPLY): BINARY_OP(NUMBER, *, OP_MULTIPLY_NUM); VM_DISPATCH();
+		VM_CASE(OP_DIVIDE): BINARY_OP(NUMBER, /, OP_DIVIDE_NUM); VM_DISPATCH();
 
-		case OP_NOT:
-			push(thread, TO_BOOL(isFalsey(pop(thread))));
-			break;
+		VM_CASE(OP_NOT):
+			PEEK(0) = TO_BOOL(isFalsey(PEEK(0)));
+			VM_DISPATCH();
 
-		case OP_NEGATE: {
-			if (!IS_NUMBER(peek(thread, 0)))
+		VM_CASE(OP_NEGATE): {
+			if (!IS_NUMBER(PEEK(0)))
 			{
-				runtimeError(thread, "Operand must be a number.");
-				return RuntimeError;
+				RUNTIME_ERROR("Operand must be a number.");
 			}
-			push(thread, TO_NUMBER(-AS_NUMBER(pop(thread))));
-			break;
+			PEEK(0) = TO_NUMBER(-AS_NUMBER(PEEK(0)));
+			VM_DISPATCH();
 		}
 
-		case OP_PRINT: {
+		VM_CASE(OP_PRINT): {
 			// stack トップに expression の評価結果が置かれているはず
-			printValue(pop(thread));
+			printValue(POP());
 			printf("\n");
-			break;
+			VM_DISPATCH();
 		}
 
-		case OP_JUMP: {
+		VM_CASE(OP_JUMP): {
 			// 無条件 jump
 			uint16_t offset = READ_SHORT();
-			frame->ip += offset;
-			break;
+			ip += offset;
+			VM_DISPATCH();
 		}
 
-		case OP_JUMP_IF_FALSE: {
+		VM_CASE(OP_JUMP_IF_FALSE): {
 			// false なら jump
 			uint16_t offset = READ_SHORT();
-			if (isFalsey(peek(thread, 0))) frame->ip += offset; // then 節をスキップ
-			break;
+			if (isFalsey(PEEK(0))) ip += offset; // then 節をスキップ
+			VM_DISPATCH();
 		}
 
-		case OP_LOOP: {
+		VM_CASE(OP_LOOP): {
 			uint16_t offset = READ_SHORT();
-			frame->ip -= offset; // back jump
-			break;
+			ip -= offset; // back jump
+
+			// ループが回り続けている関数は、呼び出しを待たずにループの先頭から機械語に切り替える
+			countHotness(frame->closure->function);
+			JIT_ENTER();
+			VM_DISPATCH();
 		}
 
-		case OP_CALL: {
+		VM_CASE(OP_CALL): {
 			int argCount = READ_BYTE();
-			if (!callValue(thread, peek(thread, argCount), argCount))
+			STORE_STATE();
+			if (!callValue(thread, PEEK(argCount), argCount))
 			{
 				return RuntimeError;
 			}
-			// 呼び出しが成功したので呼び出し元を frame 変数にキャッシュしておく
+			// 呼び出しが成功したので呼び出し先のフレームを読み直す
 			// NOTE: Native 関数の場合、frame の指し位置は変わらない
-			frame = &thread->frames[thread->frameCount - 1];
-			break;
+			LOAD_FRAME();
+			LOAD_STACK();
+			JIT_ENTER();
+			VM_DISPATCH();
 		}
 
-		case OP_INVOKE:
+		VM_CASE(OP_TAIL_CALL):
 		{
-			ObjString* method = READ_STRING();
 			int argCount = READ_BYTE();
-			if (!invoke(thread, method, argCount))
+			STORE_STATE();
+			if (!tailCallValue(thread, PEEK(argCount), argCount))
 			{
 				return RuntimeError;
 			}
-			frame = &thread->frames[thread->frameCount - 1];
-			break;
+			LOAD_FRAME();
+			LOAD_STACK();
+			JIT_ENTER();
+			VM_DISPATCH();
 		}
 
-		case OP_SUPER_INVOKE:
-		{
-			ObjString* method = READ_STRING();
-			int argCount = READ_BYTE();
-			ObjClass* superclass = AS_CLASS(pop(thread));
-			// super クラスのメソッド呼び出し時は、フィールドを探索しなくていいのでメソッドとして直接呼び出ししてよい
-			if (!invokeFromClass(thread, superclass, method, argCount))
-			{
-				return RuntimeError;
-			}
-			frame = &thread->frames[thread->frameCount - 1];
-			break;
-		}
+#define INVOKE(readName, isTail) \
+	do { \
+		ObjString* method = (readName); \
+		int argCount = READ_BYTE(); \
+		InlineCache* cache = READ_INLINE_CACHE(); \
+		STORE_STATE(); \
+		if (!invoke(thread, method, argCount, cache, (isTail))) return RuntimeError; \
+		LOAD_FRAME(); \
+		LOAD_STACK(); \
+		JIT_ENTER(); \
+	} while (false)
 
-		case OP_CLOSURE: {
-			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure* closure = newClosure(function);
-			push(thread, TO_OBJ(closure));
+#define SUPER_INVOKE(readName) \
+	do { \
+		ObjString* method = (readName); \
+		int argCount = READ_BYTE(); \
+		ObjClass* superclass = AS_CLASS(POP()); \
+		STORE_STATE(); \
+		/* super クラスのメソッド呼び出し時は、フィールドを探索しなくていいのでメソッドとして直接呼び出ししてよい */ \
+		if (!invokeFromClass(thread, superclass, method, argCount)) return RuntimeError; \
+		LOAD_FRAME(); \
+		LOAD_STACK(); \
+		JIT_ENTER(); \
+	} while (false)
 
-			// 上位値のポインタをオブジェクト配列として保持する
-			for (int i = 0; i < closure->upvalueCount; i++)
-			{
-				uint8_t isLocal = READ_BYTE();
-				uint8_t index = READ_BYTE();
-				if (isLocal)
-				{
-					// ローカルスコープの上位値の場合は、キャプチャする
-					// ローカル変数なので、フレームのスタック + index 分で Value* を取れる
-					closure->upvalues[i] = captureUpvalue(thread, frame->slots + index);
-				}
-				else
-				{
-					// ローカルでない場合は外側の関数の上位値なので、そのポインタへの参照をコピーすればいい
-					closure->upvalues[i] = frame->closure->upvalues[index];
-				}
-			}
-			break;
-		}
+		VM_CASE(OP_INVOKE): INVOKE(READ_STRING(), false); VM_DISPATCH();
+		VM_CASE(OP_TAIL_INVOKE): INVOKE(READ_STRING(), true); VM_DISPATCH();
+		VM_CASE(OP_SUPER_INVOKE): SUPER_INVOKE(READ_STRING()); VM_DISPATCH();
+
+// 上位値のインデックスは readIndex で読む (OP_WIDE の場合は 16bit)
+#define CLOSURE(readConstant, readIndex) \
+	do { \
+		ObjFunction* function = AS_FUNCTION(readConstant); \
+		STORE_STATE(); \
+		ObjClosure* closure = newClosure(function); \
+		PUSH(TO_OBJ(closure)); \
+		/* 上位値の割り当てで GC が走っても closure が回収されないように書き戻しておく */ \
+		thread->stackTop = stackTop; \
+		/* 上位値のポインタをオブジェクト配列として保持する */ \
+		for (int i = 0; i < closure->upvalueCount; i++) { \
+			uint8_t isLocal = READ_BYTE(); \
+			int index = (readIndex); \
+			ObjUpvalue* upvalue; \
+			if (isLocal) { \
+				/* ローカル変数なので、フレームのスタック + index 分で Value* を取れる */ \
+				upvalue = captureUpvalue(thread, slots + index); \
+			} else { \
+				/* ローカルでない場合は外側の関数の上位値なので、そのポインタへの参照をコピーすればいい */ \
+				upvalue = frame->closure->upvalues[index]; \
+			} \
+			/* マークスレッドは上位値の配列をロックの中で読む (captureUpvalue の割り当てはロックの外で行う) */ \
+			HeapLock lock; \
+			closure->upvalues[i] = upvalue; \
+			writeBarrier(&closure->obj, TO_OBJ(upvalue)); \
+		} \
+	} while (false)
+
+		VM_CASE(OP_CLOSURE): CLOSURE(READ_CONSTANT(), READ_BYTE()); VM_DISPATCH();
 
-		case OP_CLOSE_UPVALUE:
+		VM_CASE(OP_CLOSE_UPVALUE):
 		{
-			closeUpvalues(thread, thread->stackTop - 1);
-			pop(thread);
-			break;
+			closeUpvalues(thread, stackTop - 1);
+			stackTop--;
+			VM_DISPATCH();
 		}
 
-		case OP_RETURN: {
-			Value result = pop(thread);
-			closeUpvalues(thread, frame->slots);
+		VM_CASE(OP_RETURN): {
+			Value result = POP();
+			closeUpvalues(thread, slots);
 			thread->frameCount--;
 			if (thread->frameCount == 0)
 			{
 				// 実行終了
-				pop(thread); // 0 番目に積んでいた function を POP
+				stackTop--; // 0 番目に積んでいた function を POP
 				// 最後の実行結果をスタックトップに積んで、呼び出し元で取り出す
-				push(thread, result);
+				PUSH(result);
+				thread->stackTop = stackTop;
 				return Ok;
 			}
 
-			thread->stackTop = frame->slots; // スタックを復元
-			push(thread, result);
-			frame = &thread->frames[thread->frameCount - 1]; // 呼び出し元フレームを一つ上に
+			stackTop = slots; // スタックを復元
+			PUSH(result);
+			LOAD_FRAME(); // 呼び出し元フレームを一つ上に
 			// frame が書き換わることで、関数呼び出し位置の ip から実行が再開する
-			break;
+			JIT_ENTER();
+			VM_DISPATCH();
 		}
 
-		case OP_YIELD:
+		VM_CASE(OP_YIELD):
 		{
 			// TODO: メインスレッドだったら怒る
 			// NOTE: ここでスタックトップに積んである値を結果として返すが、
 			// ここで取り出してしまうと呼び出し元に返す方法がないので、積んだままループを抜ける
 			// 呼び出し時点で関数の ip は yield の次を指している
 			// スタックの状態などを全て保存したまま実行を完了してしまう
+			STORE_STATE();
 			return Yield;
 		}
 
-		case OP_CLASS:
-		{
-			push(thread, TO_OBJ(newClass(READ_STRING())));
-			break;
-		}
+#define CLASS(readName) \
+	do { \
+		ObjString* name = (readName); \
+		STORE_STATE(); \
+		PUSH(TO_OBJ(newClass(name))); \
+	} while (false)
 
-		case OP_INHERIT:
+		VM_CASE(OP_CLASS): CLASS(READ_STRING()); VM_DISPATCH();
+
+		VM_CASE(OP_INHERIT):
 		{
-			Value superClass = peek(thread, 1);
+			Value superClass = PEEK(1);
 			if (!IS_CLASS(superClass))
 			{
-				runtimeError(thread, "Superclass must be a class.");
-				return RuntimeError;
+				RUNTIME_ERROR("Superclass must be a class.");
 			}
 
-			ObjClass* subClass = AS_CLASS(peek(thread, 0));
+			ObjClass* subClass = AS_CLASS(PEEK(0));
 			// 親クラスのメソッドを全て子クラスに突っ込む
+			STORE_STATE();
 			tableAddAll(&AS_CLASS(superClass)->methods, &subClass->methods);
-			pop(thread);
-			break;
+			stackTop--;
+			VM_DISPATCH();
+		}
+
+#define METHOD(readName) \
+	do { \
+		ObjString* name = (readName); \
+		STORE_STATE(); \
+		defineMethod(thread, name); \
+		LOAD_STACK(); \
+	} while (false)
+
+		VM_CASE(OP_METHOD): METHOD(READ_STRING()); VM_DISPATCH();
+
+// 数値の for ループの更新と条件の判定。数値でなければ何もせず、次の OP_LOOP から通常の更新節と条件節を実行する
+// 条件が偽の場合も同じく通常の命令列に任せるので、ループを抜ける時の状態 (条件の値の POP など) は変わらない
+#define FOR_LOOP(readLimit) \
+	do { \
+		Value* counter = &slots[READ_BYTE()]; \
+		double step = AS_NUMBER(READ_CONSTANT()); \
+		Value limit = (readLimit); \
+		uint16_t offset = READ_SHORT(); \
+		if (IS_NUMBER(*counter) && IS_NUMBER(limit)) { \
+			double next = AS_NUMBER(*counter) + step; \
+			if (next < AS_NUMBER(limit)) { \
+				*counter = TO_NUMBER(next); \
+				ip -= offset; \
+				countHotness(frame->closure->function); \
+				JIT_ENTER(); \
+			} \
+		} \
+	} while (false)
+
+		VM_CASE(OP_FOR_LOOP): FOR_LOOP(slots[READ_BYTE()]); VM_DISPATCH();
+		VM_CASE(OP_FOR_LOOP_CONSTANT): FOR_LOOP(READ_CONSTANT()); VM_DISPATCH();
+		VM_CASE(OP_FOR_LOOP_GLOBAL): FOR_LOOP(vm.globalValues.values[READ_GLOBAL_INDEX()]); VM_DISPATCH();
+
+#undef FOR_LOOP
+
+		VM_CASE(OP_JUMP_TABLE):
+		VM_CASE(OP_JUMP_STRING): {
+			// switch 文の分岐。ラベルの数によらず表を一度引くだけで飛び先が決まる
+			uint8_t* instruction = ip - 1;
+			ip = instruction + getSwitchJump(instruction, constants, POP());
+			VM_DISPATCH();
+		}
+
+		VM_CASE(OP_CONSTANT_LONG): {
+			Value constant = constants[READ_LONG()];
+			PUSH(constant);
+			VM_DISPATCH();
+		}
+
+		VM_CASE(OP_JUMP_LONG): {
+			uint32_t offset = READ_LONG();
+			ip += offset;
+			VM_DISPATCH();
 		}
 
-		case OP_METHOD:
+		VM_CASE(OP_JUMP_IF_FALSE_LONG): {
+			uint32_t offset = READ_LONG();
+			if (isFalsey(PEEK(0))) ip += offset;
+			VM_DISPATCH();
+		}
+
+		VM_CASE(OP_LOOP_LONG): {
+			uint32_t offset = READ_LONG();
+			ip -= offset;
+			countHotness(frame->closure->function);
+			JIT_ENTER();
+			VM_DISPATCH();
+		}
+
+		VM_CASE(OP_WIDE): {
+			// 前置された命令を、16bit で読んだ最初のオペランドで実行する
+			uint8_t op = READ_BYTE();
+			uint16_t operand = READ_SHORT();
+			switch (op)
+			{
+			case OP_GET_LOCAL: PUSH(slots[operand]); break;
+			case OP_SET_LOCAL: slots[operand] = PEEK(0); break;
+			case OP_GET_UPVALUE: PUSH(*frame->closure->upvalues[operand]->location); break;
+			case OP_SET_UPVALUE: setUpvalue(frame->closure->upvalues[operand], PEEK(0)); break;
+			case OP_GET_PROPERTY: GET_PROPERTY(AS_STRING(constants[operand])); break;
+			case OP_SET_PROPERTY: SET_PROPERTY(AS_STRING(constants[operand])); break;
+			case OP_GET_SUPER: GET_SUPER(AS_STRING(constants[operand])); break;
+			case OP_INVOKE: INVOKE(AS_STRING(constants[operand]), false); break;
+			case OP_TAIL_INVOKE: INVOKE(AS_STRING(constants[operand]), true); break;
+			case OP_SUPER_INVOKE: SUPER_INVOKE(AS_STRING(constants[operand])); break;
+			case OP_CLOSURE: CLOSURE(constants[operand], READ_SHORT()); break;
+			case OP_CLASS: CLASS(AS_STRING(constants[operand])); break;
+			case OP_METHOD: METHOD(AS_STRING(constants[operand])); break;
+			default:
+				RUNTIME_ERROR("Unknown wide opcode %d.", op);
+			}
+			VM_DISPATCH();
+		}
+
+#undef GET_PROPERTY
+#undef SET_PROPERTY
+#undef GET_SUPER
+#undef INVOKE
+#undef SUPER_INVOKE
+#undef CLOSURE
+#undef CLASS
+#undef METHOD
+
+		VM_CASE(OP_GET_LOCAL_0): PUSH(slots[0]); VM_DISPATCH();
+		VM_CASE(OP_GET_LOCAL_1): PUSH(slots[1]); VM_DISPATCH();
+		VM_CASE(OP_GET_LOCAL_2): PUSH(slots[2]); VM_DISPATCH();
+		VM_CASE(OP_GET_LOCAL_3): PUSH(slots[3]); VM_DISPATCH();
+
+		VM_CASE(OP_ADD_LOCAL_CONST):
 		{
-			defineMethod(thread, READ_STRING());
-			break;
+			// OP_GET_LOCAL + OP_CONSTANT + OP_ADD
+			uint8_t* instruction = ip - 1;
+			Value a = slots[READ_BYTE()];
+			Value b = READ_CONSTANT();
+			if (IS_NUMBER(a) && IS_NUMBER(b))
+			{
+				*instruction = OP_ADD_LOCAL_CONST_NUM;
+				PUSH(TO_NUMBER(AS_NUMBER(a) + AS_NUMBER(b)));
+			}
+			else if (IS_STRING(a) && IS_STRING(b))
+			{
+				PUSH(a);
+				PUSH(b);
+				STORE_STATE();
+				concatenate(thread);
+				LOAD_STACK();
+			}
+			else
+			{
+				RUNTIME_ERROR("Operand must be two numbers or two strings.");
+			}
+			VM_DISPATCH();
+		}
+
+#define COMPARE_AND_JUMP(op, quickened) \
+	do { \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			RUNTIME_ERROR("Operand must be numbers."); \
+		} \
+		ip[-1] = (quickened); \
+		uint16_t offset = READ_SHORT(); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		if (!(a op b)) \
+		{ \
+			/* 分岐先には条件式の評価値を POP する命令があるので、false を積んでおく */ \
+			PUSH(TO_BOOL(false)); \
+			ip += offset; \
+		} \
+	} while (false)
+
+		VM_CASE(OP_JUMP_IF_NOT_LESS): COMPARE_AND_JUMP(<, OP_JUMP_IF_NOT_LESS_NUM); VM_DISPATCH();
+		VM_CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_AND_JUMP(>, OP_JUMP_IF_NOT_GREATER_NUM); VM_DISPATCH();
+
+		VM_CASE(OP_JUMP_IF_NOT_EQUAL):
+		{
+			if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+			{
+				ip[-1] = OP_JUMP_IF_NOT_EQUAL_NUM;
+			}
+			uint16_t offset = READ_SHORT();
+			Value b = POP();
+			Value a = POP();
+			if (!valuesEqual(a, b))
+			{
+				PUSH(TO_BOOL(false));
+				ip += offset;
+			}
+			VM_DISPATCH();
+		}
+
+		VM_CASE(OP_GET_THIS_PROPERTY):
+		{
+			// OP_GET_LOCAL 0 + OP_GET_PROPERTY
+			Value receiver = slots[0];
+			if (!IS_INSTANCE(receiver))
+			{
+				RUNTIME_ERROR("Only instances have properties.");
+			}
+
+			ObjString* name = READ_STRING();
+			InlineCache* cache = READ_INLINE_CACHE();
+
+			PUSH(receiver);
+			STORE_STATE();
+			if (!getProperty(thread, name, cache))
+			{
+				return RuntimeError;
+			}
+			LOAD_STACK();
+			VM_DISPATCH();
+		}
+
+		// ここからレジスタ命令
+
+// スロットに書き込む。スタックトップ以上のスロットに書いた場合はそこまで積んだことにする
+#define WRITE_REGISTER(slot, value) \
+	do { \
+		Value* destination = slots + (slot); \
+		*destination = (value); \
+		if (destination >= stackTop) stackTop = destination + 1; \
+	} while (false)
+
+// 三番地の数値演算命令。readB は 2 番目の読み出し元 (スロットか定数) を読む式
+#define REGISTER_BINARY_OP(op, readB) \
+	do { \
+		uint8_t dst = READ_BYTE(); \
+		Value a = slots[READ_BYTE()]; \
+		Value b = (readB); \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+			RUNTIME_ERROR("Operand must be numbers."); \
+		} \
+		WRITE_REGISTER(dst, TO_NUMBER(AS_NUMBER(a) op AS_NUMBER(b))); \
+	} while (false)
+
+// 文字列の連結はスタックの上で行ってから書き込む
+#define REGISTER_ADD(readB) \
+	do { \
+		uint8_t dst = READ_BYTE(); \
+		Value a = slots[READ_BYTE()]; \
+		Value b = (readB); \
+		if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+			WRITE_REGISTER(dst, TO_NUMBER(AS_NUMBER(a) + AS_NUMBER(b))); \
+		} else if (IS_STRING(a) && IS_STRING(b)) { \
+			PUSH(a); \
+			PUSH(b); \
+			STORE_STATE(); \
+			concatenate(thread); \
+			LOAD_STACK(); \
+			Value result = POP(); \
+			WRITE_REGISTER(dst, result); \
+		} else { \
+			RUNTIME_ERROR("Operand must be two numbers or two strings."); \
+		} \
+	} while (false)
+
+// 比較と分岐の三番地命令。条件が偽なら、分岐先の OP_POP のために false を積んでからジャンプする
+#define REGISTER_COMPARE_AND_JUMP(op, readB) \
+	do { \
+		Value a = slots[READ_BYTE()]; \
+		Value b = (readB); \
+		uint16_t offset = READ_SHORT(); \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+			RUNTIME_ERROR("Operand must be numbers."); \
+		} \
+		if (!(AS_NUMBER(a) op AS_NUMBER(b))) { \
+			PUSH(TO_BOOL(false)); \
+			ip += offset; \
+		} \
+	} while (false)
+
+		VM_CASE(OP_MOVE):
+		{
+			uint8_t dst = READ_BYTE();
+			WRITE_REGISTER(dst, slots[READ_BYTE()]);
+			VM_DISPATCH();
+		}
+		VM_CASE(OP_LOAD_CONSTANT):
+		{
+			uint8_t dst = READ_BYTE();
+			WRITE_REGISTER(dst, READ_CONSTANT());
+			VM_DISPATCH();
 		}
 
+		VM_CASE(OP_ADD_RR): REGISTER_ADD(slots[READ_BYTE()]); VM_DISPATCH();
+		VM_CASE(OP_ADD_RK): REGISTER_ADD(READ_CONSTANT()); VM_DISPATCH();
+		VM_CASE(OP_SUBTRACT_RR): REGISTER_BINARY_OP(-, slots[READ_BYTE()]); VM_DISPATCH();
+		VM_CASE(OP_SUBTRACT_RK): REGISTER_BINARY_OP(-, READ_CONSTANT()); VM_DISPATCH();
+		VM_CASE(OP_MULTIPLY_RR): REGISTER_BINARY_OP(*, slots[READ_BYTE()]); VM_DISPATCH();
+		VM_CASE(OP_MULTIPLY_RK): REGISTER_BINARY_OP(*, READ_CONSTANT()); VM_DISPATCH();
+		VM_CASE(OP_DIVIDE_RR): REGISTER_BINARY_OP(/, slots[READ_BYTE()]); VM_DISPATCH();
+		VM_CASE(OP_DIVIDE_RK): REGISTER_BINARY_OP(/, READ_CONSTANT()); VM_DISPATCH();
+
+		VM_CASE(OP_JUMP_IF_NOT_LESS_RR): REGISTER_COMPARE_AND_JUMP(<, slots[READ_BYTE()]); VM_DISPATCH();
+		VM_CASE(OP_JUMP_IF_NOT_LESS_RK): REGISTER_COMPARE_AND_JUMP(<, READ_CONSTANT()); VM_DISPATCH();
+		VM_CASE(OP_JUMP_IF_NOT_GREATER_RR): REGISTER_COMPARE_AND_JUMP(>, slots[READ_BYTE()]); VM_DISPATCH();
+		VM_CASE(OP_JUMP_IF_NOT_GREATER_RK): REGISTER_COMPARE_AND_JUMP(>, READ_CONSTANT()); VM_DISPATCH();
+
+		VM_CASE(OP_JUMP_IF_NOT_EQUAL_RR):
+		{
+			Value a = slots[READ_BYTE()];
+			Value b = slots[READ_BYTE()];
+			uint16_t offset = READ_SHORT();
+			if (!valuesEqual(a, b))
+			{
+				PUSH(TO_BOOL(false));
+				ip += offset;
+			}
+			VM_DISPATCH();
+		}
+		VM_CASE(OP_JUMP_IF_NOT_EQUAL_RK):
+		{
+			Value a = slots[READ_BYTE()];
+			Value b = READ_CONSTANT();
+			uint16_t offset = READ_SHORT();
+			if (!valuesEqual(a, b))
+			{
+				PUSH(TO_BOOL(false));
+				ip += offset;
+			}
+			VM_DISPATCH();
+		}
+
+		// ここから型推論で型の検査を省いた命令
+
+// オペランドが数値だと分かっている二項演算
+#define UNCHECKED_BINARY_OP(ValueType, op) \
+	do { \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(PEEK(0)); \
+		PEEK(0) = TO_##ValueType(a op b); \
+	} while (false)
+
+		VM_CASE(OP_ADD_UNCHECKED): UNCHECKED_BINARY_OP(NUMBER, +); VM_DISPATCH();
+		VM_CASE(OP_SUBTRACT_UNCHECKED): UNCHECKED_BINARY_OP(NUMBER, -); VM_DISPATCH();
+		VM_CASE(OP_MULTIPLY_UNCHECKED): UNCHECKED_BINARY_OP(NUMBER, *); VM_DISPATCH();
+		VM_CASE(OP_DIVIDE_UNCHECKED): UNCHECKED_BINARY_OP(NUMBER, /); VM_DISPATCH();
+		VM_CASE(OP_NEGATE_UNCHECKED): PEEK(0) = TO_NUMBER(-AS_NUMBER(PEEK(0))); VM_DISPATCH();
+		VM_CASE(OP_GREATER_UNCHECKED): UNCHECKED_BINARY_OP(BOOL, >); VM_DISPATCH();
+		VM_CASE(OP_LESS_UNCHECKED): UNCHECKED_BINARY_OP(BOOL, <); VM_DISPATCH();
+
+#undef UNCHECKED_BINARY_OP
+
+		// ここから quickening による型特化命令
+		// 汎用命令が一度成功したときの型をガードで確認し、外れたら汎用命令に戻る
+		VM_CASE(OP_EQUAL_NUM):
+		{
+			if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+			{
+				DEOPTIMIZE(OP_EQUAL);
+				VM_DISPATCH();
+			}
+			double b = AS_NUMBER(POP());
+			double a = AS_NUMBER(PEEK(0));
+			PEEK(0) = TO_BOOL(a == b);
+			VM_DISPATCH();
+		}
+
+		VM_CASE(OP_GREATER_NUM): BINARY_OP_NUM(BOOL, >, OP_GREATER); VM_DISPATCH();
+		VM_CASE(OP_LESS_NUM): BINARY_OP_NUM(BOOL, <, OP_LESS); VM_DISPATCH();
+		VM_CASE(OP_ADD_NUM): BINARY_OP_NUM(NUMBER, +, OP_ADD); VM_DISPATCH();
+
+		VM_CASE(OP_ADD_STR):
+		{
+			if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1)))
+			{
+				DEOPTIMIZE(OP_ADD);
+				VM_DISPATCH();
+			}
+			STORE_STATE();
+			concatenate(thread);
+			LOAD_STACK();
+			VM_DISPATCH();
+		}
+
+		VM_CASE(OP_SUBTRACT_NUM): BINARY_OP_NUM(NUMBER, -, OP_SUBTRACT); VM_DISPATCH();
+		VM_CASE(OP_MULTIPLY_NUM): BINARY_OP_NUM(NUMBER, *, OP_MULTIPLY); VM_DISPATCH();
+		VM_CASE(OP_DIVIDE_NUM): BINARY_OP_NUM(NUMBER, /, OP_DIVIDE); VM_DISPATCH();
+
+		VM_CASE(OP_ADD_LOCAL_CONST_NUM):
+		{
+			// オペランドを読む前にガードを確認する
+			Value a = slots[ip[0]];
+			Value b = constants[ip[1]];
+			if (!IS_NUMBER(a))
+			{
+				DEOPTIMIZE(OP_ADD_LOCAL_CONST);
+				VM_DISPATCH();
+			}
+			ip += 2;
+			PUSH(TO_NUMBER(AS_NUMBER(a) + AS_NUMBER(b)));
+			VM_DISPATCH();
+		}
+
+#define COMPARE_AND_JUMP_NUM(op, generic) \
+	{ \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			DEOPTIMIZE(generic); \
+			VM_DISPATCH(); \
+		} \
+		uint16_t offset = READ_SHORT(); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		if (!(a op b)) \
+		{ \
+			PUSH(TO_BOOL(false)); \
+			ip += offset; \
+		} \
+	}
+
+		VM_CASE(OP_JUMP_IF_NOT_LESS_NUM): COMPARE_AND_JUMP_NUM(<, OP_JUMP_IF_NOT_LESS); VM_DISPATCH();
+		VM_CASE(OP_JUMP_IF_NOT_GREATER_NUM): COMPARE_AND_JUMP_NUM(>, OP_JUMP_IF_NOT_GREATER); VM_DISPATCH();
+		VM_CASE(OP_JUMP_IF_NOT_EQUAL_NUM): COMPARE_AND_JUMP_NUM(==, OP_JUMP_IF_NOT_EQUAL); VM_DISPATCH();
+
+#undef COMPARE_AND_JUMP
+#undef COMPARE_AND_JUMP_NUM
+#undef WRITE_REGISTER
+#undef REGISTER_BINARY_OP
+#undef REGISTER_ADD
+#undef REGISTER_COMPARE_AND_JUMP
+
 		default:
 			return RuntimeError;
 
 		}
 	}
 
-#undef READ_STRING
-#undef READ_CONSTANT
-#undef READ_SHORT
-#undef READ_BYTE
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef TRACE_EXECUTION
 
 }
 
+#undef RUN_ATTRIBUTES
 #undef BINARY_OP
+#undef BINARY_OP_NUM
+#undef DEOPTIMIZE
+#undef RUNTIME_ERROR
+#undef JIT_ENTER
+#undef LOAD_FRAME
+#undef LOAD_STACK
+#undef STORE_STATE
+#undef READ_STRING
+#undef READ_INLINE_CACHE
+#undef READ_GLOBAL_INDEX
+#undef READ_CONSTANT
+#undef READ_LONG
+#undef READ_SHORT
+#undef READ_BYTE
+#undef PEEK
+#undef POP
+#undef PUSH
 
-void freeObjects()
+void freeObjectList(Obj* target)
 {
-	Obj* target = vm.objects;
 	while (target != nullptr)
 	{
 		Obj* next = target->next;
@@ -817,6 +1726,367 @@ void freeObjects()
 	}
 }
 
+void freeObjects()
+{
+	// 増分 GC のスイープ中なら、スイープ待ちのオブジェクトも解放する
+	freeObjectList(vm.objects);
+	freeObjectList(vm.sweepList);
+}
+
+}
+
+namespace
+{
+
+// JIT コードは frame->ip をオペランドの先頭 (呼び出し命令では末尾) に合わせてから呼び出すので、そこからオペランドを読む
+CallFrame* currentFrame(Thread* thread)
+{
+	return &thread->frames[thread->frameCount - 1];
+}
+
+Value readConstant(CallFrame* frame, int offset)
+{
+	return frame->closure->function->chunk.constants.values[frame->ip[offset]];
+}
+
+int readShort(CallFrame* frame, int offset)
+{
+	return (frame->ip[offset] << 8) | frame->ip[offset + 1];
+}
+
+InlineCache* readInlineCache(CallFrame* frame, int offset)
+{
+	return &frame->closure->function->chunk.caches[readShort(frame, offset)];
+}
+
+// 呼び出し命令の後始末。呼び出し先のフレームが積まれていれば、機械語から直接実行する
+JitResult finishJitCall(Thread* thread, int frameCount)
+{
+	if (thread->frameCount == frameCount)
+	{
+		// ネイティブ関数や初期化子のないクラスは呼び出しの中で完了している
+		return JitResult::Continue;
+	}
+	return jitEnterCallee(thread);
+}
+
+JitResult finishJitTailCall(Thread* thread, int frameCount)
+{
+	if (thread->frameCount != frameCount)
+	{
+		return jitEnterCallee(thread);
+	}
+
+	// フレームが置き換わった場合は、ip が呼び出し先の先頭を指している
+	CallFrame* frame = currentFrame(thread);
+	ObjFunction* function = frame->closure->function;
+	if (frame->ip != function->chunk.code)
+	{
+		return JitResult::Continue;
+	}
+	return function->jitCode != nullptr ? JitResult::TailCall : JitResult::Exit;
+}
+
+}
+
+JitResult jitCall(Thread* thread)
+{
+	int frameCount = thread->frameCount;
+	int argCount = currentFrame(thread)->ip[-1];
+	if (!callValue(thread, peek(thread, argCount), argCount))
+	{
+		return JitResult::Error;
+	}
+	return finishJitCall(thread, frameCount);
+}
+
+JitResult jitTailCall(Thread* thread)
+{
+	int frameCount = thread->frameCount;
+	int argCount = currentFrame(thread)->ip[-1];
+	if (!tailCallValue(thread, peek(thread, argCount), argCount))
+	{
+		return JitResult::Error;
+	}
+	return finishJitTailCall(thread, frameCount);
+}
+
+JitResult jitInvoke(Thread* thread)
+{
+	// OP_INVOKE のオペランドは 名前の定数, 引数の数, 16bit のキャッシュ番号
+	CallFrame* frame = currentFrame(thread);
+	int frameCount = thread->frameCount;
+	if (!invoke(thread, AS_STRING(readConstant(frame, -4)), frame->ip[-3], readInlineCache(frame, -2), false))
+	{
+		return JitResult::Error;
+	}
+	return finishJitCall(thread, frameCount);
+}
+
+JitResult jitTailInvoke(Thread* thread)
+{
+	CallFrame* frame = currentFrame(thread);
+	int frameCount = thread->frameCount;
+	if (!invoke(thread, AS_STRING(readConstant(frame, -4)), frame->ip[-3], readInlineCache(frame, -2), true))
+	{
+		return JitResult::Error;
+	}
+	return finishJitTailCall(thread, frameCount);
+}
+
+JitResult jitSuperInvoke(Thread* thread)
+{
+	CallFrame* frame = currentFrame(thread);
+	int frameCount = thread->frameCount;
+	ObjClass* superclass = AS_CLASS(pop(thread));
+	if (!invokeFromClass(thread, superclass, AS_STRING(readConstant(frame, -2)), frame->ip[-1]))
+	{
+		return JitResult::Error;
+	}
+	return finishJitCall(thread, frameCount);
+}
+
+// 機械語から呼び出されたフレームの OP_RETURN
+// 呼び出し元のフレームが必ずあるので、スクリプトの終了は考えなくてよい
+bool jitReturn(Thread* thread)
+{
+	CallFrame* frame = currentFrame(thread);
+	Value result = pop(thread);
+	closeUpvalues(thread, frame->slots);
+	thread->frameCount--;
+	thread->stackTop = frame->slots;
+	push(thread, result);
+	return true;
+}
+
+bool jitGetGlobal(Thread* thread)
+{
+	int index = readShort(currentFrame(thread), 0);
+	Value value = vm.globalValues.values[index];
+	if (IS_UNDEFINED(value))
+	{
+		runtimeError(thread, "Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[index]));
+		return false;
+	}
+	push(thread, value);
+	return true;
+}
+
+bool jitSetGlobal(Thread* thread)
+{
+	int index = readShort(currentFrame(thread), 0);
+	if (IS_UNDEFINED(vm.globalValues.values[index]))
+	{
+		runtimeError(thread, "Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[index]));
+		return false;
+	}
+	vm.globalValues.values[index] = peek(thread, 0);
+	return true;
+}
+
+bool jitSetUpvalue(Thread* thread)
+{
+	CallFrame* frame = currentFrame(thread);
+	setUpvalue(frame->closure->upvalues[frame->ip[0]], peek(thread, 0));
+	return true;
+}
+
+bool jitGetProperty(Thread* thread)
+{
+	if (!IS_INSTANCE(peek(thread, 0)))
+	{
+		runtimeError(thread, "Only instances have properties.");
+		return false;
+	}
+
+	CallFrame* frame = currentFrame(thread);
+	return getProperty(thread, AS_STRING(readConstant(frame, 0)), readInlineCache(frame, 1));
+}
+
+bool jitSetProperty(Thread* thread)
+{
+	if (!IS_INSTANCE(peek(thread, 1)))
+	{
+		runtimeError(thread, "Only instances have fields.");
+		return false;
+	}
+
+	CallFrame* frame = currentFrame(thread);
+	setProperty(thread, AS_STRING(readConstant(frame, 0)), readInlineCache(frame, 1));
+
+	Value value = pop(thread);
+	thread->stackTop[-1] = value; // instance を評価値で置き換える
+	return true;
+}
+
+bool jitGetSuper(Thread* thread)
+{
+	ObjString* name = AS_STRING(readConstant(currentFrame(thread), 0));
+	ObjClass* superclass = AS_CLASS(pop(thread));
+	if (!bindMethod(thread, superclass, name))
+	{
+		runtimeError(thread, "Undefine property '%s'.", name->chars);
+		return false;
+	}
+	return true;
+}
+
+// 二項演算の汎用版。機械語側の数値の高速パスから外れた場合に呼ばれる
+// 比較と分岐の融合命令では、比較結果の bool を積むところまでを行う
+bool jitBinaryOp(Thread* thread)
+{
+	CallFrame* frame = currentFrame(thread);
+	uint8_t instruction = frame->ip[-1];
+	if (instruction == OP_ADD_LOCAL_CONST || instruction == OP_ADD_LOCAL_CONST_NUM)
+	{
+		push(thread, frame->slots[frame->ip[0]]);
+		push(thread, readConstant(frame, 1));
+		instruction = OP_ADD;
+	}
+
+	Value b = peek(thread, 0);
+	Value a = peek(thread, 1);
+	switch (instruction)
+	{
+	case OP_EQUAL:
+	case OP_EQUAL_NUM:
+	case OP_JUMP_IF_NOT_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL_NUM:
+		thread->stackTop -= 2;
+		push(thread, TO_BOOL(valuesEqual(a, b)));
+		return true;
+	case OP_ADD:
+	case OP_ADD_NUM:
+	case OP_ADD_STR:
+		if (IS_STRING(a) && IS_STRING(b))
+		{
+			concatenate(thread);
+			return true;
+		}
+		if (!IS_NUMBER(a) || !IS_NUMBER(b))
+		{
+			runtimeError(thread, "Operand must be two numbers or two strings.");
+			return false;
+		}
+		break;
+	default:
+		if (!IS_NUMBER(a) || !IS_NUMBER(b))
+		{
+			runtimeError(thread, "Operand must be numbers.");
+			return false;
+		}
+		break;
+	}
+
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	Value result;
+	switch (instruction)
+	{
+	case OP_GREATER:
+	case OP_GREATER_NUM:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_NOT_GREATER_NUM:
+		result = TO_BOOL(x > y);
+		break;
+	case OP_LESS:
+	case OP_LESS_NUM:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_NOT_LESS_NUM:
+		result = TO_BOOL(x < y);
+		break;
+	case OP_SUBTRACT:
+	case OP_SUBTRACT_NUM:
+		result = TO_NUMBER(x - y);
+		break;
+	case OP_MULTIPLY:
+	case OP_MULTIPLY_NUM:
+		result = TO_NUMBER(x * y);
+		break;
+	case OP_DIVIDE:
+	case OP_DIVIDE_NUM:
+		result = TO_NUMBER(x / y);
+		break;
+	default:
+		result = TO_NUMBER(x + y);
+		break;
+	}
+
+	thread->stackTop -= 2;
+	push(thread, result);
+	return true;
+}
+
+bool jitNegate(Thread* thread)
+{
+	if (!IS_NUMBER(peek(thread, 0)))
+	{
+		runtimeError(thread, "Operand must be a number.");
+		return false;
+	}
+	thread->stackTop[-1] = TO_NUMBER(-AS_NUMBER(peek(thread, 0)));
+	return true;
+}
+
+bool jitPrint(Thread* thread)
+{
+	printValue(pop(thread));
+	printf("\n");
+	return true;
+}
+
+bool jitClosure(Thread* thread)
+{
+	CallFrame* frame = currentFrame(thread);
+	ObjClosure* closure = newClosure(AS_FUNCTION(readConstant(frame, 0)));
+	push(thread, TO_OBJ(closure));
+
+	for (int i = 0; i < closure->upvalueCount; i++)
+	{
+		uint8_t isLocal = frame->ip[1 + i * 2];
+		uint8_t index = frame->ip[2 + i * 2];
+		ObjUpvalue* upvalue = isLocal ? captureUpvalue(thread, frame->slots + index) : frame->closure->upvalues[index];
+
+		HeapLock lock; // マークスレッドは上位値の配列をロックの中で読む
+		closure->upvalues[i] = upvalue;
+		writeBarrier(&closure->obj, TO_OBJ(upvalue));
+	}
+	return true;
+}
+
+bool jitCloseUpvalue(Thread* thread)
+{
+	closeUpvalues(thread, thread->stackTop - 1);
+	thread->stackTop--;
+	return true;
+}
+
+bool jitClass(Thread* thread)
+{
+	ObjString* name = AS_STRING(readConstant(currentFrame(thread), 0));
+	push(thread, TO_OBJ(newClass(name)));
+	return true;
+}
+
+bool jitInherit(Thread* thread)
+{
+	Value superClass = peek(thread, 1);
+	if (!IS_CLASS(superClass))
+	{
+		runtimeError(thread, "Superclass must be a class.");
+		return false;
+	}
+
+	ObjClass* subClass = AS_CLASS(peek(thread, 0));
+	tableAddAll(&AS_CLASS(superClass)->methods, &subClass->methods);
+	thread->stackTop--;
+	return true;
+}
+
+bool jitMethod(Thread* thread)
+{
+	defineMethod(thread, AS_STRING(readConstant(currentFrame(thread), 0)));
+	return true;
 }
 
 void initThread(Thread* thread)
@@ -839,8 +2109,11 @@ void initVM()
 	vm.grayCount = 0;
 	vm.grayCapacity = 0;
 	vm.grayStack = nullptr;
+	initNursery();
 
-	initTable(&vm.globals);
+	initTable(&vm.globalIndices);
+	initValueArray(&vm.globalValues);
+	initValueArray(&vm.globalNames);
 	initTable(&vm.strings);
 
 	// 初期化子関数名は "init" で固定
@@ -854,13 +2127,42 @@ void initVM()
 
 void freeVM()
 {
-	freeTable(&vm.globals);
+#if DEBUG_PEEPHOLE_STATS
+	printPeepholeStats();
+#endif
+
+	joinGcThreads();
+	freeTable(&vm.globalIndices);
+	freeValueArray(&vm.globalValues);
+	freeValueArray(&vm.globalNames);
 	freeTable(&vm.strings);
 	vm.initString = nullptr;
 
 	freeObjects();
+	freeNursery();
 
 	free(vm.grayStack);
+	free(vm.satbBuffer);
+	free(vm.deferredThreads);
+}
+
+int resolveGlobal(ObjString* name)
+{
+	// グローバル変数の番号を返す。初めて見る名前なら未定義のスロットを割り当てる
+	// 定義より前に参照する関数や REPL の入力をまたいだ参照も、名前から同じ番号に解決される
+	Value index;
+	if (tableGet(&vm.globalIndices, name, &index))
+	{
+		return static_cast<int>(AS_NUMBER(index));
+	}
+
+	push(&vm.mainThread, TO_OBJ(name)); // GC 回避
+	int newIndex = vm.globalValues.count;
+	writeToValueArray(&vm.globalValues, UNDEFINED_VAL);
+	writeToValueArray(&vm.globalNames, TO_OBJ(name));
+	tableSet(&vm.globalIndices, name, TO_NUMBER(newIndex));
+	pop(&vm.mainThread);
+	return newIndex;
 }
 
 VM* getVM()
@@ -886,14 +2188,25 @@ InterpretResult interpret(Thread* thread, const char* source)
 	ObjClosure* closure = compileTo(thread, source);
 	if (closure == nullptr) return InterpretResult::CompileError;
 
+	return interpret(thread, closure);
+}
+
+InterpretResult interpret(Thread* thread, ObjClosure* closure)
+{
 	// 確保済みのスタック 0 番に closure 自身を格納する
 	push(thread, TO_OBJ(closure));
 
 	// function の chunk をスレッドにロード
-	call(thread, closure, 0);
+	// 読み込んだキャッシュのスクリプトがスタックに収まらない場合などは、エラーを報告済みでスタックもリセットされている
+	if (!call(thread, closure, 0)) return InterpretResult::RuntimeError;
 
 	auto result = run(thread); // ロードした chunk の実行ループを開始
-	pop(thread); // NOTE: 最後の実行結果は今のところ不要なので捨てる
+	if (result != InterpretResult::RuntimeError)
+	{
+		// ランタイムエラーの場合はスタックがリセット済みなので pop しない
+		// (REPL で次の入力を実行するときにスタックが壊れてしまう)
+		pop(thread); // NOTE: 最後の実行結果は今のところ不要なので捨てる
+	}
 	return result;
 }
 
@@ -901,16 +2214,3 @@ InterpretResult interpret(const char* source)
 {
 	return interpret(&vm.mainThread, source);
 }
-
-void push(Thread* thread, Value value)
-{
-	*thread->stackTop = value;
-	thread->stackTop++;
-}
-
-Value pop(Thread* thread)
-{
-	thread->stackTop--;
-	return *thread->stackTop;
-}
-
@@ -1,6 +1,10 @@
 ﻿#pragma once
 
+#include <cstdint>
+#include <mutex>
+
 #include "chunk.h"
+#include "memory.h"
 #include "value.h"
 #include "table.h"
 #include "thread.h"
@@ -11,7 +15,12 @@ struct ObjClosure;
 struct VM
 {
 	Thread mainThread;
-	Table globals;
+
+	// グローバル変数はコンパイル時に番号を割り当てて、配列で管理する
+	Table globalIndices; // 変数名 -> 番号
+	ValueArray globalValues; // 未定義の変数は UNDEFINED_VAL
+	ValueArray globalNames; // 番号 -> 変数名 (エラーメッセージ用)
+
 	Table strings;
 	ObjString* initString = nullptr;
 
@@ -22,6 +31,45 @@ struct VM
 	int grayCount = 0;
 	int grayCapacity = 0;
 	Obj** grayStack = nullptr;
+
+	// 増分 GC の進み具合
+	GcPhase gcPhase = GcPhase::Idle;
+	Obj* sweepList = nullptr; // マークが終わった時点のオブジェクト。生き残ったものから objects に戻す
+	size_t gcDebt = 0; // 前のスライスから割り当てたバイト数
+
+	// 並行マーク
+	// マークスレッドとの間で、grayStack と、マークスレッドが読む配列の付け替え (HeapLock) を守る
+	std::recursive_mutex heapMutex;
+	// SATB 書き込みバリアで記録した、書き換える前の値が指していたオブジェクト (プログラムのスレッドだけが触る)
+	int satbCount = 0;
+	int satbCapacity = 0;
+	Obj** satbBuffer = nullptr;
+	// マークスレッドが辿らずに残したスレッドオブジェクト。再マークでスタックを辿る
+	int deferredThreadCount = 0;
+	int deferredThreadCapacity = 0;
+	Obj** deferredThreads = nullptr;
+
+	// GC の統計 (停止時間はナノ秒)
+	int gcCount = 0;
+	int minorGcCount = 0;
+	uint64_t maxGcPause = 0;
+	uint64_t totalGcPause = 0;
+
+	// 若い世代のナーサリ。[nurseryStart, nurseryTop) に割り当て済み
+	uint8_t* nurseryStart = nullptr;
+	uint8_t* nurseryTop = nullptr;
+	uint8_t* nurseryEnd = nullptr;
+
+	// 若いオブジェクトを指しうる古いオブジェクト (記憶集合)。マイナー GC のルートになる
+	int rememberedCount = 0;
+	int rememberedCapacity = 0;
+	Obj** remembered = nullptr;
+
+	// ナーサリの外にメモリ (文字列の文字、インスタンスのフィールド) を持つ若いオブジェクト
+	// マイナー GC はナーサリ全体ではなく、これだけをたどって死んだオブジェクトのメモリを解放する
+	int youngOwnerCount = 0;
+	int youngOwnerCapacity = 0;
+	Obj** youngOwners = nullptr;
 };
 
 enum class InterpretResult
@@ -36,7 +84,20 @@ void initVM();
 void freeVM();
 VM* getVM();
 
+int resolveGlobal(ObjString* name);
+
 InterpretResult interpret(const char* source);
 InterpretResult interpret(Thread* thread, const char* source);
-void push(Thread* thread, Value value);
-Value pop(Thread* thread);
+InterpretResult interpret(Thread* thread, ObjClosure* closure); // コンパイル済みのスクリプトを実行する
+
+inline void push(Thread* thread, Value value)
+{
+	*thread->stackTop = value;
+	thread->stackTop++;
+}
+
+inline Value pop(Thread* thread)
+{
+	thread->stackTop--;
+	return *thread->stackTop;
+}
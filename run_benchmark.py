@@ -4,7 +4,7 @@ import sys
 import fnmatch
 import time
 
-def run(pattern=None):
+def run(pattern=None, vm_args=[]):
     binary_path = "./x64/Release/cpplox.exe"
 
     # testsディレクトリ内の.loxファイルのパスを取得
@@ -26,7 +26,7 @@ def run(pattern=None):
         print(f"============================================")
         print(f"run: {lox_file}")
 
-        command = [binary_path, file_path]
+        command = [binary_path, *vm_args, file_path]
 
         start_time = time.time_ns()
         process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
@@ -65,7 +65,10 @@ def run(pattern=None):
         exit(1)
 
 if __name__ == "__main__":
+    # "--" で始まる引数はそのまま cpplox に渡す (例: --no-jit で JIT なしと比較する)
+    vm_args = [arg for arg in sys.argv[1:] if arg.startswith("--")]
+    patterns = [arg for arg in sys.argv[1:] if not arg.startswith("--")]
     pattern_arg = None
-    if len(sys.argv) > 1:
-        pattern_arg = sys.argv[1]
-    run(pattern_arg)
\ No newline at end of file
+    if len(patterns) > 0:
+        pattern_arg = patterns[0]
+    run(pattern_arg, vm_args)
\ No newline at end of file
@@ -4,18 +4,100 @@ import sys
 import fnmatch
 import argparse
 
-def run(pattern=None, is_release=False):
+def compare_with_interpreter(expected, again, actual):
+    # 出力と終了コードがインタプリタと一致するかを調べる
+    # clock() の結果のように実行ごとに変わる行は比べない
+    # インタプリタを 2 回実行して (expected, again)、結果が変わった行をそのような行とみなす
+    print(actual.stdout.decode(), end='')
+    print(actual.stderr.decode(), end='')
+
+    expected_lines = expected.stdout.splitlines()
+    again_lines = again.stdout.splitlines()
+    actual_lines = actual.stdout.splitlines()
+    same = len(expected_lines) == len(actual_lines) == len(again_lines) and all(
+        e == a or e != g for e, a, g in zip(expected_lines, actual_lines, again_lines))
+    if not same or (expected.stderr, expected.returncode) != (actual.stderr, actual.returncode):
+        print("output differs from the interpreter")
+        return 1
+    return actual.returncode
+
+def run_aot(lox_file, file_path, binary_path):
+    # AOT コンパイルした実行ファイルの結果をインタプリタと比べる
+    import build_aot
+    output = os.path.join("./x64/aot/tests", os.path.splitext(lox_file)[0])
+    if build_aot.build(file_path, output, binary_path, "cl" if os.name == "nt" else "c++", "./x64/aot") != 0:
+        print("failed to build")
+        return 1
+
+    expected = subprocess.run([binary_path, file_path], capture_output=True)
+    again = subprocess.run([binary_path, file_path], capture_output=True)
+    actual = subprocess.run([output], capture_output=True)
+    return compare_with_interpreter(expected, again, actual)
+
+def run_cached(lox_file, file_path, binary_path):
+    # バイトコードキャッシュ (.loxc) から実行した結果を、ソースから実行した結果と比べる
+    expected = subprocess.run([binary_path, file_path], capture_output=True)
+    again = subprocess.run([binary_path, file_path], capture_output=True)
+
+    cache_path = os.path.splitext(file_path)[0] + ".loxc"
+    if subprocess.run([binary_path, "--compile", file_path]).returncode != 0:
+        print("failed to compile")
+        return 1
+    actual = subprocess.run([binary_path, file_path], capture_output=True)
+    os.remove(cache_path)
+    return compare_with_interpreter(expected, again, actual)
+
+def run_with_flags(lox_file, file_path, binary_path, flags):
+    # flags を付けて実行した結果を、フラグなしで実行した結果と比べる
+    expected = subprocess.run([binary_path, file_path], capture_output=True)
+    again = subprocess.run([binary_path, file_path], capture_output=True)
+    actual = subprocess.run([binary_path, *flags, file_path], capture_output=True)
+    return compare_with_interpreter(expected, again, actual)
+
+# run_with_flags で調べるモード
+# オプション名 -> (cpplox に渡すフラグ, ヘルプ)
+FLAG_MODES = {
+    "register": (["--register"], "Compare runs with register bytecode with the interpreter"),
+    "lazy": (["--lazy"], "Compare runs with lazy function compilation with the interpreter"),
+    "incremental-gc": (["--incremental-gc"], "Compare runs with the incremental garbage collector with the interpreter"),
+    "concurrent-gc": (["--concurrent-gc"], "Compare runs with the concurrent marking garbage collector with the interpreter"),
+    "parallel-gc": (["--gc-threads", "4"], "Compare runs with the parallel marking garbage collector with the interpreter"),
+    "background-sweep": (["--background-sweep"], "Compare runs with the background sweeper thread with the interpreter"),
+}
+
+def run_disassemble(lox_file, file_path, binary_path):
+    # --disassemble で表示したバイトコードを、同じ名前の .expected ファイルと比べる
+    actual = subprocess.run([binary_path, "--disassemble", file_path], capture_output=True)
+    print(actual.stdout.decode(), end='')
+    print(actual.stderr.decode(), end='')
+    if actual.returncode != 0:
+        return actual.returncode
+
+    with open(os.path.splitext(file_path)[0] + ".expected", "rb") as f:
+        expected = f.read()
+    if expected.splitlines() != actual.stdout.splitlines():
+        print("bytecode differs from the expected output")
+        return 1
+    return 0
+
+def run(pattern=None, is_release=False, mode=None, extra_flags=None, binary_path=None):
     if is_release:
         configuration = "Release"
     else:
         configuration = "Debug"
 
-    binary_path = f"./x64/{configuration}/cpplox.exe"
+    if binary_path is None:
+        binary_path = f"./x64/{configuration}/cpplox.exe"
 
     # testsディレクトリ内の.loxファイルのパスを取得
     tests_directory = './tests'
     lox_files = [file for file in os.listdir(tests_directory) if file.endswith('.lox')]
 
+    # disassemble ディレクトリ内のテストはコンパイル結果のバイトコードを調べる
+    disassemble_directory = 'disassemble'
+    if mode is None:
+        lox_files += [f"{disassemble_directory}/{file}" for file in os.listdir(os.path.join(tests_directory, disassemble_directory)) if file.endswith('.lox')]
+
     if pattern:
         lox_files = fnmatch.filter(lox_files, f"*{pattern}*")
 
@@ -31,18 +113,27 @@ def run(pattern=None, is_release=False):
         print(f"============================================")
         print(f"run: {lox_file}")
 
-        command = [binary_path, file_path]
-        process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        if lox_file.startswith(disassemble_directory + "/"):
+            return_code = run_disassemble(lox_file, file_path, binary_path)
+        elif mode == "aot":
+            return_code = run_aot(lox_file, file_path, binary_path)
+        elif mode == "cache":
+            return_code = run_cached(lox_file, file_path, binary_path)
+        elif extra_flags is not None:
+            return_code = run_with_flags(lox_file, file_path, binary_path, extra_flags)
+        else:
+            command = [binary_path, file_path]
+            process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
 
-        return_code = None
-        while return_code == None:
-            return_code = process.poll()
+            return_code = None
+            while return_code == None:
+                return_code = process.poll()
 
-            for line in process.stdout:
-                print(line.decode(), end='')
+                for line in process.stdout:
+                    print(line.decode(), end='')
 
-            for line in process.stderr:
-                print(line.decode(), end='')
+                for line in process.stderr:
+                    print(line.decode(), end='')
         
         if return_code == 0:
             print(f"[PASS] {lox_file}")
@@ -66,10 +157,19 @@ def main():
     parser = argparse.ArgumentParser(description='Lox test benchmark')
     parser.add_argument('--release', action='store_true', help='Release mode')
     parser.add_argument('--pattern', type=str, help='Pattern argument', default="", required=False)
+    parser.add_argument('--binary', type=str, help='cpplox binary', default=None, required=False)
+
+    # 実行のしかたを変えるモードは 1 つだけ指定できる
+    modes = parser.add_mutually_exclusive_group()
+    modes.add_argument('--aot', dest='mode', action='store_const', const='aot', help='Compare AOT compiled executables with the interpreter')
+    modes.add_argument('--cache', dest='mode', action='store_const', const='cache', help='Compare runs from bytecode caches with the interpreter')
+    for name, (flags, help) in FLAG_MODES.items():
+        modes.add_argument(f'--{name}', dest='mode', action='store_const', const=name, help=help)
 
     args = parser.parse_args()
 
-    run(args.pattern, args.release)
+    extra_flags = FLAG_MODES[args.mode][0] if args.mode in FLAG_MODES else None
+    run(args.pattern, args.release, args.mode, extra_flags, args.binary)
 
 if __name__ == "__main__":
     main()